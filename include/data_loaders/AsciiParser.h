@@ -0,0 +1,59 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+#include <charconv>
+
+class MappedFile;
+
+
+//parses whitespace separated numbers from a text buffer, usually a MappedFile, without allocating anything for each number
+//the numbers are parsed with std::from_chars so they don't depend on the locale and give the same values as stod and stoi
+//the numbers of one line are read with the parse_ functions and next_line() moves to the first number of the next non empty line
+class AsciiParser
+{
+public:
+    AsciiParser(const char* begin, const char* end, const std::string& source_name); //the source_name is only used in the error messages
+    AsciiParser(const MappedFile& file);
+
+    bool at_end() const { return m_cur==m_end; }
+    void next_line(); //skips the rest of the current line and all the empty lines after it
+    size_t count_lines() const; //nr of lines that contain something else than whitespace, useful for preallocating the matrices before parsing
+    int nr_tokens_in_line() const; //nr of tokens separated by spaces or tabs from the current position until the end of the line
+
+    //they die with a LOG(FATAL) if the next token on the current line is not a number
+    double parse_double(){ return parse_number<double>(); }
+    float parse_float(){ return parse_number<float>(); }
+    int parse_int(){ return parse_number<int>(); }
+
+private:
+    template <typename T>
+    T parse_number(){
+        skip_spaces();
+        const char* start=m_cur;
+        //from_chars doesn't accept the leading + that stod accepts
+        if(start!=m_end && *start=='+'){
+            start++;
+        }
+        T value;
+        std::from_chars_result result=std::from_chars(start, m_end, value);
+        if(result.ec!=std::errc() || result.ptr==start){
+            fail();
+        }
+        m_cur=result.ptr;
+        return value;
+    }
+
+    void skip_spaces(){
+        while(m_cur!=m_end && (*m_cur==' ' || *m_cur=='\t' || *m_cur=='\r')){
+            m_cur++;
+        }
+    }
+    void skip_whitespace();
+    [[noreturn]] void fail() const;
+
+    const char* m_begin;
+    const char* m_cur;
+    const char* m_end;
+    std::string m_source_name;
+};
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+
+//eigen
+#include <Eigen/Core>
+#include <Eigen/StdVector>
+
+namespace easy_pbr{
+    class Frame;
+}
+
+
+//spatial index over the camera centres of the frames of a loader so that the close frames can be found without scanning all the frames for every one of them
+//the distance between two cameras is the distance between their centres plus view_dir_weight*(1-cos) of the angle between their view directions. With a weight of 0 it gives the same frames as the old linear scans
+//optionally it precomputes the nr_precomputed_neighbours closest frames of every frame, so that querying with one of the frames of the loader is just a lookup
+class CameraNeighbourIndex
+{
+public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    CameraNeighbourIndex();
+
+    void build(const std::vector<easy_pbr::Frame>& frames, const float view_dir_weight, const int nr_precomputed_neighbours);
+    bool is_built() const;
+    int nr_cams() const;
+
+    int closest_idx(const easy_pbr::Frame& frame) const; //idx of the closest frame which is not at the same position as the query, like get_closest_frame
+    int closest_idx_further_than(const easy_pbr::Frame& frame, const float min_distance) const; //idx of the closest frame whose distance to the query is at least min_distance
+    std::vector<int> close_idxs(const easy_pbr::Frame& frame, const int nr_frames, const bool discard_same_idx) const; //idxs of the nr_frames closest ones ordered by proximity, like get_close_frames
+
+private:
+
+    struct Query{
+        Eigen::Vector3f center;
+        Eigen::Vector3f dir;
+        int frame_idx;
+        bool discard_same_idx; //skips the frames with the same frame_idx as the query
+        bool discard_same_position; //skips the frames whose center is at the same position as the query
+        float min_distance; //skips the frames that are closer than this
+    };
+    typedef std::pair<float, int> Candidate; //distance and idx of the camera. Comparing them as pairs breaks ties towards the lower idx, like the linear scan did
+
+    Query make_query(const easy_pbr::Frame& frame) const;
+    void build_tree(const int begin, const int end);
+    void search_tree(const int begin, const int end, const Query& query, const size_t nr_neighbours, std::vector<Candidate>& heap) const;
+    std::vector<int> search(const Query& query, const int nr_neighbours) const;
+    float distance(const int cam_idx, const Query& query) const;
+
+    float m_view_dir_weight;
+    int m_nr_precomputed_neighbours;
+
+    std::vector<Eigen::Vector3f, Eigen::aligned_allocator<Eigen::Vector3f> > m_centers;
+    std::vector<Eigen::Vector3f, Eigen::aligned_allocator<Eigen::Vector3f> > m_dirs;
+    std::vector<int> m_frame_idxs;
+    std::unordered_map<int, int> m_frame_idx2cam; //from the frame_idx of a frame to its position in the frames we were built with
+
+    //implicit kd-tree. The range [begin,end) is split at mid=(begin+end)/2 along m_split_axis[mid] and m_tree_cams[mid] is the camera at the split
+    std::vector<int> m_tree_cams;
+    std::vector<int> m_split_axis;
+
+    std::vector<int> m_precomputed_neighbours; //nr_cams x m_nr_precomputed_neighbours, the closest ones of each frame when discarding itself
+};
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+//eigen
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <Eigen/StdVector>
+
+namespace easy_pbr{
+    class Mesh;
+}
+
+
+//one camera of cameras.bin. The nr of params depends on the model, e.g. SIMPLE_PINHOLE has f,cx,cy and PINHOLE has fx,fy,cx,cy
+struct ColmapCamera{
+    uint32_t camera_id;
+    int model_id;
+    uint64_t width;
+    uint64_t height;
+    std::vector<double> params;
+};
+
+//one image of images.bin with the pose that maps from world to camera. The observations of the image are skipped, only their number is kept
+struct ColmapImage{
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    uint32_t image_id;
+    Eigen::Quaterniond q;
+    Eigen::Vector3d t;
+    uint32_t camera_id;
+    std::string name;
+    uint64_t nr_points2D;
+};
+
+
+//reads the binary files of a colmap reconstruction as described in https://colmap.github.io/format.html#binary-file-format
+//the files are mapped and parsed in one pass. The points2D of every image and the tracks of the points3D are skipped over without being read since the loaders only need the poses
+class ColmapReader
+{
+public:
+    static std::vector<ColmapCamera> read_cameras(const std::string& path);
+    static std::vector<ColmapImage, Eigen::aligned_allocator<ColmapImage> > read_images(const std::string& path); //in the same order as in the file
+    static std::shared_ptr<easy_pbr::Mesh> read_points3D(const std::string& path); //the sparse cloud with V and the colors in C in the range [0,1]
+
+private:
+    static int nr_params_of_model(const int model_id);
+};
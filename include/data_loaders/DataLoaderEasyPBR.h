@@ -32,6 +32,8 @@ namespace easy_pbr{
     class Mesh;
 }
 // class DataTransformer;
+class WorkerPool;
+class CameraNeighbourIndex;
 
 
 class DataLoaderEasyPBR
@@ -42,12 +44,18 @@ public:
     ~DataLoaderEasyPBR();
     void start(); //starts reading the data from disk. This gets called automatically if we have autostart=true
     easy_pbr::Frame get_next_frame();
+    int get_next_frame_idx(); //advances like get_next_frame but returns only the idx so the frame can be accessed without copying it
     std::vector<easy_pbr::Frame> get_all_frames();
+    const std::vector<easy_pbr::Frame>& get_all_frames_ref(); //no copy of the frames, the reference is valid until start() is called again
     easy_pbr::Frame get_frame_at_idx( const int idx);
+    const easy_pbr::Frame& get_frame_ref_at_idx( const int idx); //no copy of the frame, the reference is valid until start() is called again
     easy_pbr::Frame get_closest_frame( const easy_pbr::Frame& frame); //return the one closest frame
     std::vector<easy_pbr::Frame> get_close_frames( const easy_pbr::Frame& frame, const int nr_frames, const bool discard_same_idx ); //return a certain number of frames ordered by proximity,
+    int get_closest_frame_idx( const easy_pbr::Frame& frame); //same as get_closest_frame but returns the idx of the frame which can be used with get_frame_at_idx
+    std::vector<int> get_close_frames_idxs( const easy_pbr::Frame& frame, const int nr_frames, const bool discard_same_idx ); //same as get_close_frames but returns the idxs of the frames instead of copies of them
     // std::vector<float> compute_frame_weights( const easy_pbr::Frame& frame, std::vector<easy_pbr::Frame>& close_frames);
     easy_pbr::Frame get_random_frame();
+    int get_random_frame_idx(); //same random draw as get_random_frame but returns only the idx
     bool loaded_scene_mesh(){ return m_loaded_scene_mesh;  };
     std::shared_ptr<easy_pbr::Mesh> get_scene_mesh(){ return m_scene_mesh;   };
     bool has_data(); //will reeturn always true because this dataloader preloads all the frames and keeps them in memory all the time. They are not so many
@@ -79,6 +87,8 @@ private:
 
     //objects
     std::shared_ptr<radu::utils::RandGenerator> m_rand_gen;
+    std::shared_ptr<CameraNeighbourIndex> m_cam_index; //finds the frames that are close to a certain one. Gets built after reading the data
+    std::shared_ptr<WorkerPool> m_decode_pool; //decodes the images in parallel. Is null when we read serially
     std::shared_ptr<easy_pbr::Mesh> m_scene_mesh;
 
 
@@ -99,6 +109,9 @@ private:
     // std::thread m_loader_thread;
     int m_nr_resets;
     int m_idx_img_to_read; //corresponds to the idx of the frame we will return since we have them all in memory
+    int m_nr_decode_threads; //nr of threads used to decode the images. 1 reads serially on the calling thread and 0 uses all the cores
+    float m_close_frames_view_dir_weight; //how much the difference in view direction adds to the distance between two frames. With 0 only the distance between the camera centers is used
+    int m_nr_precomputed_close_frames; //for every frame we precompute this many close frames so that querying them with a frame of the loader is just a lookup
 
 
     //internal
@@ -136,6 +136,7 @@ private:
     std::vector<bool> m_get_last_published_frame_for_cam; //if we shoudl return the last published frame or not
 
     float m_rgb_subsample_factor;
+    bool m_reduced_jpeg_decode; //decodes the jpegs directly at the subsampled resolution which is much faster but not bit-identical to the INTER_AREA resize
     int m_imgs_to_skip;
     int m_nr_images_to_read; //nr images to read starting from m_imgs_to_skip
     bool m_do_overfit;
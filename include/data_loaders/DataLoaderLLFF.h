@@ -32,6 +32,8 @@ namespace radu { namespace utils{
 //     class Frame;
 // }
 // class DataTransformer;
+class WorkerPool;
+class CameraNeighbourIndex;
 
 
 class DataLoaderLLFF
@@ -42,10 +44,16 @@ public:
     ~DataLoaderLLFF();
     void start(); //starts reading the data from disk. This gets called automatically if we have autostart=true
     easy_pbr::Frame get_next_frame();
+    int get_next_frame_idx(); //advances like get_next_frame but returns only the idx so the frame can be accessed without copying it
     easy_pbr::Frame get_frame_at_idx( const int idx);
+    const easy_pbr::Frame& get_frame_ref_at_idx( const int idx); //no copy of the frame, the reference is valid until start() is called again
+    const std::vector<easy_pbr::Frame>& get_all_frames_ref(); //no copy of the frames, the reference is valid until start() is called again
     easy_pbr::Frame get_closest_frame( const easy_pbr::Frame& frame);
     std::vector<easy_pbr::Frame> get_close_frames( const easy_pbr::Frame& frame, const int nr_frames, const bool discard_same_idx ); //return a certain number of frames ordered by proximity,
+    int get_closest_frame_idx( const easy_pbr::Frame& frame); //same as get_closest_frame but returns the idx of the frame which can be used with get_frame_at_idx
+    std::vector<int> get_close_frames_idxs( const easy_pbr::Frame& frame, const int nr_frames, const bool discard_same_idx ); //same as get_close_frames but returns the idxs of the frames instead of copies of them
     easy_pbr::Frame get_random_frame();
+    int get_random_frame_idx(); //same random draw as get_random_frame but returns only the idx
     bool has_data(); //will reeturn always true because this dataloader preloads all the frames and keeps them in memory all the time. They are not so many
     void reset(); //starts reading from the beggining
     int nr_samples(); //returns the number of scenes for the object that we selected
@@ -66,39 +74,20 @@ private:
     void init_extrinsics_and_intrinsics(); //rad the pose json file and fills m_filename2pose
     void read_data(); //a scene (depending on the mode) and all the images contaned in it together with the poses and so on
 
-    // Read data in little endian format for cross-platform support. From colmap github src/util/endian.h
-    template <typename T>
-    T ReadBinaryLittleEndian(std::istream* stream);
-    template <typename T>
-    void ReadBinaryLittleEndian(std::istream* stream, std::vector<T>* data);
-    // Convert data between endianness and the native format. Note that, for float
-    // and double types, these functions are only valid if the format is IEEE-754.
-    // This is the case for pretty much most processors.
-    template <typename T>
-    T LittleEndianToNative(const T x);
-    template <typename T>
-    T BigEndianToNative(const T x);
-    template <typename T>
-    T NativeToLittleEndian(const T x);
-    template <typename T>
-    T NativeToBigEndian(const T x);
-    // Reverse the order of each byte.
-    template <typename T>
-    T ReverseBytes(const T& data);
-    // Check the order in which bytes are stored in computer memory.
-    bool IsLittleEndian();
-    bool IsBigEndian();
 
 
 
     //objects
     std::shared_ptr<radu::utils::RandGenerator> m_rand_gen;
+    std::shared_ptr<CameraNeighbourIndex> m_cam_index; //finds the frames that are close to a certain one. Gets built after reading the data
+    std::shared_ptr<WorkerPool> m_decode_pool; //decodes the images in parallel. Is null when we read serially
     // std::shared_ptr<DataTransformer> m_transformer;
 
     //params
     bool m_autostart;
     // std::atomic<bool> m_is_running;// if the loop of loading is running, it is used to break the loop when the user ctrl-c
     int m_subsample_factor;
+    bool m_reduced_jpeg_decode; //decodes the jpegs directly at the subsampled resolution which is much faster but not bit-identical to the INTER_AREA resize
     std::string m_mode; // train or test or val
     bool m_shuffle;
     bool m_do_overfit; // return all the time just the first image
@@ -110,6 +99,9 @@ private:
     // std::thread m_loader_thread;
     int m_nr_resets;
     int m_idx_img_to_read; //corresponds to the idx of the frame we will return since we have them all in memory
+    int m_nr_decode_threads; //nr of threads used to decode the images. 1 reads serially on the calling thread and 0 uses all the cores
+    float m_close_frames_view_dir_weight; //how much the difference in view direction adds to the distance between two frames. With 0 only the distance between the camera centers is used
+    int m_nr_precomputed_close_frames; //for every frame we precompute this many close frames so that querying them with a frame of the loader is just a lookup
 
 
     //internal
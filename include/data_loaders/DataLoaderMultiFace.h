@@ -19,6 +19,8 @@
 
 #include "easy_pbr/Frame.h"
 
+#include "data_loaders/SamplePipeline.h"
+
 
 
 
@@ -29,6 +31,7 @@ namespace radu { namespace utils{
 namespace easy_pbr{
     class Mesh;
 }
+class WorkerPool;
 // class DataTransformer;
 
 
@@ -37,6 +40,13 @@ struct GenesisCam{
     std::vector< std::string > imgs_paths;
 };
 
+//everything the loader needs for one timestep of the sequence. A timestep of -1 means that there is no data
+struct MultiFaceTimestep{
+    int timestep=-1;
+    std::vector<easy_pbr::Frame> frames;
+    std::shared_ptr<easy_pbr::Mesh> mesh;
+};
+
 
 class DataLoaderMultiFace
 {
@@ -46,13 +56,17 @@ public:
     ~DataLoaderMultiFace();
     void start(); //starts reading the data from disk. This gets called automatically if we have autostart=true
     easy_pbr::Frame get_next_frame();
+    int get_next_frame_idx(); //advances like get_next_frame but returns only the idx so the frame can be accessed without copying it
     std::vector<easy_pbr::Frame> get_all_frames();
+    const std::vector<easy_pbr::Frame>& get_all_frames_ref(); //no copy of the frames, the reference is valid until the loader moves to another timestep or start() is called again
     easy_pbr::Frame get_frame_at_idx( const int idx);
+    const easy_pbr::Frame& get_frame_ref_at_idx( const int idx); //no copy of the frame, the reference is valid until the loader moves to another timestep or start() is called again
     easy_pbr::Frame get_frame_for_cam_id( const int cam_id);
     easy_pbr::Frame get_closest_frame( const easy_pbr::Frame& frame); //return the one closest frame
     std::vector<easy_pbr::Frame> get_close_frames( const easy_pbr::Frame& frame, const int nr_frames, const bool discard_same_idx ); //return a certain number of frames ordered by proximity,
     // std::vector<float> compute_frame_weights( const easy_pbr::Frame& frame, std::vector<easy_pbr::Frame>& close_frames);
     easy_pbr::Frame get_random_frame();
+    int get_random_frame_idx(); //same random draw as get_random_frame but returns only the idx
     std::shared_ptr<easy_pbr::Mesh>  get_mesh_head();
     // std::shared_ptr<easy_pbr::Mesh>  get_mesh_head_bald();
     // std::shared_ptr<easy_pbr::Mesh>  get_mesh_shoulders();
@@ -74,6 +88,11 @@ public:
     std::string sequence();
     std::string dataset_path();
     std::string mesh_name_for_cur_timestep(); //return the mesh string like 017867 for this sequence and this timestep
+    //sequence playback over the timesteps. With sequence_playback=true the frames and the mesh of the next timestep are read and decoded in the background while the current one is being used
+    int timestep();
+    int nr_timesteps(); //nr of timesteps for which we have both the mesh and the images of all the cameras
+    void set_timestep(const int timestep); //reads the frames and the mesh of this timestep and restarts the prefetching after it
+    bool next_timestep(); //moves to the next timestep, waiting for the prefetcher if it's not done with it yet. Returns false if we are already at the last one
     int subsample_factor();
     void set_subsample_factor(const int val);
     // std::shared_ptr<GenesisHair> get_random_roots(const int nr_strands);
@@ -99,6 +118,13 @@ private:
     Eigen::Affine3f  init_transforms(); 
     Eigen::Affine3f transform_from_world_mugsy_to_world_easypbr(const Eigen::Affine3f& tf_world_obj, const bool do_scaling);
     void read_data(); //a scene (depending on the mode) and all the images contaned in it together with the poses and so on
+    MultiFaceTimestep read_timestep(const int timestep, const bool load_images); //only reads members that don't change after start() so it also runs on the prefetch thread
+    void start_prefetching(); //starts prefetching the timesteps after m_timestep
+    std::shared_ptr<easy_pbr::Mesh> read_mesh_for_timestep(const int timestep); //from the binary cache if there is one that is up to date, the mesh is already placed in the world
+    static boost::filesystem::path binary_cache_path(const boost::filesystem::path& obj_filename);
+    static bool is_binary_cache_valid(const boost::filesystem::path& cache_filename, const boost::filesystem::path& obj_filename);
+    static std::shared_ptr<easy_pbr::Mesh> read_binary_cache(const boost::filesystem::path& cache_filename);
+    static bool write_binary_cache(const boost::filesystem::path& cache_filename, const std::shared_ptr<easy_pbr::Mesh>& mesh); //returns false if the cache could not be written, for example if the dataset is read only
     void load_images_in_frame(easy_pbr::Frame& frame);
     std::shared_ptr<easy_pbr::Mesh>  read_mesh(const std::string path, bool load_texture, bool transform, bool check_frame_nr);
     // std::shared_ptr<GenesisHair>  read_hair_recon(const std::string path_bin_file);
@@ -108,6 +134,7 @@ private:
 
     //objects
     std::shared_ptr<radu::utils::RandGenerator> m_rand_gen;
+    std::shared_ptr<WorkerPool> m_decode_pool; //decodes the images of a timestep in parallel. Is null when we read serially
     // std::shared_ptr<DataTransformer> m_transformer;
 
     //params
@@ -121,20 +148,26 @@ private:
     //rest of params
     bool m_autostart;
     int m_subsample_factor;
+    bool m_reduced_jpeg_decode; //decodes the jpegs directly at the subsampled resolution which is much faster but not bit-identical to the INTER_AREA resize
     // bool m_load_as_float;
     std::string m_mode; // train or test or val
     bool m_shuffle;
     bool m_load_as_shell;
+    int m_nr_decode_threads; //nr of threads used to decode the images of a timestep. 1 reads serially and 0 uses all the cores
     bool m_do_overfit; // return all the time just the first image
     float m_scene_rotate_x_angle;
     Eigen::Vector3f m_scene_translation; //moves the scene so that we have it at the origin more or less
     float m_scene_scale_multiplier; //multiplier the scene scale with this value so that we keep it in a range that we can expect
+    bool m_use_binary_cache; //keeps a binary copy of the parsed obj of every timestep in binary_cache/ next to the tracked meshes and reads from it when it is up to date
+    bool m_sequence_playback; //prefetch the next timesteps in the background so that next_timestep() doesn't need to wait for the disk
+    int m_prefetch_depth; //maximum nr of timesteps that are being read or waiting to be consumed
 
 
 
     //other
     int m_nr_resets;
     int m_idx_img_to_read; //corresponds to the idx of the frame we will return since we have them all in memory
+    std::atomic<bool> m_failed_writing_cache; //we stop trying to write the binary cache after the first failure so we don't warn for every timestep
 
 
     //internal
@@ -156,5 +189,6 @@ private:
     // std::shared_ptr<easy_pbr::Mesh>  m_mesh_scalp_for_timestep;
     // std::shared_ptr<easy_pbr::Mesh>  m_mesh_hair_for_timestep;
     // std::shared_ptr<GenesisHair>  m_hair_for_timestep;
+    SamplePipeline<MultiFaceTimestep> m_timesteps_pipeline; //the sample idx is the offset from the timestep that was current when the prefetching started
 
 };
\ No newline at end of file
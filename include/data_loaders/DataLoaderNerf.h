@@ -28,6 +28,8 @@ namespace radu { namespace utils{
 //     class Frame;
 // }
 // class DataTransformer;
+class WorkerPool;
+class CameraNeighbourIndex;
 
 
 class DataLoaderNerf
@@ -38,12 +40,18 @@ public:
     ~DataLoaderNerf();
     void start(); //starts reading the data from disk. This gets called automatically if we have autostart=true
     easy_pbr::Frame get_next_frame();
+    int get_next_frame_idx(); //advances like get_next_frame but returns only the idx so the frame can be accessed without copying it
     std::vector<easy_pbr::Frame> get_all_frames();
+    const std::vector<easy_pbr::Frame>& get_all_frames_ref(); //no copy of the frames, the reference is valid until start() is called again
     easy_pbr::Frame get_frame_at_idx( const int idx);
+    const easy_pbr::Frame& get_frame_ref_at_idx( const int idx); //no copy of the frame, the reference is valid until start() is called again
     easy_pbr::Frame get_closest_frame( const easy_pbr::Frame& frame); //return the one closest frame
     std::vector<easy_pbr::Frame> get_close_frames( const easy_pbr::Frame& frame, const int nr_frames, const bool discard_same_idx ); //return a certain number of frames ordered by proximity,
+    int get_closest_frame_idx( const easy_pbr::Frame& frame); //same as get_closest_frame but returns the idx of the frame which can be used with get_frame_at_idx
+    std::vector<int> get_close_frames_idxs( const easy_pbr::Frame& frame, const int nr_frames, const bool discard_same_idx ); //same as get_close_frames but returns the idxs of the frames instead of copies of them
     // std::vector<float> compute_frame_weights( const easy_pbr::Frame& frame, std::vector<easy_pbr::Frame>& close_frames);
     easy_pbr::Frame get_random_frame();
+    int get_random_frame_idx(); //same random draw as get_random_frame but returns only the idx
     void set_dataset_path(const std::string dataset_path);
     void set_restrict_to_scene_name(const std::string scene_name);
     std::string get_restrict_to_scene_name();
@@ -67,6 +75,8 @@ private:
 
     //objects
     std::shared_ptr<radu::utils::RandGenerator> m_rand_gen;
+    std::shared_ptr<CameraNeighbourIndex> m_cam_index; //finds the frames that are close to a certain one. Gets built after reading the data
+    std::shared_ptr<WorkerPool> m_decode_pool; //decodes the images in parallel. Is null when we read serially
     // std::shared_ptr<DataTransformer> m_transformer;
 
     //params
@@ -85,6 +95,9 @@ private:
     std::string m_restrict_to_scene_name;
     bool m_load_mask;
     float m_r, m_g, m_b; //the color of the background
+    int m_nr_decode_threads; //nr of threads used to decode the images. 1 reads serially on the calling thread and 0 uses all the cores
+    float m_close_frames_view_dir_weight; //how much the difference in view direction adds to the distance between two frames. With 0 only the distance between the camera centers is used
+    int m_nr_precomputed_close_frames; //for every frame we precompute this many close frames so that querying them with a frame of the loader is just a lookup
 
     //internal
     std::unordered_map<std::string, Eigen::Affine3d> m_filename2pose; //maps from the filename of the image to the corresponding pose
@@ -3,6 +3,7 @@
 
 #include <thread>
 #include <vector>
+#include <atomic>
 
 //ros
 // #include <ros/ros.h>
@@ -14,8 +15,8 @@
 #include <Eigen/Geometry>
 #include <Eigen/StdVector>
 
-//readerwriterqueue
-#include "readerwriterqueue/readerwriterqueue.h"
+//my stuff
+#include "data_loaders/SamplePipeline.h"
 
 //boost
 #include <boost/bind.hpp>
@@ -67,8 +68,17 @@ private:
 
     void init_params(const std::string config_file);
     void init_data_reading(); //after the parameters this uses the params to initiate all the structures needed for the susequent read_data
-    void read_data();
-    std::shared_ptr<easy_pbr::Mesh> read_sample(const fs::path sample_filename); //reads one data sample
+    void read_data(); //preloads all the samples in m_clouds_vec
+    std::shared_ptr<easy_pbr::Mesh> read_sample(const fs::path sample_filename); //reads one data sample, does both the parsing and the processing
+    std::shared_ptr<easy_pbr::Mesh> parse_sample(const fs::path sample_filename); //parses the file and moves the cloud in place. Does not touch the random generator so it can run concurrently
+    void process_sample(std::shared_ptr<easy_pbr::Mesh>& cloud); //subsampling, augmentation and shuffling of the points. Uses the random generator so the pipeline runs it for one cloud at a time
+    //the xyz and all the label columns of a sample as they are in the text file. Maize has two label columns (leaf collar and leaf tip) and tomato only one
+    typedef Eigen::Matrix<float, Eigen::Dynamic, 3, Eigen::RowMajor> PointsXYZ;
+    void parse_txt(const fs::path& sample_filename, PointsXYZ& xyz, Eigen::MatrixXi& labels);
+    static fs::path binary_cache_path(const fs::path& sample_filename);
+    static bool is_binary_cache_valid(const fs::path& cache_filename, const fs::path& sample_filename);
+    void read_binary_cache(const fs::path& cache_filename, PointsXYZ& xyz, Eigen::MatrixXi& labels);
+    bool write_binary_cache(const fs::path& cache_filename, const PointsXYZ& xyz, const Eigen::MatrixXi& labels); //returns false if the cache could not be written, for example if the dataset is read only
 
     //objects
     std::shared_ptr<radu::utils::RandGenerator> m_rand_gen;
@@ -95,21 +105,23 @@ private:
     bool m_do_overfit; //return only one of the samples the whole time, concretely the first sample in the dataset
     bool m_do_augmentation;
     bool m_preload;
+    int m_nr_reader_threads; //nr of threads that read clouds from disk concurrently
+    int m_prefetch_depth; //maximum nr of clouds that are being read or waiting to be consumed
+    bool m_ordered_delivery; //returns the clouds in the same order as the files. Otherwise they are returned as soon as they are ready
+    bool m_use_binary_cache; //reads the samples from a binary file next to the text file, which gets written the first time the text is parsed
 
 
 
 
     //internal
-    std::thread m_loader_thread;
-    uint32_t m_idx_cloud_to_read;
     uint32_t m_idx_cloud_to_return;
     int m_nr_resets;
     bool m_is_modified; //indicate that a cloud was finished processind and you are ready to get it
-    bool m_is_running;// if the loop of loading is running, it is used to break the loop when the user ctrl-c
     int m_nr_sequences;
     std::vector<fs::path> m_sample_filenames;
-    moodycamel::ReaderWriterQueue<std::shared_ptr<easy_pbr::Mesh> > m_clouds_buffer;
+    SamplePipeline< std::shared_ptr<easy_pbr::Mesh> > m_clouds_pipeline; //used when we don't preload
     std::vector< std::shared_ptr<easy_pbr::Mesh>  > m_clouds_vec;
+    std::atomic<bool> m_failed_writing_cache; //we stop trying to write the binary cache after the first failure so we don't warn for every sample
     // std::vector<Eigen::Affine3d,  Eigen::aligned_allocator<Eigen::Affine3d>  >m_worldROS_cam_vec; //actually the semantic kitti expressed the clouds in the left camera coordinate so it should be m_worldRos_cam_vec
 
     //label mngr to link to all the meshes that will have a semantic information
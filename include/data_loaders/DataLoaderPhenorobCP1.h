@@ -35,6 +35,7 @@ BETTER_ENUM(PHCP1DatasetType, int, Raw = 0, ProcessedColmap )
 namespace radu { namespace utils{
     class RandGenerator;
 }}
+class ImageCache;
 
 // namespace easy_pbr{
 //     class Frame;
@@ -152,12 +153,14 @@ private:
 
     //objects
     std::shared_ptr<radu::utils::RandGenerator> m_rand_gen;
+    std::shared_ptr<ImageCache> m_image_cache; //keeps the images decoded by the shell frames. Null if we don't load as shell or image_cache_mb is 0
     // std::shared_ptr<DataTransformer> m_transformer;
 
     //params
     bool m_autostart;
     // std::atomic<bool> m_is_running;// if the loop of loading is running, it is used to break the loop when the user ctrl-c
     int m_rgb_subsample_factor;
+    bool m_reduced_jpeg_decode; //decodes the jpegs directly at the subsampled resolution which is much faster but not bit-identical to the INTER_AREA resize
     // int m_photoneo_subsample_factor;
     // float m_exposure_change;
     // bool m_load_as_float;
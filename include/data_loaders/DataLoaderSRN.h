@@ -5,6 +5,7 @@
 #include <unordered_map>
 #include <vector>
 #include <atomic>
+#include <mutex>
 
 
 
@@ -27,6 +28,8 @@
 namespace radu { namespace utils{
     class RandGenerator;
 }}
+class ImageCache;
+class WorkerPool;
 
 // namespace easy_pbr{
 //     class Frame;
@@ -42,9 +45,11 @@ public:
     ~DataLoaderSRN();
     void start(); //starts reading the data from disk. This gets called automatically if we have autostart=true
     easy_pbr::Frame get_random_frame();
+    int get_random_frame_idx(); //same random draw as get_random_frame but returns only the idx
     easy_pbr::Frame get_frame_at_idx( const int idx);
-    void start_reading_next_scene(); //switch to another scene from this object and start reading it
-    bool finished_reading_scene(); //returns true when we have finished reading everything for that one scene of the corresponding object and we can safely use get_random_frame
+    std::shared_ptr< const std::vector<easy_pbr::Frame> > get_all_frames_ref(); //no copy of the frames. The scene is never modified once it is served so the snapshot stays valid after the loader switches to the next scene
+    void start_reading_next_scene(); //asks to switch to the next scene. Never blocks, the current scene keeps being served until the next one is read. The next one is usually read already in the background
+    bool finished_reading_scene(); //returns true when we have switched to the scene asked for with start_reading_next_scene. Also does the switch if it was waiting for the background read
     bool has_data(); //calls internally finished_reading scene. It's mostly a convenience function
     void reset(); //starts reading from the beggining
     int nr_samples(); //returns the number of scenes for the object that we selected
@@ -62,7 +67,9 @@ private:
 
     void init_params(const std::string config_file);
     void init_data_reading(); //after the parameters this uses the params to initiate all the structures needed for the susequent read_data
-    void read_scene(const std::string scene_path); //a path to the scene which contains all the  images and the pose and so on
+    void read_scene(const std::string scene_path); //a path to the scene which contains all the  images and the pose and so on. Reads into m_frames_next_scene
+    void read_next_scene_in_background(); //starts reading the scene at m_idx_scene_to_read if there is one
+    void switch_scene_if_ready(); //if the user asked for the next scene and it's finished reading, it becomes the current one and we start reading the one after it
     std::unordered_map<std::string, std::string> create_mapping_classnr2classname(); //create the mapping between the weird nr of a class to the actual class name
     Eigen::Affine3f process_extrinsics_line(const std::string line);
     void load_images_in_frame(easy_pbr::Frame& frame);
@@ -70,6 +77,8 @@ private:
 
     //objects
     std::shared_ptr<radu::utils::RandGenerator> m_rand_gen;
+    std::shared_ptr<ImageCache> m_image_cache; //keeps the images decoded by the shell frames. Null if we don't load as shell or image_cache_mb is 0
+    std::shared_ptr<WorkerPool> m_decode_pool; //decodes the images of a scene in parallel. Is null when we read serially
     // std::shared_ptr<DataTransformer> m_transformer;
 
     //params
@@ -82,6 +91,7 @@ private:
     int m_nr_samples_to_read;
     int m_nr_imgs_to_read;
     int m_subsample_factor;
+    bool m_reduced_jpeg_decode; //decodes the jpegs directly at the subsampled resolution which is much faster but not bit-identical to the INTER_AREA resize
     bool m_shuffle;
     bool m_do_overfit; // return all the time just images from the the first scene of that specified object class
     std::string m_object_name;
@@ -91,6 +101,7 @@ private:
     std::string m_difficulty;
     bool m_load_depth;
     bool m_load_as_shell;
+    int m_nr_decode_threads; //nr of threads used to decode the images of a scene. 1 reads serially on the loader thread and 0 uses all the cores
     std::thread m_loader_thread;
     int m_nr_resets;
     int m_idx_scene_to_read;
@@ -99,7 +110,12 @@ private:
 
     //internal
     std::vector<boost::filesystem::path> m_scene_folders; //contains all the folders of the scenes for this objects
-    std::vector< easy_pbr::Frame > m_frames_for_scene;
-    int m_nr_scenes_read_so_far;
+    std::shared_ptr< const std::vector<easy_pbr::Frame> > m_frames_for_scene; //the scene that is being served. Replaced as a whole on a switch so that the snapshots handed out stay valid
+    std::vector< easy_pbr::Frame > m_frames_next_scene; //the scene that is read in the background while the current one is served
+    std::atomic<bool> m_next_scene_ready; //m_frames_next_scene is fully read and waiting to be switched to
+    bool m_switch_requested; //start_reading_next_scene() was called but we haven't switched yet because the next scene is still reading
+    std::mutex m_scene_mutex; //guards the frames of both scenes, the rng and the scene counters. The getters run without the gil so several python threads can use them while another one switches the scene
+    std::mutex m_switch_mutex; //serializes the calls that switch the scene or reset since they join and start the loader thread
+    int m_nr_scenes_read_so_far; //nr of scenes switched to so far. It seeds the shuffle of the images of the next scene
 
 };
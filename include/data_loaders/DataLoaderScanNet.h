@@ -2,6 +2,7 @@
 
 
 #include <thread>
+#include <atomic>
 #include <unordered_map>
 #include <vector>
 
@@ -10,9 +11,8 @@
 #include <Eigen/Geometry>
 #include <Eigen/StdVector>
 
-
-//readerwriterqueue
-#include "readerwriterqueue/readerwriterqueue.h"
+//my stuff
+#include "data_loaders/SamplePipeline.h"
 
 //boost
 #include <boost/bind.hpp>
@@ -55,11 +55,17 @@ private:
 
     void init_params(const std::string config_file);
     void init_data_reading(); //after the parameters this uses the params to initiate all the structures needed for the susequent read_data
-    void read_data();
+    std::shared_ptr<easy_pbr::Mesh> read_sample(const int idx); //reads and parses the cloud at a certain idx, from the preprocessed cache if possible. Runs concurrently on all the reader threads
+    std::shared_ptr<easy_pbr::Mesh> preprocess_sample(const fs::path& ply_filename, const bool with_labels); //reads the ply, labels and alignment of a scene and gives the aligned cloud without any augmentation
+    void process_sample(std::shared_ptr<easy_pbr::Mesh>& cloud); //subsamples and augments the cloud. Uses the random generator so the pipeline runs it for one cloud at a time
     Eigen::MatrixXi read_labels(const std::string labels_file); //the labels of the point cloud are stored in a separate ply file. We read it the same way as the ReadPLY.cpp in libigl.
     Eigen::Affine3d read_alignment_matrix(const std::string alignment_file); //scannet provides and alignment files as a 4x4 matrix stored in row major that aligns the walls and so on
     // std::unordered_map<std::string, bool>  read_data_split(const std::string data_split_file);
     void create_transformation_matrices();
+    static fs::path preprocessed_cache_path(const fs::path& ply_filename);
+    bool is_preprocessed_cache_valid(const fs::path& cache_filename, const fs::path& ply_filename, const bool with_labels); //the cache has to be newer than the files of the scene and written with the same label config
+    std::shared_ptr<easy_pbr::Mesh> read_preprocessed_cache(const fs::path& cache_filename);
+    bool write_preprocessed_cache(const fs::path& cache_filename, const std::shared_ptr<easy_pbr::Mesh>& cloud, const bool with_labels); //returns false if the cache could not be written, for example if the dataset is read only
 
     //objects
     std::shared_ptr<radu::utils::RandGenerator> m_rand_gen;
@@ -67,7 +73,6 @@ private:
 
     //params
     bool m_autostart;
-    bool m_is_running;// if the loop of loading is running, it is used to break the loop when the user ctrl-c
     std::string m_mode; // train or test or val
     fs::path m_dataset_path;
     int m_nr_clouds_to_skip;
@@ -77,9 +82,11 @@ private:
     bool m_shuffle;
     bool m_do_overfit; // return all the time just one of the clouds, specifically the first one
     // bool m_do_adaptive_subsampling; //randomly drops points from the cloud, dropping with more probability the ones that are closes and with less the ones further
-    std::thread m_loader_thread;
-    uint32_t m_idx_cloud_to_read;
     int m_nr_resets;
+    int m_nr_reader_threads; //nr of threads that read clouds from disk concurrently
+    int m_prefetch_depth; //maximum nr of clouds that are being read or waiting to be consumed
+    bool m_ordered_delivery; //returns the clouds in the same order as the files. Otherwise they are returned as soon as they are ready
+    bool m_use_preprocessed_cache; //stores the aligned and labeled cloud of each scene next to its ply the first time it's read and maps it in the next epochs
     // std::string m_pose_file;
     // std::string m_pose_file_format;
 
@@ -90,9 +97,12 @@ private:
     std::unordered_map<std::string, bool> m_files_train;
     std::unordered_map<std::string, bool> m_files_test;
     std::unordered_map<std::string, bool> m_files_validation;
-    moodycamel::ReaderWriterQueue<std::shared_ptr<easy_pbr::Mesh> > m_clouds_buffer;
+    SamplePipeline< std::shared_ptr<easy_pbr::Mesh> > m_clouds_pipeline;
     // std::vector<Eigen::Affine3d,  Eigen::aligned_allocator<Eigen::Affine3d>  >m_worldROS_cam_vec; //actually the semantic kitti expressed the clouds in the left camera coordinate so it should be m_worldRos_cam_vec
     Eigen::Affine3d m_tf_worldGL_worldROS;
+    std::string m_labels_file;
+    uint64_t m_preprocessed_config_hash;
+    std::atomic<bool> m_failed_writing_cache; //we stop trying to write the preprocessed cache after the first failure so we don't warn for every scene
 
     //label mngr to link to all the meshes that will have a semantic information
     std::shared_ptr<easy_pbr::LabelMngr> m_label_mngr;
@@ -4,6 +4,7 @@
 #include <thread>
 #include <unordered_map>
 #include <vector>
+#include <cstdint>
 
 //ros
 // #include <ros/ros.h>
@@ -15,8 +16,8 @@
 #include <Eigen/Geometry>
 #include <Eigen/StdVector>
 
-//readerwriterqueue
-#include "readerwriterqueue/readerwriterqueue.h"
+//my stuff
+#include "data_loaders/SamplePipeline.h"
 
 //boost
 #include <boost/bind.hpp>
@@ -33,6 +34,7 @@ namespace easy_pbr{
     class Mesh;
 }
 class DataTransformer;
+class MappedFile;
 
 
 class DataLoaderSemanticKitti
@@ -54,6 +56,7 @@ public:
     void set_mode_validation();
     void set_sequence(const std::string sequence);
     // void set_adaptive_subsampling(const bool adaptive_subsampling);
+    static void pack_sequence(const std::string sequence_path); //converts all the npz scans of a sequence folder into a single scans.pack inside that folder which can be read with read_packed=true
 
 
     int add(const int a, const int b );
@@ -62,7 +65,11 @@ private:
     void init_params(const std::string config_file);
     void init_data_reading(); //after the parameters this uses the params to initiate all the structures needed for the susequent read_data
     std::vector<Eigen::Affine3d,  Eigen::aligned_allocator<Eigen::Affine3d>  >read_pose_file(std::string m_pose_file);
-    void read_data();
+    std::shared_ptr<easy_pbr::Mesh> read_sample(const int idx); //reads and parses the cloud at a certain idx. Runs concurrently on all the reader threads
+    void process_sample(std::shared_ptr<easy_pbr::Mesh>& cloud); //augments the cloud. Uses the random generator so the pipeline runs it for one cloud at a time
+    void read_packed_index(const fs::path& sequence_path, std::vector<fs::path>& npz_filenames); //maps the scans.pack of a sequence and adds its scans to npz_filenames
+    void read_packed_scan(const fs::path& npz_filename, std::shared_ptr<easy_pbr::Mesh>& cloud);
+    static bool is_scan_file(const fs::path& path); //the folder of a sequence also contains the poses, the intensities and maybe the packed file, which are not scans
     Eigen::Affine3d get_pose_for_scan_nr_and_sequence(const int scan_nr, const std::string sequence);
     void create_transformation_matrices();
     // void apply_transform(Eigen::MatrixXd& V, const Eigen::Affine3d& trans);
@@ -74,7 +81,6 @@ private:
 
     //params
     bool m_autostart;
-    bool m_is_running;// if the loop of loading is running, it is used to break the loop when the user ctrl-c
     std::string m_mode; // train or test or val
     fs::path m_dataset_path;
     fs::path m_sequence;
@@ -87,9 +93,11 @@ private:
     bool m_shuffle;
     bool m_do_overfit; // return all the time just one of the clouds, specifically the first one
     // bool m_do_adaptive_subsampling; //randomly drops points from the cloud, dropping with more probability the ones that are closes and with less the ones further
-    std::thread m_loader_thread;
-    uint32_t m_idx_cloud_to_read;
     int m_nr_resets;
+    int m_nr_reader_threads; //nr of threads that read clouds from disk concurrently
+    int m_prefetch_depth; //maximum nr of clouds that are being read or waiting to be consumed
+    bool m_ordered_delivery; //returns the clouds in the same order as the files. Otherwise they are returned as soon as they are ready
+    bool m_read_packed; //reads the scans from the scans.pack of each sequence instead of the npz files
     // std::string m_pose_file;
     // std::string m_pose_file_format;
 
@@ -97,8 +105,15 @@ private:
     //internal
     bool m_is_modified; //indicate that a cloud was finished processind and you are ready to get it
     int m_nr_sequences;
-    std::vector<fs::path> m_npz_filenames;
-    moodycamel::ReaderWriterQueue<std::shared_ptr<easy_pbr::Mesh> > m_clouds_buffer;
+    std::vector<fs::path> m_npz_filenames; //when reading packed files these are the paths the npz files would have, so that the shuffling and the scan_nr work the same
+    struct PackedScan{
+        std::shared_ptr<MappedFile> pack; //the file of the whole sequence, shared by all its scans
+        uint64_t xyz_offset;
+        uint64_t labels_offset;
+        int nr_points;
+    };
+    std::unordered_map<std::string, PackedScan> m_packed_scans; //maps from the npz path of the scan to where it is in the packed file. Only written in init_data_reading so the readers can use it concurrently
+    SamplePipeline< std::shared_ptr<easy_pbr::Mesh> > m_clouds_pipeline;
     // std::vector<Eigen::Affine3d,  Eigen::aligned_allocator<Eigen::Affine3d>  >m_worldROS_cam_vec; //actually the semantic kitti expressed the clouds in the left camera coordinate so it should be m_worldRos_cam_vec
     std::unordered_map< std::string,  std::vector<Eigen::Affine3d,  Eigen::aligned_allocator<Eigen::Affine3d>  > > m_poses_per_sequence; //each sequence is identified by a string like "00, 01 etc". Each has a vector of poses
     Eigen::Affine3d m_tf_cam_velodyne;
@@ -12,8 +12,8 @@
 #include <Eigen/Geometry>
 #include <Eigen/StdVector>
 
-//readerwriterqueue
-#include "readerwriterqueue/readerwriterqueue.h"
+//my stuff
+#include "data_loaders/SamplePipeline.h"
 
 //boost
 #include <boost/bind.hpp>
@@ -51,6 +51,7 @@ public:
     void set_mode_validation();
     std::string get_object_name();
     void set_object_name(const std::string object_name);
+    static void write_binary_cache(const std::string dataset_path); //converts once all the pts and seg files of the dataset into binary files that the loader then reads instead of parsing the text
 
 
 
@@ -59,9 +60,13 @@ private:
 
     void init_params(const std::string config_file);
     void init_data_reading(); //after the parameters this uses the params to initiate all the structures needed for the susequent read_data
-    void read_data();
-    Eigen::MatrixXd read_pts(const std::string file_path);
-    Eigen::MatrixXi read_labels(const std::string file_path);
+    std::shared_ptr<easy_pbr::Mesh> read_sample(const int idx); //reads and parses the cloud at a certain idx. Runs concurrently on all the reader threads
+    void process_sample(std::shared_ptr<easy_pbr::Mesh>& cloud); //augments the cloud. Uses the random generator so the pipeline runs it for one cloud at a time
+    static Eigen::MatrixXd read_pts(const std::string file_path);
+    static Eigen::MatrixXi read_labels(const std::string file_path);
+    static boost::filesystem::path binary_cache_path(const boost::filesystem::path& pts_filename);
+    static bool is_binary_cache_valid(const boost::filesystem::path& cache_filename, const boost::filesystem::path& pts_filename, const boost::filesystem::path& labels_filename);
+    static void read_binary_cache(const std::string file_path, Eigen::MatrixXd& V, Eigen::MatrixXi& labels);
     std::unordered_map<std::string, std::string> read_mapping_synsetoffset2category(const std::string file_path);
     void create_transformation_matrices();
     // void apply_transform(Eigen::MatrixXd& V, const Eigen::Affine3d& trans);
@@ -73,7 +78,6 @@ private:
 
     //params
     bool m_autostart;
-    bool m_is_running;// if the loop of loading is running, it is used to break the loop when the user ctrl-c
     std::string m_mode; // train or test or val
     bool m_shuffle_points; //When splatting in a permutohedral lattice it's better to have adyancent point in 3D be in different parts in memoru to aboid hashing conflicts
     bool m_normalize; //normalizes the point cloud between [-1,1]
@@ -83,9 +87,11 @@ private:
     boost::filesystem::path m_dataset_path;  //get the path where all the off files are
     // int m_nr_clouds_to_skip;
     // int m_nr_clouds_to_read;
-    std::thread m_loader_thread;
-    uint32_t m_idx_cloud_to_read;
     int m_nr_resets;
+    int m_nr_reader_threads; //nr of threads that read clouds from disk concurrently
+    int m_prefetch_depth; //maximum nr of clouds that are being read or waiting to be consumed
+    bool m_ordered_delivery; //returns the clouds in the same order as the files. Otherwise they are returned as soon as they are ready
+    bool m_use_binary_cache; //reads the shapes from the binary cache written by write_binary_cache when it exists and is newer than the text files
     // std::string m_pose_file;
     // std::string m_pose_file_format;
 
@@ -94,7 +100,7 @@ private:
     std::vector<boost::filesystem::path> m_pts_filenames; //contains all the pts filenames from all the classes
     std::vector<boost::filesystem::path> m_labels_filenames; //contains all the labels for the correspinding pts files
     // std::unordered_map<std::string, std::string> m_synsetoffset2category; //mapping from the filename which a bunch of number to the class name;
-    moodycamel::ReaderWriterQueue<std::shared_ptr<easy_pbr::Mesh> > m_clouds_buffer;
+    SamplePipeline< std::shared_ptr<easy_pbr::Mesh> > m_clouds_pipeline;
     Eigen::Affine3d m_tf_worldGL_worldROS;
 
     //label mngr to link to all the meshes that will have a semantic information
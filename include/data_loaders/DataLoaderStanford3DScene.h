@@ -4,13 +4,12 @@
 #include <thread>
 #include <unordered_map>
 #include <vector>
+#include <deque>
 
 //eigen
 #include <Eigen/Core>
 #include<Eigen/StdVector>
 
-//readerwriterqueue
-#include "readerwriterqueue/readerwriterqueue.h"
 
 //boost
 #include <boost/bind.hpp>
@@ -19,6 +18,9 @@ namespace fs = boost::filesystem;
 
 #include "easy_pbr/Frame.h"
 
+//my stuff
+#include "data_loaders/SamplePipeline.h"
+
 
 namespace radu { namespace utils{
     class RandGenerator;
@@ -53,7 +55,6 @@ private:
     void init_data_reading(); //after the parameters this uses the params to initiate all the structures needed for the susequent read_data
     void read_pose_file(std::string pose_file);
     Eigen::Matrix3d read_intrinsics_file(std::string intrinsics_file);
-    void read_data();
     void read_sample(easy_pbr::Frame& frame_color, easy_pbr::Frame& frame_depth, const boost::filesystem::path& sample_filename); //reads one data sample
 
     //objects
@@ -61,25 +62,27 @@ private:
 
     //params
     bool m_autostart;
-    bool m_is_running;// if the loop of loading is running, it is used to break the loop when the user ctrl-c
     fs::path m_dataset_path;
     fs::path m_pose_file_path;
     int m_nr_samples_to_skip;
     int m_nr_samples_to_read;
     bool m_shuffle;
     bool m_do_overfit; // return all the time just one of the samples, specifically the first one
-    std::thread m_loader_thread;
-    uint32_t m_idx_sample_to_read;
     int m_nr_resets;
+    int m_nr_reader_threads; //nr of threads that read samples from disk concurrently
+    int m_prefetch_depth; //maximum nr of samples that are being read or waiting to be consumed
+    bool m_ordered_delivery; //returns the samples in the same order as the files. Otherwise they are returned as soon as they are ready
     int m_rgb_subsample_factor; //reduces the size of the color frames
+    bool m_reduced_jpeg_decode; //decodes the jpegs directly at the subsampled resolution which is much faster but not bit-identical to the INTER_AREA resize
     int m_depth_subsample_factor; //reduces the size of the depth frames
 
 
     //internal
     bool m_is_modified; //indicate that a cloud was finished processind and you are ready to get it
     std::vector<fs::path> m_samples_filenames;
-    moodycamel::ReaderWriterQueue<easy_pbr::Frame> m_frames_color_buffer;
-    moodycamel::ReaderWriterQueue<easy_pbr::Frame> m_frames_depth_buffer;
+    SamplePipeline< std::pair<easy_pbr::Frame, easy_pbr::Frame> > m_frames_pipeline; //color and depth frames are read together
+    std::deque<easy_pbr::Frame> m_frames_color_ready; //the color frames that came out of the pipeline but were not yet returned, since the color and depth are returned separately
+    std::deque<easy_pbr::Frame> m_frames_depth_ready;
     std::vector<PoseStanford3DScene> m_poses_vec;
     Eigen::Affine3d m_tf_worldGL_worldROS;
     Eigen::Matrix3d m_K;
@@ -11,8 +11,6 @@
 #include <Eigen/Core>
 #include<Eigen/StdVector>
 
-//readerwriterqueue
-#include "readerwriterqueue/readerwriterqueue.h"
 
 //boost
 #include <boost/bind.hpp>
@@ -20,6 +18,7 @@
 namespace fs = boost::filesystem;
 
 #include "data_loaders/core/MeshCore.h"
+#include "data_loaders/SamplePipeline.h"
 
 
 namespace radu { namespace utils{
@@ -30,6 +29,7 @@ namespace easy_pbr{
     class LabelMngr;
 }
 class DataTransformer;
+class WorkerPool;
 
 
 class DataLoaderStanfordIndoor
@@ -55,17 +55,20 @@ private:
 
     void init_params(const std::string config_file);
     void init_data_reading(); //after the parameters this uses the params to initiate all the structures needed for the susequent read_data
-    void read_data_and_reparse();
-    void read_data();
+    MeshCore read_sample(const int idx); //reads the room at a certain idx either from the original files or from our binary. Runs concurrently on all the reader threads
+    MeshCore read_room_and_reparse(const fs::path& room_path); //reads the original ASCII files of the room, parsing the objects in parallel, and writes them into our binary
+    MeshCore read_room_binary(const fs::path& room_path); //maps our binary and copies its blocks into the cloud
+    void write_room_binary(const fs::path& binary_path, const MeshCore& cloud);
+    void process_sample(MeshCore& cloud); //subsamples and augments the cloud. Uses the random generator so the pipeline runs it for one cloud at a time
     bool should_read_area(const int area_number); //depending on the mode (train or test) and the the m_fold we may need to read or not one of the 6 areas
 
     //objects
     std::shared_ptr<radu::utils::RandGenerator> m_rand_gen;
+    std::shared_ptr<WorkerPool> m_worker_pool; //parses the objects of a room in parallel. Kept alive for the whole loader so the threads are not recreated every time
     std::shared_ptr<DataTransformer> m_transformer;
 
     //params
     bool m_autostart;
-    bool m_is_running;// if the loop of loading is running, it is used to break the loop when the user ctrl-c
     std::string m_mode; // train or test or val
     int m_fold; //The dataset is divided in 6 areas, the fold number indicates which area we use for training and which for testing. Explained here http://buildingparser.stanford.edu/dataset.html
     fs::path m_dataset_path;
@@ -76,16 +79,17 @@ private:
     bool m_shuffle_points; //When splatting in a permutohedral lattice it's better to have adyancent point in 3D be in different parts in memoru to aboid hashing conflicts
     bool m_shuffle;
     bool m_do_overfit; // return all the time just one of the clouds, specifically the first one
-    std::thread m_loader_thread;
-    uint32_t m_idx_cloud_to_read;
     int m_nr_resets;
+    int m_nr_reader_threads; //nr of threads that read clouds from disk concurrently
+    int m_prefetch_depth; //maximum nr of clouds that are being read or waiting to be consumed
+    bool m_ordered_delivery; //returns the clouds in the same order as the files. Otherwise they are returned as soon as they are ready
     bool m_read_original_data_and_reparse; //if we are reparsing the data we are only reading the original files whcih are stored in horrible slow ASCII and store them in a binary of floats per room.
 
 
     //internal
     bool m_is_modified; //indicate that a cloud was finished processind and you are ready to get it
     std::vector<fs::path> m_room_paths;
-    moodycamel::ReaderWriterQueue<MeshCore> m_clouds_buffer;
+    SamplePipeline<MeshCore> m_clouds_pipeline;
 
     //label mngr to link to all the meshes that will have a semantic information
     std::shared_ptr<LabelMngr> m_label_mngr;
@@ -3,6 +3,7 @@
 
 //eigen
 #include <Eigen/Core>
+#include <Eigen/Geometry>
 
 #include <memory>
 
@@ -23,6 +24,10 @@ public:
     DataTransformer(const configuru::Config& config_file);
 
     std::shared_ptr<easy_pbr::Mesh> transform(std::shared_ptr<easy_pbr::Mesh>& mesh);
+    //draws the same random numbers that transform() draws for a cloud of nr_points without colors but instead of applying them it returns the composed affine and the noise to add to every point (nr_points x 3, empty if there is no noise)
+    //it lets the caller augment many small clouds, like the strands of a hair, in its own pass without creating a mesh for each. The subsampling is not supported since it would change the nr of points
+    //as in transform(), the affine is not applied to the points that are exactly at the origin
+    Eigen::Affine3d draw_cloud_augmentation(const int nr_points, Eigen::MatrixXd& xyz_noise);
 
     //params
     Eigen::Vector3f m_random_translation_xyz_magnitude;
@@ -42,9 +47,14 @@ public:
     float m_chance_of_xyz_noise;
     Eigen::Vector3f m_xyz_noise_stddev;
 
+    bool m_fused; //composes all the affine augmentations into one transform and applies it together with the subsampling, the noise and the color jitter in one pass over the points
+    bool m_fused_exact_rng; //the fused path draws the random numbers in the same order as the sequential one so both give the same cloud. Setting it to false uses a single draw per point for both subsamplings which is faster but gives a different cloud
+
 private:
 
     void init_params(const configuru::Config& config_file);
+    std::shared_ptr<easy_pbr::Mesh> transform_fused(std::shared_ptr<easy_pbr::Mesh>& mesh);
+    Eigen::Affine3d draw_random_affine(Eigen::Matrix3d& rot); //composes the translation, stretch, rotations and mirroring into one transform. rot gets only the rotations
 
     //objects
     std::shared_ptr<radu::utils::RandGenerator> m_rand_gen;
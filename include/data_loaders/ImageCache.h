@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+
+#include <opencv2/core/core.hpp>
+
+
+
+//keeps the decoded images that the shell frames load on demand so that loading the same frame again doesn't decode the file again
+//the images are kept until the total nr of bytes goes over the budget, at which point the least recently used ones are dropped
+//the returned mats are copies of the cached ones so the caller can write into them without changing what the other readers get
+//a hit therefore still costs a copy of the image, which is much cheaper than decoding and resizing it again
+class ImageCache
+{
+public:
+    ImageCache();
+
+    //returns the process-wide cache which is shared between all the loaders. It starts with a budget of 0 so it doesn't keep anything until a loader reserves some
+    static std::shared_ptr<ImageCache> shared();
+
+    //reads the image with cv::imread(path, imread_flags) and if subsample_factor>1 resizes it by 1/subsample_factor with the interpolation. Safe to call from several threads
+    //reduced_jpeg_decode is passed to MiscDataFuncs::read_image
+    cv::Mat read(const std::string& path, const int imread_flags, const int subsample_factor, const int interpolation, const bool reduced_jpeg_decode=false);
+    //same as above but if the cache is null it just decodes the image
+    static cv::Mat read(const std::shared_ptr<ImageCache>& cache, const std::string& path, const int imread_flags, const int subsample_factor, const int interpolation, const bool reduced_jpeg_decode=false);
+    static cv::Mat decode(const std::string& path, const int imread_flags, const int subsample_factor, const int interpolation, const bool reduced_jpeg_decode=false);
+
+    void reserve_budget(const size_t nr_bytes); //grows the budget to at least nr_bytes so that a loader asking for less doesn't shrink the cache of another loader
+    void clear();
+
+    size_t budget_bytes();
+    size_t nr_bytes(); //bytes of all the images currently in the cache
+    size_t nr_images();
+    uint64_t nr_hits();
+    uint64_t nr_misses();
+    uint64_t nr_evictions();
+
+private:
+    struct Entry{
+        std::string key;
+        cv::Mat img;
+        size_t nr_bytes;
+    };
+
+    static std::string make_key(const std::string& path, const int imread_flags, const int subsample_factor, const int interpolation, const bool reduced_jpeg_decode);
+    void evict_until_under(const size_t nr_bytes); //needs the mutex to be locked
+
+    std::list<Entry> m_lru; //the front is the most recently used
+    std::unordered_map<std::string, std::list<Entry>::iterator> m_key2entry;
+    std::mutex m_mutex;
+    size_t m_budget_bytes;
+    size_t m_nr_bytes;
+    uint64_t m_nr_hits;
+    uint64_t m_nr_misses;
+    uint64_t m_nr_evictions;
+
+};
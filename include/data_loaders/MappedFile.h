@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+
+//maps a whole file read-only into memory so the loaders can read binary caches without copying them into a buffer first
+//the pages are shared between all the readers of the same file and are only paged in from disk when they are touched
+class MappedFile
+{
+public:
+    MappedFile(const std::string& path); //dies with a LOG(FATAL) if the file cannot be opened or mapped
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+    const std::string& path() const { return m_path; }
+
+    //returns a pointer of type T at a byte offset in the file. Checks that the range [offset, offset+nr_elems*sizeof(T)) is inside the file
+    template <typename T>
+    const T* at(const size_t offset, const size_t nr_elems=1) const{
+        check_range(offset, nr_elems*sizeof(T));
+        return reinterpret_cast<const T*>(m_data+offset);
+    }
+
+private:
+    void check_range(const size_t offset, const size_t nr_bytes) const;
+
+    std::string m_path;
+    const char* m_data;
+    size_t m_size;
+};
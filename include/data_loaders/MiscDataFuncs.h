@@ -1,9 +1,16 @@
 #pragma once
 
 
+//c++
+#include <string>
+#include <vector>
+#include <tuple>
+
 //eigen
 #include <Eigen/Core>
 
+#include <opencv2/core/core.hpp>
+
 #ifdef WITH_TORCH
     #include "data_loaders/TensorReel.h"
 #endif
@@ -18,13 +25,32 @@ class MiscDataFuncs
 public:
     MiscDataFuncs();
 
+    //same as cv::imread followed by a cv::resize by 1/subsample_factor with the interpolation
+    //with reduced_jpeg_decode, jpegs read as color, grayscale or unchanged with a factor of 2, 4 or 8 and INTER_AREA are decoded by libjpeg directly at the lower resolution which skips most of the decoding and the resize. The result is close to the resized image but not bit-identical, see compare_reduced_jpeg_decode
+    static cv::Mat read_image(const std::string& path, const int imread_flags, const int subsample_factor, const int interpolation, const bool reduced_jpeg_decode=false);
+    //decodes the image both ways and returns if the reduced decode would be used for it, the psnr in db and the max absolute difference in the range [0,255] between the reduced decode and the imread with INTER_AREA
+    static std::tuple<bool, double, double> compare_reduced_jpeg_decode(const std::string& path, const int imread_flags, const int subsample_factor);
+    //splits an 8 or 16 bit rgba image, as read with cv::IMREAD_UNCHANGED, in one pass over the pixels instead of the split/merge and the conversions that each allocate a new mat
+    //if composite is true the rgb is blended over the bg_color, which is in the range [0,255], otherwise the alpha is just dropped. The mask is 1 where alpha>0 and has the mask_type, either CV_8U or CV_32F
+    //any of the outputs can be a nullptr if it's not needed. The ones that are given always get newly allocated mats
+    static void rgba2rgb_and_mask(const cv::Mat& rgba, const bool composite, const Eigen::Vector3f& bg_color, cv::Mat* rgb_8u, cv::Mat* rgb_32f, cv::Mat* mask, const int mask_type=CV_8U);
+
     #ifdef WITH_TORCH
-        static TensorReel frames2tensors(const std::vector< easy_pbr::Frame >& frames);
+        //packs all the frames into reels on the gpu. The rgb can be stored as "float32", "float16" or "uint8" and the mask as "float32", "uint8" or "bool", see TensorReel for how to dequantize them
+        static TensorReel frames2tensors(const std::vector< easy_pbr::Frame >& frames, const std::string rgb_dtype="float32", const std::string mask_dtype="float32");
+        static TensorReel frames2tensors_cpu(const std::vector< easy_pbr::Frame >& frames, const std::string rgb_dtype="float32", const std::string mask_dtype="float32"); //same reels but they stay on the cpu, useful on machines without a gpu
     #endif
     
 
 private:
 
+    static bool read_jpeg_header(const std::string& path, int& width, int& height, int& nr_channels); //reads the size and nr of channels from the header of the jpeg without decoding it. Returns false if it's not an 8 bit jpeg
+    static cv::Mat read_jpeg_reduced(const std::string& path, const int imread_flags, const int subsample_factor, const int interpolation); //decodes the jpeg at 1/subsample_factor of its size. Returns an empty mat if the reduced decode can't give the same size as the resize
+
+    #ifdef WITH_TORCH
+        static TensorReel frames2reel(const std::vector< easy_pbr::Frame >& frames, const bool to_gpu, const std::string& rgb_dtype, const std::string& mask_dtype);
+    #endif
+
 
     //internal
 
@@ -0,0 +1,288 @@
+#pragma once
+
+#include <thread>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <string>
+
+//loguru
+#define LOGURU_REPLACE_GLOG 1
+#include <loguru.hpp>
+
+
+//prefetches the samples of a loader on a set of reader threads and hands them over to the consumer through a bounded buffer
+//every sample goes through two stages:
+//  read_fn(idx) runs concurrently on all the readers and should do only the work that doesn't touch state shared between samples (disk reading, parsing, decoding)
+//  process_fn(sample) runs on the reader threads but only one at a time, so it can use the random generators and the data transformer of the loader. It can be null if the loader has nothing to do there
+//  with ordered=true it also runs in the order of the idx so the random numbers drawn there land on the same samples as when reading with one thread, whatever the nr of readers
+//the readers block on a condition variable when the buffer is full or when they read everything in the epoch, until a sample is consumed or the pipeline is reset
+//the samples can be delivered in the order of their idx (ordered=true) which gives the same order as reading with one thread, or as soon as they are ready
+template <typename T>
+class SamplePipeline
+{
+public:
+    SamplePipeline():
+        m_is_running(false),
+        m_is_resetting(false),
+        m_nr_readers(1),
+        m_prefetch_depth(4),
+        m_ordered(true),
+        m_nr_samples(0),
+        m_idx_to_claim(0),
+        m_idx_to_deliver(0),
+        m_idx_to_process(0),
+        m_nr_in_flight(0)
+    {
+    }
+    ~SamplePipeline(){
+        stop();
+    }
+
+    void set_nr_readers(const int nr_readers){
+        CHECK(m_readers.empty()) << "Cannot change the nr of readers while the pipeline is running";
+        CHECK(nr_readers>0) << "We need at least one reader but got " << nr_readers;
+        m_nr_readers=nr_readers;
+    }
+    void set_prefetch_depth(const int prefetch_depth){
+        CHECK(m_readers.empty()) << "Cannot change the prefetch depth while the pipeline is running";
+        CHECK(prefetch_depth>0) << "The prefetch depth has to be at least 1 but got " << prefetch_depth;
+        m_prefetch_depth=prefetch_depth;
+    }
+    void set_ordered(const bool ordered){
+        CHECK(m_readers.empty()) << "Cannot change the delivery order while the pipeline is running";
+        m_ordered=ordered;
+    }
+
+    //starts the readers. nr_samples<0 makes the pipeline read forever which is what the loaders use for do_overfit
+    void start(const int nr_samples, std::function<T(const int)> read_fn, std::function<void(T&)> process_fn, const std::string thread_name){
+        CHECK(m_readers.empty()) << "The pipeline is already running. Please check in the config file that autostart is not already set to true. Or just don't call start()";
+
+        m_read_fn=read_fn;
+        m_process_fn=process_fn;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            restart_epoch(nr_samples);
+            m_is_running=true;
+        }
+
+        for(int i=0; i<m_nr_readers; i++){
+            m_readers.emplace_back(&SamplePipeline::reader_loop, this, thread_name);
+        }
+    }
+
+    //stops and joins the readers and drops everything that was prefetched
+    void stop(){
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_is_running=false;
+        }
+        m_cv_readers.notify_all();
+        m_cv_consumer.notify_all();
+
+        for(size_t i=0; i<m_readers.size(); i++){
+            if (m_readers[i].joinable()){
+                m_readers[i].join();
+            }
+        }
+        m_readers.clear();
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_ready_ordered.clear();
+        m_ready_unordered.clear();
+        m_nr_in_flight=0;
+    }
+
+    //starts a new epoch of nr_samples. It waits for the samples that are currently being read, then calls between_epochs_fn while no reader is running so the loader can safely reshuffle the files it reads from
+    //samples that were prefetched but not consumed are dropped
+    void reset(const int nr_samples, const std::function<void()>& between_epochs_fn=nullptr){
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_is_resetting=true;
+        m_cv_readers.wait(lock, [this]{ return m_nr_in_flight==0; });
+        lock.unlock();
+
+        if(between_epochs_fn){
+            between_epochs_fn();
+        }
+
+        lock.lock();
+        restart_epoch(nr_samples);
+        m_is_resetting=false;
+        lock.unlock();
+        m_cv_readers.notify_all();
+    }
+
+    bool has_data(){
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return has_data_locked();
+    }
+
+    //returns the next sample or an empty one if nothing is ready yet. Never blocks
+    T try_get(){
+        T sample{};
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if(!has_data_locked()){
+                return sample;
+            }
+            sample=pop_locked();
+        }
+        m_cv_readers.notify_all();
+        return sample;
+    }
+
+    //blocks until a sample is ready. Returns an empty one if the epoch finished or the pipeline is stopped
+    T get(){
+        T sample{};
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv_consumer.wait(lock, [this]{ return has_data_locked() || is_finished_reading_locked() || !m_is_running; });
+            if(!has_data_locked()){
+                return sample;
+            }
+            sample=pop_locked();
+        }
+        m_cv_readers.notify_all();
+        return sample;
+    }
+
+    //returns true when every sample in the epoch was read and processed but maybe not yet consumed
+    bool is_finished_reading(){
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return is_finished_reading_locked();
+    }
+
+    //returns true when every sample in the epoch was read and also consumed
+    bool is_finished(){
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return is_finished_reading_locked() && !has_data_locked();
+    }
+
+    bool is_running(){
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_is_running;
+    }
+
+
+private:
+
+    void reader_loop(const std::string thread_name){
+
+        loguru::set_thread_name(thread_name.c_str());
+
+        while(true){
+            int idx;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_cv_readers.wait(lock, [this]{ return !m_is_running || can_claim_locked(); });
+                if(!m_is_running){
+                    return;
+                }
+                idx=m_idx_to_claim++;
+                m_nr_in_flight++;
+            }
+
+            T sample=m_read_fn(idx);
+            if(m_process_fn){
+                if(m_ordered){
+                    //wait for the samples before this one to be processed. They were all claimed before so they are either in flight or done
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_cv_readers.wait(lock, [this, idx]{ return !m_is_running || m_idx_to_process==idx; });
+                    if(!m_is_running){
+                        m_nr_in_flight--;
+                        return;
+                    }
+                }
+                {
+                    std::lock_guard<std::mutex> lock(m_process_mutex);
+                    m_process_fn(sample);
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_nr_in_flight--;
+                m_idx_to_process++;
+                if(m_ordered){
+                    m_ready_ordered[idx]=sample;
+                }else{
+                    m_ready_unordered.push_back(sample);
+                }
+            }
+            m_cv_consumer.notify_all();
+            m_cv_readers.notify_all(); //a reset might be waiting for the samples in flight and the next reader for its turn to process
+        }
+    }
+
+    void restart_epoch(const int nr_samples){
+        m_nr_samples=nr_samples;
+        m_idx_to_claim=0;
+        m_idx_to_deliver=0;
+        m_idx_to_process=0;
+        m_ready_ordered.clear();
+        m_ready_unordered.clear();
+    }
+
+    bool can_claim_locked(){
+        if(m_is_resetting){
+            return false;
+        }
+        if(m_nr_samples>=0 && m_idx_to_claim>=m_nr_samples){
+            return false;
+        }
+        int nr_ready=m_ordered? m_ready_ordered.size() : m_ready_unordered.size();
+        return nr_ready+m_nr_in_flight < m_prefetch_depth;
+    }
+
+    bool has_data_locked(){
+        if(m_ordered){
+            return !m_ready_ordered.empty() && m_ready_ordered.begin()->first==m_idx_to_deliver;
+        }else{
+            return !m_ready_unordered.empty();
+        }
+    }
+
+    T pop_locked(){
+        T sample;
+        if(m_ordered){
+            auto it=m_ready_ordered.begin();
+            sample=it->second;
+            m_ready_ordered.erase(it);
+        }else{
+            sample=m_ready_unordered.front();
+            m_ready_unordered.pop_front();
+        }
+        m_idx_to_deliver++;
+        return sample;
+    }
+
+    bool is_finished_reading_locked(){
+        return m_nr_samples>=0 && m_idx_to_claim>=m_nr_samples && m_nr_in_flight==0;
+    }
+
+
+    std::function<T(const int)> m_read_fn;
+    std::function<void(T&)> m_process_fn;
+    std::vector<std::thread> m_readers;
+
+    std::mutex m_mutex; //protects everything below
+    std::mutex m_process_mutex; //makes process_fn run one sample at a time
+    std::condition_variable m_cv_readers; //signaled when there is space in the buffer, a new epoch started or a sample was processed
+    std::condition_variable m_cv_consumer; //signaled when a sample is ready
+    bool m_is_running;
+    bool m_is_resetting;
+    int m_nr_readers;
+    int m_prefetch_depth; //maximum nr of samples that are either being read or waiting in the buffer
+    bool m_ordered;
+    int m_nr_samples;
+    int m_idx_to_claim;
+    int m_idx_to_deliver;
+    int m_idx_to_process; //with ordered delivery, the idx of the next sample that can go through process_fn
+    int m_nr_in_flight;
+    std::map<int, T> m_ready_ordered;
+    std::deque<T> m_ready_unordered;
+
+};
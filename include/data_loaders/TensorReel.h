@@ -2,6 +2,9 @@
 
 #include "UtilsPytorch.h" //contains torch so it has to be added BEFORE any other include because the other ones might include loguru which gets screwed up if torch was included before it
 
+//c++
+#include <string>
+
 
 
 class TensorReel
@@ -18,6 +21,18 @@ public:
     torch::Tensor tf_cam_world_reel; 
     torch::Tensor tf_world_cam_reel; 
 
+    //the rgb and mask reels can be stored in a smaller type than float to fit bigger scenes in memory. The dtype is "float32", "float16" or "uint8" for the rgb and "float32", "uint8" or "bool" for the mask
+    //multiplying the stored values by the scale gives back the values of the frames (1/255 for uint8 and 1 for the rest) so the consumers can dequantize only the pixels they sample
+    std::string rgb_dtype;
+    std::string mask_dtype;
+    float rgb_scale;
+    float mask_scale;
+
+    torch::Tensor dequantize_rgb(const torch::Tensor& rgb) const; //float32 colors from values sampled from the rgb_reel
+    torch::Tensor dequantize_mask(const torch::Tensor& mask) const; //float32 mask from values sampled from the mask_reel
+
+    static torch::ScalarType dtype_from_name(const std::string& dtype_name); //dies if the name is not one of the supported ones
+
 
 private:
 
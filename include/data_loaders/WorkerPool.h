@@ -0,0 +1,42 @@
+#pragma once
+
+#include <thread>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+
+
+//a fixed set of worker threads that the loaders can submit jobs to. Used mostly for decoding the images of a scene in parallel.
+//the pool is shared between all the loaders in the process so that creating several loaders doesn't oversubscribe the cores
+class WorkerPool
+{
+public:
+    WorkerPool(const int nr_threads);
+    ~WorkerPool();
+
+    //returns the process-wide pool with nr_threads workers. nr_threads<=0 selects the number of hardware threads
+    static std::shared_ptr<WorkerPool> shared(const int nr_threads);
+
+    //runs job(i) for every i in [0,nr_jobs) and blocks until all of them finished. The calling thread also executes jobs so that it's safe to call this from inside a job
+    //the jobs should write their results to a preallocated slot at index i so that the output order is deterministic and independent of the scheduling
+    void parallel_for(const int nr_jobs, const std::function<void(const int)>& job);
+    //same as above but if nr_threads<=1 or the pool is null, it runs everything serially on the calling thread
+    static void parallel_for(const std::shared_ptr<WorkerPool>& pool, const int nr_jobs, const std::function<void(const int)>& job);
+
+    int nr_threads();
+
+private:
+
+    void worker_loop();
+
+    std::vector<std::thread> m_workers;
+    std::deque< std::function<void()> > m_tasks;
+    std::mutex m_mutex;
+    std::condition_variable m_task_available;
+    bool m_is_running;
+
+};
@@ -32,14 +32,22 @@ namespace easy_pbr{
     class LabelMngr;
     class Mesh;
 }
+namespace igl{
+    template <typename DerivedV, int DIM> class AABB;
+}
 class DataTransformer;
+class WorkerPool;
 
 
 // Struct to contain everything we need for one hair sample
 class USCHair : public std::enable_shared_from_this<USCHair> {
     public:
         std::shared_ptr<easy_pbr::Mesh> full_hair_cloud; //cloud containing the points of the hair
-        std::vector< std::shared_ptr<easy_pbr::Mesh> > strand_meshes; //vector containing a mesh for each strand
+        //all the strands are stored one after another in one flat array. Strand s has the points [strand_offsets(s), strand_offsets(s+1)) so with the 100 points per strand of the usc hair this is a nr_strands x 100 x 3 array
+        Eigen::Matrix<float, Eigen::Dynamic, 3, Eigen::RowMajor> strand_points; //nr_points x 3
+        Eigen::VectorXi strand_offsets; //nr_strands+1
+        Eigen::VectorXi strand_file_idx; //nr_strands x 1 idx of the strand in the .data file
+        Eigen::Array<bool, Eigen::Dynamic, 1> strand_valid; //nr_strands x 1 false for the strands that are only a root, have duplicated points or were dropped
         // Eigen::MatrixXd points; //Nx3 points of the hair
         // Eigen::MatrixXi per_point_strand_idx; //Nx1 index of strand for each point. Points that belong to the same strand will have the same idx
         Eigen::MatrixXd uv_roots; // nr_strands x 2 uv for only the points on the roots
@@ -60,6 +68,12 @@ class USCHair : public std::enable_shared_from_this<USCHair> {
 
         std::string cloud_path;
         int strand_idx=-1;
+
+        int nr_strands() const { return strand_offsets.size()>0? strand_offsets.size()-1 : 0; }
+        int nr_points_of_strand(const int s) const { return strand_offsets(s+1)-strand_offsets(s); }
+        std::shared_ptr<USCHair> gather_strands(const std::vector<int>& strand_idxs) const; //new hair with a copy of only these strands, all of them valid
+        std::shared_ptr<easy_pbr::Mesh> get_strand_mesh(const int s) const; //creates a mesh with a copy of the points of the strand. Only for visualization, the loader itself works on the flat array
+        std::vector< std::shared_ptr<easy_pbr::Mesh> > get_strand_meshes() const;
 } ;
 
 
@@ -86,6 +100,9 @@ public:
     void set_mode_validation();
 
     std::shared_ptr<USCHair> get_random_roots(const int nr_strands); //create random roots and return their position, uv and tbn
+    //projects the points (nr_points x 3 in the coordinates of the scalp vertices) onto the closest point of the scalp and interpolates the uv and the tbn from there
+    //only reads the scalp and its tree which are built once in start() so it's safe to call from several threads
+    void compute_root_points_atributes(Eigen::MatrixXd& uv, std::vector<Eigen::Matrix3d>& tbn_per_point, const Eigen::MatrixXd& points) const;
 
 
 private:
@@ -93,13 +110,13 @@ private:
     void init_params(const std::string config_file);
     void init_data_reading(); //after the parameters this uses the params to initiate all the structures needed for the susequent read_data
     std::vector<Eigen::Affine3d,  Eigen::aligned_allocator<Eigen::Affine3d>  >read_pose_file(std::string m_pose_file);
+    void init_scalp(); //reads the head and the scalp and builds the tree used for the closest point queries on the scalp
     void read_data();
     // std::tuple<
     //     std::vector< std::shared_ptr<easy_pbr::Mesh> >,
     //     std::shared_ptr<easy_pbr::Mesh>
     // > read_hair_sample(const std::string data_filepath); //returns a full hair mesha and also a vector of meshes corresponding with the strands
     std::shared_ptr<USCHair> read_hair_sample(const std::string data_filepath); //returns a full hair mesha and also a vector of meshes corresponding with the strands
-    void compute_root_points_atributes(Eigen::MatrixXd& uv, std::vector<Eigen::Matrix3d>& tbn_per_point, std::shared_ptr<easy_pbr::Mesh> mesh, std::vector<Eigen::Vector3d> points_vec); //project the points onto the closest point on the mesh and get the uv from there
     void compute_full_hair(std::shared_ptr<USCHair>& usc_hair);
     void compute_all_atributes(std::shared_ptr<USCHair>& usc_hair);
 
@@ -120,6 +137,7 @@ private:
     //objects
     std::shared_ptr<radu::utils::RandGenerator> m_rand_gen;
     std::shared_ptr<DataTransformer> m_transformer;
+    std::shared_ptr<WorkerPool> m_worker_pool; //projects the roots onto the scalp and computes the per strand attributes in parallel. Kept alive for the whole loader so the threads are not recreated for every hair
 
     //params
     bool m_autostart;
@@ -153,6 +171,7 @@ private:
     std::vector<std::shared_ptr<USCHair> > m_hairs_vec;
     std::shared_ptr<easy_pbr::Mesh>  m_mesh_head;
     std::shared_ptr<easy_pbr::Mesh>  m_mesh_scalp;
+    std::shared_ptr< igl::AABB<Eigen::MatrixXd,3> > m_scalp_tree; //over the V and F of the scalp which never change after loading
 
 
 };
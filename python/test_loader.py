@@ -610,6 +610,21 @@ def test_llff():
 
         view.update()
 
+def test_reduced_jpeg_decode():
+    #the reduced_jpeg_decode of the loaders lets libjpeg decode at the lower resolution instead of doing imread and the INTER_AREA resize
+    #it's not bit-identical so this checks that it stays close to the resized image. It runs on a small synthetic jpeg that comes with the repo
+    #before enabling it for a dataset, point img_path to some of its images to check it there too
+    img_path=os.path.join(os.path.dirname(os.path.abspath(__file__)), "data", "reduced_jpeg_decode.jpg")
+    imread_flags={"unchanged": -1, "grayscale": 0, "color": 1} #cv2.IMREAD_UNCHANGED, cv2.IMREAD_GRAYSCALE, cv2.IMREAD_COLOR
+    min_psnr=40.0
+
+    for flags_name, flags in imread_flags.items():
+        for subsample_factor in [2,4,8]:
+            used_reduced, psnr, max_abs_diff=MiscDataFuncs.compare_reduced_jpeg_decode(img_path, flags, subsample_factor)
+            print("imread ", flags_name, " subsample_factor ", subsample_factor, " psnr ", psnr, " max abs diff ", max_abs_diff)
+            assert used_reduced, "the reduced decode was not used for imread "+flags_name+" at subsample_factor "+str(subsample_factor)
+            assert psnr>=min_psnr, "the reduced decode for imread "+flags_name+" at subsample_factor "+str(subsample_factor)+" has a psnr of "+str(psnr)+" which is lower than "+str(min_psnr)
+
 def test_blender_fb():
     loader=DataLoaderBlenderFB(config_path)
     # loader.set_mode_train()
@@ -1086,6 +1101,7 @@ def test_multiface():
 # test_blended_mvs()
 # test_deep_voxels()
 # test_llff()
+test_reduced_jpeg_decode()
 # test_blender_fb()
 # test_usc_hair()
 test_phenorob_cp1()
@@ -0,0 +1,76 @@
+#include "data_loaders/AsciiParser.h"
+
+//c++
+#include <algorithm>
+#include <cstdlib>
+
+//loguru
+#define LOGURU_REPLACE_GLOG 1
+#include <loguru.hpp>
+
+//my stuff
+#include "data_loaders/MappedFile.h"
+
+
+
+AsciiParser::AsciiParser(const char* begin, const char* end, const std::string& source_name):
+    m_begin(begin),
+    m_cur(begin),
+    m_end(end),
+    m_source_name(source_name)
+{
+    skip_whitespace();
+}
+
+AsciiParser::AsciiParser(const MappedFile& file):
+    AsciiParser(file.data(), file.data()+file.size(), file.path())
+{
+}
+
+void AsciiParser::next_line(){
+    const char* newline=std::find(m_cur, m_end, '\n');
+    m_cur=newline;
+    skip_whitespace();
+}
+
+size_t AsciiParser::count_lines() const{
+    size_t nr_lines=0;
+    bool line_has_content=false;
+    for(const char* c=m_begin; c!=m_end; c++){
+        if(*c=='\n'){
+            nr_lines+=line_has_content;
+            line_has_content=false;
+        }else if(*c!=' ' && *c!='\t' && *c!='\r'){
+            line_has_content=true;
+        }
+    }
+    nr_lines+=line_has_content; //the last line may not end with a newline
+    return nr_lines;
+}
+
+int AsciiParser::nr_tokens_in_line() const{
+    int nr_tokens=0;
+    bool in_token=false;
+    for(const char* c=m_cur; c!=m_end && *c!='\n'; c++){
+        bool is_space= *c==' ' || *c=='\t' || *c=='\r';
+        if(!is_space && !in_token){
+            nr_tokens++;
+        }
+        in_token=!is_space;
+    }
+    return nr_tokens;
+}
+
+void AsciiParser::skip_whitespace(){
+    while(m_cur!=m_end && (*m_cur==' ' || *m_cur=='\t' || *m_cur=='\r' || *m_cur=='\n')){
+        m_cur++;
+    }
+}
+
+void AsciiParser::fail() const{
+    //we only count the lines when something went wrong so that the parsing itself doesn't need to keep track of them
+    size_t line_nr=std::count(m_begin, m_cur, '\n')+1;
+    const char* line_end=std::find(m_cur, m_end, '\n');
+    LOG(FATAL) << "Expected a number in " << m_source_name << " at line " << line_nr << " but found \"" << std::string(m_cur, line_end) << "\"";
+    std::abort(); //LOG(FATAL) already aborts but the compiler doesn't know it
+}
@@ -0,0 +1,222 @@
+#include "data_loaders/CameraNeighbourIndex.h"
+
+//c++
+#include <algorithm>
+#include <cmath>
+
+//loguru
+#define LOGURU_REPLACE_GLOG 1
+#include <loguru.hpp>
+
+//my stuff
+#include "easy_pbr/Frame.h"
+
+using namespace easy_pbr;
+
+
+CameraNeighbourIndex::CameraNeighbourIndex():
+    m_view_dir_weight(0.0),
+    m_nr_precomputed_neighbours(0)
+{
+}
+
+void CameraNeighbourIndex::build(const std::vector<Frame>& frames, const float view_dir_weight, const int nr_precomputed_neighbours){
+    CHECK(view_dir_weight>=0.0) << "The weight of the view direction cannot be negative because the kd-tree relies on the distance being at least the distance between the centers. It is " << view_dir_weight;
+
+    m_view_dir_weight=view_dir_weight;
+    m_centers.clear();
+    m_dirs.clear();
+    m_frame_idxs.clear();
+    m_frame_idx2cam.clear();
+    m_precomputed_neighbours.clear();
+
+    int nr_cams=frames.size();
+    for(int i=0; i<nr_cams; i++){
+        Query query=make_query(frames[i]);
+        m_centers.push_back(query.center);
+        m_dirs.push_back(query.dir);
+        m_frame_idxs.push_back(query.frame_idx);
+        m_frame_idx2cam.emplace(query.frame_idx, i);
+    }
+
+    m_tree_cams.resize(nr_cams);
+    m_split_axis.resize(nr_cams);
+    for(int i=0; i<nr_cams; i++){
+        m_tree_cams[i]=i;
+    }
+    build_tree(0, nr_cams);
+
+    //every frame discards itself so it can have at most nr_cams-1 neighbours
+    m_nr_precomputed_neighbours=std::max(0, std::min(nr_precomputed_neighbours, nr_cams-1));
+    if(m_nr_precomputed_neighbours>0){
+        m_precomputed_neighbours.resize(nr_cams*m_nr_precomputed_neighbours);
+        for(int i=0; i<nr_cams; i++){
+            Query query;
+            query.center=m_centers[i];
+            query.dir=m_dirs[i];
+            query.frame_idx=m_frame_idxs[i];
+            query.discard_same_idx=true;
+            query.discard_same_position=false;
+            std::vector<int> neighbours=search(query, m_nr_precomputed_neighbours);
+            CHECK((int)neighbours.size()==m_nr_precomputed_neighbours) << "Frame " << m_frame_idxs[i] << " has only " << neighbours.size() << " other frames to be close to. Are there several frames with the same frame_idx?";
+            std::copy(neighbours.begin(), neighbours.end(), m_precomputed_neighbours.begin()+i*m_nr_precomputed_neighbours);
+        }
+    }
+}
+
+bool CameraNeighbourIndex::is_built() const{
+    return !m_tree_cams.empty();
+}
+
+int CameraNeighbourIndex::nr_cams() const{
+    return m_centers.size();
+}
+
+int CameraNeighbourIndex::closest_idx(const Frame& frame) const{
+    CHECK(is_built()) << "The index was not built. Did you call start() on the loader?";
+
+    Query query=make_query(frame);
+    query.discard_same_idx=false;
+    query.discard_same_position=true;
+    std::vector<int> closest=search(query, 1);
+    CHECK(!closest.empty()) << "There is no frame at a different position than the query";
+
+    return closest[0];
+}
+
+int CameraNeighbourIndex::closest_idx_further_than(const Frame& frame, const float min_distance) const{
+    CHECK(is_built()) << "The index was not built. Did you call start() on the loader?";
+
+    Query query=make_query(frame);
+    query.min_distance=min_distance;
+    std::vector<int> closest=search(query, 1);
+    CHECK(!closest.empty()) << "There is no frame at a distance of at least " << min_distance << " from the query";
+
+    return closest[0];
+}
+
+std::vector<int> CameraNeighbourIndex::close_idxs(const Frame& frame, const int nr_frames, const bool discard_same_idx) const{
+    CHECK(is_built()) << "The index was not built. Did you call start() on the loader?";
+    CHECK(nr_frames<nr_cams()) << "Cannot select more close frames than the total nr of frames that we have in the loader. Required select of " << nr_frames << " out of a total of " << nr_cams() << " available in the loader";
+
+    Query query=make_query(frame);
+    query.discard_same_idx=discard_same_idx;
+    query.discard_same_position=false;
+
+    //if the query is one of our frames we already know its neighbours
+    if(discard_same_idx && nr_frames<=m_nr_precomputed_neighbours){
+        auto it=m_frame_idx2cam.find(query.frame_idx);
+        if(it!=m_frame_idx2cam.end() && m_centers[it->second]==query.center && m_dirs[it->second]==query.dir){
+            auto begin=m_precomputed_neighbours.begin()+it->second*m_nr_precomputed_neighbours;
+            return std::vector<int>(begin, begin+nr_frames);
+        }
+    }
+
+    std::vector<int> close=search(query, nr_frames);
+    CHECK((int)close.size()==nr_frames) << "Could only find " << close.size() << " close frames out of the " << nr_frames << " requested";
+
+    return close;
+}
+
+CameraNeighbourIndex::Query CameraNeighbourIndex::make_query(const Frame& frame) const{
+    Query query;
+    //same as the old scans which compared tf_cam_world.inverse().translation() so that the distances are exactly the same
+    query.center=frame.tf_cam_world.inverse().translation().cast<float>();
+    query.dir=frame.tf_cam_world.inverse().linear().col(2).cast<float>(); //the camera looks along the z axis
+    query.frame_idx=frame.frame_idx;
+    query.discard_same_idx=false;
+    query.discard_same_position=false;
+    query.min_distance=0.0;
+    return query;
+}
+
+void CameraNeighbourIndex::build_tree(const int begin, const int end){
+    if(end-begin<=0){
+        return;
+    }
+
+    //split along the axis where the cameras are most spread out
+    Eigen::Vector3f min_point=m_centers[m_tree_cams[begin]];
+    Eigen::Vector3f max_point=min_point;
+    for(int i=begin+1; i<end; i++){
+        min_point=min_point.cwiseMin(m_centers[m_tree_cams[i]]);
+        max_point=max_point.cwiseMax(m_centers[m_tree_cams[i]]);
+    }
+    int axis;
+    (max_point-min_point).maxCoeff(&axis);
+
+    int mid=(begin+end)/2;
+    std::nth_element(m_tree_cams.begin()+begin, m_tree_cams.begin()+mid, m_tree_cams.begin()+end, [this, axis](const int a, const int b){
+        return m_centers[a](axis) < m_centers[b](axis);
+    });
+    m_split_axis[mid]=axis;
+
+    build_tree(begin, mid);
+    build_tree(mid+1, end);
+}
+
+void CameraNeighbourIndex::search_tree(const int begin, const int end, const Query& query, const size_t nr_neighbours, std::vector<Candidate>& heap) const{
+    if(end-begin<=0){
+        return;
+    }
+
+    int mid=(begin+end)/2;
+    int cam=m_tree_cams[mid];
+    int axis=m_split_axis[mid];
+
+    //the camera at the split
+    float dist=distance(cam, query);
+    bool is_discarded= (query.discard_same_idx && m_frame_idxs[cam]==query.frame_idx) ||
+                       (query.discard_same_position && (m_centers[cam]-query.center).norm()<=1e-7) ||
+                       dist<query.min_distance;
+    if(!is_discarded){
+        Candidate candidate(dist, cam);
+        if(heap.size()<nr_neighbours){
+            heap.push_back(candidate);
+            std::push_heap(heap.begin(), heap.end());
+        }else if(candidate<heap.front()){
+            std::pop_heap(heap.begin(), heap.end());
+            heap.back()=candidate;
+            std::push_heap(heap.begin(), heap.end());
+        }
+    }
+
+    //first the side of the query and then the other one only if it can still have something closer than the furthest one we have
+    float diff=query.center(axis)-m_centers[cam](axis);
+    if(diff<0){
+        search_tree(begin, mid, query, nr_neighbours, heap);
+    }else{
+        search_tree(mid+1, end, query, nr_neighbours, heap);
+    }
+    //the slack keeps the cameras at exactly the same distance, the rounding of the norm could otherwise put them just below std::abs(diff)
+    if(heap.size()<nr_neighbours || std::abs(diff)*(1.0f-1e-6f) <= heap.front().first){
+        if(diff<0){
+            search_tree(mid+1, end, query, nr_neighbours, heap);
+        }else{
+            search_tree(begin, mid, query, nr_neighbours, heap);
+        }
+    }
+}
+
+std::vector<int> CameraNeighbourIndex::search(const Query& query, const int nr_neighbours) const{
+    std::vector<Candidate> heap;
+    heap.reserve(nr_neighbours+1);
+    if(nr_neighbours>0){
+        search_tree(0, m_tree_cams.size(), query, nr_neighbours, heap);
+    }
+
+    std::sort_heap(heap.begin(), heap.end()); //sorts them from closest to furthest
+    std::vector<int> idxs(heap.size());
+    for(size_t i=0; i<heap.size(); i++){
+        idxs[i]=heap[i].second;
+    }
+    return idxs;
+}
+
+float CameraNeighbourIndex::distance(const int cam_idx, const Query& query) const{
+    float dist=(m_centers[cam_idx]-query.center).norm();
+    if(m_view_dir_weight!=0.0){
+        dist+=m_view_dir_weight*(1.0-m_dirs[cam_idx].dot(query.dir));
+    }
+    return dist;
+}
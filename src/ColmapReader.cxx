@@ -0,0 +1,159 @@
+#include "data_loaders/ColmapReader.h"
+
+//c++
+#include <cstring>
+#include <algorithm>
+
+//loguru
+#define LOGURU_REPLACE_GLOG 1
+#include <loguru.hpp>
+
+//my stuff
+#include "data_loaders/MappedFile.h"
+#include "easy_pbr/Mesh.h"
+
+using namespace easy_pbr;
+
+
+
+namespace{
+
+//walks through a mapped colmap file. Every read checks that it stays inside the file so a truncated file dies with a message instead of reading garbage
+//the values are copied out with memcpy because after the variable length names they are not aligned anymore
+class BinaryCursor{
+public:
+    BinaryCursor(const MappedFile& file): m_file(file), m_offset(0) {}
+
+    //colmap writes everything in little endian
+    template <typename T>
+    T read(){
+        T val;
+        std::memcpy(&val, m_file.at<char>(m_offset, sizeof(T)), sizeof(T));
+        m_offset+=sizeof(T);
+        if(!is_little_endian()){
+            char* bytes=reinterpret_cast<char*>(&val);
+            std::reverse(bytes, bytes+sizeof(T));
+        }
+        return val;
+    }
+
+    std::string read_string(){
+        const char* begin=m_file.data()+m_offset;
+        const char* end=m_file.data()+m_file.size();
+        const char* terminator=std::find(begin, end, '\0');
+        CHECK(terminator!=end) << "Found a name without the terminating null character in " << m_file.path();
+        m_offset+=terminator-begin+1;
+        return std::string(begin, terminator);
+    }
+
+    void skip(const size_t nr_bytes){
+        m_file.at<char>(m_offset, nr_bytes); //just for the range check
+        m_offset+=nr_bytes;
+    }
+
+private:
+    static bool is_little_endian(){
+        const uint16_t val=1;
+        return *reinterpret_cast<const char*>(&val)==1;
+    }
+
+    const MappedFile& m_file;
+    size_t m_offset;
+};
+
+} //namespace
+
+
+
+std::vector<ColmapCamera> ColmapReader::read_cameras(const std::string& path){
+    MappedFile file(path);
+    BinaryCursor cursor(file);
+
+    const uint64_t nr_cameras=cursor.read<uint64_t>();
+    std::vector<ColmapCamera> cameras(nr_cameras);
+    for(size_t i=0; i<nr_cameras; i++){
+        ColmapCamera& camera=cameras[i];
+        camera.camera_id=cursor.read<uint32_t>();
+        camera.model_id=cursor.read<int>();
+        camera.width=cursor.read<uint64_t>();
+        camera.height=cursor.read<uint64_t>();
+        camera.params.resize(nr_params_of_model(camera.model_id));
+        for(size_t p=0; p<camera.params.size(); p++){
+            camera.params[p]=cursor.read<double>();
+        }
+    }
+
+    return cameras;
+}
+
+std::vector<ColmapImage, Eigen::aligned_allocator<ColmapImage> > ColmapReader::read_images(const std::string& path){
+    MappedFile file(path);
+    BinaryCursor cursor(file);
+
+    const uint64_t nr_images=cursor.read<uint64_t>();
+    std::vector<ColmapImage, Eigen::aligned_allocator<ColmapImage> > images(nr_images);
+    for(size_t i=0; i<nr_images; i++){
+        ColmapImage& image=images[i];
+        image.image_id=cursor.read<uint32_t>();
+        image.q.w()=cursor.read<double>();
+        image.q.x()=cursor.read<double>();
+        image.q.y()=cursor.read<double>();
+        image.q.z()=cursor.read<double>();
+        image.t.x()=cursor.read<double>();
+        image.t.y()=cursor.read<double>();
+        image.t.z()=cursor.read<double>();
+        image.camera_id=cursor.read<uint32_t>();
+        image.name=cursor.read_string();
+
+        //every point2D is a x,y double and the uint64 id of the point3D it observes
+        image.nr_points2D=cursor.read<uint64_t>();
+        cursor.skip(image.nr_points2D*(2*sizeof(double)+sizeof(uint64_t)));
+    }
+
+    return images;
+}
+
+std::shared_ptr<Mesh> ColmapReader::read_points3D(const std::string& path){
+    MappedFile file(path);
+    BinaryCursor cursor(file);
+
+    const uint64_t nr_points=cursor.read<uint64_t>();
+    MeshSharedPtr cloud=Mesh::create();
+    cloud->V.resize(nr_points,3);
+    cloud->C.resize(nr_points,3);
+    for(size_t i=0; i<nr_points; i++){
+        cursor.skip(sizeof(uint64_t)); //point3D_id
+        for(int d=0; d<3; d++){
+            cloud->V(i,d)=cursor.read<double>();
+        }
+        for(int d=0; d<3; d++){
+            cloud->C(i,d)=cursor.read<uint8_t>()/255.0;
+        }
+        cursor.skip(sizeof(double)); //reprojection error
+
+        //every element of the track is the uint32 image_id and the uint32 idx of the point2D in that image
+        const uint64_t track_length=cursor.read<uint64_t>();
+        cursor.skip(track_length*2*sizeof(uint32_t));
+    }
+    cloud->m_vis.m_show_points=true;
+
+    return cloud;
+}
+
+int ColmapReader::nr_params_of_model(const int model_id){
+    //from src/base/camera_models.h of the colmap github
+    switch(model_id){
+        case 0: return 3;  //SIMPLE_PINHOLE
+        case 1: return 4;  //PINHOLE
+        case 2: return 4;  //SIMPLE_RADIAL
+        case 3: return 5;  //RADIAL
+        case 4: return 8;  //OPENCV
+        case 5: return 8;  //OPENCV_FISHEYE
+        case 6: return 12; //FULL_OPENCV
+        case 7: return 5;  //FOV
+        case 8: return 4;  //SIMPLE_RADIAL_FISHEYE
+        case 9: return 5;  //RADIAL_FISHEYE
+        case 10: return 12; //THIN_PRISM_FISHEYE
+        default: LOG(FATAL) << "Unknown colmap camera model with id " << model_id; return 0;
+    }
+}
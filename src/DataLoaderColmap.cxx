@@ -18,7 +18,12 @@ using namespace configuru;
 
 //my stuff
 #include "data_loaders/DataTransformer.h"
+#include "data_loaders/WorkerPool.h"
+#include "data_loaders/CameraNeighbourIndex.h"
+#include "data_loaders/MiscDataFuncs.h"
+#include "data_loaders/ColmapReader.h"
 #include "easy_pbr/Frame.h"
+#include "easy_pbr/Mesh.h"
 #include "Profiler.h"
 #include "string_utils.h"
 #include "numerical_utils.h"
@@ -44,7 +49,8 @@ DataLoaderColmap::DataLoaderColmap(const std::string config_file):
     // m_is_running(false),
     m_idx_img_to_read(0),
     m_nr_resets(0),
-    m_rand_gen(new RandGenerator)
+    m_rand_gen(new RandGenerator),
+    m_cam_index(new CameraNeighbourIndex)
 {
     init_params(config_file);
 
@@ -77,12 +83,16 @@ void DataLoaderColmap::init_params(const std::string config_file){
 
     m_autostart=loader_config["autostart"];
     m_subsample_factor=loader_config["subsample_factor"];
+    m_reduced_jpeg_decode=loader_config.get_or("reduced_jpeg_decode", false);
     m_shuffle=loader_config["shuffle"];
     m_do_overfit=loader_config["do_overfit"];
     m_scene_scale_multiplier= loader_config["scene_scale_multiplier"];
     m_load_imgs_with_transparency=loader_config["load_imgs_with_transparency"];
     // m_restrict_to_object= (std::string)loader_config["restrict_to_object"]; //makes it load clouds only from a specific object
     m_dataset_path = (std::string)loader_config["dataset_path"];    //get the path where all the off files are
+    m_nr_decode_threads=loader_config.get_or("nr_decode_threads", 1);
+    m_close_frames_view_dir_weight=loader_config.get_or("close_frames_view_dir_weight", 0.0);
+    m_nr_precomputed_close_frames=loader_config.get_or("nr_precomputed_close_frames", 0);
 
 
     //data transformer
@@ -92,9 +102,15 @@ void DataLoaderColmap::init_params(const std::string config_file){
 }
 
 void DataLoaderColmap::start(){
+    if(m_nr_decode_threads!=1){
+        m_decode_pool=WorkerPool::shared(m_nr_decode_threads);
+    }
+
     // init_data_reading();
     // init_extrinsics_and_intrinsics();
     read_data();
+
+    m_cam_index->build(m_frames, m_close_frames_view_dir_weight, m_nr_precomputed_close_frames);
 }
 
 
@@ -195,67 +211,19 @@ void DataLoaderColmap::read_data(){
     fs::path pose_file=m_dataset_path/"sparse"/"images.bin";
 
     //read the bin file according to this format https://colmap.github.io/format.html#binary-file-format
-    //reading a binary file is also guided by src/base/reconstruction.cc from the colmap github at least from version 3.6 at function Reconstruction::ReadImagesBinary
-    //some types from https://github.com/colmap/colmap/blob/ff9a463067a2656d1f59d12109fe2931e29e3ca0/src/util/types.h
-    // Unique identifier for cameras.
-    typedef uint32_t camera_t;
-    // Unique identifier for images.
-    typedef uint32_t image_t;
-    // Index per image, i.e. determines maximum number of 2D points per image.
-    // typedef uint32_t point2D_t;
-    // Unique identifier per added 3D point. Since we add many 3D points,
-    // delete them, and possibly re-add them again, the maximum number of allowed
-    // unique indices should be large.
-    typedef uint64_t point3D_t;
-
-    std::ifstream file(pose_file.string(), std::ios::binary);
-    CHECK(file.is_open()) << "Could not open file " << pose_file;
-    const size_t num_reg_images = ReadBinaryLittleEndian<uint64_t>(&file);
-    VLOG(1) << "Reading nr of images: " << num_reg_images;
-    for (size_t i = 0; i < num_reg_images; ++i) {
-
-      image_t image_id = ReadBinaryLittleEndian<image_t>(&file);
-
-      Eigen::Quaterniond q;
-      q.w() =  ReadBinaryLittleEndian<double>(&file);
-      q.x() =  ReadBinaryLittleEndian<double>(&file);
-      q.y() =  ReadBinaryLittleEndian<double>(&file);
-      q.z() =  ReadBinaryLittleEndian<double>(&file);
-      // q.normalize();
-
-      Eigen::Vector3d t;
-      t.x() = ReadBinaryLittleEndian<double>(&file);
-      t.y() = ReadBinaryLittleEndian<double>(&file);
-      t.z() = ReadBinaryLittleEndian<double>(&file);
-
-      camera_t camera_id = ReadBinaryLittleEndian<camera_t>(&file);
-
-
-      VLOG(1) << "image_id" << image_id;
-
+    //the points2D of the images are skipped since we only need the poses
+    std::vector<ColmapImage, Eigen::aligned_allocator<ColmapImage> > images=ColmapReader::read_images(pose_file.string());
+    VLOG(1) << "Reading nr of images: " << images.size();
+    for (size_t i = 0; i < images.size(); ++i) {
 
-      std::string image_name;
-      char name_char;
-      do {
-          file.read(&name_char, 1);
-          if (name_char != '\0') {
-          image_name += name_char;
-          }
-      } while (name_char != '\0');
+      uint32_t image_id = images[i].image_id;
+      const Eigen::Quaterniond& q = images[i].q;
+      const Eigen::Vector3d& t = images[i].t;
+      uint32_t camera_id = images[i].camera_id;
+      std::string image_name = images[i].name;
 
-      const size_t num_points2D = ReadBinaryLittleEndian<uint64_t>(&file);
 
-
-      std::vector<Eigen::Vector2d> points2D;
-      points2D.reserve(num_points2D);
-      std::vector<point3D_t> point3D_ids;
-      point3D_ids.reserve(num_points2D);
-      for (size_t j = 0; j < num_points2D; ++j) {
-          const double x = ReadBinaryLittleEndian<double>(&file);
-          const double y = ReadBinaryLittleEndian<double>(&file);
-          points2D.emplace_back(x, y);
-          point3D_ids.push_back(ReadBinaryLittleEndian<point3D_t>(&file));
-      }
+      VLOG(1) << "image_id" << image_id;
 
 
       //NOW we finished reading everything from the binary file regarding this image,  so now we can read the image itself
@@ -288,44 +256,8 @@ void DataLoaderColmap::read_data(){
 
       VLOG(1) << "Read pose for image " << image_name;
 
-      //load actually the TRANSAPRENCY ONE
-      if (m_load_imgs_with_transparency){
-        cv::Mat rgba_8u = cv::imread(img_path.string(), cv::IMREAD_UNCHANGED);
-        if(m_subsample_factor>1){
-            cv::Mat resized;
-            cv::resize(rgba_8u, resized, cv::Size(), 1.0/m_subsample_factor, 1.0/m_subsample_factor, cv::INTER_AREA);
-            rgba_8u=resized;
-        }
-        std::vector<cv::Mat> channels(4);
-        cv::split(rgba_8u, channels);
-        cv::threshold( channels[3], frame.mask, 0.0, 1.0, cv::THRESH_BINARY);
-        channels.pop_back();
-        cv::merge(channels, frame.rgb_8u);
-      }else{
-        // read rgb
-        frame.rgb_8u = cv::imread(img_path.string(), cv::IMREAD_UNCHANGED);
-        if(m_subsample_factor>1){
-            cv::Mat resized;
-            cv::resize(frame.rgb_8u, resized, cv::Size(), 1.0/m_subsample_factor, 1.0/m_subsample_factor, cv::INTER_AREA);
-            frame.rgb_8u=resized;
-        }
-      }
-
-
-
-
-
-
-      cv::cvtColor(frame.rgb_8u, frame.gray_8u, cv::COLOR_BGR2GRAY);
-      frame.rgb_8u.convertTo(frame.rgb_32f, CV_32FC3, 1.0/255.0);
-      // cv::cvtColor(frame.rgb_32f, frame.gray_32f, cv::COLOR_BGR2GRAY);
-      frame.width=frame.rgb_32f.cols;
-      frame.height=frame.rgb_32f.rows;
-
-      //load gradients
-      cv::cvtColor(frame.rgb_32f, frame.gray_32f, cv::COLOR_BGR2GRAY);
-      cv::Scharr( frame.gray_32f, frame.grad_x_32f, CV_32F, 1, 0);
-      cv::Scharr( frame.gray_32f, frame.grad_y_32f, CV_32F, 0, 1);
+      //the image itself is decoded afterwards in parallel for all the frames
+      frame.rgb_path=img_path.string();
 
 
       //extrinsics
@@ -366,22 +298,48 @@ void DataLoaderColmap::read_data(){
 
 
 
+    //decode all the images, each job of the worker pool writes only into its own frame so the order of m_frames stays the same as with the serial read
+    WorkerPool::parallel_for(m_decode_pool, m_frames.size(), [&](const int i){
+      Frame& frame = m_frames[i];
+
+      //load actually the TRANSAPRENCY ONE
+      if (m_load_imgs_with_transparency){
+        cv::Mat rgba_8u = MiscDataFuncs::read_image(frame.rgb_path, cv::IMREAD_UNCHANGED, m_subsample_factor, cv::INTER_AREA);
+        MiscDataFuncs::rgba2rgb_and_mask(rgba_8u, false, Eigen::Vector3f::Zero(), &frame.rgb_8u, &frame.rgb_32f, &frame.mask);
+      }else{
+        // read rgb
+        frame.rgb_8u = MiscDataFuncs::read_image(frame.rgb_path, cv::IMREAD_UNCHANGED, m_subsample_factor, cv::INTER_AREA, m_reduced_jpeg_decode);
+        frame.rgb_8u.convertTo(frame.rgb_32f, CV_32FC3, 1.0/255.0);
+      }
+
+
+
+
+
+
+      cv::cvtColor(frame.rgb_8u, frame.gray_8u, cv::COLOR_BGR2GRAY);
+      // cv::cvtColor(frame.rgb_32f, frame.gray_32f, cv::COLOR_BGR2GRAY);
+      frame.width=frame.rgb_32f.cols;
+      frame.height=frame.rgb_32f.rows;
+
+      //load gradients
+      cv::cvtColor(frame.rgb_32f, frame.gray_32f, cv::COLOR_BGR2GRAY);
+      cv::Scharr( frame.gray_32f, frame.grad_x_32f, CV_32F, 1, 0);
+      cv::Scharr( frame.gray_32f, frame.grad_y_32f, CV_32F, 0, 1);
+    });
+
+
     //read cameras intrinsics
     fs::path cameras_path=m_dataset_path/"sparse"/"cameras.bin";
-    std::ifstream camera_file(cameras_path.string(), std::ios::binary);
-    CHECK(camera_file.is_open()) << "Could not open file " << pose_file;
-
-    const size_t num_cameras = ReadBinaryLittleEndian<uint64_t>(&camera_file);
-    VLOG(1) << "Reading intrinsics for nr of cameras: " << num_cameras;
-    for (size_t i = 0; i < num_cameras; ++i) {
-      // class Camera camera;
-      camera_t camera_id = ReadBinaryLittleEndian<camera_t>(&camera_file);
-      int model_id =ReadBinaryLittleEndian<int>(&camera_file);
-      uint64_t width = ReadBinaryLittleEndian<uint64_t>(&camera_file);
-      uint64_t height = ReadBinaryLittleEndian<uint64_t>(&camera_file);
-      std::vector<double> params;
-      params.resize(4);
-      ReadBinaryLittleEndian<double>(&camera_file, &params );
+    std::vector<ColmapCamera> cameras=ColmapReader::read_cameras(cameras_path.string());
+    VLOG(1) << "Reading intrinsics for nr of cameras: " << cameras.size();
+    for (size_t i = 0; i < cameras.size(); ++i) {
+      uint32_t camera_id = cameras[i].camera_id;
+      int model_id = cameras[i].model_id;
+      uint64_t width = cameras[i].width;
+      uint64_t height = cameras[i].height;
+      const std::vector<double>& params = cameras[i].params;
+      CHECK(params.size()>=4) << "The camera " << camera_id << " has " << params.size() << " params but we need at least fx,fy,cx,cy so the camera model should be pinhole like. The model id is " << model_id;
 
 
       VLOG(1) << "width and height" << width << " " << height;
@@ -503,100 +461,59 @@ void DataLoaderColmap::read_data(){
 
 
 
-Frame DataLoaderColmap::get_next_frame(){
+int DataLoaderColmap::get_next_frame_idx(){
     CHECK(m_idx_img_to_read<(int)m_frames.size()) << "m_idx_img_to_read is out of bounds. It is " << m_idx_img_to_read << " while m_frames has size " << m_frames.size();
-    Frame  frame= m_frames[m_idx_img_to_read];
+    int idx=m_idx_img_to_read;
 
     if(!m_do_overfit){
         m_idx_img_to_read++;
     }
 
-    return frame;
+    return idx;
 }
-Frame DataLoaderColmap::get_frame_at_idx( const int idx){
-    CHECK(idx<(int)m_frames.size()) << "idx is out of bounds. It is " << idx << " while m_frames has size " << m_frames.size();
-
-    Frame  frame= m_frames[idx];
+Frame DataLoaderColmap::get_next_frame(){
+    return m_frames[get_next_frame_idx()];
+}
+const Frame& DataLoaderColmap::get_frame_ref_at_idx( const int idx){
+    CHECK(idx>=0 && idx<(int)m_frames.size()) << "idx is out of bounds. It is " << idx << " while m_frames has size " << m_frames.size();
 
-    return frame;
+    return m_frames[idx];
+}
+Frame DataLoaderColmap::get_frame_at_idx( const int idx){
+    return get_frame_ref_at_idx(idx);
+}
+const std::vector<easy_pbr::Frame>& DataLoaderColmap::get_all_frames_ref(){
+    return m_frames;
 }
 
-Frame DataLoaderColmap::get_random_frame(){
+int DataLoaderColmap::get_random_frame_idx(){
     CHECK(m_frames.size()>0 ) << "m_frames has size 0";
 
-    int random_idx=m_rand_gen->rand_int(0, m_frames.size()-1);
-    Frame  frame= m_frames[random_idx];
-
-    return frame;
+    return m_rand_gen->rand_int(0, m_frames.size()-1);
+}
+Frame DataLoaderColmap::get_random_frame(){
+    return m_frames[get_random_frame_idx()];
 }
 Frame DataLoaderColmap::get_closest_frame( const easy_pbr::Frame& frame){
-
-    float closest_distance=std::numeric_limits<float>::max();
-    int closest_idx=-1;
-    for(size_t i=0; i<m_frames.size(); i++){
-        float dist =  ( m_frames[i].tf_cam_world.inverse().translation() - frame.tf_cam_world.inverse().translation() ).norm();
-        if (dist < closest_distance && dist>1e-7){
-            closest_distance=dist;
-            closest_idx=i;
-        }
-    }
-
-    Frame  frame_closest= m_frames[closest_idx];
-
-    return frame_closest;
-
+    return m_frames[ get_closest_frame_idx(frame) ];
+}
+int DataLoaderColmap::get_closest_frame_idx( const easy_pbr::Frame& frame){
+    return m_cam_index->closest_idx(frame);
 }
 
 std::vector<easy_pbr::Frame>  DataLoaderColmap::get_close_frames( const easy_pbr::Frame& frame, const int nr_frames, const bool discard_same_idx){
 
-    CHECK(nr_frames<(int)m_frames.size()) << "Cannot select more close frames than the total nr of frames that we have in the loader. Required select of " << nr_frames << " out of a total of " << m_frames.size() << " available in the loader";
+    std::vector<int> close_idxs=get_close_frames_idxs(frame, nr_frames, discard_same_idx);
 
     std::vector<easy_pbr::Frame> selected_close_frames;
-
-    for(int i=0; i<nr_frames; i++){
-
-        //select a close frame
-        float closest_distance=std::numeric_limits<float>::max();
-        int closest_idx=-1;
-        for(size_t j=0; j<m_frames.size(); j++){
-
-            //ignore if the current frame we are checking is THIS
-            if (discard_same_idx){
-                if( m_frames[j].frame_idx == frame.frame_idx ){
-                    continue;
-                }
-            }
-
-            //ignore the current frame that we are checking if it's any of the ones already selected
-            bool is_already_selected=false;
-            for(size_t k=0; k<selected_close_frames.size(); k++){
-                if( m_frames[j].frame_idx == selected_close_frames[k].frame_idx ){
-                    is_already_selected=true;
-                }
-            }
-            if(is_already_selected){
-                continue;
-            }
-
-            //now get the closest one
-            float dist =  ( m_frames[j].tf_cam_world.inverse().translation() - frame.tf_cam_world.inverse().translation() ).norm();
-            // float dist = 1.0 -  m_frames[j].look_dir().dot(frame.look_dir());
-            if (dist < closest_distance){
-                closest_distance=dist;
-                closest_idx=j;
-            }
-        }
-
-        Frame  frame_closest= m_frames[closest_idx];
-        selected_close_frames.push_back(frame_closest);
-
-
+    for(size_t i=0; i<close_idxs.size(); i++){
+        selected_close_frames.push_back( m_frames[close_idxs[i]] );
     }
 
-
     return selected_close_frames;
-
-
+}
+std::vector<int>  DataLoaderColmap::get_close_frames_idxs( const easy_pbr::Frame& frame, const int nr_frames, const bool discard_same_idx){
+    return m_cam_index->close_idxs(frame, nr_frames, discard_same_idx);
 }
 
 
@@ -624,6 +541,8 @@ void DataLoaderColmap::reset(){
         unsigned seed = m_nr_resets;
         auto rng_0 = std::default_random_engine(seed);
         std::shuffle(std::begin(m_frames), std::end(m_frames), rng_0);
+        //the index stores the positions of the frames in m_frames so it has to follow the new order
+        m_cam_index->build(m_frames, m_close_frames_view_dir_weight, m_nr_precomputed_close_frames);
     }
 
     m_idx_img_to_read=0;
@@ -651,78 +570,16 @@ void DataLoaderColmap::set_mode_all(){
     m_mode="all";
 }
 
+std::shared_ptr<Mesh> DataLoaderColmap::read_sparse_cloud(){
+    fs::path points_path=m_dataset_path/"sparse"/"points3D.bin";
+    MeshSharedPtr cloud=ColmapReader::read_points3D(points_path.string());
 
+    //the poses of the frames get rotated by -90 degrees around x and rescaled so we move the points into that same world
+    Eigen::Matrix3d rot=Eigen::AngleAxisd( -90 * M_PI / 180.0, Eigen::Vector3d::UnitX() ).toRotationMatrix();
+    cloud->V=cloud->V*rot; //the points are the rows so this applies the inverse of the rotation to every point
+    if(m_scene_scale_multiplier>0.0){
+        cloud->V*=m_scene_scale_multiplier;
+    }
 
-
-
-//Bunch of functions required to read binary files
-//from colmap github src/util/endian.h
-template <typename T>
-T DataLoaderColmap::ReadBinaryLittleEndian(std::istream* stream) {
-  T data_little_endian;
-  stream->read(reinterpret_cast<char*>(&data_little_endian), sizeof(T));
-  return LittleEndianToNative(data_little_endian);
-}
-
-template <typename T>
-void DataLoaderColmap::ReadBinaryLittleEndian(std::istream* stream, std::vector<T>* data) {
-  for (size_t i = 0; i < data->size(); ++i) {
-    (*data)[i] = ReadBinaryLittleEndian<T>(stream);
-  }
-}
-template <typename T>
-T DataLoaderColmap::LittleEndianToNative(const T x) {
-  if (IsLittleEndian()) {
-    return x;
-  } else {
-    return ReverseBytes(x);
-  }
-}
-template <typename T>
-T DataLoaderColmap::BigEndianToNative(const T x) {
-  if (IsBigEndian()) {
-    return x;
-  } else {
-    return ReverseBytes(x);
-  }
-}
-
-template <typename T>
-T DataLoaderColmap::NativeToLittleEndian(const T x) {
-  if (IsLittleEndian()) {
-    return x;
-  } else {
-    return ReverseBytes(x);
-  }
-}
-template <typename T>
-T DataLoaderColmap::NativeToBigEndian(const T x) {
-  if (IsBigEndian()) {
-    return x;
-  } else {
-    return ReverseBytes(x);
-  }
-}
-template <typename T>
-T DataLoaderColmap::ReverseBytes(const T& data) {
-  T data_reversed = data;
-  std::reverse(reinterpret_cast<char*>(&data_reversed),
-               reinterpret_cast<char*>(&data_reversed) + sizeof(T));
-  return data_reversed;
-}
-
-inline bool DataLoaderColmap::IsLittleEndian() {
-#ifdef BOOST_BIG_ENDIAN
-  return false;
-#else
-  return true;
-#endif
-}
-
-inline bool DataLoaderColmap::IsBigEndian() {
-#ifdef BOOST_BIG_ENDIAN
-  return true;
-#else
-  return false;
-#endif
+    return cloud;
 }
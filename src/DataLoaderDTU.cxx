@@ -22,6 +22,8 @@ using namespace configuru;
 
 //my stuff
 #include "data_loaders/DataTransformer.h"
+#include "data_loaders/ImageCache.h"
+#include "data_loaders/WorkerPool.h"
 #include "easy_pbr/Frame.h"
 #include "Profiler.h"
 #include "string_utils.h"
@@ -46,10 +48,13 @@ using namespace easy_pbr;
 
 DataLoaderDTU::DataLoaderDTU(const std::string config_file):
     m_is_running(false),
+    m_next_scene_ready(false),
+    m_switch_requested(false),
     m_autostart(false),
     m_idx_scene_to_read(0),
     m_nr_resets(0),
     m_rand_gen(new RandGenerator),
+    m_frames_for_scene(std::make_shared< const std::vector<Frame> >()),
     m_nr_scenes_read_so_far(0)
 {
     init_params(config_file);
@@ -85,11 +90,21 @@ void DataLoaderDTU::init_params(const std::string config_file){
     m_read_with_bg_thread = loader_config["read_with_bg_thread"];
     m_shuffle=loader_config["shuffle"];
     m_subsample_factor=loader_config["subsample_factor"];
+    m_reduced_jpeg_decode=loader_config.get_or("reduced_jpeg_decode", false);
     m_do_overfit=loader_config["do_overfit"];
     // m_restrict_to_object= (std::string)loader_config["restrict_to_object"]; //makes it load clouds only from a specific object
     m_dataset_path = (std::string)loader_config["dataset_path"];    //get the path where all the off files are
     m_restrict_to_scene_name= (std::string)loader_config["restrict_to_scene_name"];
     m_load_as_shell= loader_config["load_as_shell"];
+    int image_cache_mb=loader_config.get_or("image_cache_mb", 0);
+    if(m_load_as_shell && image_cache_mb>0){
+        m_image_cache=ImageCache::shared();
+        m_image_cache->reserve_budget( (size_t)image_cache_mb*1024*1024 );
+    }
+    m_nr_decode_threads=loader_config.get_or("nr_decode_threads", 1);
+    if(m_nr_decode_threads!=1){
+        m_decode_pool=WorkerPool::shared(m_nr_decode_threads);
+    }
     m_mode= (std::string)loader_config["mode"];
     m_load_mask=loader_config["load_mask"];
     m_preload_to_gpu_tensors=loader_config["preload_to_gpu_tensors"];
@@ -180,8 +195,16 @@ void DataLoaderDTU::init_data_reading(){
 }
 
 void DataLoaderDTU::start_reading_next_scene(){
-    CHECK(m_is_running==false) << "The loader thread is already running. Wait until the scene is finished loading before loading a new one. You can check this with finished_reading_scene()";
+    //the current scene keeps being served until the next one is decoded so this never blocks. The switch happens here or in finished_reading_scene() once the next scene is ready
+    std::lock_guard<std::mutex> lock(m_switch_mutex);
+    m_switch_requested=true;
+    if(!m_is_running && !m_next_scene_ready){
+        read_next_scene_in_background();
+    }
+    switch_scene_if_ready();
+}
 
+void DataLoaderDTU::read_next_scene_in_background(){
     std::string scene_path;
     if ( m_idx_scene_to_read< (int)m_scene_folders.size()){
         scene_path=m_scene_folders[m_idx_scene_to_read].string();
@@ -210,16 +233,38 @@ void DataLoaderDTU::start_reading_next_scene(){
     }
 }
 
+void DataLoaderDTU::switch_scene_if_ready(){
+    if(!m_switch_requested || m_is_running){
+        return;
+    }
+    if (m_loader_thread.joinable()){
+        m_loader_thread.join(); //the thread is done with the scene, we only reclaim it
+    }
+    if(m_next_scene_ready){
+        {
+            //the getters may be copying from the current scene on another thread so we only replace it when they are done
+            //the old scene itself is never modified, the snapshots handed out by get_all_frames_ref() keep it alive until they are dropped
+            std::lock_guard<std::mutex> lock(m_scene_mutex);
+            m_frames_for_scene=std::make_shared< const std::vector<Frame> >(std::move(m_frames_next_scene));
+            m_frames_next_scene.clear();
+            m_nr_scenes_read_so_far++; //counted only once the scene is used so that a read ahead dropped by reset() doesn't shift the seeds of the following scenes
+            m_current_scene_name=m_next_scene_name;
+            m_next_scene_ready=false;
+        }
+        //start decoding the scene after this one while this one is being used
+        if(m_read_with_bg_thread){
+            read_next_scene_in_background();
+        }
+    }
+    m_switch_requested=false;
+}
+
 
 void DataLoaderDTU::read_scene(const std::string scene_path){
     // VLOG(1) <<" read from path " << scene_path;
 
     TIME_SCOPE("read_scene");
 
-    m_current_scene_name= fs::path(scene_path).filename().string();
-
-    m_frames_for_scene.clear();
-
     std::vector<fs::path> paths;
     for (fs::directory_iterator itr( fs::path(scene_path)/"image"); itr!=fs::directory_iterator(); ++itr){
         fs::path img_path= itr->path();
@@ -230,7 +275,11 @@ void DataLoaderDTU::read_scene(const std::string scene_path){
 
     // shuffle the data for this scene if neccsary
     if(m_shuffle && m_mode=="train"){
-        unsigned seed1 = m_nr_scenes_read_so_far;
+        unsigned seed1;
+        {
+            std::lock_guard<std::mutex> lock(m_scene_mutex);
+            seed1 = m_nr_scenes_read_so_far;
+        }
         auto rng_1 = std::default_random_engine(seed1);
         std::shuffle(std::begin(paths), std::end(paths), rng_1);
     }
@@ -242,7 +291,8 @@ void DataLoaderDTU::read_scene(const std::string scene_path){
     // TODO Stefano: read from config file
     bool train_on_test=true;
 
-    //load all the scene for the chosen object
+    //pick the images first so that the filtering select the same ones as when reading them one after another
+    std::vector<fs::path> img_paths;
     for (size_t i=0; i<paths.size(); i++){
         // fs::path img_path= itr->path();
         fs::path img_path= paths[i];
@@ -274,89 +324,74 @@ void DataLoaderDTU::read_scene(const std::string scene_path){
                     continue;
                 }
             }
+            img_paths.push_back(img_path);
+        }
+    }
 
-
-            Frame frame;
-            frame.frame_idx=img_idx;
-
-            //sets the paths and all the things necessary for the loading of images
-            frame.rgb_path=img_path.string();
-            frame.subsample_factor=m_subsample_factor;
-
-            if (m_load_mask){
-                //for some reason the mask does not neceserraly have the same name as the image. the image can be 00002 and the mask is 002 so always with 3 digits 
-                std::stringstream ss;
-                ss << std::setw(3) << std::setfill('0') << img_idx;
-                std::string mask_filename=ss.str()+".png";
-                // std::string mask_path=(fs::path(scene_path)/"mask"/img_path.filename()).string();
-                std::string mask_path=(fs::path(scene_path)/"mask"/mask_filename ).string();
-                CHECK(boost::filesystem::exists(mask_path)) << "Mask does not exist under path" << mask_path;
-
-                frame.mask_path=mask_path;
-            }
-
-
-            //load the images if necessary or delay it for whne it's needed
-            frame.load_images=[this]( easy_pbr::Frame& frame ) -> void{ this->load_images_in_frame(frame); };
-            if (m_load_as_shell){
-                //set the function to load the images whenever it's neede
-                frame.is_shell=true;
-            }else{
-                frame.is_shell=false;
-                frame.load_images(frame);
-            }
-
-
-
-            //just get it from the hashmap
-            frame.K = m_scene2frame_idx2K[scene_path][img_idx];
-            frame.tf_cam_world = m_scene2frame_idx2tf_cam_world[scene_path][img_idx];
-
-
-            if(m_subsample_factor>1){
-                frame.rescale_K(1.0/m_subsample_factor);
-            }
-
-
-
-
-            
-
-
-
-
-
-
-
-
-
-
-            
-
-
-
-
+    //the frames are built and their images decoded in parallel, each into its own slot so they keep the order of the paths
+    std::vector<Frame> frames(img_paths.size());
+    WorkerPool::parallel_for(m_decode_pool, img_paths.size(), [&](const int i){
+        fs::path img_path= img_paths[i];
+        int img_idx=std::stoi( img_path.stem().string() );
+
+        Frame frame;
+        frame.frame_idx=img_idx;
+
+        //sets the paths and all the things necessary for the loading of images
+        frame.rgb_path=img_path.string();
+        frame.subsample_factor=m_subsample_factor;
+
+        if (m_load_mask){
+            //for some reason the mask does not neceserraly have the same name as the image. the image can be 00002 and the mask is 002 so always with 3 digits 
+            std::stringstream ss;
+            ss << std::setw(3) << std::setfill('0') << img_idx;
+            std::string mask_filename=ss.str()+".png";
+            // std::string mask_path=(fs::path(scene_path)/"mask"/img_path.filename()).string();
+            std::string mask_path=(fs::path(scene_path)/"mask"/mask_filename ).string();
+            CHECK(boost::filesystem::exists(mask_path)) << "Mask does not exist under path" << mask_path;
+
+            frame.mask_path=mask_path;
+        }
 
 
+        //load the images if necessary or delay it for whne it's needed
+        frame.load_images=[this]( easy_pbr::Frame& frame ) -> void{ this->load_images_in_frame(frame); };
+        if (m_load_as_shell){
+            //set the function to load the images whenever it's neede
+            frame.is_shell=true;
+        }else{
+            frame.is_shell=false;
+            frame.load_images(frame);
+        }
 
 
 
-            m_frames_for_scene.push_back(frame);
+        //just get it from the hashmap
+        frame.K = m_scene2frame_idx2K.at(scene_path).at(img_idx); //at() because several threads look it up at the same time and [] could insert
+        frame.tf_cam_world = m_scene2frame_idx2tf_cam_world.at(scene_path).at(img_idx);
 
 
+        if(m_subsample_factor>1){
+            frame.rescale_K(1.0/m_subsample_factor);
         }
-    }
 
-    // VLOG(1) << "loaded a scene with nr of frames " << m_frames_for_scene.size();
-    CHECK(m_frames_for_scene.size()!=0) << "Clouldn't load any images for this scene in path " << scene_path;
+        frames[i]=frame;
+    });
+    // VLOG(1) << "loaded a scene with nr of frames " << frames.size();
+    CHECK(frames.size()!=0) << "Clouldn't load any images for this scene in path " << scene_path;
 
-    m_nr_scenes_read_so_far++;
+    {
+        std::lock_guard<std::mutex> lock(m_scene_mutex);
+        m_frames_next_scene=std::move(frames);
+        m_next_scene_name= fs::path(scene_path).filename().string();
+    }
 
     //shuffle the images from this scene
     //unsigned seed = m_nr_scenes_read_so_far;
     //auto rng_0 = std::default_random_engine(seed);
-    //std::shuffle(std::begin(m_frames_for_scene), std::end(m_frames_for_scene), rng_0);
+    //std::shuffle(std::begin(m_frames_next_scene), std::end(m_frames_next_scene), rng_0);
 
+    m_next_scene_ready=true;
     m_is_running=false;
 }
 
@@ -366,23 +401,13 @@ void DataLoaderDTU::load_images_in_frame(easy_pbr::Frame& frame){
 
 
     // VLOG(1) << "load image from" << frame.rgb_path ;
-    cv::Mat rgb_8u=cv::imread(frame.rgb_path);
-    if(frame.subsample_factor>1){
-        cv::Mat resized;
-        cv::resize(rgb_8u, resized, cv::Size(), 1.0/frame.subsample_factor, 1.0/frame.subsample_factor, cv::INTER_AREA);
-        rgb_8u=resized;
-    }
+    cv::Mat rgb_8u=ImageCache::read(m_image_cache, frame.rgb_path, cv::IMREAD_COLOR, frame.subsample_factor, cv::INTER_AREA, m_reduced_jpeg_decode);
     frame.rgb_8u=rgb_8u;
 
 
     //load also mask if it's there
     if (!frame.mask_path.empty()){
-        cv::Mat mask=cv::imread(frame.mask_path );
-        if(frame.subsample_factor>1){
-            cv::Mat resized;
-            cv::resize(mask, resized, cv::Size(), 1.0/frame.subsample_factor, 1.0/frame.subsample_factor, cv::INTER_NEAREST);
-            mask=resized;
-        }
+        cv::Mat mask=ImageCache::read(m_image_cache, frame.mask_path, cv::IMREAD_COLOR, frame.subsample_factor, cv::INTER_NEAREST);
         mask.convertTo(frame.mask, CV_32FC3, 1.0/255.0);
         // VLOG(1) << "read mask of type "<< type2string( mask.type() );
         // frame.mask=mask;
@@ -606,37 +631,54 @@ void DataLoaderDTU::read_poses_and_intrinsics(){
 
 
 bool DataLoaderDTU::finished_reading_scene(){
-    return !m_is_running;
+    std::lock_guard<std::mutex> lock(m_switch_mutex);
+    switch_scene_if_ready();
+    return !m_switch_requested;
 }
 bool DataLoaderDTU::has_data(){
     return finished_reading_scene();
 }
 
+int DataLoaderDTU::get_random_frame_idx(){
+    std::lock_guard<std::mutex> lock(m_scene_mutex);
+    CHECK(m_frames_for_scene->size()>0 ) << "m_frames_for_scene has size 0";
+
+    return m_rand_gen->rand_int(0, m_frames_for_scene->size()-1);
+}
 Frame DataLoaderDTU::get_random_frame(){
-    int random_idx=m_rand_gen->rand_int(0, m_frames_for_scene.size()-1);
-    // int random_idx=0;
-    return m_frames_for_scene[random_idx];
+    std::lock_guard<std::mutex> lock(m_scene_mutex);
+    CHECK(m_frames_for_scene->size()>0 ) << "m_frames_for_scene has size 0";
+
+    return (*m_frames_for_scene)[m_rand_gen->rand_int(0, m_frames_for_scene->size()-1)];
 }
 
 Frame DataLoaderDTU::get_frame_at_idx( const int idx){
-    CHECK(idx<(int)m_frames_for_scene.size()) << "idx is out of bounds. It is " << idx << " while m_frames has size " << m_frames_for_scene.size();
+    std::lock_guard<std::mutex> lock(m_scene_mutex);
+    CHECK(idx>=0 && idx<(int)m_frames_for_scene->size()) << "idx is out of bounds. It is " << idx << " while m_frames_for_scene has size " << m_frames_for_scene->size();
 
-    Frame  frame= m_frames_for_scene[idx];
-
-    return frame;
+    return (*m_frames_for_scene)[idx];
 }
-std::vector< easy_pbr::Frame > DataLoaderDTU::get_all_frames(){
+std::shared_ptr< const std::vector<easy_pbr::Frame> > DataLoaderDTU::get_all_frames_ref(){
+    std::lock_guard<std::mutex> lock(m_scene_mutex);
     return m_frames_for_scene;
+}
+std::vector< easy_pbr::Frame > DataLoaderDTU::get_all_frames(){
+    std::lock_guard<std::mutex> lock(m_scene_mutex);
+    return *m_frames_for_scene;
 } 
 
 
 
 
 bool DataLoaderDTU::is_finished(){
+    std::lock_guard<std::mutex> lock(m_switch_mutex);
     //check if this loader has loaded everything
     if(m_idx_scene_to_read<(int)m_scene_folders.size()){
         return false; //there is still more files to read
     }
+    if(m_is_running || m_next_scene_ready){
+        return false; //the last scene was read ahead but we didn't switch to it yet
+    }
 
 
     return true; //there is nothing more to read and nothing more in the buffer so we are finished
@@ -645,6 +687,7 @@ bool DataLoaderDTU::is_finished(){
 
 
 void DataLoaderDTU::reset(){
+    std::lock_guard<std::mutex> lock(m_switch_mutex);
 
     m_nr_resets++;
 
@@ -655,11 +698,22 @@ void DataLoaderDTU::reset(){
         std::shuffle(std::begin(m_scene_folders), std::end(m_scene_folders), rng_0);
     }
 
+    //a scene that was read ahead in the previous order is dropped so that the next epoch starts from its first scene. If the user is already waiting for it we let it finish
+    if(!m_switch_requested){
+        if (m_loader_thread.joinable()){
+            m_loader_thread.join();
+        }
+        std::lock_guard<std::mutex> lock_scene(m_scene_mutex);
+        m_frames_next_scene.clear();
+        m_next_scene_ready=false;
+    }
+
     m_idx_scene_to_read=0;
 }
 
 int DataLoaderDTU::nr_samples(){
-    return m_frames_for_scene.size();
+    std::lock_guard<std::mutex> lock(m_scene_mutex);
+    return m_frames_for_scene->size();
 }
 int DataLoaderDTU::nr_scenes(){
     return m_scene_folders.size();
@@ -694,6 +748,7 @@ std::string DataLoaderDTU::get_restrict_to_scene_name(){
     return m_restrict_to_scene_name;
 }
 std::string DataLoaderDTU::get_current_scene_name(){
+    std::lock_guard<std::mutex> lock(m_scene_mutex);
     return m_current_scene_name;
 }
 
@@ -18,6 +18,9 @@ using namespace configuru;
 
 //my stuff
 #include "data_loaders/DataTransformer.h"
+#include "data_loaders/WorkerPool.h"
+#include "data_loaders/CameraNeighbourIndex.h"
+#include "data_loaders/MiscDataFuncs.h"
 #include "easy_pbr/Frame.h"
 #include "Profiler.h"
 #include "string_utils.h"
@@ -57,6 +60,7 @@ DataLoaderEasyPBR::DataLoaderEasyPBR(const std::string config_file):
     m_idx_img_to_read(0),
     m_nr_resets(0),
     m_rand_gen(new RandGenerator),
+    m_cam_index(new CameraNeighbourIndex),
     m_scene_mesh(new easy_pbr::Mesh),
     m_loaded_scene_mesh(false)
 {
@@ -100,6 +104,9 @@ void DataLoaderEasyPBR::init_params(const std::string config_file){
     // m_restrict_to_object= (std::string)loader_config["restrict_to_object"]; //makes it load clouds only from a specific object
     m_dataset_path = (std::string)loader_config["dataset_path"];    //get the path where all the off files are
     m_object_name= (std::string)loader_config["object_name"];
+    m_nr_decode_threads=loader_config.get_or("nr_decode_threads", 1);
+    m_close_frames_view_dir_weight=loader_config.get_or("close_frames_view_dir_weight", 0.0);
+    m_nr_precomputed_close_frames=loader_config.get_or("nr_precomputed_close_frames", 0);
 
     // m_scene_scale_multiplier= loader_config["scene_scale_multiplier"];
     bool found_scene_multiplier_for_cur_obj=false;
@@ -124,9 +131,15 @@ void DataLoaderEasyPBR::init_params(const std::string config_file){
 }
 
 void DataLoaderEasyPBR::start(){
+    if(m_nr_decode_threads!=1){
+        m_decode_pool=WorkerPool::shared(m_nr_decode_threads);
+    }
+
     init_poses();
     init_data_reading();
     read_data();
+
+    m_cam_index->build(m_frames, m_close_frames_view_dir_weight, m_nr_precomputed_close_frames);
 }
 
 
@@ -324,36 +337,24 @@ void DataLoaderEasyPBR::read_data(){
 
 
     //attempt 2
-    for (size_t i = 0; i < m_frames.size(); i++){
+    //the frames are already created as shells so each job of the worker pool only fills in the images of its own frame
+    WorkerPool::parallel_for(m_decode_pool, m_frames.size(), [&](const int i){
         Frame& frame=m_frames[i];
 
         VLOG(1) << "reading " << frame.rgb_path;
 
         //read rgba and split into rgb and alpha mask
-        cv::Mat rgba_8u = cv::imread(frame.rgb_path, cv::IMREAD_UNCHANGED);
-        cv::Mat rgb_8u;
-        if(m_subsample_factor>1){
-            cv::Mat resized;
-            cv::resize(rgba_8u, resized, cv::Size(), 1.0/m_subsample_factor, 1.0/m_subsample_factor, cv::INTER_AREA);
-            rgba_8u=resized;
-        }
-        std::vector<cv::Mat> channels(4);
-        cv::split(rgba_8u, channels);
-        if (m_load_mask){
-            cv::threshold( channels[3], frame.mask, 0.0, 1.0, cv::THRESH_BINARY);
-        }
-        channels.pop_back();
-        cv::merge(channels, rgb_8u);
+        cv::Mat rgba_8u = MiscDataFuncs::read_image(frame.rgb_path, cv::IMREAD_UNCHANGED, m_subsample_factor, cv::INTER_AREA);
+        MiscDataFuncs::rgba2rgb_and_mask(rgba_8u, false, Eigen::Vector3f::Zero(), nullptr, &frame.rgb_32f, m_load_mask? &frame.mask : nullptr);
 
 
         // cv::cvtColor(frame.rgb_8u, frame.gray_8u, cv::COLOR_BGR2GRAY);
-        rgb_8u.convertTo(frame.rgb_32f, CV_32FC3, 1.0/255.0);
         // cv::cvtColor(frame.rgb_32f, frame.gray_32f, cv::COLOR_BGR2GRAY);
         frame.width=frame.rgb_32f.cols;
         frame.height=frame.rgb_32f.rows;
 
         frame.is_shell=false;
-    }
+    });
 
 
 
@@ -437,51 +438,47 @@ void DataLoaderEasyPBR::read_data(){
 
 
 
-Frame DataLoaderEasyPBR::get_next_frame(){
+int DataLoaderEasyPBR::get_next_frame_idx(){
     CHECK(m_idx_img_to_read<(int)m_frames.size()) << "m_idx_img_to_read is out of bounds. It is " << m_idx_img_to_read << " while m_frames has size " << m_frames.size();
-    Frame  frame= m_frames[m_idx_img_to_read];
+    int idx=m_idx_img_to_read;
 
     if(!m_do_overfit){
         m_idx_img_to_read++;
     }
 
-    return frame;
+    return idx;
+}
+Frame DataLoaderEasyPBR::get_next_frame(){
+    return m_frames[get_next_frame_idx()];
+}
+const std::vector<easy_pbr::Frame>& DataLoaderEasyPBR::get_all_frames_ref(){
+    return m_frames;
 }
 std::vector<easy_pbr::Frame> DataLoaderEasyPBR::get_all_frames(){
     return m_frames;
 }
-Frame DataLoaderEasyPBR::get_frame_at_idx( const int idx){
-    CHECK(idx<(int)m_frames.size()) << "idx is out of bounds. It is " << idx << " while m_frames has size " << m_frames.size();
-
-    Frame  frame= m_frames[idx];
+const Frame& DataLoaderEasyPBR::get_frame_ref_at_idx( const int idx){
+    CHECK(idx>=0 && idx<(int)m_frames.size()) << "idx is out of bounds. It is " << idx << " while m_frames has size " << m_frames.size();
 
-    return frame;
+    return m_frames[idx];
+}
+Frame DataLoaderEasyPBR::get_frame_at_idx( const int idx){
+    return get_frame_ref_at_idx(idx);
 }
 
-Frame DataLoaderEasyPBR::get_random_frame(){
+int DataLoaderEasyPBR::get_random_frame_idx(){
     CHECK(m_frames.size()>0 ) << "m_frames has size 0";
 
-    int random_idx=m_rand_gen->rand_int(0, m_frames.size()-1);
-    Frame  frame= m_frames[random_idx];
-
-    return frame;
+    return m_rand_gen->rand_int(0, m_frames.size()-1);
+}
+Frame DataLoaderEasyPBR::get_random_frame(){
+    return m_frames[get_random_frame_idx()];
 }
 Frame DataLoaderEasyPBR::get_closest_frame( const easy_pbr::Frame& frame){
-
-    float closest_distance=std::numeric_limits<float>::max();
-    int closest_idx=-1;
-    for(size_t i=0; i<m_frames.size(); i++){
-        float dist =  ( m_frames[i].tf_cam_world.inverse().translation() - frame.tf_cam_world.inverse().translation() ).norm();
-        if (dist < closest_distance && dist>1e-7){
-            closest_distance=dist;
-            closest_idx=i;
-        }
-    }
-
-    Frame  frame_closest= m_frames[closest_idx];
-
-    return frame_closest;
-
+    return m_frames[ get_closest_frame_idx(frame) ];
+}
+int DataLoaderEasyPBR::get_closest_frame_idx( const easy_pbr::Frame& frame){
+    return m_cam_index->closest_idx(frame);
 }
 std::vector< easy_pbr::Frame > DataLoaderEasyPBR::furthest_frame_sampler( std::vector<easy_pbr::Frame>& frames, const int nr_frames_to_pick ){
 
@@ -538,54 +535,17 @@ std::vector< easy_pbr::Frame > DataLoaderEasyPBR::furthest_frame_sampler( std::v
 
 std::vector<easy_pbr::Frame>  DataLoaderEasyPBR::get_close_frames( const easy_pbr::Frame& frame, const int nr_frames, const bool discard_same_idx){
 
-    CHECK(nr_frames<(int)m_frames.size()) << "Cannot select more close frames than the total nr of frames that we have in the loader. Required select of " << nr_frames << " out of a total of " << m_frames.size() << " available in the loader";
+    std::vector<int> close_idxs=get_close_frames_idxs(frame, nr_frames, discard_same_idx);
 
     std::vector<easy_pbr::Frame> selected_close_frames;
-
-    for(int i=0; i<nr_frames; i++){
-
-        //select a close frame
-        float closest_distance=std::numeric_limits<float>::max();
-        int closest_idx=-1;
-        for(size_t j=0; j<m_frames.size(); j++){
-
-            //ignore if the current frame we are checking is THIS
-            if (discard_same_idx){
-                if( m_frames[j].frame_idx == frame.frame_idx ){
-                    continue;
-                }
-            }
-
-            //ignore the current frame that we are checking if it's any of the ones already selected
-            bool is_already_selected=false;
-            for(size_t k=0; k<selected_close_frames.size(); k++){
-                if( m_frames[j].frame_idx == selected_close_frames[k].frame_idx ){
-                    is_already_selected=true;
-                }
-            }
-            if(is_already_selected){
-                continue;
-            }
-
-            //now get the closest one
-            float dist =  ( m_frames[j].tf_cam_world.inverse().translation() - frame.tf_cam_world.inverse().translation() ).norm();
-            // float dist = 1.0 -  m_frames[j].look_dir().dot(frame.look_dir());
-            if (dist < closest_distance){
-                closest_distance=dist;
-                closest_idx=j;
-            }
-        }
-
-        Frame  frame_closest= m_frames[closest_idx];
-        selected_close_frames.push_back(frame_closest);
-
-
+    for(size_t i=0; i<close_idxs.size(); i++){
+        selected_close_frames.push_back( m_frames[close_idxs[i]] );
     }
 
-
     return selected_close_frames;
-
-
+}
+std::vector<int>  DataLoaderEasyPBR::get_close_frames_idxs( const easy_pbr::Frame& frame, const int nr_frames, const bool discard_same_idx){
+    return m_cam_index->close_idxs(frame, nr_frames, discard_same_idx);
 }
 
 // //compute weights
@@ -656,6 +616,8 @@ void DataLoaderEasyPBR::reset(){
         unsigned seed = m_nr_resets;
         auto rng_0 = std::default_random_engine(seed);
         std::shuffle(std::begin(m_frames), std::end(m_frames), rng_0);
+        //the index stores the positions of the frames in m_frames so it has to follow the new order
+        m_cam_index->build(m_frames, m_close_frames_view_dir_weight, m_nr_precomputed_close_frames);
     }
 
     m_idx_img_to_read=0;
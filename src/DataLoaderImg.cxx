@@ -15,6 +15,7 @@
 //My stuff
 #include "Profiler.h"
 #include "string_utils.h"
+#include "data_loaders/MiscDataFuncs.h"
 
 //cv
 //#include <cv_bridge/cv_bridge.h>
@@ -134,6 +135,7 @@ void DataLoaderImg::init_params(const std::string config_file){
 
     // //input for the images
     m_rgb_subsample_factor=loader_config["rgb_subsample_factor"];
+    m_reduced_jpeg_decode=loader_config.get_or("reduced_jpeg_decode", false);
 
 }
 
@@ -298,7 +300,7 @@ void DataLoaderImg::read_data_for_cam(const int cam_id){
 
             //Get images, rgb, gradients etc
             // TIME_START("read_imgs");
-            frame.rgb_8u=cv::imread(rgb_filename.string());
+            frame.rgb_8u=MiscDataFuncs::read_image(rgb_filename.string(), cv::IMREAD_COLOR, m_rgb_subsample_factor, cv::INTER_AREA, m_reduced_jpeg_decode);
 
             // std::cout << "reading " << rgb_filename.string() << '\n';
 
@@ -308,11 +310,6 @@ void DataLoaderImg::read_data_for_cam(const int cam_id){
             // cv::minMaxLoc(frame.rgb, &min, &max);
             // std::cout << "min max of frame.rgb is " << min << " " << max << '\n';
 
-            if(m_rgb_subsample_factor>1){
-                cv::Mat resized;
-                cv::resize(frame.rgb_8u, resized, cv::Size(), 1.0/m_rgb_subsample_factor, 1.0/m_rgb_subsample_factor, cv::INTER_AREA);
-                frame.rgb_8u=resized;
-            }
             frame.rgb_8u.convertTo(frame.rgb_32f, CV_32FC3, 1.0/255.0);
             frame.width=frame.rgb_32f.cols;
             frame.height=frame.rgb_32f.rows;
@@ -16,30 +16,27 @@ using namespace configuru;
 //my stuff
 #include "data_loaders/core/MeshCore.h"
 
-#define BUFFER_SIZE 5 //clouds are stored in a queue until they are acessed, the queue stores a maximum of X items
-
 using namespace easy_pbr;
 
-DataLoaderModelNet40::DataLoaderModelNet40(const std::string config_file):
-    m_clouds_buffer(BUFFER_SIZE),
-    m_is_running(true),
-    m_idx_cloud_to_read(0)
+DataLoaderModelNet40::DataLoaderModelNet40(const std::string config_file)
 {
     init_params(config_file);
     // read_pose_file();
     create_transformation_matrices();
     // std::cout << " creating thread" << "\n";
-    m_loader_thread=std::thread(&DataLoaderModelNet40::read_data, this);  //starts the spin in another thread
+    m_clouds_pipeline.set_nr_readers(m_nr_reader_threads);
+    m_clouds_pipeline.set_prefetch_depth(m_prefetch_depth);
+    m_clouds_pipeline.start(m_off_filenames.size(),
+        [this](const int idx){ return read_sample(idx); },
+        nullptr,
+        "loader_thread_modelnet");
     // std::cout << " finidhed creating thread" << "\n";
 
 }
 
 DataLoaderModelNet40::~DataLoaderModelNet40(){
 
-    m_is_running=false;
-    if (m_loader_thread.joinable()){
-        m_loader_thread.join();
-    }
+    m_clouds_pipeline.stop(); //the readers use the members of the loader so they have to finish before anything gets destroyed
 }
 
 void DataLoaderModelNet40::init_params(const std::string config_file){
@@ -56,6 +53,8 @@ void DataLoaderModelNet40::init_params(const std::string config_file){
     // m_nr_clouds_to_read=loader_config["nr_clouds_to_read"];
     m_mode=(std::string)loader_config["mode"];
     m_normalize=loader_config["normalize"];
+    m_nr_reader_threads=loader_config.get_or("nr_reader_threads", 1);
+    m_prefetch_depth=loader_config.get_or("prefetch_depth", 4);
 
     //get the path where all the off files are
     fs::path dataset_path = (std::string)loader_config["dataset_path"];
@@ -91,66 +90,38 @@ void DataLoaderModelNet40::init_params(const std::string config_file){
 
 }
 
-void DataLoaderModelNet40::read_data(){
-
-    loguru::set_thread_name("loader_thread_kitti");
-
-    while (m_is_running) {
-
-        //we finished reading so we wait here for a reset
-        if(m_idx_cloud_to_read>=m_off_filenames.size()){
-            std::this_thread::sleep_for(std::chrono::milliseconds(300));
-            continue;
-        }
-
-        // std::cout << "size approx is " << m_queue.size_approx() << '\n';
-        // std::cout << "m_idx_img_to_read is " << m_idx_img_to_read << '\n';
-        if(m_clouds_buffer.size_approx()<BUFFER_SIZE-1){ //there is enough space
-            //read the frame and everything else and push it to the queue
-
-            fs::path off_filename=m_off_filenames[ m_idx_cloud_to_read ];
-            m_idx_cloud_to_read++;
-            // VLOG(1) << "reading " << npz_filename;
-
-            //read off
-            MeshCore cloud;
-            cloud.load_from_file(off_filename.string());
-            if(m_normalize){
-                cloud.normalize_size();
-                cloud.normalize_position();
-            }
-
-            //transform
-            cloud.apply_transform(m_tf_worldGL_worldROS); // from worldROS to worldGL
+MeshCore DataLoaderModelNet40::read_sample(const int idx){
 
-            //some sensible visualization options
-            cloud.m_vis.m_show_mesh=true;
-            cloud.m_vis.m_show_points=true;
+    fs::path off_filename=m_off_filenames[ idx ];
+    // VLOG(1) << "reading " << npz_filename;
 
+    //read off
+    MeshCore cloud;
+    cloud.load_from_file(off_filename.string());
+    if(m_normalize){
+        cloud.normalize_size();
+        cloud.normalize_position();
+    }
 
-            m_clouds_buffer.enqueue(cloud);;
+    //transform
+    cloud.apply_transform(m_tf_worldGL_worldROS); // from worldROS to worldGL
 
-        }
+    //some sensible visualization options
+    cloud.m_vis.m_show_mesh=true;
+    cloud.m_vis.m_show_points=true;
 
-    }
+    return cloud;
 
 }
 
 bool DataLoaderModelNet40::has_data(){
-    if(m_clouds_buffer.peek()==nullptr){
-        return false;
-    }else{
-        return true;
-    }
+    return m_clouds_pipeline.has_data();
 }
 
 
 MeshCore DataLoaderModelNet40::get_cloud(){
 
-    MeshCore cloud;
-    m_clouds_buffer.try_dequeue(cloud);
-
-    return cloud;
+    return m_clouds_pipeline.try_get();
 }
 
 
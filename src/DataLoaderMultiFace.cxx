@@ -6,6 +6,8 @@
 #include <fstream>
 #include <iterator>
 #include <algorithm>
+#include <cstring>
+#include <thread>
 
 #include <opencv2/imgcodecs.hpp>  //for imread
 #include "opencv2/imgproc/imgproc.hpp" //for cv::resize
@@ -23,6 +25,9 @@ using namespace configuru;
 
 //my stuff
 // #include "data_loaders/DataTransformer.h"
+#include "data_loaders/MiscDataFuncs.h"
+#include "data_loaders/MappedFile.h"
+#include "data_loaders/WorkerPool.h"
 #include "easy_pbr/Frame.h"
 #include "easy_pbr/Mesh.h"
 #include "Profiler.h"
@@ -55,6 +60,38 @@ namespace fs = boost::filesystem;
 using namespace radu::utils;
 using namespace easy_pbr;
 
+//layout of the binary cache of the obj of one timestep, written in <tracked_mesh sequence folder>/binary_cache/<timestep>.bin
+//  header
+//  V, NV, UV and C as doubles and then F as int32. Each of them is a uint32 nr of rows and cols followed by the values in column major order. The empty ones have 0 rows
+//the doubles go first so that they stay aligned
+namespace{
+    const char CACHE_MAGIC[8]={'M','F','A','C','E','O','B','J'};
+    const uint32_t CACHE_VERSION=1;
+    struct CacheHeader{
+        char magic[8];
+        uint32_t version;
+        uint32_t padding;
+    };
+    static_assert(sizeof(CacheHeader)==16, "CacheHeader has to have no padding so that the file layout is the same on all compilers");
+
+    template <typename Scalar, typename MatrixType>
+    void write_cache_matrix(std::ofstream& file, const MatrixType& mat){
+        uint32_t size[2]={(uint32_t)mat.rows(), (uint32_t)mat.cols()};
+        Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> mat_scalar=mat.template cast<Scalar>();
+        file.write(reinterpret_cast<const char*>(size), sizeof(size));
+        file.write(reinterpret_cast<const char*>(mat_scalar.data()), (size_t)mat_scalar.size()*sizeof(Scalar));
+    }
+
+    template <typename Scalar, typename MatrixType>
+    void read_cache_matrix(const MappedFile& file, size_t& offset, MatrixType& mat){
+        const uint32_t* size=file.at<uint32_t>(offset, 2);
+        offset+=2*sizeof(uint32_t);
+        size_t nr_elems=(size_t)size[0]*size[1];
+        mat=Eigen::Map< const Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> >(file.at<Scalar>(offset, nr_elems), size[0], size[1]).template cast<typename MatrixType::Scalar>();
+        offset+=nr_elems*sizeof(Scalar);
+    }
+}
+
 
 struct {
     bool operator()(fs::path a, fs::path b) const {
@@ -87,6 +124,7 @@ struct {
 DataLoaderMultiFace::DataLoaderMultiFace(const std::string config_file, const int subject_id):
     // m_is_running(false),
     m_idx_img_to_read(0),
+    m_failed_writing_cache(false),
     m_nr_resets(0),
     m_rand_gen(new RandGenerator)
 {
@@ -104,6 +142,7 @@ DataLoaderMultiFace::~DataLoaderMultiFace(){
     // if (m_loader_thread.joinable()){
     //     m_loader_thread.join();
     // }
+    m_timesteps_pipeline.stop();
 }
 
 void DataLoaderMultiFace::init_params(const std::string config_file, const int subject_id){
@@ -137,10 +176,18 @@ void DataLoaderMultiFace::init_params(const std::string config_file, const int s
     //rest of params
     m_autostart=loader_config["autostart"];
     m_subsample_factor=loader_config["subsample_factor"];
+    m_reduced_jpeg_decode=loader_config.get_or("reduced_jpeg_decode", false);
     m_shuffle=loader_config["shuffle"];
     m_load_as_shell= loader_config["load_as_shell"];
     m_do_overfit=loader_config["do_overfit"];
     m_mode=(std::string)loader_config["mode"];
+    m_use_binary_cache=loader_config.get_or("use_binary_cache", true);
+    m_sequence_playback=loader_config.get_or("sequence_playback", false);
+    m_prefetch_depth=loader_config.get_or("prefetch_depth", 1);
+    m_nr_decode_threads=loader_config.get_or("nr_decode_threads", 1);
+    if(m_nr_decode_threads!=1){
+        m_decode_pool=WorkerPool::shared(m_nr_decode_threads);
+    }
     
    
 
@@ -155,6 +202,9 @@ void DataLoaderMultiFace::start(){
     // m_tf_frame_to_world_pre.setIdentity();
     // m_tf_frame_to_world_pre.linear().col(1) = -m_tf_frame_to_world_pre.linear().col(1);
     read_data();
+    if(m_sequence_playback){
+        start_prefetching();
+    }
 }
 
 
@@ -400,12 +450,21 @@ Eigen::Affine3f DataLoaderMultiFace::transform_from_world_mugsy_to_world_easypbr
 }
 
 void DataLoaderMultiFace::read_data(){
-    CHECK(m_timestep>=0) << "Timestep should be positive or zero. It is " << m_timestep;
+    MultiFaceTimestep sample=read_timestep(m_timestep, !m_load_as_shell);
+    m_mesh_for_timestep=sample.mesh;
+    m_frames=std::move(sample.frames);
+    m_idx_img_to_read=0;
+}
 
+MultiFaceTimestep DataLoaderMultiFace::read_timestep(const int timestep, const bool load_images){
+    CHECK(timestep>=0) << "Timestep should be positive or zero. It is " << timestep;
+
+    MultiFaceTimestep sample;
+    sample.timestep=timestep;
 
 
     //read mesh
-    CHECK(m_timestep<(int)m_meshes_paths_for_timesteps.size()) << "Timestep should be less that the nr of meshes. Timestep is " << m_timestep << " nr of meshes for all timesteps is "<< m_meshes_paths_for_timesteps.size();
+    CHECK(timestep<(int)m_meshes_paths_for_timesteps.size()) << "Timestep should be less that the nr of meshes. Timestep is " << timestep << " nr of meshes for all timesteps is "<< m_meshes_paths_for_timesteps.size();
     
 
 
@@ -433,16 +492,7 @@ void DataLoaderMultiFace::read_data(){
     // m_mesh_for_timestep=mesh;
 
     //attempt 2
-    MeshSharedPtr mesh=Mesh::create();
-    mesh->read_obj(m_meshes_paths_for_timesteps[m_timestep], true, false);
-    mesh->scale_mesh(m_scene_scale_multiplier);
-    mesh->apply_model_matrix_to_cpu(true);
-    //place in world
-    Eigen::Affine3f tf_world_obj =mesh->model_matrix().cast<float>();
-    tf_world_obj=transform_from_world_mugsy_to_world_easypbr(tf_world_obj, false); //we don't scale here because the scaling of translation doesn't make a any difference here because we already have a translation of 0,0,0
-    mesh->set_model_matrix(tf_world_obj.cast<double>());
-    mesh->apply_model_matrix_to_cpu(true);
-    m_mesh_for_timestep=mesh;
+    sample.mesh=read_mesh_for_timestep(timestep);
    
 
     // for (size_t i = 0; i < m_imgs_paths.size(); i++){
@@ -453,7 +503,7 @@ void DataLoaderMultiFace::read_data(){
         int cam_idx=m_cameras[i].cam_idx;
         // VLOG(1) << "readin from cam_idx" << cam_idx;
         // VLOG(1) << "this cam has nr of imgs " << m_cameras[i].imgs_paths.size();
-        CHECK(m_timestep<(int)m_cameras[i].imgs_paths.size()) << "Timestep should be less that the nr of images. Timestep is " << m_timestep << " nr of images for this cam is "<< m_cameras[i].imgs_paths.size();
+        CHECK(timestep<(int)m_cameras[i].imgs_paths.size()) << "Timestep should be less that the nr of images. Timestep is " << timestep << " nr of images for this cam is "<< m_cameras[i].imgs_paths.size();
 
 
         //see if we add this camera based on the mode that we are in
@@ -469,8 +519,8 @@ void DataLoaderMultiFace::read_data(){
         Frame frame;
         frame.cam_id=cam_idx;
         frame.add_extra_field("cam_id_lin", (int)i);
-        frame.frame_idx=m_frames.size();
-        fs::path img_path=m_cameras[i].imgs_paths[m_timestep];
+        frame.frame_idx=sample.frames.size();
+        fs::path img_path=m_cameras[i].imgs_paths[timestep];
         frame.rgb_path=img_path.string();
         //add also a maks path
         fs::path img_filename=img_path.filename();
@@ -486,19 +536,15 @@ void DataLoaderMultiFace::read_data(){
 
 
         //load the images if necessary or delay it for whne it's needed
+        //the images that we load are decoded all together after the loop
         frame.load_images=[this]( easy_pbr::Frame& frame ) -> void{ this->load_images_in_frame(frame); };
-        if (m_load_as_shell){
-            //set the function to load the images whenever it's neede
-            frame.is_shell=true;
-        }else{
-            frame.is_shell=false;
-            frame.load_images(frame);
-        }
+        frame.is_shell=!load_images;
 
         // VLOG(1) << "Cam idx is " << cam_idx;
 
         //extrinsics
-        Eigen::Affine3f tf_cam_world = m_camidx2pose[cam_idx].cast<float>();
+        //we use at() because operator[] could insert into the maps while the prefetch thread is reading them
+        Eigen::Affine3f tf_cam_world = m_camidx2pose.at(cam_idx).cast<float>();
         Eigen::Affine3f tf_world_cam= tf_cam_world.inverse();
 
 
@@ -548,25 +594,140 @@ void DataLoaderMultiFace::read_data(){
 
 
         //intrinsics got mostly from here https://github.com/bmild/nerf/blob/0247d6e7ede8d918bc1fab2711f845669aee5e03/load_blender.py
-        frame.K=m_camidx2intrinsics[cam_idx].cast<float>();
+        frame.K=m_camidx2intrinsics.at(cam_idx).cast<float>();
         if(m_subsample_factor>1){
             //based on the post from tomas simon and https://dsp.stackexchange.com/questions/6055/how-does-resizing-an-image-affect-the-intrinsic-camera-matrix
             frame.rescale_K(1.0/m_subsample_factor);
         }
 
         //distorsion
-        frame.distort_coeffs=m_camidx2distorsion[cam_idx].cast<float>();
+        frame.distort_coeffs=m_camidx2distorsion.at(cam_idx).cast<float>();
 
 
-        m_frames.push_back(frame);
+        sample.frames.push_back(frame);
 
         nr_cameras_valid++;
 
     }
 
+    //decode the cameras in parallel, each job writes only to its own frame
+    if(load_images){
+        WorkerPool::parallel_for(m_decode_pool, sample.frames.size(), [&](const int i){
+            sample.frames[i].load_images(sample.frames[i]);
+        });
+    }
+
+    return sample;
+
+}
+
+void DataLoaderMultiFace::start_prefetching(){
+    int first_timestep=m_timestep+1;
+    int nr_timesteps_left=std::max(0, nr_timesteps()-first_timestep);
 
+    //the prefetched timesteps get their images decoded even if we load as shell since the point is to have them ready when we move to them
+    m_timesteps_pipeline.set_prefetch_depth(m_prefetch_depth);
+    m_timesteps_pipeline.start(nr_timesteps_left, [this, first_timestep](const int idx){ return this->read_timestep(first_timestep+idx, true); }, nullptr, "loader_thread_multiface");
 }
 
+MeshSharedPtr DataLoaderMultiFace::read_mesh_for_timestep(const int timestep){
+
+    //read the obj, from the binary cache if there is one that is up to date
+    fs::path obj_filename=m_meshes_paths_for_timesteps[timestep];
+    fs::path cache_filename=binary_cache_path(obj_filename);
+    MeshSharedPtr mesh;
+    if(m_use_binary_cache && is_binary_cache_valid(cache_filename, obj_filename)){
+        mesh=read_binary_cache(cache_filename);
+    }else{
+        mesh=Mesh::create();
+        mesh->read_obj(obj_filename.string(), true, false);
+        if(m_use_binary_cache && !m_failed_writing_cache){
+            if(!write_binary_cache(cache_filename, mesh)){
+                m_failed_writing_cache=true;
+                LOG(WARNING) << "Could not write the binary cache " << cache_filename << ". We will keep on parsing the obj files";
+            }
+        }
+    }
+
+    //the cache has the mesh as it is in the obj so that it doesn't depend on the scene params of the config
+    mesh->scale_mesh(m_scene_scale_multiplier);
+    mesh->apply_model_matrix_to_cpu(true);
+    //place in world
+    Eigen::Affine3f tf_world_obj =mesh->model_matrix().cast<float>();
+    tf_world_obj=transform_from_world_mugsy_to_world_easypbr(tf_world_obj, false); //we don't scale here because the scaling of translation doesn't make a any difference here because we already have a translation of 0,0,0
+    mesh->set_model_matrix(tf_world_obj.cast<double>());
+    mesh->apply_model_matrix_to_cpu(true);
+
+    return mesh;
+}
+
+fs::path DataLoaderMultiFace::binary_cache_path(const fs::path& obj_filename){
+    //it goes in a folder because init_data_reading takes all the files of the tracked_mesh folder that have obj in the path
+    return obj_filename.parent_path()/"binary_cache"/(obj_filename.stem().string()+".bin");
+}
+
+bool DataLoaderMultiFace::is_binary_cache_valid(const fs::path& cache_filename, const fs::path& obj_filename){
+    //a cache that is older than the obj was written from a file that has been changed since, so we ignore it
+    boost::system::error_code ec;
+    std::time_t cache_time=fs::last_write_time(cache_filename, ec);
+    if(ec){
+        return false;
+    }
+    return cache_time>=fs::last_write_time(obj_filename);
+}
+
+MeshSharedPtr DataLoaderMultiFace::read_binary_cache(const fs::path& cache_filename){
+    MappedFile file(cache_filename.string());
+
+    const CacheHeader* header=file.at<CacheHeader>(0);
+    CHECK( std::memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC))==0 ) << cache_filename << " is not a multiface mesh cache file";
+    CHECK(header->version==CACHE_VERSION) << cache_filename << " has version " << header->version << " but we can only read version " << CACHE_VERSION << ". Please delete it so it gets written again";
+
+    MeshSharedPtr mesh=Mesh::create();
+    size_t offset=sizeof(CacheHeader);
+    read_cache_matrix<double>(file, offset, mesh->V);
+    read_cache_matrix<double>(file, offset, mesh->NV);
+    read_cache_matrix<double>(file, offset, mesh->UV);
+    read_cache_matrix<double>(file, offset, mesh->C);
+    read_cache_matrix<int32_t>(file, offset, mesh->F);
+
+    return mesh;
+}
+
+bool DataLoaderMultiFace::write_binary_cache(const fs::path& cache_filename, const MeshSharedPtr& mesh){
+    boost::system::error_code ec;
+    fs::create_directories(cache_filename.parent_path(), ec);
+    if(ec){
+        return false;
+    }
+
+    CacheHeader header;
+    std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version=CACHE_VERSION;
+    header.padding=0;
+
+    //we write into a temporary file and rename it at the end so that a loader never sees a half written cache. The name of the temporary file is unique for each thread in case the prefetcher and the loader write the same timestep
+    fs::path tmp_filename=cache_filename.string()+".tmp"+std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    std::ofstream file(tmp_filename.string(), std::ios::binary);
+    if(!file.is_open()){
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    write_cache_matrix<double>(file, mesh->V);
+    write_cache_matrix<double>(file, mesh->NV);
+    write_cache_matrix<double>(file, mesh->UV);
+    write_cache_matrix<double>(file, mesh->C);
+    write_cache_matrix<int32_t>(file, mesh->F);
+    file.close();
+    if(file.fail()){
+        fs::remove(tmp_filename, ec);
+        return false;
+    }
+    fs::rename(tmp_filename, cache_filename, ec);
+    return !ec;
+}
+
+
 // MeshSharedPtr DataLoaderMultiFace::read_mesh(const std::string path, bool load_texture, bool transform, bool check_frame_nr){
 
 //     CHECK( fs::exists(fs::path(path)) ) << "Could not find path " << path;
@@ -990,13 +1151,8 @@ void DataLoaderMultiFace::load_images_in_frame(easy_pbr::Frame& frame){
     //         rgb_32f=resized;
     //     }
     // }else{
-        cv::Mat rgb_8u = cv::imread( frame.rgb_path );
         //resize the rgb8u mat and then convert to float because its faster
-        if(m_subsample_factor>1){
-            cv::Mat resized;
-            cv::resize(rgb_8u, resized, cv::Size(), 1.0/m_subsample_factor, 1.0/m_subsample_factor, cv::INTER_AREA);
-            rgb_8u=resized;
-        }
+        cv::Mat rgb_8u = MiscDataFuncs::read_image(frame.rgb_path, cv::IMREAD_COLOR, m_subsample_factor, cv::INTER_AREA, m_reduced_jpeg_decode);
         // frame.rgb_8u=rgb_8u;
         rgb_8u.convertTo(rgb_32f, CV_32FC3, 1.0/255.0);
     // }
@@ -1016,6 +1172,49 @@ std::shared_ptr<easy_pbr::Mesh>  DataLoaderMultiFace::get_mesh_head(){
 
     return m_mesh_for_timestep;
 }
+
+int DataLoaderMultiFace::timestep(){
+    return m_timestep;
+}
+
+int DataLoaderMultiFace::nr_timesteps(){
+    int nr=m_meshes_paths_for_timesteps.size();
+    for (size_t i = 0; i < m_cameras.size(); i++){
+        nr=std::min(nr, (int)m_cameras[i].imgs_paths.size());
+    }
+    return nr;
+}
+
+void DataLoaderMultiFace::set_timestep(const int timestep){
+    CHECK(timestep>=0 && timestep<nr_timesteps()) << "Timestep is out of bounds. It is " << timestep << " while we have " << nr_timesteps() << " timesteps";
+
+    //whatever was prefetched is for the timesteps after the old one so we drop it
+    m_timesteps_pipeline.stop();
+    m_timestep=timestep;
+    read_data();
+    if(m_sequence_playback){
+        start_prefetching();
+    }
+}
+
+bool DataLoaderMultiFace::next_timestep(){
+    if(m_timestep+1>=nr_timesteps()){
+        return false;
+    }
+    if(!m_sequence_playback){
+        set_timestep(m_timestep+1);
+        return true;
+    }
+
+    //the pipeline delivers the timesteps in order so this is always m_timestep+1
+    MultiFaceTimestep sample=m_timesteps_pipeline.get();
+    CHECK(sample.timestep==m_timestep+1) << "Expected to get timestep " << m_timestep+1 << " from the prefetcher but got " << sample.timestep;
+    m_timestep=sample.timestep;
+    m_mesh_for_timestep=sample.mesh;
+    m_frames=std::move(sample.frames);
+    m_idx_img_to_read=0;
+    return true;
+}
 // std::shared_ptr<easy_pbr::Mesh>  DataLoaderMultiFace::get_mesh_head_bald(){
 //     CHECK(m_load_bald_mesh) << "load_bald_mesh should be true in the cfg file";
 //     return m_mesh_head_bald_for_timestep;
@@ -1039,15 +1238,21 @@ std::shared_ptr<easy_pbr::Mesh>  DataLoaderMultiFace::get_mesh_head(){
 
 
 
-Frame DataLoaderMultiFace::get_next_frame(){
+int DataLoaderMultiFace::get_next_frame_idx(){
     CHECK(m_idx_img_to_read<(int)m_frames.size()) << "m_idx_img_to_read is out of bounds. It is " << m_idx_img_to_read << " while m_frames has size " << m_frames.size();
-    Frame  frame= m_frames[m_idx_img_to_read];
+    int idx=m_idx_img_to_read;
 
     if(!m_do_overfit){
         m_idx_img_to_read++;
     }
 
-    return frame;
+    return idx;
+}
+Frame DataLoaderMultiFace::get_next_frame(){
+    return m_frames[get_next_frame_idx()];
+}
+const std::vector<easy_pbr::Frame>& DataLoaderMultiFace::get_all_frames_ref(){
+    return m_frames;
 }
 std::vector<easy_pbr::Frame> DataLoaderMultiFace::get_all_frames(){
     return m_frames;
@@ -1061,21 +1266,22 @@ std::vector<easy_pbr::Frame> DataLoaderMultiFace::get_all_frames(){
 //    LOG(FATAL) << "Could not find cam_id " << cam_id << " m_frames has size " << m_frames.size();
 
 // }
-Frame DataLoaderMultiFace::get_frame_at_idx( const int idx){
-    CHECK(idx<(int)m_frames.size()) << "idx is out of bounds. It is " << idx << " while m_frames has size " << m_frames.size();
-
-    Frame  frame= m_frames[idx];
+const Frame& DataLoaderMultiFace::get_frame_ref_at_idx( const int idx){
+    CHECK(idx>=0 && idx<(int)m_frames.size()) << "idx is out of bounds. It is " << idx << " while m_frames has size " << m_frames.size();
 
-    return frame;
+    return m_frames[idx];
+}
+Frame DataLoaderMultiFace::get_frame_at_idx( const int idx){
+    return get_frame_ref_at_idx(idx);
 }
 
-Frame DataLoaderMultiFace::get_random_frame(){
+int DataLoaderMultiFace::get_random_frame_idx(){
     CHECK(m_frames.size()>0 ) << "m_frames has size 0";
 
-    int random_idx=m_rand_gen->rand_int(0, m_frames.size()-1);
-    Frame  frame= m_frames[random_idx];
-
-    return frame;
+    return m_rand_gen->rand_int(0, m_frames.size()-1);
+}
+Frame DataLoaderMultiFace::get_random_frame(){
+    return m_frames[get_random_frame_idx()];
 }
 // Frame DataLoaderMultiFace::get_closest_frame( const easy_pbr::Frame& frame){
 
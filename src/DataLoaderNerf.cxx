@@ -15,6 +15,9 @@ using namespace configuru;
 
 //my stuff
 #include "data_loaders/DataTransformer.h"
+#include "data_loaders/WorkerPool.h"
+#include "data_loaders/CameraNeighbourIndex.h"
+#include "data_loaders/MiscDataFuncs.h"
 #include "easy_pbr/Frame.h"
 #include "Profiler.h"
 #include "string_utils.h"
@@ -63,7 +66,8 @@ DataLoaderNerf::DataLoaderNerf(const std::string config_file):
     // m_is_running(false),
     m_idx_img_to_read(0),
     m_nr_resets(0),
-    m_rand_gen(new RandGenerator)
+    m_rand_gen(new RandGenerator),
+    m_cam_index(new CameraNeighbourIndex)
 {
     init_params(config_file);
 
@@ -105,6 +109,10 @@ void DataLoaderNerf::init_params(const std::string config_file){
     m_dataset_path = (std::string)loader_config["dataset_path"];    //get the path where all the off files are
     m_restrict_to_scene_name= (std::string)loader_config["restrict_to_scene_name"];
 
+    m_nr_decode_threads=loader_config.get_or("nr_decode_threads", 1);
+    m_close_frames_view_dir_weight=loader_config.get_or("close_frames_view_dir_weight", 0.0);
+    m_nr_precomputed_close_frames=loader_config.get_or("nr_precomputed_close_frames", 0);
+
     m_r = 0.0;
     m_g = 0.0;
     m_b = 0.0;
@@ -116,9 +124,15 @@ void DataLoaderNerf::init_params(const std::string config_file){
 }
 
 void DataLoaderNerf::start(){
+    if(m_nr_decode_threads!=1){
+        m_decode_pool=WorkerPool::shared(m_nr_decode_threads);
+    }
+
     init_data_reading();
     init_poses();
     read_data();
+
+    m_cam_index->build(m_frames, m_close_frames_view_dir_weight, m_nr_precomputed_close_frames);
 }
 
 
@@ -224,9 +238,11 @@ void DataLoaderNerf::init_poses(){
 
 void DataLoaderNerf::read_data(){
 
-    for (size_t i = 0; i < m_imgs_paths.size(); i++){
+    //each image is decoded in a job of the worker pool and written at its own idx so the order of the frames is the same as with the serial read
+    std::vector<Frame> frames(m_imgs_paths.size());
+    WorkerPool::parallel_for(m_decode_pool, m_imgs_paths.size(), [&](const int i){
 
-        Frame frame;
+        Frame& frame=frames[i];
 
         fs::path img_path = m_imgs_paths[i];
         // VLOG(1) << "reading " << img_path;
@@ -242,39 +258,17 @@ void DataLoaderNerf::read_data(){
         }
 
         //read rgba and split into rgb and alpha mask
-        cv::Mat rgba_8u = cv::imread(img_path.string(), cv::IMREAD_UNCHANGED);
+        cv::Mat rgba_8u = MiscDataFuncs::read_image(img_path.string(), cv::IMREAD_UNCHANGED, m_subsample_factor, cv::INTER_AREA);
         // convert to uint8
         // rgba_8u.convertTo(rgba_8u, CV_8UC4); 
         // VLOG(1) << "typestring is " << radu::utils::type2string(rgba_8u.type());
 
-        if(m_subsample_factor>1){
-            cv::Mat resized;
-            cv::resize(rgba_8u, resized, cv::Size(), 1.0/m_subsample_factor, 1.0/m_subsample_factor, cv::INTER_AREA);
-            rgba_8u = resized;
-        }
-        
-        // split channels
-        std::vector<cv::Mat> channels(4);
-        cv::split(rgba_8u, channels);
-
-        // composite rgb on top of bg given alpha
-        channels[0] = channels[0].mul(channels[3]/255.0) + m_r * (1.0 - channels[3]/255.0);
-        channels[1] = channels[1].mul(channels[3]/255.0) + m_g * (1.0 - channels[3]/255.0);
-        channels[2] = channels[2].mul(channels[3]/255.0) + m_b * (1.0 - channels[3]/255.0);
-
-        // get alpha channel, binary threshold to use as mask
+        // composite rgb on top of bg given alpha and get the alpha channel binary thresholded to use as mask
+        // the semi transparent pixels are blended by their actual alpha. Before, the weight of the rgb was computed on 8 bit and so rounded to 0 or 1
         if (m_load_mask){
             frame.mask_path = img_path.string();
-            cv::Mat mask;
-            cv::threshold(channels[3], mask, 0.0, 1.0, cv::THRESH_BINARY);
-            mask.convertTo(frame.mask, CV_8UC3, 1.0); // CV_32FC3
         }
-        channels.pop_back();
-
-        cv::merge(channels, frame.rgb_8u);
-
-        // frame.rgb_8u = frame.rgb_8u/255.0;
-        frame.rgb_8u.convertTo(frame.rgb_32f, CV_32FC3, 1.0/255.0);
+        MiscDataFuncs::rgba2rgb_and_mask(rgba_8u, true, Eigen::Vector3f(m_r, m_g, m_b), &frame.rgb_8u, &frame.rgb_32f, m_load_mask? &frame.mask : nullptr);
         // frame.width=frame.rgb_8u.cols;
         // frame.height=frame.rgb_8u.rows;
 
@@ -357,7 +351,7 @@ void DataLoaderNerf::read_data(){
 
         //extrinsics
         // VLOG(1) << "img_path.stem().string()" << img_path.stem().string();
-        frame.tf_cam_world=m_filename2pose[img_path.stem().string()].cast<float>();
+        frame.tf_cam_world=m_filename2pose.at(img_path.stem().string()).cast<float>();
 
         //intrinsics got mostly from here https://github.com/bmild/nerf/blob/0247d6e7ede8d918bc1fab2711f845669aee5e03/load_blender.py
         frame.K.setIdentity();
@@ -376,113 +370,71 @@ void DataLoaderNerf::read_data(){
             frame.tf_cam_world=tf_world_cam_rescaled.inverse();
         }
 
-        m_frames.push_back(frame);
+        VLOG(1) << "loaded frame " << frame.frame_idx;
+    });
 
-        std::cout << "loaded frame " << frame.frame_idx << std::endl;
-        // VLOG(1) << "pushback and frames is " << m_frames.size();
-    }
+    m_frames.insert(m_frames.end(), frames.begin(), frames.end());
 }
 
 
 
-Frame DataLoaderNerf::get_next_frame(){
+int DataLoaderNerf::get_next_frame_idx(){
     CHECK(m_idx_img_to_read<(int)m_frames.size()) << "m_idx_img_to_read is out of bounds. It is " << m_idx_img_to_read << " while m_frames has size " << m_frames.size();
-    Frame  frame= m_frames[m_idx_img_to_read];
+    int idx=m_idx_img_to_read;
 
     if(!m_do_overfit){
         m_idx_img_to_read++;
     }
 
-    return frame;
+    return idx;
+}
+Frame DataLoaderNerf::get_next_frame(){
+    return m_frames[get_next_frame_idx()];
+}
+const std::vector<easy_pbr::Frame>& DataLoaderNerf::get_all_frames_ref(){
+    return m_frames;
 }
 std::vector<easy_pbr::Frame> DataLoaderNerf::get_all_frames(){
     return m_frames;
 }
-Frame DataLoaderNerf::get_frame_at_idx( const int idx){
-    CHECK(idx<(int)m_frames.size()) << "idx is out of bounds. It is " << idx << " while m_frames has size " << m_frames.size();
-
-    Frame  frame= m_frames[idx];
+const Frame& DataLoaderNerf::get_frame_ref_at_idx( const int idx){
+    CHECK(idx>=0 && idx<(int)m_frames.size()) << "idx is out of bounds. It is " << idx << " while m_frames has size " << m_frames.size();
 
-    return frame;
+    return m_frames[idx];
+}
+Frame DataLoaderNerf::get_frame_at_idx( const int idx){
+    return get_frame_ref_at_idx(idx);
 }
 
-Frame DataLoaderNerf::get_random_frame(){
+int DataLoaderNerf::get_random_frame_idx(){
     CHECK(m_frames.size()>0 ) << "m_frames has size 0";
 
-    int random_idx=m_rand_gen->rand_int(0, m_frames.size()-1);
-    Frame  frame= m_frames[random_idx];
-
-    return frame;
+    return m_rand_gen->rand_int(0, m_frames.size()-1);
+}
+Frame DataLoaderNerf::get_random_frame(){
+    return m_frames[get_random_frame_idx()];
 }
 Frame DataLoaderNerf::get_closest_frame( const easy_pbr::Frame& frame){
-
-    float closest_distance=std::numeric_limits<float>::max();
-    int closest_idx=-1;
-    for(size_t i=0; i<m_frames.size(); i++){
-        float dist =  ( m_frames[i].tf_cam_world.inverse().translation() - frame.tf_cam_world.inverse().translation() ).norm();
-        if (dist < closest_distance && dist>1e-7){
-            closest_distance=dist;
-            closest_idx=i;
-        }
-    }
-
-    Frame  frame_closest= m_frames[closest_idx];
-
-    return frame_closest;
-
+    return m_frames[ get_closest_frame_idx(frame) ];
+}
+int DataLoaderNerf::get_closest_frame_idx( const easy_pbr::Frame& frame){
+    return m_cam_index->closest_idx(frame);
 }
 
 
 std::vector<easy_pbr::Frame>  DataLoaderNerf::get_close_frames( const easy_pbr::Frame& frame, const int nr_frames, const bool discard_same_idx){
 
-    CHECK(nr_frames<(int)m_frames.size()) << "Cannot select more close frames than the total nr of frames that we have in the loader. Required select of " << nr_frames << " out of a total of " << m_frames.size() << " available in the loader";
+    std::vector<int> close_idxs=get_close_frames_idxs(frame, nr_frames, discard_same_idx);
 
     std::vector<easy_pbr::Frame> selected_close_frames;
-
-    for(int i=0; i<nr_frames; i++){
-
-        //select a close frame
-        float closest_distance=std::numeric_limits<float>::max();
-        int closest_idx=-1;
-        for(size_t j=0; j<m_frames.size(); j++){
-
-            //ignore if the current frame we are checking is THIS
-            if (discard_same_idx){
-                if( m_frames[j].frame_idx == frame.frame_idx ){
-                    continue;
-                }
-            }
-
-            //ignore the current frame that we are checking if it's any of the ones already selected
-            bool is_already_selected=false;
-            for(size_t k=0; k<selected_close_frames.size(); k++){
-                if( m_frames[j].frame_idx == selected_close_frames[k].frame_idx ){
-                    is_already_selected=true;
-                }
-            }
-            if(is_already_selected){
-                continue;
-            }
-
-            //now get the closest one
-            float dist =  ( m_frames[j].tf_cam_world.inverse().translation() - frame.tf_cam_world.inverse().translation() ).norm();
-            // float dist = 1.0 -  m_frames[j].look_dir().dot(frame.look_dir());
-            if (dist < closest_distance){
-                closest_distance=dist;
-                closest_idx=j;
-            }
-        }
-
-        Frame  frame_closest= m_frames[closest_idx];
-        selected_close_frames.push_back(frame_closest);
-
-
+    for(size_t i=0; i<close_idxs.size(); i++){
+        selected_close_frames.push_back( m_frames[close_idxs[i]] );
     }
 
-
     return selected_close_frames;
-
-
+}
+std::vector<int>  DataLoaderNerf::get_close_frames_idxs( const easy_pbr::Frame& frame, const int nr_frames, const bool discard_same_idx){
+    return m_cam_index->close_idxs(frame, nr_frames, discard_same_idx);
 }
 
 void DataLoaderNerf::set_load_mask(bool load_mask){
@@ -569,6 +521,8 @@ void DataLoaderNerf::reset(){
         unsigned seed = m_nr_resets;
         auto rng_0 = std::default_random_engine(seed);
         std::shuffle(std::begin(m_frames), std::end(m_frames), rng_0);
+        //the index stores the positions of the frames in m_frames so it has to follow the new order
+        m_cam_index->build(m_frames, m_close_frames_view_dir_weight, m_nr_precomputed_close_frames);
     }
 
     m_idx_img_to_read=0;
@@ -3,6 +3,9 @@
 //c++
 #include <algorithm>
 #include <random>
+#include <fstream>
+#include <cstring>
+#include <functional>
 
 //loguru
 #define LOGURU_REPLACE_GLOG 1
@@ -24,6 +27,9 @@ using namespace configuru;
 #include "easy_pbr/Mesh.h"
 #include "easy_pbr/LabelMngr.h"
 #include "data_loaders/DataTransformer.h"
+#include "data_loaders/MappedFile.h"
+#include "data_loaders/AsciiParser.h"
+#include "data_loaders/WorkerPool.h"
 #include "Profiler.h"
 #include "string_utils.h"
 #include "eigen_utils.h"
@@ -32,13 +38,26 @@ using namespace configuru;
 using namespace radu::utils;
 using namespace easy_pbr;
 
-#define BUFFER_SIZE 5 //clouds are stored in a queue until they are acessed, the queue stores a maximum of X items
+//layout of the binary cache of one sample, written in <plant folder>/binary_cache/<sample>.bin
+//  header
+//  nr_points*3 floats with the xyz, row major
+//  nr_points*nr_label_columns int32 with the labels, first all the labels of the first column and then the ones of the second
+namespace{
+    const char CACHE_MAGIC[8]={'P','H','E','N','O','4','D','B'};
+    const uint32_t CACHE_VERSION=1;
+    struct CacheHeader{
+        char magic[8];
+        uint32_t version;
+        uint32_t nr_points;
+        uint32_t nr_label_columns;
+        uint32_t padding;
+    };
+    static_assert(sizeof(CacheHeader)==24, "CacheHeader has to have no padding so that the file layout is the same on all compilers");
+}
 
 DataLoaderPheno4D::DataLoaderPheno4D(const std::string config_file):
     m_is_modified(false),
-    m_is_running(false),
-    m_clouds_buffer(BUFFER_SIZE),
-    m_idx_cloud_to_read(0),
+    m_failed_writing_cache(false),
     m_idx_cloud_to_return(0),
     m_nr_resets(0),
     m_rand_gen(new RandGenerator),
@@ -51,9 +70,7 @@ DataLoaderPheno4D::DataLoaderPheno4D(const std::string config_file):
     // create_transformation_matrices();
     // std::cout << " creating thread" << "\n";
     if(m_autostart){
-        init_data_reading();
-        m_is_running=true;
-        m_loader_thread=std::thread(&DataLoaderPheno4D::read_data, this);  //starts the spin in another thread
+        start();
     }
     // std::cout << " finidhed creating thread" << "\n";
 
@@ -62,11 +79,7 @@ DataLoaderPheno4D::DataLoaderPheno4D(const std::string config_file):
 DataLoaderPheno4D::~DataLoaderPheno4D(){
 
     // std::cout << "finishing" << std::endl;
-    m_is_running=false;
-
-    if (m_loader_thread.joinable()){
-        m_loader_thread.join();
-    }
+    m_clouds_pipeline.stop(); //the readers use the members of the loader so they have to finish before anything gets destroyed
 }
 
 void DataLoaderPheno4D::init_params(const std::string config_file){
@@ -100,6 +113,10 @@ void DataLoaderPheno4D::init_params(const std::string config_file){
     m_shuffle_days=loader_config["shuffle_days"];
     m_do_overfit=loader_config["do_overfit"];
     m_preload=loader_config["preload"];
+    m_nr_reader_threads=loader_config.get_or("nr_reader_threads", 1);
+    m_prefetch_depth=loader_config.get_or("prefetch_depth", 4);
+    m_ordered_delivery=loader_config.get_or("ordered_delivery", true);
+    m_use_binary_cache=loader_config.get_or("use_binary_cache", true);
 
     //sanity check all settings
     CHECK(m_plant_type=="maize" || m_plant_type=="tomato") << "Plant type should be maize or tomato but it is set to " << m_plant_type;
@@ -116,15 +133,21 @@ void DataLoaderPheno4D::init_params(const std::string config_file){
 }
 
 void DataLoaderPheno4D::start(){
-    CHECK(m_is_running==false) << "The loader thread is already running. Please check in the config file that autostart is not already set to true. Or just don't call start()";
+    CHECK(!m_clouds_pipeline.is_running() && m_clouds_vec.empty()) << "The loader thread is already running. Please check in the config file that autostart is not already set to true. Or just don't call start()";
 
     init_data_reading();
 
-    m_is_running=true;
     if (m_preload){
         read_data(); //if we prelaod we don't need to use any threads and it may cause some other issues
     }else{
-        m_loader_thread=std::thread(&DataLoaderPheno4D::read_data, this);  //starts the spin in another thread
+        m_clouds_pipeline.set_nr_readers(m_nr_reader_threads);
+        m_clouds_pipeline.set_prefetch_depth(m_prefetch_depth);
+        m_clouds_pipeline.set_ordered(m_ordered_delivery);
+        int nr_clouds= m_do_overfit? -1 : m_sample_filenames.size(); //when overfitting we keep on reading the first cloud forever
+        m_clouds_pipeline.start(nr_clouds,
+            [this](const int idx){ return parse_sample( m_sample_filenames[ m_do_overfit? 0 : idx ] ); },
+            [this](MeshSharedPtr& cloud){ process_sample(cloud); },
+            "loader_thread_pheno4d");
     }
 }
 
@@ -264,101 +287,50 @@ void DataLoaderPheno4D::init_data_reading(){
 
 void DataLoaderPheno4D::read_data(){
 
-    loguru::set_thread_name("loader_thread_kitti");
-
-
     //if we preload, we just read the meshes and store them in memory, data transformation will be done while reading the mesh
-    if (m_preload){
-        for(size_t i=0; i<m_sample_filenames.size(); i++ ){
-
-            fs::path sample_filename=m_sample_filenames[ m_idx_cloud_to_read ];
-            VLOG(1) << "preloading from " << sample_filename;
-            if(!m_do_overfit){
-                m_idx_cloud_to_read++;
-            }
-            MeshSharedPtr cloud=read_sample(sample_filename);
-            m_clouds_vec.push_back(cloud);
-
-        }
-
-    }else{ //we continously read from disk
-
-        while (m_is_running ) {
-
-            //we finished reading so we wait here for a reset
-            if(m_idx_cloud_to_read>=m_sample_filenames.size()){
-                std::this_thread::sleep_for(std::chrono::milliseconds(300));
-                continue;
-            }
-
-            // std::cout << "size approx is " << m_queue.size_approx() << '\n';
-            // std::cout << "m_idx_img_to_read is " << m_idx_img_to_read << '\n';
-            if(m_clouds_buffer.size_approx()<BUFFER_SIZE-1){ //there is enough space
-                //read the frame and everything else and push it to the queue
-
-                fs::path sample_filename=m_sample_filenames[ m_idx_cloud_to_read ];
-                if(!m_do_overfit){
-                    m_idx_cloud_to_read++;
-                }
-                // VLOG(1) << "reading " << sample_filename;
-
-                MeshSharedPtr cloud=read_sample(sample_filename);
-
-                m_clouds_buffer.enqueue(cloud);;
-
-            }
-
-        }
-
-
+    //the parsing of all the plants and days is done in parallel and afterwards they are processed in order so the random generator is used in the same order as when reading them one by one
+    std::vector<MeshSharedPtr> clouds(m_sample_filenames.size());
+    WorkerPool::parallel_for(WorkerPool::shared(0), clouds.size(), [&](const int i){
+        clouds[i]=parse_sample( m_sample_filenames[ m_do_overfit? 0 : i ] );
+    });
+
+    for(size_t i=0; i<clouds.size(); i++ ){
+        VLOG(1) << "preloading from " << clouds[i]->m_disk_path;
+        process_sample(clouds[i]);
+        m_clouds_vec.push_back(clouds[i]);
     }
 
 }
 
 std::shared_ptr<Mesh> DataLoaderPheno4D::read_sample(const fs::path sample_filename){
+    MeshSharedPtr cloud=parse_sample(sample_filename);
+    process_sample(cloud);
+    return cloud;
+}
 
-    std::vector<Eigen::VectorXd> points_vec;
-    std::vector<int> labels_vec;
-
-    //read the text and each line contains xyz,label
-    std::ifstream f(sample_filename.string());
-    std::string line;
-    while (std::getline(f, line)) {
-        // std::cout << line << std::endl;
-        std::vector<std::string> tokens=split(line, " ");
-        // VLOG(1) << "lne is " << line;
-        // CHECK(tokens.size()==4) << "We expect to have 4 tokens corresponding to xyz,label but we got " << tokens.size() << " and the line is " << line << " from file " << sample_filename;
-        // LOG_IF(ERROR, tokens.size()==4) << "We expect to have 4 tokens corresponding to xyz,label but we got " << tokens.size() << " and the line is " << line << " from file " << sample_filename;
-        int expected_tokens=4;
-        if(m_plant_type=="maize"){
-            expected_tokens=5; //if we load maize it will have 5 tokens corresponding to xyz, label collar, label tip
-        }
-        if((int)tokens.size()!=expected_tokens){
-            continue;
-        }
-
-
-        Eigen::VectorXd point_eigen(3);
-        point_eigen<< std::stof(tokens[0]),  std::stof(tokens[1]),  std::stof(tokens[2]);
-        points_vec.push_back(point_eigen);
-
+std::shared_ptr<Mesh> DataLoaderPheno4D::parse_sample(const fs::path sample_filename){
 
-        int label=std::stoi(tokens[3]);;
-        if(m_segmentation_method=="leaf_tip" && m_plant_type=="maize"){
-            label=std::stoi(tokens[4]);
+    //read xyz and labels, from the binary cache if there is one that is up to date
+    PointsXYZ xyz;
+    Eigen::MatrixXi labels;
+    fs::path cache_filename=binary_cache_path(sample_filename);
+    if(m_use_binary_cache && is_binary_cache_valid(cache_filename, sample_filename)){
+        read_binary_cache(cache_filename, xyz, labels);
+    }else{
+        parse_txt(sample_filename, xyz, labels);
+        if(m_use_binary_cache && !m_failed_writing_cache){
+            if(!write_binary_cache(cache_filename, xyz, labels)){
+                m_failed_writing_cache=true;
+                LOG(WARNING) << "Could not write the binary cache " << cache_filename << ". We will keep on parsing the text files";
+            }
         }
-        // if(label>=2){
-            // label=2;
-        // }
-        labels_vec.push_back(label);
-
     }
 
-
     //copy into EigenMatrix
     MeshSharedPtr cloud=Mesh::create();
-    cloud->V=vec2eigen(points_vec);
-    cloud->L_gt=vec2eigen(labels_vec);
+    cloud->V=xyz.cast<double>();
+    int label_column= (m_segmentation_method=="leaf_tip" && m_plant_type=="maize")? 1 : 0;
+    cloud->L_gt=labels.col(label_column);
 
 
     if(m_normalize){
@@ -378,6 +350,123 @@ std::shared_ptr<Mesh> DataLoaderPheno4D::read_sample(const fs::path sample_filen
     cloud->apply_model_matrix_to_cpu(true);
     cloud->transform_vertices_cpu(move);
 
+    //some sensible visualization options
+    cloud->m_vis.m_show_mesh=false;
+    cloud->m_vis.m_show_points=true;
+    cloud->m_vis.m_color_type=+MeshColorType::SemanticGT;
+
+    //set the labelmngr which will be used by the viewer to put correct colors for the semantics
+    cloud->m_label_mngr=m_label_mngr->shared_from_this();
+
+    cloud->m_disk_path=sample_filename.string();
+
+    cloud->name=sample_filename.stem().string();
+
+    return cloud;
+
+}
+
+void DataLoaderPheno4D::parse_txt(const fs::path& sample_filename, PointsXYZ& xyz, Eigen::MatrixXi& labels){
+    //each line contains xyz,label and maize has one more label column
+    int nr_label_columns= m_plant_type=="maize"? 2 : 1;
+    int expected_tokens=3+nr_label_columns;
+
+    //the file is parsed directly from the mapped pages into matrices preallocated for the nr of lines, so nothing gets allocated for each point
+    MappedFile file(sample_filename.string());
+    AsciiParser parser(file);
+    size_t max_nr_points=parser.count_lines();
+    xyz.resize(max_nr_points, 3);
+    labels.resize(max_nr_points, nr_label_columns);
+
+    int nr_points=0;
+    while(!parser.at_end()){
+        //lines with a different nr of tokens are skipped
+        if(parser.nr_tokens_in_line()!=expected_tokens){
+            parser.next_line();
+            continue;
+        }
+
+        xyz(nr_points,0)=parser.parse_float();
+        xyz(nr_points,1)=parser.parse_float();
+        xyz(nr_points,2)=parser.parse_float();
+        for(int c=0; c<nr_label_columns; c++){
+            //parsing as double and truncating gives the same as stoi also when the label is written like 1.0
+            labels(nr_points,c)=(int)parser.parse_double();
+        }
+        nr_points++;
+        parser.next_line();
+    }
+
+    xyz.conservativeResize(nr_points, 3);
+    labels.conservativeResize(nr_points, nr_label_columns);
+}
+
+fs::path DataLoaderPheno4D::binary_cache_path(const fs::path& sample_filename){
+    //it goes in a folder because init_data_reading counts the days from the files of the plant folder
+    return sample_filename.parent_path()/"binary_cache"/(sample_filename.stem().string()+".bin");
+}
+
+bool DataLoaderPheno4D::is_binary_cache_valid(const fs::path& cache_filename, const fs::path& sample_filename){
+    //a cache that is older than the text file was written from a file that has been changed since, so we ignore it
+    boost::system::error_code ec;
+    std::time_t cache_time=fs::last_write_time(cache_filename, ec);
+    if(ec){
+        return false;
+    }
+    return cache_time>=fs::last_write_time(sample_filename);
+}
+
+void DataLoaderPheno4D::read_binary_cache(const fs::path& cache_filename, PointsXYZ& xyz, Eigen::MatrixXi& labels){
+    MappedFile file(cache_filename.string());
+
+    const CacheHeader* header=file.at<CacheHeader>(0);
+    CHECK( std::memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC))==0 ) << cache_filename << " is not a pheno4d cache file";
+    CHECK(header->version==CACHE_VERSION) << cache_filename << " has version " << header->version << " but we can only read version " << CACHE_VERSION << ". Please delete it so it gets written again";
+    int nr_label_columns= m_plant_type=="maize"? 2 : 1;
+    CHECK((int)header->nr_label_columns==nr_label_columns) << cache_filename << " has " << header->nr_label_columns << " label columns but " << m_plant_type << " should have " << nr_label_columns;
+    int nr_points=header->nr_points;
+
+    size_t xyz_offset=sizeof(CacheHeader);
+    size_t labels_offset=xyz_offset+(size_t)nr_points*3*sizeof(float);
+    xyz=Eigen::Map<const PointsXYZ>(file.at<float>(xyz_offset, (size_t)nr_points*3), nr_points, 3);
+    labels=Eigen::Map< const Eigen::Matrix<int32_t, Eigen::Dynamic, Eigen::Dynamic> >(file.at<int32_t>(labels_offset, (size_t)nr_points*nr_label_columns), nr_points, nr_label_columns).cast<int>();
+}
+
+bool DataLoaderPheno4D::write_binary_cache(const fs::path& cache_filename, const PointsXYZ& xyz, const Eigen::MatrixXi& labels){
+    boost::system::error_code ec;
+    fs::create_directories(cache_filename.parent_path(), ec);
+    if(ec){
+        return false;
+    }
+
+    CacheHeader header;
+    std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version=CACHE_VERSION;
+    header.nr_points=xyz.rows();
+    header.nr_label_columns=labels.cols();
+    header.padding=0;
+    Eigen::Matrix<int32_t, Eigen::Dynamic, Eigen::Dynamic> labels_int32=labels.cast<int32_t>();
+
+    //we write into a temporary file and rename it at the end so that a loader never sees a half written cache. The name of the temporary file is unique for each thread in case several loaders write the same sample
+    fs::path tmp_filename=cache_filename.string()+".tmp"+std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    std::ofstream file(tmp_filename.string(), std::ios::binary);
+    if(!file.is_open()){
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(xyz.data()), (size_t)xyz.rows()*3*sizeof(float));
+    file.write(reinterpret_cast<const char*>(labels_int32.data()), (size_t)labels_int32.size()*sizeof(int32_t));
+    file.close();
+    if(file.fail()){
+        fs::remove(tmp_filename, ec);
+        return false;
+    }
+    fs::rename(tmp_filename, cache_filename, ec);
+    return !ec;
+}
+
+void DataLoaderPheno4D::process_sample(MeshSharedPtr& cloud){
+
     if (m_preload){ //if we preload then we just subsample, and then we move and rotate the cloud, when we retreive it
 
         if(m_transformer->m_random_subsample_percentage!=0.0){
@@ -430,20 +519,6 @@ std::shared_ptr<Mesh> DataLoaderPheno4D::read_sample(const fs::path sample_filen
         // cloud->D = perm * cloud->D; // permute rows
     }
 
-    //some sensible visualization options
-    cloud->m_vis.m_show_mesh=false;
-    cloud->m_vis.m_show_points=true;
-    cloud->m_vis.m_color_type=+MeshColorType::SemanticGT;
-
-    //set the labelmngr which will be used by the viewer to put correct colors for the semantics
-    cloud->m_label_mngr=m_label_mngr->shared_from_this();
-
-    cloud->m_disk_path=sample_filename.string();
-
-    cloud->name=sample_filename.stem().string();
-
-    return cloud;
-
 }
 
 
@@ -451,11 +526,7 @@ bool DataLoaderPheno4D::has_data(){
     if (m_preload){
         return true;
     }else{
-        if(m_clouds_buffer.peek()==nullptr){
-            return false;
-        }else{
-            return true;
-        }
+        return m_clouds_pipeline.has_data();
     }
 }
 
@@ -483,9 +554,7 @@ std::shared_ptr<Mesh> DataLoaderPheno4D::get_cloud(){
 
 
     }else{
-        std::shared_ptr<Mesh> cloud;
-        m_clouds_buffer.try_dequeue(cloud);
-        return cloud;
+        return m_clouds_pipeline.try_get();
     }
 
 }
@@ -519,17 +588,7 @@ bool DataLoaderPheno4D::is_finished(){
 
 
     }else{
-        //check if this loader has loaded everything
-        if(m_idx_cloud_to_read<m_sample_filenames.size()){
-            return false; //there is still more files to read
-        }
-
-        //check that there is nothing in the ring buffers
-        if(m_clouds_buffer.peek()!=nullptr){
-            return false; //there is still something in the buffer
-        }
-
-        return true; //there is nothing more to read and nothing more in the buffer so we are finished
+        return m_clouds_pipeline.is_finished(); //there is nothing more to read and nothing more in the buffer
     }
 
 }
@@ -545,31 +604,27 @@ bool DataLoaderPheno4D::is_finished_reading(){
         }
 
     }else{
-
-        //check if this loader has loaded everything
-        if(m_idx_cloud_to_read<m_sample_filenames.size()){
-            return false; //there is still more files to read
-        }
-
-        return true; //there is nothing more to read and so we are finished reading
-
+        return m_clouds_pipeline.is_finished_reading();
     }
 
 }
 
 void DataLoaderPheno4D::reset(){
-    m_nr_resets++;
-    // we shuffle again the data so as to have freshly shuffled data for the next epoch
-    if(m_shuffle_days){
-        // unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-        // auto rng = std::default_random_engine(seed);
-        unsigned seed = m_nr_resets;
-        auto rng = std::default_random_engine(seed);
-        std::shuffle(std::begin(m_sample_filenames), std::end(m_sample_filenames), rng);
-        std::shuffle(std::begin(m_clouds_vec), std::end(m_clouds_vec), rng);
-    }
+    int nr_clouds= m_do_overfit? -1 : m_sample_filenames.size();
+    //the readers are paused while we shuffle so none of them sees the file list half shuffled
+    m_clouds_pipeline.reset(nr_clouds, [this](){
+        m_nr_resets++;
+        // we shuffle again the data so as to have freshly shuffled data for the next epoch
+        if(m_shuffle_days){
+            // unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
+            // auto rng = std::default_random_engine(seed);
+            unsigned seed = m_nr_resets;
+            auto rng = std::default_random_engine(seed);
+            std::shuffle(std::begin(m_sample_filenames), std::end(m_sample_filenames), rng);
+            std::shuffle(std::begin(m_clouds_vec), std::end(m_clouds_vec), rng);
+        }
+    });
 
-    m_idx_cloud_to_read=0;
     m_idx_cloud_to_return=0;
 }
 
@@ -19,6 +19,7 @@ using namespace configuru;
 
 //my stuff
 #include "data_loaders/DataTransformer.h"
+#include "data_loaders/ImageCache.h"
 #include "easy_pbr/Frame.h"
 #include "Profiler.h"
 #include "string_utils.h"
@@ -104,9 +105,15 @@ void DataLoaderPhenorobCP1::init_params(const std::string config_file){
 
     m_autostart=loader_config["autostart"];
     m_rgb_subsample_factor=loader_config["rgb_subsample_factor"];
+    m_reduced_jpeg_decode=loader_config.get_or("reduced_jpeg_decode", false);
     // m_photoneo_subsample_factor=loader_config["photoneo_subsample_factor"];
     m_shuffle=loader_config["shuffle"];
     m_load_as_shell= loader_config["load_as_shell"];
+    int image_cache_mb=loader_config.get_or("image_cache_mb", 0);
+    if(m_load_as_shell && image_cache_mb>0){
+        m_image_cache=ImageCache::shared();
+        m_image_cache->reserve_budget( (size_t)image_cache_mb*1024*1024 );
+    }
     m_do_overfit=loader_config["do_overfit"];
     m_scene_normalization_file=(std::string)loader_config["scene_normalization_file"];
     m_scene_translation=loader_config["scene_translation"];
@@ -1134,7 +1141,6 @@ void DataLoaderPhenorobCP1::load_images_in_frame(easy_pbr::Frame& frame){
     //read rgba and split into rgb and alpha mask
     cv::Mat rgb_32f;
 
-    cv::Mat rgb_8u = cv::imread( frame.rgb_path );
     //resize the rgb8u mat and then convert to float because its faster
     int subsample_factor=m_rgb_subsample_factor;
     // if ( frame.has_extra_field("is_photoneo") ){
@@ -1142,11 +1148,10 @@ void DataLoaderPhenorobCP1::load_images_in_frame(easy_pbr::Frame& frame){
     // }
     //if it's a processed by colmap frame then it's already subsampled
     // if(subsample_factor>1 && (m_dataset_type==+PHCP1DatasetType::Raw || m_dataset_type==+PHCP1DatasetType::ProcessedKalibr) ){
-    if(subsample_factor>1 && (m_dataset_type==+PHCP1DatasetType::Raw) ){
-        cv::Mat resized;
-        cv::resize(rgb_8u, resized, cv::Size(), 1.0/subsample_factor, 1.0/subsample_factor, cv::INTER_AREA);
-        rgb_8u=resized;
+    if(m_dataset_type!=+PHCP1DatasetType::Raw){
+        subsample_factor=1;
     }
+    cv::Mat rgb_8u = ImageCache::read(m_image_cache, frame.rgb_path, cv::IMREAD_COLOR, subsample_factor, cv::INTER_AREA, m_reduced_jpeg_decode);
     frame.rgb_8u=rgb_8u;
     rgb_8u.convertTo(rgb_32f, CV_32FC3, 1.0/255.0);
     // VLOG(1) << " type is  " << radu::utils::type2string(rgba_32f.type());
@@ -16,6 +16,8 @@ using namespace configuru;
 
 //my stuff
 #include "data_loaders/DataTransformer.h"
+#include "data_loaders/ImageCache.h"
+#include "data_loaders/WorkerPool.h"
 #include "easy_pbr/Frame.h"
 #include "Profiler.h"
 #include "string_utils.h"
@@ -40,10 +42,13 @@ using namespace easy_pbr;
 
 DataLoaderSRN::DataLoaderSRN(const std::string config_file):
     m_is_running(false),
+    m_next_scene_ready(false),
+    m_switch_requested(false),
     m_autostart(false),
     m_idx_scene_to_read(0),
     m_nr_resets(0),
     m_rand_gen(new RandGenerator),
+    m_frames_for_scene(std::make_shared< const std::vector<Frame> >()),
     m_nr_scenes_read_so_far(0)
 {
     init_params(config_file);
@@ -83,6 +88,7 @@ void DataLoaderSRN::init_params(const std::string config_file){
     m_nr_imgs_to_read=loader_config["nr_imgs_to_read"];
     m_shuffle=loader_config["shuffle"];
     m_subsample_factor=loader_config["subsample_factor"];
+    m_reduced_jpeg_decode=loader_config.get_or("reduced_jpeg_decode", false);
     m_do_overfit=loader_config["do_overfit"];
     // m_restrict_to_object= (std::string)loader_config["restrict_to_object"]; //makes it load clouds only from a specific object
     m_dataset_path = (std::string)loader_config["dataset_path"];    //get the path where all the off files are
@@ -91,6 +97,15 @@ void DataLoaderSRN::init_params(const std::string config_file){
     // m_difficulty =(std::string)loader_config["difficulty"];
     // m_load_depth= loader_config["load_depth"];
     m_load_as_shell= loader_config["load_as_shell"];
+    int image_cache_mb=loader_config.get_or("image_cache_mb", 0);
+    if(m_load_as_shell && image_cache_mb>0){
+        m_image_cache=ImageCache::shared();
+        m_image_cache->reserve_budget( (size_t)image_cache_mb*1024*1024 );
+    }
+    m_nr_decode_threads=loader_config.get_or("nr_decode_threads", 1);
+    if(m_nr_decode_threads!=1){
+        m_decode_pool=WorkerPool::shared(m_nr_decode_threads);
+    }
     m_mode= (std::string)loader_config["mode"];
     m_get_spiral_test_else_split_train= loader_config["get_spiral_test_else_split_train"];
 
@@ -194,8 +209,16 @@ void DataLoaderSRN::init_data_reading(){
 }
 
 void DataLoaderSRN::start_reading_next_scene(){
-    CHECK(m_is_running==false) << "The loader thread is already running. Wait until the scene is finished loading before loading a new one. You can check this with finished_reading_scene()";
+    //the current scene keeps being served until the next one is decoded so this never blocks. The switch happens here or in finished_reading_scene() once the next scene is ready
+    std::lock_guard<std::mutex> lock(m_switch_mutex);
+    m_switch_requested=true;
+    if(!m_is_running && !m_next_scene_ready){
+        read_next_scene_in_background();
+    }
+    switch_scene_if_ready();
+}
 
+void DataLoaderSRN::read_next_scene_in_background(){
     std::string scene_path;
     if ( m_idx_scene_to_read< (int)m_scene_folders.size()){
         scene_path=m_scene_folders[m_idx_scene_to_read].string();
@@ -219,12 +242,33 @@ void DataLoaderSRN::start_reading_next_scene(){
     }
 }
 
+void DataLoaderSRN::switch_scene_if_ready(){
+    if(!m_switch_requested || m_is_running){
+        return;
+    }
+    if (m_loader_thread.joinable()){
+        m_loader_thread.join(); //the thread is done with the scene, we only reclaim it
+    }
+    if(m_next_scene_ready){
+        {
+            //the getters may be copying from the current scene on another thread so we only replace it when they are done
+            //the old scene itself is never modified, the snapshots handed out by get_all_frames_ref() keep it alive until they are dropped
+            std::lock_guard<std::mutex> lock(m_scene_mutex);
+            m_frames_for_scene=std::make_shared< const std::vector<Frame> >(std::move(m_frames_next_scene));
+            m_frames_next_scene.clear();
+            m_nr_scenes_read_so_far++; //counted only once the scene is used so that a read ahead dropped by reset() doesn't shift the seeds of the following scenes
+            m_next_scene_ready=false;
+        }
+        //start decoding the scene after this one while this one is being used
+        read_next_scene_in_background();
+    }
+    m_switch_requested=false;
+}
+
 
 void DataLoaderSRN::read_scene(const std::string scene_path){
     // VLOG(1) <<" read from path " << scene_path;
 
-    m_frames_for_scene.clear();
-
     std::vector<fs::path> paths;
     for (fs::directory_iterator itr( fs::path(scene_path)/"rgb"); itr!=fs::directory_iterator(); ++itr){
         fs::path img_path= itr->path();
@@ -232,11 +276,16 @@ void DataLoaderSRN::read_scene(const std::string scene_path){
     }
 
     //shuffle the images from this scene
-    unsigned seed1 = m_nr_scenes_read_so_far;
+    unsigned seed1;
+    {
+        std::lock_guard<std::mutex> lock(m_scene_mutex);
+        seed1 = m_nr_scenes_read_so_far;
+    }
     auto rng_1 = std::default_random_engine(seed1);
     std::shuffle(std::begin(paths), std::end(paths), rng_1);
 
-    //load all the scene for the chosen object
+    //pick the images first so that the filtering and the early stop select the same ones as when reading them one after another
+    std::vector<fs::path> img_paths;
     // for (fs::directory_iterator itr(scene_path); itr!=fs::directory_iterator(); ++itr){
     for (size_t i=0; i<paths.size(); i++){
         // fs::path img_path= itr->path();
@@ -245,129 +294,123 @@ void DataLoaderSRN::read_scene(const std::string scene_path){
         // VLOG(1) << "img_path" <<img_path;
         if(img_path.filename().string().find("png")!= std::string::npos){
             // VLOG(1) << "png img path " << img_path;
-
-            int img_idx=std::stoi( img_path.stem().string() );
-            // VLOG(1) << "img idx is " << img_idx;
-
-            Frame frame;
-            frame.frame_idx=img_idx;
-
-            //sets the paths and all the things necessary for the loading of images
-            frame.rgb_path=img_path.string();
-            frame.subsample_factor=m_subsample_factor;
-
-
-            //load the images if necessary or delay it for whne it's needed
-            frame.load_images=[this]( easy_pbr::Frame& frame ) -> void{ this->load_images_in_frame(frame); };
-            if (m_load_as_shell){
-                //set the function to load the images whenever it's neede
-                frame.is_shell=true;
-            }else{
-                frame.is_shell=false;
-                frame.load_images(frame);
+            img_paths.push_back(img_path);
+            if(m_nr_imgs_to_read>0 && (int)img_paths.size()>=m_nr_imgs_to_read){
+                break; //we have as many images as we need
             }
+        }
+    }
 
+    //the frames are built and their images decoded in parallel, each into its own slot so they keep the order of the paths
+    std::vector<Frame> frames(img_paths.size());
+    WorkerPool::parallel_for(m_decode_pool, img_paths.size(), [&](const int i){
+        fs::path img_path= img_paths[i];
+        int img_idx=std::stoi( img_path.stem().string() );
 
+        Frame frame;
+        frame.frame_idx=img_idx;
 
+        //sets the paths and all the things necessary for the loading of images
+        frame.rgb_path=img_path.string();
+        frame.subsample_factor=m_subsample_factor;
 
 
+        //load the images if necessary or delay it for whne it's needed
+        frame.load_images=[this]( easy_pbr::Frame& frame ) -> void{ this->load_images_in_frame(frame); };
+        if (m_load_as_shell){
+            //set the function to load the images whenever it's neede
+            frame.is_shell=true;
+        }else{
+            frame.is_shell=false;
+            frame.load_images(frame);
+        }
 
 
-            //read pose and camera params
-
-            //intrisncis are directly from the intrisnics.txt file
-
-
-            frame.K.setIdentity();
-            frame.K(0,0) =  131.250000;
-            frame.K(1,1) =  131.250000;
-            frame.K(0,2) =  64;
-            frame.K(1,2) =  64;
-            // frame.K/=m_subsample_factor;
-            // frame.K(2,2)=1.0; //dividing by 2,4,8 etc depending on the subsample shouldn't affect the coordinate in the last row and last column which is always 1.0
-            frame.rescale_K(1.0/m_subsample_factor);
-
-
-
-            //the extrinsics are stored in poses folder
-            fs::path pose_file_path= fs::path(scene_path)/"pose"/(img_path.stem().string()+".txt");
-            std::string pose_string= radu::utils::file_to_string(pose_file_path.string());
-            //the pose is stored directly as a 4x4 matrix in a rowmajor way so we just load it directly
-            std::vector<std::string> tokens=radu::utils::split(pose_string, " ");
-            CHECK(tokens.size()==16) << "We expect to have 16 tokens because we want a 4x4 matrix. However we got tokens " << tokens.size();
-            Eigen::Affine3f tf_world_cam;
-            //row1
-            tf_world_cam.matrix()(0,0)= std::stof(tokens[0]);
-            tf_world_cam.matrix()(0,1)= std::stof(tokens[1]);
-            tf_world_cam.matrix()(0,2)= std::stof(tokens[2]);
-            tf_world_cam.matrix()(0,3)= std::stof(tokens[3]);
-            //row2
-            tf_world_cam.matrix()(1,0)= std::stof(tokens[4]);
-            tf_world_cam.matrix()(1,1)= std::stof(tokens[5]);
-            tf_world_cam.matrix()(1,2)= std::stof(tokens[6]);
-            tf_world_cam.matrix()(1,3)= std::stof(tokens[7]);
-            //row3
-            tf_world_cam.matrix()(2,0)= std::stof(tokens[8]);
-            tf_world_cam.matrix()(2,1)= std::stof(tokens[9]);
-            tf_world_cam.matrix()(2,2)= std::stof(tokens[10]);
-            tf_world_cam.matrix()(2,3)= std::stof(tokens[11]);
-            //row4
-            tf_world_cam.matrix()(3,0)= std::stof(tokens[12]);
-            tf_world_cam.matrix()(3,1)= std::stof(tokens[13]);
-            tf_world_cam.matrix()(3,2)= std::stof(tokens[14]);
-            tf_world_cam.matrix()(3,3)= std::stof(tokens[15]);
-
-            //the pose is weird so we multiply with a coord transformatiuon as seen here: https://github.com/sxyu/pixel-nerf/blob/master/src/data/SRNDataset.py
-            Eigen::DiagonalMatrix<float, 4> diag;
-            diag.diagonal() <<1, -1, 1, 1;
-            tf_world_cam.matrix()=tf_world_cam.matrix()*diag;
-
-            //rotate 90 degrees
-
-            Eigen::Quaternionf q = Eigen::Quaternionf( Eigen::AngleAxis<float>( -90 * M_PI / 180.0 ,  Eigen::Vector3f::UnitX() ) );
-            Eigen::Affine3f tf_rot;
-            tf_rot.setIdentity();
-            tf_rot.linear()=q.toRotationMatrix();
-            tf_world_cam=tf_rot*tf_world_cam;
-
-
-            frame.tf_cam_world=tf_world_cam.inverse();
-
-
-            //rescale things if necessary
-            if(m_scene_scale_multiplier>0.0){
-                Eigen::Affine3f tf_world_cam_rescaled = frame.tf_cam_world.inverse();
-                tf_world_cam_rescaled.translation()*=m_scene_scale_multiplier;
-                frame.tf_cam_world=tf_world_cam_rescaled.inverse();
-            }
-
-
-
-
-
-
-
-
-
-            m_frames_for_scene.push_back(frame);
-
-            if(m_nr_imgs_to_read>0 && (int)m_frames_for_scene.size()>=m_nr_imgs_to_read){
-                break; //we finished reading how many images we need so we stop the thread
-            }
 
+        //read pose and camera params
+
+        //intrisncis are directly from the intrisnics.txt file
+
+
+        frame.K.setIdentity();
+        frame.K(0,0) =  131.250000;
+        frame.K(1,1) =  131.250000;
+        frame.K(0,2) =  64;
+        frame.K(1,2) =  64;
+        // frame.K/=m_subsample_factor;
+        // frame.K(2,2)=1.0; //dividing by 2,4,8 etc depending on the subsample shouldn't affect the coordinate in the last row and last column which is always 1.0
+        frame.rescale_K(1.0/m_subsample_factor);
+
+
+
+        //the extrinsics are stored in poses folder
+        fs::path pose_file_path= fs::path(scene_path)/"pose"/(img_path.stem().string()+".txt");
+        std::string pose_string= radu::utils::file_to_string(pose_file_path.string());
+        //the pose is stored directly as a 4x4 matrix in a rowmajor way so we just load it directly
+        std::vector<std::string> tokens=radu::utils::split(pose_string, " ");
+        CHECK(tokens.size()==16) << "We expect to have 16 tokens because we want a 4x4 matrix. However we got tokens " << tokens.size();
+        Eigen::Affine3f tf_world_cam;
+        //row1
+        tf_world_cam.matrix()(0,0)= std::stof(tokens[0]);
+        tf_world_cam.matrix()(0,1)= std::stof(tokens[1]);
+        tf_world_cam.matrix()(0,2)= std::stof(tokens[2]);
+        tf_world_cam.matrix()(0,3)= std::stof(tokens[3]);
+        //row2
+        tf_world_cam.matrix()(1,0)= std::stof(tokens[4]);
+        tf_world_cam.matrix()(1,1)= std::stof(tokens[5]);
+        tf_world_cam.matrix()(1,2)= std::stof(tokens[6]);
+        tf_world_cam.matrix()(1,3)= std::stof(tokens[7]);
+        //row3
+        tf_world_cam.matrix()(2,0)= std::stof(tokens[8]);
+        tf_world_cam.matrix()(2,1)= std::stof(tokens[9]);
+        tf_world_cam.matrix()(2,2)= std::stof(tokens[10]);
+        tf_world_cam.matrix()(2,3)= std::stof(tokens[11]);
+        //row4
+        tf_world_cam.matrix()(3,0)= std::stof(tokens[12]);
+        tf_world_cam.matrix()(3,1)= std::stof(tokens[13]);
+        tf_world_cam.matrix()(3,2)= std::stof(tokens[14]);
+        tf_world_cam.matrix()(3,3)= std::stof(tokens[15]);
+
+        //the pose is weird so we multiply with a coord transformatiuon as seen here: https://github.com/sxyu/pixel-nerf/blob/master/src/data/SRNDataset.py
+        Eigen::DiagonalMatrix<float, 4> diag;
+        diag.diagonal() <<1, -1, 1, 1;
+        tf_world_cam.matrix()=tf_world_cam.matrix()*diag;
+
+        //rotate 90 degrees
+
+        Eigen::Quaternionf q = Eigen::Quaternionf( Eigen::AngleAxis<float>( -90 * M_PI / 180.0 ,  Eigen::Vector3f::UnitX() ) );
+        Eigen::Affine3f tf_rot;
+        tf_rot.setIdentity();
+        tf_rot.linear()=q.toRotationMatrix();
+        tf_world_cam=tf_rot*tf_world_cam;
+
+
+        frame.tf_cam_world=tf_world_cam.inverse();
+
+
+        //rescale things if necessary
+        if(m_scene_scale_multiplier>0.0){
+            Eigen::Affine3f tf_world_cam_rescaled = frame.tf_cam_world.inverse();
+            tf_world_cam_rescaled.translation()*=m_scene_scale_multiplier;
+            frame.tf_cam_world=tf_world_cam_rescaled.inverse();
         }
-    }
 
-    // VLOG(1) << "loaded a scene with nr of frames " << m_frames_for_scene.size();
-    CHECK(m_frames_for_scene.size()!=0) << "Clouldn't load any images for this scene in path " << scene_path;
-
-    m_nr_scenes_read_so_far++;
+        frames[i]=frame;
+    });
+    // VLOG(1) << "loaded a scene with nr of frames " << frames.size();
+    CHECK(frames.size()!=0) << "Clouldn't load any images for this scene in path " << scene_path;
 
     //shuffle the images from this scene
-    unsigned seed = m_nr_scenes_read_so_far;
+    unsigned seed = seed1+1;
     auto rng_0 = std::default_random_engine(seed);
-    std::shuffle(std::begin(m_frames_for_scene), std::end(m_frames_for_scene), rng_0);
+    std::shuffle(std::begin(frames), std::end(frames), rng_0);
+
+    {
+        std::lock_guard<std::mutex> lock(m_scene_mutex);
+        m_frames_next_scene=std::move(frames);
+    }
 
+    m_next_scene_ready=true;
     m_is_running=false;
 }
 
@@ -377,12 +420,7 @@ void DataLoaderSRN::load_images_in_frame(easy_pbr::Frame& frame){
 
 
     // VLOG(1) << "load image from" << frame.rgb_path ;
-    cv::Mat rgb_8u=cv::imread(frame.rgb_path );
-    if(frame.subsample_factor>1){
-        cv::Mat resized;
-        cv::resize(rgb_8u, resized, cv::Size(), 1.0/frame.subsample_factor, 1.0/frame.subsample_factor, cv::INTER_AREA);
-        rgb_8u=resized;
-    }
+    cv::Mat rgb_8u=ImageCache::read(m_image_cache, frame.rgb_path, cv::IMREAD_COLOR, frame.subsample_factor, cv::INTER_AREA, m_reduced_jpeg_decode);
     frame.rgb_8u=rgb_8u;
 
     // VLOG(1) << "img type is " << radu::utils::type2string( frame.rgb_8u.type() );
@@ -398,34 +436,50 @@ void DataLoaderSRN::load_images_in_frame(easy_pbr::Frame& frame){
 
 
 bool DataLoaderSRN::finished_reading_scene(){
-    return !m_is_running;
+    std::lock_guard<std::mutex> lock(m_switch_mutex);
+    switch_scene_if_ready();
+    return !m_switch_requested;
 }
 bool DataLoaderSRN::has_data(){
     return finished_reading_scene();
 }
 
+int DataLoaderSRN::get_random_frame_idx(){
+    std::lock_guard<std::mutex> lock(m_scene_mutex);
+    CHECK(m_frames_for_scene->size()>0 ) << "m_frames_for_scene has size 0";
+
+    return m_rand_gen->rand_int(0, m_frames_for_scene->size()-1);
+}
 Frame DataLoaderSRN::get_random_frame(){
-    int random_idx=m_rand_gen->rand_int(0, m_frames_for_scene.size()-1);
-    // int random_idx=0;
-    return m_frames_for_scene[random_idx];
+    std::lock_guard<std::mutex> lock(m_scene_mutex);
+    CHECK(m_frames_for_scene->size()>0 ) << "m_frames_for_scene has size 0";
+
+    return (*m_frames_for_scene)[m_rand_gen->rand_int(0, m_frames_for_scene->size()-1)];
 }
 
 Frame DataLoaderSRN::get_frame_at_idx( const int idx){
-    CHECK(idx<(int)m_frames_for_scene.size()) << "idx is out of bounds. It is " << idx << " while m_frames has size " << m_frames_for_scene.size();
-
-    Frame  frame= m_frames_for_scene[idx];
+    std::lock_guard<std::mutex> lock(m_scene_mutex);
+    CHECK(idx>=0 && idx<(int)m_frames_for_scene->size()) << "idx is out of bounds. It is " << idx << " while m_frames_for_scene has size " << m_frames_for_scene->size();
 
-    return frame;
+    return (*m_frames_for_scene)[idx];
+}
+std::shared_ptr< const std::vector<easy_pbr::Frame> > DataLoaderSRN::get_all_frames_ref(){
+    std::lock_guard<std::mutex> lock(m_scene_mutex);
+    return m_frames_for_scene;
 }
 
 
 
 
 bool DataLoaderSRN::is_finished(){
+    std::lock_guard<std::mutex> lock(m_switch_mutex);
     //check if this loader has loaded everything
     if(m_idx_scene_to_read<(int)m_scene_folders.size()){
         return false; //there is still more files to read
     }
+    if(m_is_running || m_next_scene_ready){
+        return false; //the last scene was read ahead but we didn't switch to it yet
+    }
 
 
     return true; //there is nothing more to read and nothing more in the buffer so we are finished
@@ -434,6 +488,7 @@ bool DataLoaderSRN::is_finished(){
 
 
 void DataLoaderSRN::reset(){
+    std::lock_guard<std::mutex> lock(m_switch_mutex);
 
     m_nr_resets++;
 
@@ -444,11 +499,22 @@ void DataLoaderSRN::reset(){
         std::shuffle(std::begin(m_scene_folders), std::end(m_scene_folders), rng_0);
     }
 
+    //a scene that was read ahead in the previous order is dropped so that the next epoch starts from its first scene. If the user is already waiting for it we let it finish
+    if(!m_switch_requested){
+        if (m_loader_thread.joinable()){
+            m_loader_thread.join();
+        }
+        std::lock_guard<std::mutex> lock_scene(m_scene_mutex);
+        m_frames_next_scene.clear();
+        m_next_scene_ready=false;
+    }
+
     m_idx_scene_to_read=0;
 }
 
 int DataLoaderSRN::nr_samples(){
-    return m_frames_for_scene.size();
+    std::lock_guard<std::mutex> lock(m_scene_mutex);
+    return m_frames_for_scene->size();
 }
 
 void DataLoaderSRN::set_mode_train(){
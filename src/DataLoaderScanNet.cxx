@@ -3,6 +3,9 @@
 //c++
 #include <algorithm>
 #include <random>
+#include <fstream>
+#include <cstring>
+#include <thread>
 
 //loguru
 #define LOGURU_REPLACE_GLOG 1
@@ -28,30 +31,70 @@ using namespace configuru;
 #include "eigen_utils.h"
 #include "RandGenerator.h"
 #include "easy_pbr/LabelMngr.h"
+#include "data_loaders/MappedFile.h"
 
 using namespace radu::utils;
 using namespace easy_pbr;
 
-#define BUFFER_SIZE 5 //clouds are stored in a queue until they are acessed, the queue stores a maximum of X items
+//layout of the preprocessed cache of one scene, written next to its ply as <scene>_vh_clean_2.preprocessed.bin
+//it contains the cloud as it comes out of read_sample, so aligned and with the labels already compacted, but before any augmentation
+//  header, with the nr of rows of every field
+//  V, NV and C as column major doubles of rows x 3
+//  D and I as doubles of rows x 1
+//  F as column major int32 of rows x 3
+//  L_gt as int32 of rows x 1
+//a field that the cloud doesn't have is stored with 0 rows, so the fields don't need to have the same nr of rows
+namespace{
+    const char CACHE_MAGIC[8]={'S','C','A','N','N','E','T','P'};
+    const uint32_t CACHE_VERSION=2;
+    enum CacheField{ CACHE_V=0, CACHE_NV, CACHE_C, CACHE_D, CACHE_I, CACHE_F, CACHE_L_GT, CACHE_NR_FIELDS };
+    const int CACHE_FIELD_COLS[CACHE_NR_FIELDS]={3, 3, 3, 1, 1, 3, 1};
+    const size_t CACHE_FIELD_ELEM_SIZE[CACHE_NR_FIELDS]={sizeof(double), sizeof(double), sizeof(double), sizeof(double), sizeof(double), sizeof(int32_t), sizeof(int32_t)};
+    struct CacheHeader{
+        char magic[8];
+        uint32_t version;
+        uint32_t has_labels;
+        uint64_t nr_rows[CACHE_NR_FIELDS];
+        uint64_t config_hash; //hash of everything besides the source files that changes the preprocessed cloud
+    };
+    static_assert(sizeof(CacheHeader)==80, "CacheHeader has to have no padding so that the file layout is the same on all compilers");
+
+    //fills the byte offset of each field and returns the size that the whole file should have
+    size_t cache_field_offsets(const CacheHeader& header, size_t* offsets){
+        size_t offset=sizeof(CacheHeader);
+        for(int i=0; i<CACHE_NR_FIELDS; i++){
+            offsets[i]=offset;
+            offset+=header.nr_rows[i]*CACHE_FIELD_COLS[i]*CACHE_FIELD_ELEM_SIZE[i];
+        }
+        return offset;
+    }
+
+    //fnv-1a, we can't use std::hash because the cache has to stay valid between different builds
+    uint64_t hash_string(const std::string& str){
+        uint64_t hash=14695981039346656037ull;
+        for(const char c : str){
+            hash^=(unsigned char)c;
+            hash*=1099511628211ull;
+        }
+        return hash;
+    }
+}
 
 DataLoaderScanNet::DataLoaderScanNet(const std::string config_file):
     m_is_modified(false),
-    m_is_running(false),
-    m_clouds_buffer(BUFFER_SIZE),
-    m_idx_cloud_to_read(0),
     m_nr_resets(0),
     m_rand_gen(new RandGenerator),
+    m_failed_writing_cache(false),
     m_min_label_written(999999),
     m_max_label_written(-999999)
 {
 
+    create_transformation_matrices(); //before the params because the preprocessed cache depends on them
     init_params(config_file);
     // read_pose_file();
-    create_transformation_matrices();
     // std::cout << " creating thread" << "\n";
     if(m_autostart){
-        m_is_running=true;
-        m_loader_thread=std::thread(&DataLoaderScanNet::read_data, this);  //starts the spin in another thread
+        start();
     }
     // std::cout << " finidhed creating thread" << "\n";
 
@@ -60,11 +103,7 @@ DataLoaderScanNet::DataLoaderScanNet(const std::string config_file):
 DataLoaderScanNet::~DataLoaderScanNet(){
 
     // std::cout << "finishing" << std::endl;
-    m_is_running=false;
-
-    if (m_loader_thread.joinable()){
-        m_loader_thread.join();
-    }
+    m_clouds_pipeline.stop(); //the readers use the members of the loader so they have to finish before anything gets destroyed
 }
 
 void DataLoaderScanNet::init_params(const std::string config_file){
@@ -91,13 +130,22 @@ void DataLoaderScanNet::init_params(const std::string config_file){
     m_shuffle_points=loader_config["shuffle_points"];
     m_shuffle=loader_config["shuffle"];
     m_do_overfit=loader_config["do_overfit"];
+    m_nr_reader_threads=loader_config.get_or("nr_reader_threads", 1);
+    m_prefetch_depth=loader_config.get_or("prefetch_depth", 4);
+    m_ordered_delivery=loader_config.get_or("ordered_delivery", true);
     // m_do_adaptive_subsampling=loader_config["do_adaptive_subsampling"];
     m_dataset_path=(std::string)loader_config["dataset_path"];
+    m_use_preprocessed_cache=loader_config.get_or("use_preprocessed_cache", false);
 
     //label file and colormap
     Config mngr_config=loader_config["label_mngr"];
     m_label_mngr=std::make_shared<LabelMngr>(mngr_config);
-    m_label_mngr->compact("UNUSED");
+    std::string unused_label="UNUSED";
+    m_label_mngr->compact(unused_label);
+    //the preprocessed clouds depend on the label mngr, the label that gets compacted away and the transform into the gl frame, so a cache written with any of them different is not valid anymore
+    m_labels_file=(std::string)mngr_config["labels_file"];
+    std::string tf_bytes( reinterpret_cast<const char*>(m_tf_worldGL_worldROS.matrix().data()), 16*sizeof(double) );
+    m_preprocessed_config_hash=hash_string( configuru::dump_string(mngr_config, configuru::JSON) + "|" + unused_label + "|" + tf_bytes );
 
     //data transformer
     Config transformer_config=loader_config["transformer"];
@@ -107,9 +155,18 @@ void DataLoaderScanNet::init_params(const std::string config_file){
 }
 
 void DataLoaderScanNet::start(){
-    CHECK(m_is_running==false) << "The loader thread is already running. Please check in the config file that autostart is not already set to true. Or just don't call start()";
-    m_is_running=true;
-    m_loader_thread=std::thread(&DataLoaderScanNet::read_data, this);  //starts the spin in another thread
+    CHECK(!m_clouds_pipeline.is_running()) << "The loader thread is already running. Please check in the config file that autostart is not already set to true. Or just don't call start()";
+
+    init_data_reading();
+
+    m_clouds_pipeline.set_nr_readers(m_nr_reader_threads);
+    m_clouds_pipeline.set_prefetch_depth(m_prefetch_depth);
+    m_clouds_pipeline.set_ordered(m_ordered_delivery);
+    int nr_clouds= m_do_overfit? -1 : m_ply_filenames.size(); //when overfitting we keep on reading the first cloud forever
+    m_clouds_pipeline.start(nr_clouds,
+        [this](const int idx){ return read_sample(idx); },
+        [this](MeshSharedPtr& cloud){ process_sample(cloud); },
+        "loader_thread_scannet");
 }
 
 void DataLoaderScanNet::init_data_reading(){
@@ -181,71 +238,69 @@ void DataLoaderScanNet::init_data_reading(){
 
 }
 
-void DataLoaderScanNet::read_data(){
+std::shared_ptr<Mesh> DataLoaderScanNet::read_sample(const int idx){
 
-    loguru::set_thread_name("loader_thread_scannet");
+    fs::path ply_filename=m_ply_filenames[ m_do_overfit? 0 : idx ];
+    // VLOG(1) << "reading " << ply_filename;
 
-    init_data_reading();
+    //the preprocessing is the same every epoch so after the first time we only need to map the result
+    MeshSharedPtr cloud;
+    bool with_labels= m_mode!="test";
+    fs::path cache_filename=preprocessed_cache_path(ply_filename);
+    if(m_use_preprocessed_cache && is_preprocessed_cache_valid(cache_filename, ply_filename, with_labels)){
+        cloud=read_preprocessed_cache(cache_filename);
+    }else{
+        cloud=preprocess_sample(ply_filename, with_labels);
+        if(m_use_preprocessed_cache && !m_failed_writing_cache){
+            if(!write_preprocessed_cache(cache_filename, cloud, with_labels)){
+                m_failed_writing_cache=true;
+                LOG(WARNING) << "Could not write the preprocessed cache " << cache_filename << ". We will keep on preprocessing the ply files";
+            }
+        }
+    }
 
-    while (m_is_running ) {
+    //put the name of the scene (eg: scene0707_00) as the name of the mesh. This will help with writing the predictions afterwards
+    cloud->name=fs::absolute(ply_filename).parent_path().filename().string();
+    cloud->m_disk_path=ply_filename.string();
 
-        //we finished reading so we wait here for a reset
-        if(m_idx_cloud_to_read>=m_ply_filenames.size()){
-            std::this_thread::sleep_for(std::chrono::milliseconds(300));
-            continue;
-        }
+    return cloud;
+}
 
-        // std::cout << "size approx is " << m_queue.size_approx() << '\n';
-        // std::cout << "m_idx_img_to_read is " << m_idx_img_to_read << '\n';
-        if(m_clouds_buffer.size_approx()<BUFFER_SIZE-1){ //there is enough space
-            //read the frame and everything else and push it to the queue
-            // LOG(WARNING) << "At the moment this loader doesnt care about train and test and just reads all clouds in the dataset. NEeds ot be fixed";
+std::shared_ptr<Mesh> DataLoaderScanNet::preprocess_sample(const fs::path& ply_filename, const bool with_labels){
 
-            fs::path ply_filename=m_ply_filenames[ m_idx_cloud_to_read ];
-            if(!m_do_overfit){
-                m_idx_cloud_to_read++;
-            }
-            // VLOG(1) << "reading " << ply_filename;
-            // VLOG(1) << "nr of classes is " << m_label_mngr->nr_classes();
+    // VLOG(1) << "nr of classes is " << m_label_mngr->nr_classes();
 
+    MeshSharedPtr cloud=Mesh::create();
 
-            MeshSharedPtr cloud=Mesh::create();
+    //read xyz positions
+    cloud->load_from_file(ply_filename.string());
+    // cloud->C.array()/=255.0;
+    cloud->D=cloud->V.rowwise().norm();
+    cloud->recalculate_normals();
+    cloud->I = 0.3*cloud->C.col(0) + 0.59*cloud->C.col(1) + 0.11*cloud->C.col(2);
 
-            //put the name of the scene (eg: scene0707_00) as the name of the mesh. This will help with writing the predictions afterwards
-            cloud->name=fs::absolute(ply_filename).parent_path().filename().string();
+    if(with_labels){
+        // read labels
+        fs::path labels_file=fs::absolute(ply_filename).parent_path()/ (ply_filename.stem().string()+".labels.ply");
+        // VLOG(1)<< "Reading labels from " << labels_file;
+        cloud->L_gt=read_labels(labels_file.string());
 
-            //read xyz positions
-            cloud->load_from_file(ply_filename.string());
-            // cloud->C.array()/=255.0;
-            cloud->D=cloud->V.rowwise().norm();
-            cloud->recalculate_normals();
-            cloud->I.resize(cloud->V.rows(),1);
-            for(int i=0; i<cloud->V.rows(); i++){
-                cloud->I(i) = 0.3*cloud->C(i,0) + 0.59*cloud->C(i,1) + 0.11*cloud->C(i,2);
-            }
+        //the labels indices have to be reindexed because the label_manager compacted the labels so that their indices are conscutive
+        m_label_mngr->reindex_into_compacted_labels(cloud->L_gt);
 
-            if(m_mode!="test"){
-                // read labels
-                fs::path labels_file=fs::absolute(ply_filename).parent_path()/ (ply_filename.stem().string()+".labels.ply");
-                // VLOG(1)<< "Reading labels from " << labels_file;
-                cloud->L_gt=read_labels(labels_file.string());
-
-                //the labels indices have to be reindexed because the label_manager compacted the labels so that their indices are conscutive
-                m_label_mngr->reindex_into_compacted_labels(cloud->L_gt);
-
-                // CHECK(cloud.L_gt.maxCoeff()<m_label_mngr->nr_classes()) << "We have read a cloud which have a label idx higher than the nr of classes. The max label is " << cloud.L_gt.maxCoeff() << " and the nr of classes is m_label_mngr->nr_classes()";
-                //some clouds are messed up and have a label idx higher that the nr of classes. Set those vertices to unlabeled
-                if(cloud->L_gt.maxCoeff()>=m_label_mngr->nr_classes()){
-                    int nr_wrong_labels=0;
-                    for(int i=0; i<cloud->L_gt.rows(); i++){
-                        if(cloud->L_gt(i)>=m_label_mngr->nr_classes()){
-                            cloud->L_gt(i)=m_label_mngr->get_idx_unlabeled();
-                            nr_wrong_labels++;
-                        }
-                    }
-                    LOG(ERROR) << "Found a cloud with higher label idx than nr_classes. We have set " << nr_wrong_labels << " vertices to unlabeled";
+        // CHECK(cloud.L_gt.maxCoeff()<m_label_mngr->nr_classes()) << "We have read a cloud which have a label idx higher than the nr of classes. The max label is " << cloud.L_gt.maxCoeff() << " and the nr of classes is m_label_mngr->nr_classes()";
+        //some clouds are messed up and have a label idx higher that the nr of classes. Set those vertices to unlabeled
+        if(cloud->L_gt.maxCoeff()>=m_label_mngr->nr_classes()){
+            int nr_wrong_labels=0;
+            for(int i=0; i<cloud->L_gt.rows(); i++){
+                if(cloud->L_gt(i)>=m_label_mngr->nr_classes()){
+                    cloud->L_gt(i)=m_label_mngr->get_idx_unlabeled();
+                    nr_wrong_labels++;
                 }
             }
+            LOG(ERROR) << "Found a cloud with higher label idx than nr_classes. We have set " << nr_wrong_labels << " vertices to unlabeled";
+        }
+    }
 
 
 
@@ -255,69 +310,168 @@ void DataLoaderScanNet::read_data(){
 
 
 
-            fs::path alignment_file=fs::absolute(ply_filename).parent_path()/ (fs::absolute(ply_filename).parent_path().filename().string()+".txt");
-            // VLOG(1) << "reading alignment file from " << alignment_file;
-            Eigen::Affine3d alignment;
-            alignment=read_alignment_matrix(alignment_file.string());
-
-            //the scannet dataset is gigantic and sometimes we can't process all points, we establish a maximum amount of points we can process and drop the rest
-            int nr_points=cloud->V.rows();
-            if (nr_points>m_max_nr_points_per_cloud && m_max_nr_points_per_cloud>0){
-                LOG(WARNING)<< "Overstepping theshold of max nr of points of " << m_max_nr_points_per_cloud << " because we have nr of points " << nr_points << ". Dropping points until we only are left with the maximum we can process." ;
-                //percentage of points we have to drop
-                float percentage_to_drop=1.0-(float)m_max_nr_points_per_cloud/(float)nr_points;
-                float prob_of_death=percentage_to_drop;
-                std::vector<bool> is_vertex_to_be_removed(cloud->V.rows(), false);
-                for(int i = 0; i < cloud->V.rows(); i++){
-                    float random= m_rand_gen->rand_float(0.0, 1.0);
-                    if(random<prob_of_death){
-                        is_vertex_to_be_removed[i]=true;
-                    }
-                }
-                cloud->remove_marked_vertices(is_vertex_to_be_removed, false);
-            }
+    fs::path alignment_file=fs::absolute(ply_filename).parent_path()/ (fs::absolute(ply_filename).parent_path().filename().string()+".txt");
+    // VLOG(1) << "reading alignment file from " << alignment_file;
+    Eigen::Affine3d alignment;
+    alignment=read_alignment_matrix(alignment_file.string());
 
+    cloud->transform_vertices_cpu(alignment);
+    cloud->transform_vertices_cpu(m_tf_worldGL_worldROS); // from worldROS to worldGL
 
+    return cloud;
+}
 
+fs::path DataLoaderScanNet::preprocessed_cache_path(const fs::path& ply_filename){
+    return ply_filename.parent_path()/(ply_filename.stem().string()+".preprocessed.bin");
+}
 
-            cloud->transform_vertices_cpu(alignment);
-            cloud->transform_vertices_cpu(m_tf_worldGL_worldROS); // from worldROS to worldGL
+bool DataLoaderScanNet::is_preprocessed_cache_valid(const fs::path& cache_filename, const fs::path& ply_filename, const bool with_labels){
+    //a cache that is older than any of the files it was made from was written before they changed, so we ignore it
+    boost::system::error_code ec;
+    std::time_t cache_time=fs::last_write_time(cache_filename, ec);
+    if(ec){
+        return false;
+    }
+    fs::path room_path=fs::absolute(ply_filename).parent_path();
+    std::vector<fs::path> source_files={ ply_filename, room_path/(room_path.filename().string()+".txt"), m_labels_file };
+    if(with_labels){
+        source_files.push_back( room_path/(ply_filename.stem().string()+".labels.ply") );
+    }
+    for(size_t i=0; i<source_files.size(); i++){
+        std::time_t source_time=fs::last_write_time(source_files[i], ec);
+        if(ec || cache_time<source_time){
+            return false;
+        }
+    }
 
+    //a cache written with another label config or without the labels that we need now gets written again
+    MappedFile file(cache_filename.string());
+    if(file.size()<sizeof(CacheHeader)){
+        return false;
+    }
+    const CacheHeader* header=file.at<CacheHeader>(0);
+    if(std::memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC))!=0 ||
+       header->version!=CACHE_VERSION ||
+       header->config_hash!=m_preprocessed_config_hash ||
+       (bool)header->has_labels!=with_labels){
+        return false;
+    }
+    //the fields have to fill the file exactly, otherwise it got truncated or is not ours
+    size_t offsets[CACHE_NR_FIELDS];
+    return cache_field_offsets(*header, offsets)==file.size();
+}
 
-            if(m_mode=="train"){
-                cloud=m_transformer->transform(cloud);
-            }
+std::shared_ptr<Mesh> DataLoaderScanNet::read_preprocessed_cache(const fs::path& cache_filename){
+    MappedFile file(cache_filename.string());
+
+    const CacheHeader* header=file.at<CacheHeader>(0);
+    size_t offsets[CACHE_NR_FIELDS];
+    cache_field_offsets(*header, offsets);
+    const uint64_t* rows=header->nr_rows;
+    typedef Eigen::Matrix<int32_t, Eigen::Dynamic, Eigen::Dynamic> MatrixXi32;
+
+    MeshSharedPtr cloud=Mesh::create();
+    cloud->V=Eigen::Map<const Eigen::MatrixXd>(file.at<double>(offsets[CACHE_V], rows[CACHE_V]*3), rows[CACHE_V], 3);
+    cloud->NV=Eigen::Map<const Eigen::MatrixXd>(file.at<double>(offsets[CACHE_NV], rows[CACHE_NV]*3), rows[CACHE_NV], 3);
+    cloud->C=Eigen::Map<const Eigen::MatrixXd>(file.at<double>(offsets[CACHE_C], rows[CACHE_C]*3), rows[CACHE_C], 3);
+    cloud->D=Eigen::Map<const Eigen::MatrixXd>(file.at<double>(offsets[CACHE_D], rows[CACHE_D]), rows[CACHE_D], 1);
+    cloud->I=Eigen::Map<const Eigen::MatrixXd>(file.at<double>(offsets[CACHE_I], rows[CACHE_I]), rows[CACHE_I], 1);
+    cloud->F=Eigen::Map<const MatrixXi32>(file.at<int32_t>(offsets[CACHE_F], rows[CACHE_F]*3), rows[CACHE_F], 3).cast<int>();
+    if(header->has_labels){
+        cloud->L_gt=Eigen::Map<const MatrixXi32>(file.at<int32_t>(offsets[CACHE_L_GT], rows[CACHE_L_GT]), rows[CACHE_L_GT], 1).cast<int>();
+    }
 
+    return cloud;
+}
 
-            if(m_shuffle_points){ //when splattin it is better if adyacent points in 3D space are not adyancet in memory so that we don't end up with conflicts or race conditions
-                // https://stackoverflow.com/a/15866196
-                Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic> perm(cloud->V.rows());
-                perm.setIdentity();
-                std::shuffle(perm.indices().data(), perm.indices().data()+perm.indices().size(), m_rand_gen->generator());
-                // VLOG(1) << "permutation matrix is " << perm.indices();
-                // A_perm = A * perm; // permute columns
-                cloud->V = perm * cloud->V; // permute rows
-                cloud->L_gt = perm * cloud->L_gt; // permute rows
-                cloud->D = perm * cloud->D; // permute rows
-                cloud->C = perm * cloud->C; // permute rows
-            }
+bool DataLoaderScanNet::write_preprocessed_cache(const fs::path& cache_filename, const MeshSharedPtr& cloud, const bool with_labels){
+    Eigen::Matrix<int32_t, Eigen::Dynamic, Eigen::Dynamic> F_int32=cloud->F.cast<int32_t>();
+    Eigen::Matrix<int32_t, Eigen::Dynamic, Eigen::Dynamic> L_gt_int32;
+    if(with_labels){
+        L_gt_int32=cloud->L_gt.cast<int32_t>();
+    }
 
-            //some sensible visualization options
-            cloud->m_vis.m_show_mesh=false;
-            cloud->m_vis.m_show_points=true;
-            cloud->m_vis.m_color_type=+MeshColorType::SemanticGT;
+    //every field is written with its own nr of rows, the nr of cols is fixed by the layout so a field with other cols can't be stored
+    const char* data[CACHE_NR_FIELDS]={ (const char*)cloud->V.data(), (const char*)cloud->NV.data(), (const char*)cloud->C.data(), (const char*)cloud->D.data(), (const char*)cloud->I.data(), (const char*)F_int32.data(), (const char*)L_gt_int32.data() };
+    const Eigen::Index rows[CACHE_NR_FIELDS]={ cloud->V.rows(), cloud->NV.rows(), cloud->C.rows(), cloud->D.rows(), cloud->I.rows(), F_int32.rows(), L_gt_int32.rows() };
+    const Eigen::Index cols[CACHE_NR_FIELDS]={ cloud->V.cols(), cloud->NV.cols(), cloud->C.cols(), cloud->D.cols(), cloud->I.cols(), F_int32.cols(), L_gt_int32.cols() };
+
+    CacheHeader header;
+    std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version=CACHE_VERSION;
+    header.has_labels=with_labels;
+    for(int i=0; i<CACHE_NR_FIELDS; i++){
+        CHECK(rows[i]==0 || cols[i]==CACHE_FIELD_COLS[i]) << "Field " << i << " of the cloud has " << cols[i] << " cols but the preprocessed cache stores it with " << CACHE_FIELD_COLS[i];
+        header.nr_rows[i]=rows[i];
+    }
+    header.config_hash=m_preprocessed_config_hash;
 
-            //set the labelmngr which will be used by the viewer to put correct colors for the semantics
-            cloud->m_label_mngr=m_label_mngr->shared_from_this();
+    //we write into a temporary file and rename it at the end so that a loader never sees a half written cache. The name of the temporary file is unique for each thread in case several readers write the same scene
+    fs::path tmp_filename=cache_filename.string()+".tmp"+std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    std::ofstream file(tmp_filename.string(), std::ios::binary);
+    if(!file.is_open()){
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    for(int i=0; i<CACHE_NR_FIELDS; i++){
+        file.write(data[i], header.nr_rows[i]*CACHE_FIELD_COLS[i]*CACHE_FIELD_ELEM_SIZE[i]);
+    }
+    file.close();
+    boost::system::error_code ec;
+    if(file.fail()){
+        fs::remove(tmp_filename, ec);
+        return false;
+    }
+    fs::rename(tmp_filename, cache_filename, ec);
+    return !ec;
+}
 
-            cloud->m_disk_path=ply_filename.string();
+void DataLoaderScanNet::process_sample(MeshSharedPtr& cloud){
+
+    //the alignment was already applied in read_sample, which doesn't change which points get dropped since they are dropped at random
+    //the scannet dataset is gigantic and sometimes we can't process all points, we establish a maximum amount of points we can process and drop the rest
+    int nr_points=cloud->V.rows();
+    if (nr_points>m_max_nr_points_per_cloud && m_max_nr_points_per_cloud>0){
+        LOG(WARNING)<< "Overstepping theshold of max nr of points of " << m_max_nr_points_per_cloud << " because we have nr of points " << nr_points << ". Dropping points until we only are left with the maximum we can process." ;
+        //percentage of points we have to drop
+        float percentage_to_drop=1.0-(float)m_max_nr_points_per_cloud/(float)nr_points;
+        float prob_of_death=percentage_to_drop;
+        std::vector<bool> is_vertex_to_be_removed(cloud->V.rows(), false);
+        for(int i = 0; i < cloud->V.rows(); i++){
+            float random= m_rand_gen->rand_float(0.0, 1.0);
+            if(random<prob_of_death){
+                is_vertex_to_be_removed[i]=true;
+            }
+        }
+        cloud->remove_marked_vertices(is_vertex_to_be_removed, false);
+    }
 
-            m_clouds_buffer.enqueue(cloud);;
+    if(m_mode=="train"){
+        cloud=m_transformer->transform(cloud);
+    }
 
-        }
 
+    if(m_shuffle_points){ //when splattin it is better if adyacent points in 3D space are not adyancet in memory so that we don't end up with conflicts or race conditions
+        // https://stackoverflow.com/a/15866196
+        Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic> perm(cloud->V.rows());
+        perm.setIdentity();
+        std::shuffle(perm.indices().data(), perm.indices().data()+perm.indices().size(), m_rand_gen->generator());
+        // VLOG(1) << "permutation matrix is " << perm.indices();
+        // A_perm = A * perm; // permute columns
+        cloud->V = perm * cloud->V; // permute rows
+        cloud->L_gt = perm * cloud->L_gt; // permute rows
+        cloud->D = perm * cloud->D; // permute rows
+        cloud->C = perm * cloud->C; // permute rows
     }
 
+    //some sensible visualization options
+    cloud->m_vis.m_show_mesh=false;
+    cloud->m_vis.m_show_points=true;
+    cloud->m_vis.m_color_type=+MeshColorType::SemanticGT;
+
+    //set the labelmngr which will be used by the viewer to put correct colors for the semantics
+    cloud->m_label_mngr=m_label_mngr->shared_from_this();
+
 }
 
 //read labels (took some inspiration from the file readPLY.cpp in libigl library)
@@ -454,60 +608,38 @@ void DataLoaderScanNet::write_for_evaluating_on_scannet_server( std::shared_ptr<
 
 
 bool DataLoaderScanNet::has_data(){
-    if(m_clouds_buffer.peek()==nullptr){
-        return false;
-    }else{
-        return true;
-    }
+    return m_clouds_pipeline.has_data();
 }
 
 
 std::shared_ptr<Mesh> DataLoaderScanNet::get_cloud(){
 
-    std::shared_ptr<Mesh> cloud;
-    m_clouds_buffer.try_dequeue(cloud);
-
-    return cloud;
+    return m_clouds_pipeline.try_get();
 }
 
 bool DataLoaderScanNet::is_finished(){
-    //check if this loader has loaded everything
-    if(m_idx_cloud_to_read<m_ply_filenames.size()){
-        return false; //there is still more files to read
-    }
-
-    //check that there is nothing in the ring buffers
-    if(m_clouds_buffer.peek()!=nullptr){
-        return false; //there is still something in the buffer
-    }
-
-    return true; //there is nothing more to read and nothing more in the buffer so we are finished
-
+    return m_clouds_pipeline.is_finished(); //there is nothing more to read and nothing more in the buffer
 }
 
 
 bool DataLoaderScanNet::is_finished_reading(){
-    //check if this loader has loaded everything
-    if(m_idx_cloud_to_read<m_ply_filenames.size()){
-        return false; //there is still more files to read
-    }
-
-    return true; //there is nothing more to read and so we are finished reading
-
+    return m_clouds_pipeline.is_finished_reading();
 }
 
 void DataLoaderScanNet::reset(){
-    m_nr_resets++;
-    // we shuffle again the data so as to have freshly shuffled data for the next epoch
-    if(m_shuffle){
-        // unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-        // auto rng = std::default_random_engine(seed);
-        unsigned seed = m_nr_resets;
-        auto rng = std::default_random_engine(seed);
-        std::shuffle(std::begin(m_ply_filenames), std::end(m_ply_filenames), rng);
-    }
-
-    m_idx_cloud_to_read=0;
+    int nr_clouds= m_do_overfit? -1 : m_ply_filenames.size();
+    //the readers are paused while we shuffle so none of them sees the file list half shuffled
+    m_clouds_pipeline.reset(nr_clouds, [this](){
+        m_nr_resets++;
+        // we shuffle again the data so as to have freshly shuffled data for the next epoch
+        if(m_shuffle){
+            // unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
+            // auto rng = std::default_random_engine(seed);
+            unsigned seed = m_nr_resets;
+            auto rng = std::default_random_engine(seed);
+            std::shuffle(std::begin(m_ply_filenames), std::end(m_ply_filenames), rng);
+        }
+    });
 }
 
 int DataLoaderScanNet::nr_samples(){
@@ -3,6 +3,9 @@
 //c++
 #include <algorithm>
 #include <random>
+#include <fstream>
+#include <cstring>
+#include <limits>
 
 //loguru
 #define LOGURU_REPLACE_GLOG 1
@@ -24,6 +27,7 @@ using namespace configuru;
 #include "easy_pbr/Mesh.h"
 #include "easy_pbr/LabelMngr.h"
 #include "data_loaders/DataTransformer.h"
+#include "data_loaders/MappedFile.h"
 #include "Profiler.h"
 #include "string_utils.h"
 #include "eigen_utils.h"
@@ -32,13 +36,31 @@ using namespace configuru;
 using namespace radu::utils;
 using namespace easy_pbr;
 
-#define BUFFER_SIZE 5 //clouds are stored in a queue until they are acessed, the queue stores a maximum of X items
+//layout of the scans.pack file of a sequence. Everything is stored little endian in the native layout of these structs
+//  header
+//  one PackedScanEntry for each scan, sorted by the name of the scan
+//  for each scan: nr_points*3 floats with the xyz (aligned to 16 bytes) followed by nr_points uint16 with the labels
+namespace{
+    const char PACK_MAGIC[8]={'K','I','T','T','I','P','C','K'};
+    const uint32_t PACK_VERSION=1;
+    struct PackHeader{
+        char magic[8];
+        uint32_t version;
+        uint32_t nr_scans;
+    };
+    struct PackedScanEntry{
+        char name[16]; //stem of the npz file the scan came from, so something like 000042
+        uint64_t xyz_offset; //in bytes from the start of the file
+        uint64_t labels_offset;
+        uint32_t nr_points;
+        uint32_t padding;
+    };
+    static_assert(sizeof(PackHeader)==16, "PackHeader has to have no padding so that the file layout is the same on all compilers");
+    static_assert(sizeof(PackedScanEntry)==40, "PackedScanEntry has to have no padding so that the file layout is the same on all compilers");
+}
 
 DataLoaderSemanticKitti::DataLoaderSemanticKitti(const std::string config_file):
     m_is_modified(false),
-    m_is_running(false),
-    m_clouds_buffer(BUFFER_SIZE),
-    m_idx_cloud_to_read(0),
     m_nr_resets(0),
     m_rand_gen(new RandGenerator)
 {
@@ -48,8 +70,7 @@ DataLoaderSemanticKitti::DataLoaderSemanticKitti(const std::string config_file):
     create_transformation_matrices();
     // std::cout << " creating thread" << "\n";
     if(m_autostart){
-        m_is_running=true;
-        m_loader_thread=std::thread(&DataLoaderSemanticKitti::read_data, this);  //starts the spin in another thread
+        start();
     }
     // std::cout << " finidhed creating thread" << "\n";
 
@@ -58,11 +79,7 @@ DataLoaderSemanticKitti::DataLoaderSemanticKitti(const std::string config_file):
 DataLoaderSemanticKitti::~DataLoaderSemanticKitti(){
 
     // std::cout << "finishing" << std::endl;
-    m_is_running=false;
-
-    if (m_loader_thread.joinable()){
-        m_loader_thread.join();
-    }
+    m_clouds_pipeline.stop(); //the readers use the members of the loader so they have to finish before anything gets destroyed
 }
 
 void DataLoaderSemanticKitti::init_params(const std::string config_file){
@@ -91,6 +108,10 @@ void DataLoaderSemanticKitti::init_params(const std::string config_file){
     m_normalize=loader_config["normalize"];
     m_shuffle=loader_config["shuffle"];
     m_do_overfit=loader_config["do_overfit"];
+    m_nr_reader_threads=loader_config.get_or("nr_reader_threads", 1);
+    m_prefetch_depth=loader_config.get_or("prefetch_depth", 4);
+    m_ordered_delivery=loader_config.get_or("ordered_delivery", true);
+    m_read_packed=loader_config.get_or("read_packed", false);
     // m_do_adaptive_subsampling=loader_config["do_adaptive_subsampling"];
     m_dataset_path=(std::string)loader_config["dataset_path"];
     m_sequence=(std::string)loader_config["sequence"];
@@ -107,12 +128,18 @@ void DataLoaderSemanticKitti::init_params(const std::string config_file){
 }
 
 void DataLoaderSemanticKitti::start(){
-    CHECK(m_is_running==false) << "The loader thread is already running. Please check in the config file that autostart is not already set to true. Or just don't call start()";
+    CHECK(!m_clouds_pipeline.is_running()) << "The loader thread is already running. Please check in the config file that autostart is not already set to true. Or just don't call start()";
 
     init_data_reading();
 
-    m_is_running=true;
-    m_loader_thread=std::thread(&DataLoaderSemanticKitti::read_data, this);  //starts the spin in another thread
+    m_clouds_pipeline.set_nr_readers(m_nr_reader_threads);
+    m_clouds_pipeline.set_prefetch_depth(m_prefetch_depth);
+    m_clouds_pipeline.set_ordered(m_ordered_delivery);
+    int nr_clouds= m_do_overfit? -1 : m_npz_filenames.size(); //when overfitting we keep on reading the first cloud forever
+    m_clouds_pipeline.start(nr_clouds,
+        [this](const int idx){ return read_sample(idx); },
+        [this](MeshSharedPtr& cloud){ process_sample(cloud); },
+        "loader_thread_kitti");
 }
 
 void DataLoaderSemanticKitti::init_data_reading(){
@@ -127,15 +154,17 @@ void DataLoaderSemanticKitti::init_data_reading(){
         }
 
         //see how many images we have and read the files paths into a vector
-        for (fs::directory_iterator itr(full_path); itr!=fs::directory_iterator(); ++itr){
-            //all the files in the folder might include also the pose file so we ignore that one
-            //we also ignore the files that contain intensity, for now we only read the general ones and then afterwards we append _i to the file and read the intensity if neccesarry
-            if( !(itr->path().stem()=="poses")  &&  itr->path().stem().string().find("_i")== std::string::npos ){
-                npz_filenames_all.push_back(itr->path());
+        if(m_read_packed){
+            read_packed_index(full_path, npz_filenames_all); //the packed file already stores them sorted
+        }else{
+            for (fs::directory_iterator itr(full_path); itr!=fs::directory_iterator(); ++itr){
+                if( is_scan_file(itr->path()) ){
+                    npz_filenames_all.push_back(itr->path());
+                }
+            }
+            if(!m_shuffle){ //if we are shuffling, there is no need to sort them
+                std::sort(npz_filenames_all.begin(), npz_filenames_all.end());
             }
-        }
-        if(!m_shuffle){ //if we are shuffling, there is no need to sort them
-            std::sort(npz_filenames_all.begin(), npz_filenames_all.end());
         }
 
 
@@ -167,15 +196,17 @@ void DataLoaderSemanticKitti::init_data_reading(){
                 m_nr_sequences++;
                 //read the npz of each sequence
                 std::vector<fs::path> npz_filenames_for_sequence;
-                for (fs::directory_iterator itr(full_path); itr!=fs::directory_iterator(); ++itr){
-                    //all the files in the folder might include also the pose file so we ignore that one
-                    //we also ignore the files that contain intensity, for now we only read the general ones and then afterwards we append _i to the file and read the intensity if neccesarry
-                    if( !(itr->path().stem()=="poses")  && itr->path().stem().string().find("_i")== std::string::npos ){
-                        npz_filenames_for_sequence.push_back(itr->path());
+                if(m_read_packed){
+                    read_packed_index(full_path, npz_filenames_for_sequence);
+                }else{
+                    for (fs::directory_iterator itr(full_path); itr!=fs::directory_iterator(); ++itr){
+                        if( is_scan_file(itr->path()) ){
+                            npz_filenames_for_sequence.push_back(itr->path());
+                        }
+                    }
+                    if(!m_shuffle){ //if we are shuffling, there is no need to sort them
+                        std::sort(npz_filenames_for_sequence.begin(), npz_filenames_for_sequence.end());
                     }
-                }
-                if(!m_shuffle){ //if we are shuffling, there is no need to sort them
-                    std::sort(npz_filenames_for_sequence.begin(), npz_filenames_for_sequence.end());
                 }
 
                 npz_filenames_all.insert(npz_filenames_all.end(), npz_filenames_for_sequence.begin(), npz_filenames_for_sequence.end());
@@ -221,216 +252,273 @@ void DataLoaderSemanticKitti::init_data_reading(){
 
 }
 
-void DataLoaderSemanticKitti::read_data(){
+std::shared_ptr<Mesh> DataLoaderSemanticKitti::read_sample(const int idx){
 
-    loguru::set_thread_name("loader_thread_kitti");
+    fs::path npz_filename=m_npz_filenames[ m_do_overfit? 0 : idx ];
+    // VLOG(1) << "reading " << npz_filename;
 
+    MeshSharedPtr cloud=Mesh::create();
+    if(m_read_packed){
+        read_packed_scan(npz_filename, cloud);
+    }else{
+        //read npz
+        cnpy::npz_t npz_file = cnpy::npz_load(npz_filename.string());
+        cnpy::NpyArray arr = npz_file["arr_0"]; //one can obtain the keys with https://stackoverflow.com/a/53901903
+        CHECK(arr.shape.size()==2) << "arr should have 2 dimensions and it has " << arr.shape.size();
+        CHECK(arr.shape[1]==4) << "arr second dimension should be 4 (x,y,z,label) but it is " << arr.shape[1];
+
+        //read intensity
+        // fs::path absolute_path=fs::absolute(npz_filename).parent_path();
+        // fs::path file_name=npz_filename.stem();
+        // fs::path npz_intensity_path=absolute_path/(file_name.string()+"_i"+".npz");
+        // cnpy::npz_t npz_intensity_file = cnpy::npz_load(npz_intensity_path.string());
+        // cnpy::NpyArray arr_intensity = npz_intensity_file["arr_0"]; //one can obtain the keys with https://stackoverflow.com/a/53901903
+        // CHECK(arr_intensity.shape.size()==1) << "arr should have 1 dimensions and it has " << arr.shape.size();
+
+        //copy into EigenMatrix. The array is row major with x,y,z,label in each row
+        int nr_points=arr.shape[0];
+        Eigen::Map< const Eigen::Matrix<double, Eigen::Dynamic, 4, Eigen::RowMajor> > arr_mat(arr.data<double>(), nr_points, 4);
+        cloud->V=arr_mat.leftCols<3>();
+        cloud->L_gt=arr_mat.col(3).cast<int>();
+    }
+    cloud->D=cloud->V.rowwise().norm();
+
+    // if(m_do_adaptive_subsampling){
+    //     std::vector<bool> marked_to_be_removed(cloud.V.rows(), false);
+    //     for(int i=0; i<cloud.V.rows(); i++){
+    //         float dist=cloud.V.row(i).norm();
+    //         float prob_to_remove= map(dist, 0.0, 60.0, 1.0, 0.0 ); //the closer verts have a high prob to be removed and the further away ones have one that is close to 0
+    //         float r_val = m_rand_gen->rand_float(0.0, 1.0);
+    //         if(r_val < prob_to_remove) { //the r_val will have no chance in going very low so it will not remove the points with prob_to_remove close to 0.0
+    //             marked_to_be_removed[i]=true;
+    //         }
+    //     }
+    //     cloud.remove_marked_vertices(marked_to_be_removed, false);
+    // }
+
+    //get pose
+    int scan_nr=std::stoull( npz_filename.stem().string() ); //scan_nr corresponds to the file name (without the extension of course)
+    std::string sequence= npz_filename.parent_path().stem().string();
+    // VLOG(1) << "sequence is " << sequence;
+    Eigen::Affine3d tf_worldROS_cam;
+    if(m_do_pose){
+            tf_worldROS_cam=get_pose_for_scan_nr_and_sequence(scan_nr, sequence);
+    }
+    cloud->t=scan_nr;
 
-    while (m_is_running ) {
 
-        //we finished reading so we wait here for a reset
-        if(m_idx_cloud_to_read>=m_npz_filenames.size()){
-            std::this_thread::sleep_for(std::chrono::milliseconds(300));
-            continue;
+    if(m_cap_distance>0.0){
+        std::vector<bool> is_too_far(cloud->V.rows(),false);
+        for(int i=0; i<cloud->V.rows(); i++){
+            float dist=cloud->V.row(i).norm();
+            if(dist>m_cap_distance){
+                is_too_far[i]=true;
+            }
         }
+        cloud->remove_marked_vertices(is_too_far, false);
+    }
 
-        // std::cout << "size approx is " << m_queue.size_approx() << '\n';
-        // std::cout << "m_idx_img_to_read is " << m_idx_img_to_read << '\n';
-        if(m_clouds_buffer.size_approx()<BUFFER_SIZE-1){ //there is enough space
-            //read the frame and everything else and push it to the queue
+    //transform
+    if(m_do_pose){
+        LOG(FATAL) << "Doing poses is at the moment disabled because the poses are wrong. I thought the matrix m_tf_cam_velodyne is the same for all sequences, however that is not the case.";
+        cloud->transform_vertices_cpu(m_tf_cam_velodyne); //from velodyne frame to the camera frame
+        cloud->transform_vertices_cpu(tf_worldROS_cam); // from camera to worldROS
+    }
+    cloud->transform_vertices_cpu(m_tf_worldGL_worldROS); // from worldROS to worldGL
 
-            fs::path npz_filename=m_npz_filenames[ m_idx_cloud_to_read ];
-            if(!m_do_overfit){
-                m_idx_cloud_to_read++;
-            }
-            // VLOG(1) << "reading " << npz_filename;
-
-            //read npz
-            cnpy::npz_t npz_file = cnpy::npz_load(npz_filename.string());
-            cnpy::NpyArray arr = npz_file["arr_0"]; //one can obtain the keys with https://stackoverflow.com/a/53901903
-            CHECK(arr.shape.size()==2) << "arr should have 2 dimensions and it has " << arr.shape.size();
-            CHECK(arr.shape[1]==4) << "arr second dimension should be 4 (x,y,z,label) but it is " << arr.shape[1];
-
-            //read intensity
-            fs::path absolute_path=fs::absolute(npz_filename).parent_path();
-            fs::path file_name=npz_filename.stem();
-            // fs::path npz_intensity_path=absolute_path/(file_name.string()+"_i"+".npz");
-            // cnpy::npz_t npz_intensity_file = cnpy::npz_load(npz_intensity_path.string());
-            // cnpy::NpyArray arr_intensity = npz_intensity_file["arr_0"]; //one can obtain the keys with https://stackoverflow.com/a/53901903
-            // CHECK(arr_intensity.shape.size()==1) << "arr should have 1 dimensions and it has " << arr.shape.size();
-
-
-            //copy into EigenMatrix
-            int nr_points=arr.shape[0];
-            MeshSharedPtr cloud=Mesh::create();
-            cloud->V.resize(nr_points,3);
-            cloud->V.setZero();
-            cloud->L_gt.resize(nr_points,1);
-            cloud->L_gt.setZero();
-            // cloud->I.resize(nr_points,1);
-            // cloud->I.setZero();
-            double* arr_data = arr.data<double>();
-            // float* arr_intensity_data = arr_intensity.data<float>(); //the intensities are as floats while xyz is double. You can check by reading the npz in python
-            for(int i=0; i<nr_points*4; i=i+4){
-                int row_insert=i/4;
-
-                double x=arr_data[i];
-                double y=arr_data[i+1];
-                double z=arr_data[i+2];
-                int label=arr_data[i+3];
-                // double intensity=arr_intensity_data[row_insert];
-
-                cloud->V.row(row_insert) << x,y,z;
-                cloud->L_gt.row(row_insert) << label;
-                // cloud->I.row(row_insert) << intensity;
-
-
-                // VLOG(1) << "xyz is " << x << " " << y << " " << z << " " << label;
-                // exit(1);
+    cloud->m_disk_path=npz_filename.string();
 
-            }
-            cloud->D=cloud->V.rowwise().norm();
-
-            // if(m_do_adaptive_subsampling){
-            //     std::vector<bool> marked_to_be_removed(cloud.V.rows(), false);
-            //     for(int i=0; i<cloud.V.rows(); i++){
-            //         float dist=cloud.V.row(i).norm();
-            //         float prob_to_remove= map(dist, 0.0, 60.0, 1.0, 0.0 ); //the closer verts have a high prob to be removed and the further away ones have one that is close to 0
-            //         float r_val = m_rand_gen->rand_float(0.0, 1.0);
-            //         if(r_val < prob_to_remove) { //the r_val will have no chance in going very low so it will not remove the points with prob_to_remove close to 0.0
-            //             marked_to_be_removed[i]=true;
-            //         }
-            //     }
-            //     cloud.remove_marked_vertices(marked_to_be_removed, false);
-            // }
-
-            //get pose
-            int scan_nr=std::stoull( npz_filename.stem().string() ); //scan_nr corresponds to the file name (without the extension of course)
-            std::string sequence= npz_filename.parent_path().stem().string();
-            // VLOG(1) << "sequence is " << sequence;
-            Eigen::Affine3d tf_worldROS_cam;
-            if(m_do_pose){
-                    tf_worldROS_cam=get_pose_for_scan_nr_and_sequence(scan_nr, sequence);
-            }
-            cloud->t=scan_nr;
+    return cloud;
+}
 
+void DataLoaderSemanticKitti::read_packed_index(const fs::path& sequence_path, std::vector<fs::path>& npz_filenames){
+    fs::path pack_path=sequence_path/"scans.pack";
+    if(!fs::exists(pack_path)){
+        LOG(FATAL) << "No packed file " << pack_path << ". Create it with DataLoaderSemanticKitti.pack_sequence(\"" << sequence_path.string() << "\") or set read_packed to false";
+    }
+    std::shared_ptr<MappedFile> pack=std::make_shared<MappedFile>(pack_path.string());
+
+    const PackHeader* header=pack->at<PackHeader>(0);
+    CHECK( std::memcmp(header->magic, PACK_MAGIC, sizeof(PACK_MAGIC))==0 ) << pack_path << " is not a packed semantic kitti file";
+    CHECK(header->version==PACK_VERSION) << pack_path << " has version " << header->version << " but we can only read version " << PACK_VERSION << ". Please pack the sequence again";
+
+    const PackedScanEntry* entries=pack->at<PackedScanEntry>(sizeof(PackHeader), header->nr_scans);
+    for(uint32_t i=0; i<header->nr_scans; i++){
+        const PackedScanEntry& entry=entries[i];
+        //check the ranges once here so that reading the scans later cannot go outside of the file
+        pack->at<float>(entry.xyz_offset, (size_t)entry.nr_points*3);
+        pack->at<uint16_t>(entry.labels_offset, entry.nr_points);
+
+        std::string name(entry.name, strnlen(entry.name, sizeof(entry.name)));
+        fs::path npz_filename=sequence_path/(name+".npz");
+
+        PackedScan scan;
+        scan.pack=pack;
+        scan.xyz_offset=entry.xyz_offset;
+        scan.labels_offset=entry.labels_offset;
+        scan.nr_points=entry.nr_points;
+        m_packed_scans[npz_filename.string()]=scan;
+
+        npz_filenames.push_back(npz_filename);
+    }
+}
 
-            if(m_cap_distance>0.0){
-                std::vector<bool> is_too_far(cloud->V.rows(),false);
-                for(int i=0; i<cloud->V.rows(); i++){
-                    float dist=cloud->V.row(i).norm();
-                    if(dist>m_cap_distance){
-                        is_too_far[i]=true;
-                    }
-                }
-                cloud->remove_marked_vertices(is_too_far, false);
-            }
+void DataLoaderSemanticKitti::read_packed_scan(const fs::path& npz_filename, MeshSharedPtr& cloud){
+    const PackedScan& scan=m_packed_scans.at(npz_filename.string());
 
-            //transform
-            if(m_do_pose){
-                LOG(FATAL) << "Doing poses is at the moment disabled because the poses are wrong. I thought the matrix m_tf_cam_velodyne is the same for all sequences, however that is not the case.";
-                cloud->transform_vertices_cpu(m_tf_cam_velodyne); //from velodyne frame to the camera frame
-                cloud->transform_vertices_cpu(tf_worldROS_cam); // from camera to worldROS
-            }
-            cloud->transform_vertices_cpu(m_tf_worldGL_worldROS); // from worldROS to worldGL
+    //the data is used directly from the mapped pages, the only copy is the conversion into the double and int matrices of the mesh
+    Eigen::Map< const Eigen::Matrix<float, Eigen::Dynamic, 3, Eigen::RowMajor> > xyz(scan.pack->at<float>(scan.xyz_offset), scan.nr_points, 3);
+    Eigen::Map< const Eigen::Matrix<uint16_t, Eigen::Dynamic, 1> > labels(scan.pack->at<uint16_t>(scan.labels_offset), scan.nr_points);
+    cloud->V=xyz.cast<double>();
+    cloud->L_gt=labels.cast<int>();
+}
 
+bool DataLoaderSemanticKitti::is_scan_file(const fs::path& path){
+    //we also ignore the files that contain intensity, for now we only read the general ones and then afterwards we append _i to the file and read the intensity if neccesarry
+    return path.extension()==".npz"  &&  !(path.stem()=="poses")  &&  path.stem().string().find("_i")== std::string::npos;
+}
 
-            if(m_mode=="train"){
-                cloud=m_transformer->transform(cloud);
-            }
+void DataLoaderSemanticKitti::pack_sequence(const std::string sequence_path){
+    fs::path full_path=sequence_path;
+    if(!fs::is_directory(full_path)) {
+        LOG(FATAL) << "No directory " << full_path;
+    }
 
+    std::vector<fs::path> npz_filenames;
+    for (fs::directory_iterator itr(full_path); itr!=fs::directory_iterator(); ++itr){
+        if( is_scan_file(itr->path()) ){
+            npz_filenames.push_back(itr->path());
+        }
+    }
+    std::sort(npz_filenames.begin(), npz_filenames.end());
+    CHECK(npz_filenames.size()>0) << "We did not find any npz files to pack in " << full_path;
+
+    //we write into a temporary file and rename it at the end so that a loader never sees a half written pack
+    fs::path pack_path=full_path/"scans.pack";
+    fs::path tmp_path=full_path/"scans.pack.tmp";
+    std::ofstream file(tmp_path.string(), std::ios::binary);
+    CHECK(file.is_open()) << "Could not open " << tmp_path << " for writing";
+
+    PackHeader header;
+    std::memcpy(header.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+    header.version=PACK_VERSION;
+    header.nr_scans=npz_filenames.size();
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    //the entries get filled while we write the scans and are written over the placeholder at the end
+    std::vector<PackedScanEntry> entries(npz_filenames.size());
+    file.write(reinterpret_cast<const char*>(entries.data()), entries.size()*sizeof(PackedScanEntry));
+
+    for(size_t i=0; i<npz_filenames.size(); i++){
+        const fs::path& npz_filename=npz_filenames[i];
+        cnpy::npz_t npz_file = cnpy::npz_load(npz_filename.string());
+        cnpy::NpyArray arr = npz_file["arr_0"];
+        CHECK(arr.shape.size()==2 && arr.shape[1]==4) << npz_filename << " should have a Nx4 array with x,y,z,label";
+        int nr_points=arr.shape[0];
+        Eigen::Map< const Eigen::Matrix<double, Eigen::Dynamic, 4, Eigen::RowMajor> > arr_mat(arr.data<double>(), nr_points, 4);
+
+        Eigen::Matrix<float, Eigen::Dynamic, 3, Eigen::RowMajor> xyz=arr_mat.leftCols<3>().cast<float>();
+        Eigen::Matrix<int, Eigen::Dynamic, 1> labels_int=arr_mat.col(3).cast<int>();
+        CHECK(nr_points==0 || (labels_int.minCoeff()>=0 && labels_int.maxCoeff()<=std::numeric_limits<uint16_t>::max())) << npz_filename << " has labels that do not fit in 16 bits";
+        Eigen::Matrix<uint16_t, Eigen::Dynamic, 1> labels=labels_int.cast<uint16_t>();
+
+        std::string name=npz_filename.stem().string();
+        CHECK(name.size()<sizeof(PackedScanEntry::name)) << "The name of the scan " << name << " is too long to be packed";
+
+        //pad so that the xyz starts at 16 bytes
+        uint64_t offset=file.tellp();
+        uint64_t padding=(16-offset%16)%16;
+        const char zeros[16]={0};
+        file.write(zeros, padding);
+
+        PackedScanEntry& entry=entries[i];
+        std::memset(&entry, 0, sizeof(entry));
+        std::memcpy(entry.name, name.c_str(), name.size());
+        entry.nr_points=nr_points;
+        entry.xyz_offset=offset+padding;
+        entry.labels_offset=entry.xyz_offset+(uint64_t)nr_points*3*sizeof(float);
+        file.write(reinterpret_cast<const char*>(xyz.data()), (size_t)nr_points*3*sizeof(float));
+        file.write(reinterpret_cast<const char*>(labels.data()), (size_t)nr_points*sizeof(uint16_t));
+
+        VLOG(1) << "packed " << npz_filename << " with " << nr_points << " points";
+    }
 
-            if(m_normalize){
-                cloud->normalize_size();
-                cloud->normalize_position();
-            }
+    file.seekp(sizeof(PackHeader));
+    file.write(reinterpret_cast<const char*>(entries.data()), entries.size()*sizeof(PackedScanEntry));
+    file.close();
+    CHECK(!file.fail()) << "Failed writing " << tmp_path;
 
-            if(m_shuffle_points){ //when splattin it is better if adyacent points in 3D space are not adyancet in memory so that we don't end up with conflicts or race conditions
-                // https://stackoverflow.com/a/15866196
-                Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic> perm(cloud->V.rows());
-                perm.setIdentity();
-                std::shuffle(perm.indices().data(), perm.indices().data()+perm.indices().size(), m_rand_gen->generator());
-                // VLOG(1) << "permutation matrix is " << perm.indices();
-                // A_perm = A * perm; // permute columns
-                cloud->V = perm * cloud->V; // permute rows
-                cloud->L_gt = perm * cloud->L_gt; // permute rows
-                cloud->D = perm * cloud->D; // permute rows
-            }
+    fs::rename(tmp_path, pack_path);
+    std::cout << "Packed " << npz_filenames.size() << " scans into " << pack_path << std::endl;
+}
 
-            //some sensible visualization options
-            cloud->m_vis.m_show_mesh=false;
-            cloud->m_vis.m_show_points=true;
-            cloud->m_vis.m_color_type=+MeshColorType::SemanticGT;
+void DataLoaderSemanticKitti::process_sample(MeshSharedPtr& cloud){
 
-            //set the labelmngr which will be used by the viewer to put correct colors for the semantics
-            cloud->m_label_mngr=m_label_mngr->shared_from_this();
+    if(m_mode=="train"){
+        cloud=m_transformer->transform(cloud);
+    }
 
-            cloud->m_disk_path=npz_filename.string();
 
+    if(m_normalize){
+        cloud->normalize_size();
+        cloud->normalize_position();
+    }
 
-            m_clouds_buffer.enqueue(cloud);;
+    if(m_shuffle_points){ //when splattin it is better if adyacent points in 3D space are not adyancet in memory so that we don't end up with conflicts or race conditions
+        // https://stackoverflow.com/a/15866196
+        Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic> perm(cloud->V.rows());
+        perm.setIdentity();
+        std::shuffle(perm.indices().data(), perm.indices().data()+perm.indices().size(), m_rand_gen->generator());
+        // VLOG(1) << "permutation matrix is " << perm.indices();
+        // A_perm = A * perm; // permute columns
+        cloud->V = perm * cloud->V; // permute rows
+        cloud->L_gt = perm * cloud->L_gt; // permute rows
+        cloud->D = perm * cloud->D; // permute rows
+    }
 
-        }
+    //some sensible visualization options
+    cloud->m_vis.m_show_mesh=false;
+    cloud->m_vis.m_show_points=true;
+    cloud->m_vis.m_color_type=+MeshColorType::SemanticGT;
 
-    }
+    //set the labelmngr which will be used by the viewer to put correct colors for the semantics
+    cloud->m_label_mngr=m_label_mngr->shared_from_this();
 
 }
 
 bool DataLoaderSemanticKitti::has_data(){
-    if(m_clouds_buffer.peek()==nullptr){
-        return false;
-    }else{
-        return true;
-    }
+    return m_clouds_pipeline.has_data();
 }
 
 
 std::shared_ptr<Mesh> DataLoaderSemanticKitti::get_cloud(){
 
-    std::shared_ptr<Mesh> cloud;
-    m_clouds_buffer.try_dequeue(cloud);
-
-    return cloud;
+    return m_clouds_pipeline.try_get();
 }
 
 bool DataLoaderSemanticKitti::is_finished(){
-    //check if this loader has loaded everything
-    if(m_idx_cloud_to_read<m_npz_filenames.size()){
-        return false; //there is still more files to read
-    }
-
-    //check that there is nothing in the ring buffers
-    if(m_clouds_buffer.peek()!=nullptr){
-        return false; //there is still something in the buffer
-    }
-
-    return true; //there is nothing more to read and nothing more in the buffer so we are finished
-
+    return m_clouds_pipeline.is_finished(); //there is nothing more to read and nothing more in the buffer
 }
 
 
 bool DataLoaderSemanticKitti::is_finished_reading(){
-    //check if this loader has loaded everything
-    if(m_idx_cloud_to_read<m_npz_filenames.size()){
-        return false; //there is still more files to read
-    }
-
-    return true; //there is nothing more to read and so we are finished reading
-
+    return m_clouds_pipeline.is_finished_reading();
 }
 
 void DataLoaderSemanticKitti::reset(){
-    m_nr_resets++;
-    // we shuffle again the data so as to have freshly shuffled data for the next epoch
-    if(m_shuffle){
-        // unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-        // auto rng = std::default_random_engine(seed);
-        unsigned seed = m_nr_resets;
-        auto rng = std::default_random_engine(seed);
-        std::shuffle(std::begin(m_npz_filenames), std::end(m_npz_filenames), rng);
-    }
-
-    m_idx_cloud_to_read=0;
+    int nr_clouds= m_do_overfit? -1 : m_npz_filenames.size();
+    //the readers are paused while we shuffle so none of them sees the file list half shuffled
+    m_clouds_pipeline.reset(nr_clouds, [this](){
+        m_nr_resets++;
+        // we shuffle again the data so as to have freshly shuffled data for the next epoch
+        if(m_shuffle){
+            // unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
+            // auto rng = std::default_random_engine(seed);
+            unsigned seed = m_nr_resets;
+            auto rng = std::default_random_engine(seed);
+            std::shuffle(std::begin(m_npz_filenames), std::end(m_npz_filenames), rng);
+        }
+    });
 }
 
 int DataLoaderSemanticKitti::nr_samples(){
@@ -487,9 +575,11 @@ std::vector<Eigen::Affine3d,  Eigen::aligned_allocator<Eigen::Affine3d>  > DataL
 }
 
 Eigen::Affine3d DataLoaderSemanticKitti::get_pose_for_scan_nr_and_sequence(const int scan_nr, const std::string sequence){
-    CHECK(scan_nr<(int)m_poses_per_sequence[sequence].size()) << "scan_nr out of range. Maximum pose would be for scan_nr " << m_poses_per_sequence[sequence].size() << " and you are trying to index at " <<scan_nr;
+    //we use at() because this gets called from several reader threads and operator[] could insert into the map
+    const auto& poses=m_poses_per_sequence.at(sequence);
+    CHECK(scan_nr<(int)poses.size()) << "scan_nr out of range. Maximum pose would be for scan_nr " << poses.size() << " and you are trying to index at " <<scan_nr;
 
-    return m_poses_per_sequence[sequence][scan_nr];
+    return poses[scan_nr];
 }
 
 void DataLoaderSemanticKitti::create_transformation_matrices(){
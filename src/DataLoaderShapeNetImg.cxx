@@ -13,6 +13,9 @@ using namespace configuru;
 
 //my stuff
 #include "data_loaders/DataTransformer.h"
+#include "data_loaders/ImageCache.h"
+#include "data_loaders/WorkerPool.h"
+#include "data_loaders/MiscDataFuncs.h"
 #include "easy_pbr/Frame.h"
 #include "Profiler.h"
 #include "string_utils.h"
@@ -37,9 +40,12 @@ using namespace easy_pbr;
 
 DataLoaderShapeNetImg::DataLoaderShapeNetImg(const std::string config_file):
     m_is_running(false),
+    m_next_scene_ready(false),
+    m_switch_requested(false),
     m_idx_scene_to_read(0),
     m_nr_resets(0),
     m_rand_gen(new RandGenerator),
+    m_frames_for_scene(std::make_shared< const std::vector<Frame> >()),
     m_nr_scenes_read_so_far(0)
 {
     init_params(config_file);
@@ -86,6 +92,15 @@ void DataLoaderShapeNetImg::init_params(const std::string config_file){
     m_difficulty =(std::string)loader_config["difficulty"];
     m_load_depth= loader_config["load_depth"];
     m_load_as_shell= loader_config["load_as_shell"];
+    int image_cache_mb=loader_config.get_or("image_cache_mb", 0);
+    if(m_load_as_shell && image_cache_mb>0){
+        m_image_cache=ImageCache::shared();
+        m_image_cache->reserve_budget( (size_t)image_cache_mb*1024*1024 );
+    }
+    m_nr_decode_threads=loader_config.get_or("nr_decode_threads", 1);
+    if(m_nr_decode_threads!=1){
+        m_decode_pool=WorkerPool::shared(m_nr_decode_threads);
+    }
 
     CHECK(m_difficulty=="easy") << "We only implemented the reader for the easy dataset. The hard version just moves the model randomly but maybe you can do that by just moving the mesh";
 
@@ -152,8 +167,16 @@ void DataLoaderShapeNetImg::init_data_reading(){
 }
 
 void DataLoaderShapeNetImg::start_reading_next_scene(){
-    CHECK(m_is_running==false) << "The loader thread is already running. Wait until the scene is finished loading before loading a new one. You can check this with finished_reading_scene()";
+    //the current scene keeps being served until the next one is decoded so this never blocks. The switch happens here or in finished_reading_scene() once the next scene is ready
+    std::lock_guard<std::mutex> lock(m_switch_mutex);
+    m_switch_requested=true;
+    if(!m_is_running && !m_next_scene_ready){
+        read_next_scene_in_background();
+    }
+    switch_scene_if_ready();
+}
 
+void DataLoaderShapeNetImg::read_next_scene_in_background(){
     std::string scene_path;
     if ( m_idx_scene_to_read< (int)m_scene_folders.size()){
         scene_path=m_scene_folders[m_idx_scene_to_read].string();
@@ -177,12 +200,33 @@ void DataLoaderShapeNetImg::start_reading_next_scene(){
     }
 }
 
+void DataLoaderShapeNetImg::switch_scene_if_ready(){
+    if(!m_switch_requested || m_is_running){
+        return;
+    }
+    if (m_loader_thread.joinable()){
+        m_loader_thread.join(); //the thread is done with the scene, we only reclaim it
+    }
+    if(m_next_scene_ready){
+        {
+            //the getters may be copying from the current scene on another thread so we only replace it when they are done
+            //the old scene itself is never modified, the snapshots handed out by get_all_frames_ref() keep it alive until they are dropped
+            std::lock_guard<std::mutex> lock(m_scene_mutex);
+            m_frames_for_scene=std::make_shared< const std::vector<Frame> >(std::move(m_frames_next_scene));
+            m_frames_next_scene.clear();
+            m_nr_scenes_read_so_far++; //counted only once the scene is used so that a read ahead dropped by reset() doesn't shift the seeds of the following scenes
+            m_next_scene_ready=false;
+        }
+        //start decoding the scene after this one while this one is being used
+        read_next_scene_in_background();
+    }
+    m_switch_requested=false;
+}
+
 
 void DataLoaderShapeNetImg::read_scene(const std::string scene_path){
     // VLOG(1) <<" read from path " << scene_path;
 
-    m_frames_for_scene.clear();
-
     std::vector<fs::path> paths;
     for (fs::directory_iterator itr(scene_path); itr!=fs::directory_iterator(); ++itr){
         fs::path img_path= itr->path();
@@ -190,11 +234,16 @@ void DataLoaderShapeNetImg::read_scene(const std::string scene_path){
     }
 
     //shuffle the images from this scene
-    unsigned seed1 = m_nr_scenes_read_so_far;
+    unsigned seed1;
+    {
+        std::lock_guard<std::mutex> lock(m_scene_mutex);
+        seed1 = m_nr_scenes_read_so_far;
+    }
     auto rng_1 = std::default_random_engine(seed1);
     std::shuffle(std::begin(paths), std::end(paths), rng_1);
 
-    //load all the scene for the chosen object
+    //pick the images first so that the filtering and the early stop select the same ones as when reading them one after another
+    std::vector<fs::path> img_paths;
     // for (fs::directory_iterator itr(scene_path); itr!=fs::directory_iterator(); ++itr){
     for (size_t i=0; i<paths.size(); i++){
         // fs::path img_path= itr->path();
@@ -203,122 +252,117 @@ void DataLoaderShapeNetImg::read_scene(const std::string scene_path){
         // VLOG(1) << "img_path" <<img_path;
         if(img_path.filename().string().find("png")!= std::string::npos){
             // VLOG(1) << "png img path " << img_path;
-
-            int img_idx=std::stoi( img_path.stem().string() );
-            // VLOG(1) << "img idx is " << img_idx;
-
-            Frame frame;
-            frame.frame_idx=img_idx;
-
-            //sets the paths and all the things necessary for the loading of images
-            frame.rgb_path=img_path.string();
-            if (m_load_depth){
-                fs::path filename=img_path.stem();
-                fs::path scene_name=img_path.parent_path().parent_path().filename();
-                fs::path object_name=img_path.parent_path().parent_path().parent_path().filename();
-                // VLOG(1) << "filename " << filename << " " << scene_name << " " << object_name ;
-                fs::path depth_path = m_dataset_depth_path/object_name/scene_name/m_difficulty/ (filename.string() + ".exr" );
-                frame.depth_path=depth_path.string();
+            img_paths.push_back(img_path);
+            if(m_nr_imgs_to_read>0 && (int)img_paths.size()>=m_nr_imgs_to_read){
+                break; //we have as many images as we need
             }
-            frame.subsample_factor=m_subsample_factor;
-
-
-            //load the images if necessary or delay it for whne it's needed
-            frame.load_images=[this]( easy_pbr::Frame& frame ) -> void{ this->load_images_in_frame(frame); };
-            if (m_load_as_shell){
-                //set the function to load the images whenever it's neede
-                frame.is_shell=true;
-            }else{
-                frame.is_shell=false;
-                frame.load_images(frame);
-            }
-
-
-
-
-
-
+        }
+    }
 
-            //read pose and camera params
+    //the frames are built and their images decoded in parallel, each into its own slot so they keep the order of the paths
+    std::vector<Frame> frames(img_paths.size());
+    WorkerPool::parallel_for(m_decode_pool, img_paths.size(), [&](const int i){
+        fs::path img_path= img_paths[i];
+        int img_idx=std::stoi( img_path.stem().string() );
+
+        Frame frame;
+        frame.frame_idx=img_idx;
+
+        //sets the paths and all the things necessary for the loading of images
+        frame.rgb_path=img_path.string();
+        if (m_load_depth){
+            fs::path filename=img_path.stem();
+            fs::path scene_name=img_path.parent_path().parent_path().filename();
+            fs::path object_name=img_path.parent_path().parent_path().parent_path().filename();
+            // VLOG(1) << "filename " << filename << " " << scene_name << " " << object_name ;
+            fs::path depth_path = m_dataset_depth_path/object_name/scene_name/m_difficulty/ (filename.string() + ".exr" );
+            frame.depth_path=depth_path.string();
+        }
+        frame.subsample_factor=m_subsample_factor;
 
-            //intrisncis are from here
-            // https://github.com/facebookresearch/pytorch3d/blob/778383eef77a23686f3d0e68834b29d6d73f8501/pytorch3d/datasets/r2n2/r2n2.py
-            // and from https://github.com/facebookresearch/meshrcnn/blob/master/shapenet/utils/coords.py
-            // ther we also have zmin and zmax
-            // but it seems that it's not actually  a K matrix but rather a projection matrix as  an opengl projection matrix like in here http://www.songho.ca/opengl/gl_projectionmatrix.html
-            // so it projects from camera coordinates to clip coordinates but we want a K matrix that projects to screen coords
-            Eigen::Matrix4f P;
-            P <<
-            2.1875, 0.0, 0.0, 0.0,
-            0.0, 2.1875, 0.0, 0.0,
-            0.0, 0.0, -1.002002, -0.2002002,
-            0.0, 0.0, -1.0, 0.0;
-            // Eigen::Matrix3f K = opengl_proj_to_intrinsics(P, 137, 137);
-            Eigen::Matrix3f K = opengl_proj_to_intrinsics(P, 224, 224);
-            // VLOG(1) << "K is " << K;
-            frame.K=K;
-            // frame.K/=m_subsample_factor;
-            // frame.K(2,2)=1.0; //dividing by 2,4,8 etc depending on the subsample shouldn't affect the coordinate in the last row and last column which is always 1.0
-            frame.rescale_K(1.0/m_subsample_factor);
 
-            // frame.K(1,1)=435.55555555555554 ;
+        //load the images if necessary or delay it for whne it's needed
+        frame.load_images=[this]( easy_pbr::Frame& frame ) -> void{ this->load_images_in_frame(frame); };
+        if (m_load_as_shell){
+            //set the function to load the images whenever it's neede
+            frame.is_shell=true;
+        }else{
+            frame.is_shell=false;
+            frame.load_images(frame);
+        }
 
-            // VLOG(1) << "K is " << frame.K;
 
 
-            //the extrinsics are stored in rendering_metadata.txt, stored as azimuth elevation and distance
-            //processing of this can be seen here: https://github.com/NVIDIAGameWorks/kaolin/blob/master/kaolin/datasets/shapenet.py
-            Eigen::Affine3f tf_cam_world;
-            int lines_read=0;
-            bool found=false;
-            std::ifstream metadata_file( (fs::path(scene_path)/"rendering_metadata.txt").string() );
-            if(!metadata_file.is_open()){
-                LOG(FATAL) << "Could not open the rendering metadata file ";
-            }
-            for( std::string line; getline( metadata_file, line ); ){
-                if (lines_read==img_idx){
-                    // VLOG(1) << "img idx" << img_idx << "reading line " << lines_read << " line " << line;
-                    tf_cam_world=process_extrinsics_line(line);
-                    found=true;
-                    break;
-                }
-                lines_read++;
+        //read pose and camera params
+
+        //intrisncis are from here
+        // https://github.com/facebookresearch/pytorch3d/blob/778383eef77a23686f3d0e68834b29d6d73f8501/pytorch3d/datasets/r2n2/r2n2.py
+        // and from https://github.com/facebookresearch/meshrcnn/blob/master/shapenet/utils/coords.py
+        // ther we also have zmin and zmax
+        // but it seems that it's not actually  a K matrix but rather a projection matrix as  an opengl projection matrix like in here http://www.songho.ca/opengl/gl_projectionmatrix.html
+        // so it projects from camera coordinates to clip coordinates but we want a K matrix that projects to screen coords
+        Eigen::Matrix4f P;
+        P <<
+        2.1875, 0.0, 0.0, 0.0,
+        0.0, 2.1875, 0.0, 0.0,
+        0.0, 0.0, -1.002002, -0.2002002,
+        0.0, 0.0, -1.0, 0.0;
+        // Eigen::Matrix3f K = opengl_proj_to_intrinsics(P, 137, 137);
+        Eigen::Matrix3f K = opengl_proj_to_intrinsics(P, 224, 224);
+        // VLOG(1) << "K is " << K;
+        frame.K=K;
+        // frame.K/=m_subsample_factor;
+        // frame.K(2,2)=1.0; //dividing by 2,4,8 etc depending on the subsample shouldn't affect the coordinate in the last row and last column which is always 1.0
+        frame.rescale_K(1.0/m_subsample_factor);
+
+        // frame.K(1,1)=435.55555555555554 ;
+
+        // VLOG(1) << "K is " << frame.K;
+
+
+        //the extrinsics are stored in rendering_metadata.txt, stored as azimuth elevation and distance
+        //processing of this can be seen here: https://github.com/NVIDIAGameWorks/kaolin/blob/master/kaolin/datasets/shapenet.py
+        Eigen::Affine3f tf_cam_world;
+        int lines_read=0;
+        bool found=false;
+        std::ifstream metadata_file( (fs::path(scene_path)/"rendering_metadata.txt").string() );
+        if(!metadata_file.is_open()){
+            LOG(FATAL) << "Could not open the rendering metadata file ";
+        }
+        for( std::string line; getline( metadata_file, line ); ){
+            if (lines_read==img_idx){
+                // VLOG(1) << "img idx" << img_idx << "reading line " << lines_read << " line " << line;
+                tf_cam_world=process_extrinsics_line(line);
+                found=true;
+                break;
             }
-            CHECK(found) << "Could not find a corrsponding line in the metadata for img " << img_idx;
-            // VLOG(1) << "TF is " << tf_cam_world.matrix();
-            frame.tf_cam_world=tf_cam_world;
-
-
-
-
-            // auto tf=frame.tf_cam_world;
-            // frame.tf_cam_world=tf.inverse();
-
-
-
-
+            lines_read++;
+        }
+        CHECK(found) << "Could not find a corrsponding line in the metadata for img " << img_idx;
+        // VLOG(1) << "TF is " << tf_cam_world.matrix();
+        frame.tf_cam_world=tf_cam_world;
 
 
 
-            m_frames_for_scene.push_back(frame);
+        // auto tf=frame.tf_cam_world;
+        // frame.tf_cam_world=tf.inverse();
 
-            if(m_nr_imgs_to_read>0 && (int)m_frames_for_scene.size()>=m_nr_imgs_to_read){
-                break; //we finished reading how many images we need so we stop the thread
-            }
-
-        }
-    }
-
-    // VLOG(1) << "loaded a scene with nr of frames " << m_frames_for_scene.size();
-    CHECK(m_frames_for_scene.size()!=0) << "Clouldn't load any images for this scene in path " << scene_path;
-
-    m_nr_scenes_read_so_far++;
+        frames[i]=frame;
+    });
+    // VLOG(1) << "loaded a scene with nr of frames " << frames.size();
+    CHECK(frames.size()!=0) << "Clouldn't load any images for this scene in path " << scene_path;
 
     //shuffle the images from this scene
-    unsigned seed = m_nr_scenes_read_so_far;
+    unsigned seed = seed1+1;
     auto rng_0 = std::default_random_engine(seed);
-    std::shuffle(std::begin(m_frames_for_scene), std::end(m_frames_for_scene), rng_0);
+    std::shuffle(std::begin(frames), std::end(frames), rng_0);
+
+    {
+        std::lock_guard<std::mutex> lock(m_scene_mutex);
+        m_frames_next_scene=std::move(frames);
+    }
 
+    m_next_scene_ready=true;
     m_is_running=false;
 }
 
@@ -328,25 +372,13 @@ void DataLoaderShapeNetImg::load_images_in_frame(easy_pbr::Frame& frame){
 
 
     // VLOG(1) << "load image from" << frame.rgb_path ;
-    cv::Mat rgba_8u=cv::imread(frame.rgb_path, cv::IMREAD_UNCHANGED ); //correct
+    cv::Mat rgba_8u=ImageCache::read(m_image_cache, frame.rgb_path, cv::IMREAD_UNCHANGED, frame.subsample_factor, cv::INTER_AREA); //correct
     // cv::Mat rgba_8u=cv::imread(img_path.string(), cv::IMREAD_ANYCOLOR | cv::IMREAD_ANYDEPTH );
-    if(frame.subsample_factor>1){
-        cv::Mat resized;
-        cv::resize(rgba_8u, resized, cv::Size(), 1.0/frame.subsample_factor, 1.0/frame.subsample_factor, cv::INTER_AREA);
-        rgba_8u=resized;
-    }
-    std::vector<cv::Mat> channels(4);
-    cv::split(rgba_8u, channels);
-    // cv::threshold( channels[3], frame.mask, 0.01, 1.0, cv::THRESH_BINARY);
-    // frame.mask=channels[3];
-    channels[3].convertTo(frame.mask, CV_32FC1, 1.0/255.0);
-    cv::threshold( frame.mask, frame.mask, 0.0, 1.0, cv::THRESH_BINARY);
-    channels.pop_back();
-    cv::merge(channels, frame.rgb_8u);
+    //the rgba mat may be shared with the image cache but this only reads from it
+    MiscDataFuncs::rgba2rgb_and_mask(rgba_8u, false, Eigen::Vector3f::Zero(), &frame.rgb_8u, &frame.rgb_32f, &frame.mask, CV_32F);
 
     // frame.rgb_8u=cv::imread(img_path.string(), cv::IMREAD_UNCHANGED );
     // VLOG(1) << "img type is " << radu::utils::type2string( frame.rgb_8u.type() );
-    frame.rgb_8u.convertTo(frame.rgb_32f, CV_32FC3, 1.0/255.0);
     frame.width=frame.rgb_32f.cols;
     frame.height=frame.rgb_32f.rows;
     // VLOG(1) << " frame width ad height " << frame.width << " " << frame.height;
@@ -387,34 +419,50 @@ void DataLoaderShapeNetImg::load_images_in_frame(easy_pbr::Frame& frame){
 
 
 bool DataLoaderShapeNetImg::finished_reading_scene(){
-    return !m_is_running;
+    std::lock_guard<std::mutex> lock(m_switch_mutex);
+    switch_scene_if_ready();
+    return !m_switch_requested;
 }
 bool DataLoaderShapeNetImg::has_data(){
     return finished_reading_scene();
 }
 
+int DataLoaderShapeNetImg::get_random_frame_idx(){
+    std::lock_guard<std::mutex> lock(m_scene_mutex);
+    CHECK(m_frames_for_scene->size()>0 ) << "m_frames_for_scene has size 0";
+
+    return m_rand_gen->rand_int(0, m_frames_for_scene->size()-1);
+}
 Frame DataLoaderShapeNetImg::get_random_frame(){
-    int random_idx=m_rand_gen->rand_int(0, m_frames_for_scene.size()-1);
-    // int random_idx=0;
-    return m_frames_for_scene[random_idx];
+    std::lock_guard<std::mutex> lock(m_scene_mutex);
+    CHECK(m_frames_for_scene->size()>0 ) << "m_frames_for_scene has size 0";
+
+    return (*m_frames_for_scene)[m_rand_gen->rand_int(0, m_frames_for_scene->size()-1)];
 }
 
 Frame DataLoaderShapeNetImg::get_frame_at_idx( const int idx){
-    CHECK(idx<(int)m_frames_for_scene.size()) << "idx is out of bounds. It is " << idx << " while m_frames has size " << m_frames_for_scene.size();
-
-    Frame  frame= m_frames_for_scene[idx];
+    std::lock_guard<std::mutex> lock(m_scene_mutex);
+    CHECK(idx>=0 && idx<(int)m_frames_for_scene->size()) << "idx is out of bounds. It is " << idx << " while m_frames_for_scene has size " << m_frames_for_scene->size();
 
-    return frame;
+    return (*m_frames_for_scene)[idx];
+}
+std::shared_ptr< const std::vector<easy_pbr::Frame> > DataLoaderShapeNetImg::get_all_frames_ref(){
+    std::lock_guard<std::mutex> lock(m_scene_mutex);
+    return m_frames_for_scene;
 }
 
 
 
 
 bool DataLoaderShapeNetImg::is_finished(){
+    std::lock_guard<std::mutex> lock(m_switch_mutex);
     //check if this loader has loaded everything
     if(m_idx_scene_to_read<(int)m_scene_folders.size()){
         return false; //there is still more files to read
     }
+    if(m_is_running || m_next_scene_ready){
+        return false; //the last scene was read ahead but we didn't switch to it yet
+    }
 
 
     return true; //there is nothing more to read and nothing more in the buffer so we are finished
@@ -423,6 +471,7 @@ bool DataLoaderShapeNetImg::is_finished(){
 
 
 void DataLoaderShapeNetImg::reset(){
+    std::lock_guard<std::mutex> lock(m_switch_mutex);
 
     m_nr_resets++;
 
@@ -433,11 +482,22 @@ void DataLoaderShapeNetImg::reset(){
         std::shuffle(std::begin(m_scene_folders), std::end(m_scene_folders), rng_0);
     }
 
+    //a scene that was read ahead in the previous order is dropped so that the next epoch starts from its first scene. If the user is already waiting for it we let it finish
+    if(!m_switch_requested){
+        if (m_loader_thread.joinable()){
+            m_loader_thread.join();
+        }
+        std::lock_guard<std::mutex> lock_scene(m_scene_mutex);
+        m_frames_next_scene.clear();
+        m_next_scene_ready=false;
+    }
+
     m_idx_scene_to_read=0;
 }
 
 int DataLoaderShapeNetImg::nr_samples(){
-    return m_frames_for_scene.size();
+    std::lock_guard<std::mutex> lock(m_scene_mutex);
+    return m_frames_for_scene->size();
 }
 
 std::unordered_map<std::string, std::string> DataLoaderShapeNetImg::create_mapping_classnr2classname(){
@@ -1,5 +1,10 @@
 #include "data_loaders/DataLoaderShapeNetPartSeg.h"
 
+//c++
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+
 //loguru
 #define LOGURU_REPLACE_GLOG 1
 #include <loguru.hpp>
@@ -13,6 +18,9 @@ using namespace configuru;
 
 //my stuff
 #include "data_loaders/DataTransformer.h"
+#include "data_loaders/MappedFile.h"
+#include "data_loaders/AsciiParser.h"
+#include "data_loaders/WorkerPool.h"
 #include "easy_pbr/Mesh.h"
 // #include "data_loaders/utils/MiscUtils.h"
 #include "Profiler.h"
@@ -32,12 +40,22 @@ namespace fs = boost::filesystem;
 using namespace radu::utils;
 using namespace easy_pbr;
 
-#define BUFFER_SIZE 5 //clouds are stored in a queue until they are acessed, the queue stores a maximum of X items
+//layout of the binary cache of one shape, written next to the text files in <synsetoffset>/points_cache/<shape>.bin
+//  header
+//  nr_points*3 doubles with the xyz, row major, so exactly the values parsed from the pts file
+//  nr_points int32 with the labels
+namespace{
+    const char CACHE_MAGIC[8]={'S','N','P','A','R','T','S','G'};
+    const uint32_t CACHE_VERSION=1;
+    struct CacheHeader{
+        char magic[8];
+        uint32_t version;
+        uint32_t nr_points;
+    };
+    static_assert(sizeof(CacheHeader)==16, "CacheHeader has to have no padding so that the file layout is the same on all compilers");
+}
 
 DataLoaderShapeNetPartSeg::DataLoaderShapeNetPartSeg(const std::string config_file):
-    m_clouds_buffer(BUFFER_SIZE),
-    m_is_running(false),
-    m_idx_cloud_to_read(0),
     m_nr_resets(0),
     m_rand_gen(new RandGenerator)
 {
@@ -54,10 +72,7 @@ DataLoaderShapeNetPartSeg::DataLoaderShapeNetPartSeg(const std::string config_fi
 
 DataLoaderShapeNetPartSeg::~DataLoaderShapeNetPartSeg(){
 
-    m_is_running=false;
-    if (m_loader_thread.joinable()){
-        m_loader_thread.join();
-    }
+    m_clouds_pipeline.stop(); //the readers use the members of the loader so they have to finish before anything gets destroyed
 }
 
 void DataLoaderShapeNetPartSeg::init_params(const std::string config_file){
@@ -85,6 +100,10 @@ void DataLoaderShapeNetPartSeg::init_params(const std::string config_file){
     m_normalize=loader_config["normalize"];
     m_shuffle=loader_config["shuffle"];
     m_do_overfit=loader_config["do_overfit"];
+    m_nr_reader_threads=loader_config.get_or("nr_reader_threads", 1);
+    m_prefetch_depth=loader_config.get_or("prefetch_depth", 4);
+    m_ordered_delivery=loader_config.get_or("ordered_delivery", true);
+    m_use_binary_cache=loader_config.get_or("use_binary_cache", true);
     m_restrict_to_object= (std::string)loader_config["restrict_to_object"]; //makes it load clouds only from a specific object
     m_dataset_path = (std::string)loader_config["dataset_path"];    //get the path where all the off files are
 
@@ -96,12 +115,18 @@ void DataLoaderShapeNetPartSeg::init_params(const std::string config_file){
 }
 
 void DataLoaderShapeNetPartSeg::start(){
-    CHECK(m_is_running==false) << "The loader thread is already running. Please check in the config file that autostart is not already set to true. Or just don't call start()";
+    CHECK(!m_clouds_pipeline.is_running()) << "The loader thread is already running. Please check in the config file that autostart is not already set to true. Or just don't call start()";
 
     init_data_reading();
 
-    m_is_running=true;
-    m_loader_thread=std::thread(&DataLoaderShapeNetPartSeg::read_data, this);  //starts the spin in another thread
+    m_clouds_pipeline.set_nr_readers(m_nr_reader_threads);
+    m_clouds_pipeline.set_prefetch_depth(m_prefetch_depth);
+    m_clouds_pipeline.set_ordered(m_ordered_delivery);
+    int nr_clouds= m_do_overfit? -1 : m_pts_filenames.size(); //when overfitting we keep on reading the first cloud forever
+    m_clouds_pipeline.start(nr_clouds,
+        [this](const int idx){ return read_sample(idx); },
+        [this](MeshSharedPtr& cloud){ process_sample(cloud); },
+        "loader_thread_shapenet");
 }
 
 
@@ -174,132 +199,182 @@ void DataLoaderShapeNetPartSeg::init_data_reading(){
     m_label_mngr=std::make_shared<LabelMngr>(labels_file.string(), colorscheme_file.string(), frequency_file.string(), unlabeled_idx );
 }
 
-void DataLoaderShapeNetPartSeg::read_data(){
-
-    loguru::set_thread_name("loader_thread_shapenet");
-
-
-    while (m_is_running) {
-
-        //we finished reading so we wait here for a reset
-        if(m_idx_cloud_to_read>=m_pts_filenames.size()){
-            std::this_thread::sleep_for(std::chrono::milliseconds(300));
-            continue;
-        }
-
+std::shared_ptr<Mesh> DataLoaderShapeNetPartSeg::read_sample(const int idx){
 
-        // std::cout << "size approx is " << m_queue.size_approx() << '\n';
-        // std::cout << "m_idx_img_to_read is " << m_idx_img_to_read << '\n';
-        if(m_clouds_buffer.size_approx()<BUFFER_SIZE-1){ //there is enough space
-            //read the frame and everything else and push it to the queue
+    int idx_cloud= m_do_overfit? 0 : idx;
+    fs::path pts_filename=m_pts_filenames[ idx_cloud ];
+    fs::path labels_filename=m_labels_filenames[ idx_cloud ];
 
-            TIME_SCOPE("load_shapenet")
+    // VLOG(1) << "Reading from object" << m_restrict_to_object;
 
-            fs::path pts_filename=m_pts_filenames[ m_idx_cloud_to_read ];
-            fs::path labels_filename=m_labels_filenames[ m_idx_cloud_to_read ];
-            if(!m_do_overfit){
-                m_idx_cloud_to_read++;
-            }
+    //read pts, from the binary cache if there is one that is up to date
+    MeshSharedPtr cloud=Mesh::create();
+    fs::path cache_filename=binary_cache_path(pts_filename);
+    if(m_use_binary_cache && is_binary_cache_valid(cache_filename, pts_filename, labels_filename)){
+        read_binary_cache(cache_filename.string(), cloud->V, cloud->L_gt);
+    }else{
+        cloud->V=read_pts(pts_filename.string());
+        cloud->L_gt=read_labels(labels_filename.string());
+    }
+    cloud->D=cloud->V.rowwise().norm();
+    if(m_normalize){
+        cloud->normalize_size();
+        cloud->normalize_position();
+    }
 
-            // VLOG(1) << "Reading from object" << m_restrict_to_object;
+    // VLOG(1) << "cloud->v is " << cloud->V;
 
-            //read pts
-            MeshSharedPtr cloud=Mesh::create();
-            cloud->V=read_pts(pts_filename.string());
-            cloud->L_gt=read_labels(labels_filename.string());
-            cloud->D=cloud->V.rowwise().norm();
-            if(m_normalize){
-                cloud->normalize_size();
-                cloud->normalize_position();
-            }
+    //transform
+    // cloud.apply_transform(m_tf_worldGL_worldROS); // from worldROS to worldGL
 
-            // VLOG(1) << "cloud->v is " << cloud->V;
+    cloud->m_disk_path=pts_filename.string();
 
-            //transform
-            // cloud.apply_transform(m_tf_worldGL_worldROS); // from worldROS to worldGL
-
-            if(m_mode=="train"){
-                cloud=m_transformer->transform(cloud);
-            }
+    return cloud;
+}
 
-            if(m_shuffle_points){ //when splattin it is better if adyacent points in 3D space are not adyancet in memory so that we don't end up with conflicts or race conditions
-                // https://stackoverflow.com/a/15866196
-                Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic> perm(cloud->V.rows());
-                perm.setIdentity();
-                std::shuffle(perm.indices().data(), perm.indices().data()+perm.indices().size(), m_rand_gen->generator());
-                // VLOG(1) << "permutation matrix is " << perm.indices();
-                // A_perm = A * perm; // permute columns
-                cloud->V = perm * cloud->V; // permute rows
-                cloud->L_gt = perm * cloud->L_gt; // permute rows
-                cloud->D = perm * cloud->D; // permute rows
-            }
+void DataLoaderShapeNetPartSeg::process_sample(MeshSharedPtr& cloud){
 
-            //some sensible visualization options
-            cloud->m_vis.m_show_mesh=false;
-            cloud->m_vis.m_show_points=true;
-            cloud->m_vis.m_color_type=+MeshColorType::SemanticGT;
+    TIME_SCOPE("process_shapenet")
 
-            //set the labelmngr which will be used by the viewer to put correct colors for the semantics
-            // cloud->m_label_mngr=m_label_mngr->shared_from_this();
-            cloud->m_label_mngr=m_label_mngr;
+    if(m_mode=="train"){
+        cloud=m_transformer->transform(cloud);
+    }
 
-            // VLOG(1) << "Label uindx is " << cloud->m_label_mngr->get_idx_unlabeled();
-            cloud->m_disk_path=pts_filename.string();
+    if(m_shuffle_points){ //when splattin it is better if adyacent points in 3D space are not adyancet in memory so that we don't end up with conflicts or race conditions
+        // https://stackoverflow.com/a/15866196
+        Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic> perm(cloud->V.rows());
+        perm.setIdentity();
+        std::shuffle(perm.indices().data(), perm.indices().data()+perm.indices().size(), m_rand_gen->generator());
+        // VLOG(1) << "permutation matrix is " << perm.indices();
+        // A_perm = A * perm; // permute columns
+        cloud->V = perm * cloud->V; // permute rows
+        cloud->L_gt = perm * cloud->L_gt; // permute rows
+        cloud->D = perm * cloud->D; // permute rows
+    }
 
-            m_clouds_buffer.enqueue(cloud);
+    //some sensible visualization options
+    cloud->m_vis.m_show_mesh=false;
+    cloud->m_vis.m_show_points=true;
+    cloud->m_vis.m_color_type=+MeshColorType::SemanticGT;
 
-        }
+    //set the labelmngr which will be used by the viewer to put correct colors for the semantics
+    // cloud->m_label_mngr=m_label_mngr->shared_from_this();
+    cloud->m_label_mngr=m_label_mngr;
 
-    }
+    // VLOG(1) << "Label uindx is " << cloud->m_label_mngr->get_idx_unlabeled();
 
 }
 
 
+//the files are parsed directly from the mapped pages into the preallocated matrices so that nothing gets allocated for each point
 Eigen::MatrixXd DataLoaderShapeNetPartSeg::read_pts(const std::string file_path){
-    std::ifstream infile( file_path );
-    if(!infile.is_open()){
-        LOG(FATAL) << "Could not open pts file " << file_path;
+    MappedFile file(file_path);
+    AsciiParser parser(file);
+
+    Eigen::MatrixXd V(parser.count_lines(), 3);
+    for(int i=0; i<V.rows(); i++){
+        V(i,0)=parser.parse_double();
+        V(i,1)=parser.parse_double();
+        V(i,2)=parser.parse_double();
+        parser.next_line();
     }
 
-    std::vector<Eigen::Vector3d > points_vec;
-    std::string line;
-    while (std::getline(infile, line)) {
-        std::istringstream iss(line);
-
-
-        std::vector<std::string> tokens=split(line," ");
-        Eigen::Vector3d point;
-        point.x()=stod(tokens[0]);
-        point.y()=stod(tokens[1]);
-        point.z()=stod(tokens[2]);
+    return V;
+}
 
-        points_vec.push_back(point);
+Eigen::MatrixXi DataLoaderShapeNetPartSeg::read_labels(const std::string file_path){
+    MappedFile file(file_path);
+    AsciiParser parser(file);
 
+    Eigen::MatrixXi labels(parser.count_lines(), 1);
+    for(int i=0; i<labels.rows(); i++){
+        labels(i,0)=parser.parse_int();
+        parser.next_line();
     }
 
-    return vec2eigen(points_vec);
+    return labels;
 }
 
-Eigen::MatrixXi DataLoaderShapeNetPartSeg::read_labels(const std::string file_path){
-    std::ifstream infile( file_path );
-    if(!infile.is_open()){
-        LOG(FATAL) << "Could not open labels file " << file_path;
-    }
+fs::path DataLoaderShapeNetPartSeg::binary_cache_path(const fs::path& pts_filename){
+    return pts_filename.parent_path().parent_path()/"points_cache"/(pts_filename.stem().string()+".bin");
+}
 
-    std::vector< int> labels_vec;
-    std::string line;
-    while (std::getline(infile, line)) {
-        std::istringstream iss(line);
+bool DataLoaderShapeNetPartSeg::is_binary_cache_valid(const fs::path& cache_filename, const fs::path& pts_filename, const fs::path& labels_filename){
+    //a cache that is older than the text files was written from files that have been changed since, so we ignore it
+    boost::system::error_code ec;
+    std::time_t cache_time=fs::last_write_time(cache_filename, ec);
+    if(ec){
+        return false;
+    }
+    return cache_time>=fs::last_write_time(pts_filename) && cache_time>=fs::last_write_time(labels_filename);
+}
 
+void DataLoaderShapeNetPartSeg::read_binary_cache(const std::string file_path, Eigen::MatrixXd& V, Eigen::MatrixXi& labels){
+    MappedFile file(file_path);
 
-        std::vector<std::string> tokens=split(line," ");
-        int label=stoi(tokens[0]);
+    const CacheHeader* header=file.at<CacheHeader>(0);
+    CHECK( std::memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC))==0 ) << file_path << " is not a shapenet part seg cache file";
+    CHECK(header->version==CACHE_VERSION) << file_path << " has version " << header->version << " but we can only read version " << CACHE_VERSION << ". Please write the cache again with DataLoaderShapeNetPartSeg.write_binary_cache";
+    int nr_points=header->nr_points;
 
-        labels_vec.push_back(label);
+    size_t xyz_offset=sizeof(CacheHeader);
+    size_t labels_offset=xyz_offset+(size_t)nr_points*3*sizeof(double);
+    Eigen::Map< const Eigen::Matrix<double, Eigen::Dynamic, 3, Eigen::RowMajor> > xyz(file.at<double>(xyz_offset, (size_t)nr_points*3), nr_points, 3);
+    Eigen::Map< const Eigen::Matrix<int32_t, Eigen::Dynamic, 1> > labels_mapped(file.at<int32_t>(labels_offset, nr_points), nr_points);
+    V=xyz;
+    labels=labels_mapped.cast<int>();
+}
 
+void DataLoaderShapeNetPartSeg::write_binary_cache(const std::string dataset_path){
+    fs::path full_path=dataset_path;
+    if(!fs::is_directory(full_path)) {
+        LOG(FATAL) << "No directory " << full_path;
     }
 
-    return vec2eigen(labels_vec);
+    //every synsetoffset folder has the shapes in points/ and the labels with the same name in points_label/
+    std::vector<fs::path> pts_filenames;
+    for (fs::directory_iterator synset_itr(full_path); synset_itr!=fs::directory_iterator(); ++synset_itr){
+        fs::path points_dir=synset_itr->path()/"points";
+        if(!fs::is_directory(points_dir)){
+            continue;
+        }
+        for (fs::directory_iterator itr(points_dir); itr!=fs::directory_iterator(); ++itr){
+            if(itr->path().extension()==".pts"){
+                pts_filenames.push_back(itr->path());
+            }
+        }
+        fs::create_directories(synset_itr->path()/"points_cache");
+    }
+    std::sort(pts_filenames.begin(), pts_filenames.end());
+    CHECK(pts_filenames.size()>0) << "We did not find any pts files in " << full_path;
+
+    //the shapes are independent so we convert them in parallel
+    WorkerPool::parallel_for(WorkerPool::shared(0), pts_filenames.size(), [&](const int i){
+        const fs::path& pts_filename=pts_filenames[i];
+        fs::path labels_filename=pts_filename.parent_path().parent_path()/"points_label"/(pts_filename.stem().string()+".seg");
+        Eigen::Matrix<double, Eigen::Dynamic, 3, Eigen::RowMajor> xyz=read_pts(pts_filename.string());
+        Eigen::Matrix<int32_t, Eigen::Dynamic, 1> labels=read_labels(labels_filename.string());
+        CHECK(xyz.rows()==labels.rows()) << pts_filename << " has " << xyz.rows() << " points but " << labels_filename << " has " << labels.rows() << " labels";
+
+        CacheHeader header;
+        std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+        header.version=CACHE_VERSION;
+        header.nr_points=xyz.rows();
+
+        //we write into a temporary file and rename it at the end so that a loader never sees a half written cache
+        fs::path cache_filename=binary_cache_path(pts_filename);
+        fs::path tmp_filename=cache_filename.string()+".tmp";
+        std::ofstream file(tmp_filename.string(), std::ios::binary);
+        CHECK(file.is_open()) << "Could not open " << tmp_filename << " for writing";
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(xyz.data()), (size_t)xyz.rows()*3*sizeof(double));
+        file.write(reinterpret_cast<const char*>(labels.data()), (size_t)labels.rows()*sizeof(int32_t));
+        file.close();
+        CHECK(!file.fail()) << "Failed writing " << tmp_filename;
+        fs::rename(tmp_filename, cache_filename);
+    });
+
+    std::cout << "Wrote the binary cache for " << pts_filenames.size() << " shapes in " << full_path << std::endl;
 }
 
 std::unordered_map<std::string, std::string> DataLoaderShapeNetPartSeg::read_mapping_synsetoffset2category(const std::string file_path){
@@ -331,63 +406,41 @@ std::unordered_map<std::string, std::string> DataLoaderShapeNetPartSeg::read_map
 
 
 bool DataLoaderShapeNetPartSeg::has_data(){
-    if(m_clouds_buffer.peek()==nullptr){
-        return false;
-    }else{
-        return true;
-    }
+    return m_clouds_pipeline.has_data();
 }
 
 
 std::shared_ptr<Mesh> DataLoaderShapeNetPartSeg::get_cloud(){
 
-    std::shared_ptr<Mesh> cloud;
-    m_clouds_buffer.try_dequeue(cloud);
-
-    return cloud;
+    return m_clouds_pipeline.try_get();
 }
 
 bool DataLoaderShapeNetPartSeg::is_finished(){
-    //check if this loader has loaded everything
-    if(m_idx_cloud_to_read<m_pts_filenames.size()){
-        return false; //there is still more files to read
-    }
-
-    //check that there is nothing in the ring buffers
-    if(m_clouds_buffer.peek()!=nullptr){
-        return false; //there is still something in the buffer
-    }
-
-    return true; //there is nothing more to read and nothing more in the buffer so we are finished
-
+    return m_clouds_pipeline.is_finished(); //there is nothing more to read and nothing more in the buffer
 }
 
 
 bool DataLoaderShapeNetPartSeg::is_finished_reading(){
-    //check if this loader has loaded everything
-    if(m_idx_cloud_to_read<m_pts_filenames.size()){
-        return false; //there is still more files to read
-    }
-
-    return true; //there is nothing more to read and so we are finished reading
-
+    return m_clouds_pipeline.is_finished_reading();
 }
 
 void DataLoaderShapeNetPartSeg::reset(){
 
-    m_nr_resets++;
-
-    //reshuffle for the next epoch
-    if(m_shuffle){
-        // unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-        unsigned seed = m_nr_resets;
-        auto rng_0 = std::default_random_engine(seed); //create two engines with the same states so the vector are randomized in the same way
-        auto rng_1 = rng_0;
-        std::shuffle(std::begin(m_pts_filenames), std::end(m_pts_filenames), rng_0);
-        std::shuffle(std::begin(m_labels_filenames), std::end(m_labels_filenames), rng_1);
-    }
-
-    m_idx_cloud_to_read=0;
+    int nr_clouds= m_do_overfit? -1 : m_pts_filenames.size();
+    //the readers are paused while we shuffle so none of them sees the file lists half shuffled
+    m_clouds_pipeline.reset(nr_clouds, [this](){
+        m_nr_resets++;
+
+        //reshuffle for the next epoch
+        if(m_shuffle){
+            // unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
+            unsigned seed = m_nr_resets;
+            auto rng_0 = std::default_random_engine(seed); //create two engines with the same states so the vector are randomized in the same way
+            auto rng_1 = rng_0;
+            std::shuffle(std::begin(m_pts_filenames), std::end(m_pts_filenames), rng_0);
+            std::shuffle(std::begin(m_labels_filenames), std::end(m_labels_filenames), rng_1);
+        }
+    });
 }
 
 int DataLoaderShapeNetPartSeg::nr_samples(){
@@ -415,22 +468,13 @@ std::string DataLoaderShapeNetPartSeg::get_object_name(){
 }
 
 void DataLoaderShapeNetPartSeg::set_object_name(const std::string object_name){
-    //kill data loading thread
-    m_is_running=false;
-    m_loader_thread.join();
+    //kill data loading threads, this also drops the clouds that were already prefetched
+    m_clouds_pipeline.stop();
 
     //clear all data
-    m_idx_cloud_to_read=0;
     m_nr_resets=0;
     m_pts_filenames.clear();
     m_labels_filenames.clear();
-    // m_clouds_buffer.clear();
-    //deque until ihe cloud buffer is empty
-    bool has_data=true;
-    MeshSharedPtr dummy_cloud;
-    while(has_data){
-        has_data=m_clouds_buffer.try_dequeue(dummy_cloud);
-    }
 
     //set the new object_name
     m_restrict_to_object=object_name;
@@ -27,18 +27,13 @@ namespace fs = boost::filesystem;
 
 //my stuff
 #include "RandGenerator.h"
+#include "data_loaders/MiscDataFuncs.h"
 
 using namespace radu::utils;
 using namespace easy_pbr;
 
-#define BUFFER_SIZE 5 //clouds are stored in a queue until they are acessed, the queue stores a maximum of X items
-
 DataLoaderStanford3DScene::DataLoaderStanford3DScene(const std::string config_file):
     m_is_modified(false),
-    m_is_running(false),
-    m_frames_color_buffer(BUFFER_SIZE),
-    m_frames_depth_buffer(BUFFER_SIZE),
-    m_idx_sample_to_read(0),
     m_nr_resets(0),
     m_rand_gen(new RandGenerator),
     m_rgb_subsample_factor(1),
@@ -47,19 +42,14 @@ DataLoaderStanford3DScene::DataLoaderStanford3DScene(const std::string config_fi
 
     init_params(config_file);
     if(m_autostart){
-        m_is_running=true;
-        m_loader_thread=std::thread(&DataLoaderStanford3DScene::read_data, this);  //starts the spin in another thread
+        start();
     }
 
 }
 
 DataLoaderStanford3DScene::~DataLoaderStanford3DScene(){
 
-    m_is_running=false;
-
-    if (m_loader_thread.joinable()){
-        m_loader_thread.join();
-    }
+    m_frames_pipeline.stop(); //the readers use the members of the loader so they have to finish before anything gets destroyed
 }
 
 void DataLoaderStanford3DScene::init_params(const std::string config_file){
@@ -80,20 +70,35 @@ void DataLoaderStanford3DScene::init_params(const std::string config_file){
     m_nr_samples_to_read=loader_config["nr_samples_to_read"];
     m_shuffle=loader_config["shuffle"];
     m_do_overfit=loader_config["do_overfit"];
+    m_nr_reader_threads=loader_config.get_or("nr_reader_threads", 1);
+    m_prefetch_depth=loader_config.get_or("prefetch_depth", 4);
+    m_ordered_delivery=loader_config.get_or("ordered_delivery", true);
     m_dataset_path=(std::string)loader_config["dataset_path"];
     m_pose_file_path=(std::string)loader_config["pose_file_path"];
     m_rgb_subsample_factor=loader_config["rgb_subsample_factor"];
+    m_reduced_jpeg_decode=loader_config.get_or("reduced_jpeg_decode", false);
     m_depth_subsample_factor=loader_config["depth_subsample_factor"];
 
 }
 
 void DataLoaderStanford3DScene::start(){
-    CHECK(m_is_running==false) << "The loader thread is already running. Please check in the config file that autostart is not already set to true. Or just don't call start()";
+    CHECK(!m_frames_pipeline.is_running()) << "The loader thread is already running. Please check in the config file that autostart is not already set to true. Or just don't call start()";
 
     init_data_reading();
 
-    m_is_running=true;
-    m_loader_thread=std::thread(&DataLoaderStanford3DScene::read_data, this);  //starts the spin in another thread
+    m_frames_pipeline.set_nr_readers(m_nr_reader_threads);
+    m_frames_pipeline.set_prefetch_depth(m_prefetch_depth);
+    m_frames_pipeline.set_ordered(m_ordered_delivery);
+    int nr_frames= m_do_overfit? -1 : m_samples_filenames.size(); //when overfitting we keep on reading the first sample forever
+    //there is no randomness in reading the samples so there is no processing stage
+    m_frames_pipeline.start(nr_frames,
+        [this](const int idx){
+            std::pair<Frame, Frame> frames;
+            read_sample(frames.first, frames.second, m_samples_filenames[ m_do_overfit? 0 : idx ]);
+            return frames;
+        },
+        nullptr,
+        "loader_thread_stanford3d");
 }
 
 void DataLoaderStanford3DScene::init_data_reading(){
@@ -155,60 +160,14 @@ void DataLoaderStanford3DScene::init_data_reading(){
 
 }
 
-void DataLoaderStanford3DScene::read_data(){
-
-    loguru::set_thread_name("loader_thread_vol_ref");
-
-
-    while (m_is_running ) {
-
-        //we finished reading so we wait here for a reset
-        if(m_idx_sample_to_read>=m_samples_filenames.size()){
-            std::this_thread::sleep_for(std::chrono::milliseconds(300));
-            continue;
-        }
-
-        // std::cout << "size approx is " << m_queue.size_approx() << '\n';
-        // std::cout << "m_idx_img_to_read is " << m_idx_img_to_read << '\n';
-        if(m_frames_color_buffer.size_approx()<BUFFER_SIZE-1){ //there is enough space
-            //read the frame and everything else and push it to the queue
-
-            fs::path sample_filename=m_samples_filenames[ m_idx_sample_to_read ];
-            if(!m_do_overfit){
-                m_idx_sample_to_read++;
-            }
-
-            //read frame color and frame depth
-            Frame frame_color;
-            Frame frame_depth;
-            read_sample(frame_color, frame_depth, sample_filename);
-
-
-
-            m_frames_color_buffer.enqueue(frame_color);
-            m_frames_depth_buffer.enqueue(frame_depth);
-
-        }
-
-    }
-
-}
-
-
 void DataLoaderStanford3DScene::read_sample(Frame& frame_color, Frame& frame_depth, const boost::filesystem::path& sample_filename){
 
-    TIME_SCOPE("data_loader_stanford3d")
+    // TIME_SCOPE("data_loader_stanford3d") //this runs now on several reader threads at the same time
 
     int frame_idx= std::stoi(sample_filename.stem().string());
 
     //read color img
-    frame_color.rgb_8u=cv::imread(sample_filename.string());
-    if(m_rgb_subsample_factor>1){
-        cv::Mat resized;
-        cv::resize(frame_color.rgb_8u, resized, cv::Size(), 1.0/m_rgb_subsample_factor, 1.0/m_rgb_subsample_factor, cv::INTER_AREA);
-        // frame.rgb_8u=resized.clone();
-        frame_color.rgb_8u=resized;
-    }
+    frame_color.rgb_8u=MiscDataFuncs::read_image(sample_filename.string(), cv::IMREAD_COLOR, m_rgb_subsample_factor, cv::INTER_AREA, m_reduced_jpeg_decode);
     frame_color.rgb_8u.convertTo(frame_color.rgb_32f, CV_32FC3, 1.0/255.0);
     frame_color.width=frame_color.rgb_32f.cols;
     frame_color.height=frame_color.rgb_32f.rows;
@@ -320,26 +279,45 @@ Eigen::Matrix3d DataLoaderStanford3DScene::read_intrinsics_file(std::string intr
 
 
 bool DataLoaderStanford3DScene::has_data(){
-    if(m_frames_color_buffer.peek()==nullptr || m_frames_depth_buffer.peek()==nullptr){
-        return false;
-    }else{
+    if(!m_frames_color_ready.empty() && !m_frames_depth_ready.empty()){
         return true;
     }
+    return m_frames_pipeline.has_data();
 }
 
 
 Frame DataLoaderStanford3DScene::get_color_frame(){
 
+    //the color and depth come together from the pipeline so we keep the depth around until it gets requested
+    if(m_frames_color_ready.empty() && m_frames_pipeline.has_data()){
+        std::pair<Frame, Frame> frames=m_frames_pipeline.try_get();
+        m_frames_color_ready.push_back(frames.first);
+        m_frames_depth_ready.push_back(frames.second);
+    }
+
     Frame frame;
-    m_frames_color_buffer.try_dequeue(frame);
+    if(!m_frames_color_ready.empty()){
+        frame=m_frames_color_ready.front();
+        m_frames_color_ready.pop_front();
+    }
 
     return frame;
 }
 
 Frame DataLoaderStanford3DScene::get_depth_frame(){
 
+    //the color and depth come together from the pipeline so we keep the color around until it gets requested
+    if(m_frames_depth_ready.empty() && m_frames_pipeline.has_data()){
+        std::pair<Frame, Frame> frames=m_frames_pipeline.try_get();
+        m_frames_color_ready.push_back(frames.first);
+        m_frames_depth_ready.push_back(frames.second);
+    }
+
     Frame frame;
-    m_frames_depth_buffer.try_dequeue(frame);
+    if(!m_frames_depth_ready.empty()){
+        frame=m_frames_depth_ready.front();
+        m_frames_depth_ready.pop_front();
+    }
 
     return frame;
 }
@@ -347,12 +325,12 @@ Frame DataLoaderStanford3DScene::get_depth_frame(){
 
 bool DataLoaderStanford3DScene::is_finished(){
     //check if this loader has loaded everything
-    if(m_idx_sample_to_read<m_samples_filenames.size()){
-        return false; //there is still more files to read
+    if(!m_frames_pipeline.is_finished()){
+        return false; //there is still more files to read or something in the pipeline
     }
 
     //check that there is nothing in the ring buffers
-    if(m_frames_color_buffer.peek()!=nullptr || m_frames_depth_buffer.peek()!=nullptr){
+    if(!m_frames_color_ready.empty() || !m_frames_depth_ready.empty()){
         return false; //there is still something in the buffer
     }
 
@@ -362,27 +340,26 @@ bool DataLoaderStanford3DScene::is_finished(){
 
 
 bool DataLoaderStanford3DScene::is_finished_reading(){
-    //check if this loader has loaded everything
-    if(m_idx_sample_to_read<m_samples_filenames.size()){
-        return false; //there is still more files to read
-    }
-
-    return true; //there is nothing more to read and so we are finished reading
-
+    return m_frames_pipeline.is_finished_reading();
 }
 
 void DataLoaderStanford3DScene::reset(){
-    m_nr_resets++;
-    // we shuffle again the data so as to have freshly shuffled data for the next epoch
-    if(m_shuffle){
-        // unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-        // auto rng = std::default_random_engine(seed);
-        unsigned seed = m_nr_resets;
-        auto rng = std::default_random_engine(seed);
-        std::shuffle(std::begin(m_samples_filenames), std::end(m_samples_filenames), rng);
-    }
+    int nr_frames= m_do_overfit? -1 : m_samples_filenames.size();
+    //the readers are paused while we shuffle so none of them sees the file list half shuffled
+    m_frames_pipeline.reset(nr_frames, [this](){
+        m_nr_resets++;
+        // we shuffle again the data so as to have freshly shuffled data for the next epoch
+        if(m_shuffle){
+            // unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
+            // auto rng = std::default_random_engine(seed);
+            unsigned seed = m_nr_resets;
+            auto rng = std::default_random_engine(seed);
+            std::shuffle(std::begin(m_samples_filenames), std::end(m_samples_filenames), rng);
+        }
+    });
 
-    m_idx_sample_to_read=0;
+    m_frames_color_ready.clear();
+    m_frames_depth_ready.clear();
 }
 
 int DataLoaderStanford3DScene::nr_samples(){
@@ -4,6 +4,8 @@
 #include <algorithm>
 #include <random>
 #include <iostream>
+#include <fstream>
+#include <cstring>
 
 #include <opencv2/imgcodecs.hpp>  //for imread
 #include "opencv2/imgproc/imgproc.hpp" //for cv::resize
@@ -28,38 +30,56 @@ using namespace configuru;
 #include "data_loaders/LabelMngr.h"
 #include "data_loaders/utils/MiscUtils.h"
 #include "data_loaders/utils/Profiler.h"
+#include "data_loaders/MappedFile.h"
+#include "data_loaders/AsciiParser.h"
+#include "data_loaders/WorkerPool.h"
 
 #include <boost/range.hpp>
 
 using namespace radu::utils;
 using namespace easy_pbr;
 
-#define BUFFER_SIZE 5 //clouds are stored in a queue until they are acessed, the queue stores a maximum of X items
+//layout of the room_binary.bin of a room. Each attribute is stored in its own contiguous block so that it can be used directly as a column major matrix
+//  header
+//  x, y and z blocks of nr_points floats each
+//  r, g and b blocks of nr_points floats each, in [0,1]
+//  nr_points int32 with the label ids
+//the old binaries had no header and 7 interleaved floats per point (xyz, rgb, label), we can still read them
+namespace{
+    const char ROOM_MAGIC[8]={'S','3','D','I','S','S','O','A'};
+    const uint32_t ROOM_VERSION=1;
+    struct RoomHeader{
+        char magic[8];
+        uint32_t version;
+        uint32_t padding;
+        uint64_t nr_points;
+    };
+    static_assert(sizeof(RoomHeader)==24, "RoomHeader has to have no padding so that the file layout is the same on all compilers");
+
+    //the points of one object file of a room
+    struct ObjectPoints{
+        Eigen::MatrixXd xyz;
+        Eigen::MatrixXd rgb;
+        int label_id;
+    };
+}
 
 DataLoaderStanfordIndoor::DataLoaderStanfordIndoor(const std::string config_file):
     m_is_modified(false),
-    m_is_running(false),
-    m_clouds_buffer(BUFFER_SIZE),
-    m_idx_cloud_to_read(0),
     m_nr_resets(0),
     m_rand_gen(new RandGenerator)
 {
 
     init_params(config_file);
     if(m_autostart){
-        m_is_running=true;
-        m_loader_thread=std::thread(&DataLoaderStanfordIndoor::read_data, this);  //starts the spin in another thread
+        start();
     }
 
 }
 
 DataLoaderStanfordIndoor::~DataLoaderStanfordIndoor(){
 
-    m_is_running=false;
-
-    if (m_loader_thread.joinable()){
-        m_loader_thread.join();
-    }
+    m_clouds_pipeline.stop(); //the readers use the members of the loader so they have to finish before anything gets destroyed
 }
 
 void DataLoaderStanfordIndoor::init_params(const std::string config_file){
@@ -82,6 +102,9 @@ void DataLoaderStanfordIndoor::init_params(const std::string config_file){
     m_shuffle_points=loader_config["shuffle_points"];
     m_shuffle=loader_config["shuffle"];
     m_do_overfit=loader_config["do_overfit"];
+    m_nr_reader_threads=loader_config.get_or("nr_reader_threads", 1);
+    m_prefetch_depth=loader_config.get_or("prefetch_depth", 4);
+    m_ordered_delivery=loader_config.get_or("ordered_delivery", true);
     m_dataset_path=(std::string)loader_config["dataset_path"];
 
     //label file and colormap
@@ -92,17 +115,23 @@ void DataLoaderStanfordIndoor::init_params(const std::string config_file){
     Config transformer_config=loader_config["transformer"];
     m_transformer=std::make_shared<DataTransformer>(transformer_config);
 
+    m_worker_pool=WorkerPool::shared(0);
 
 }
 
 void DataLoaderStanfordIndoor::start(){
-    CHECK(m_is_running==false) << "The loader thread is already running. Please check in the config file that autostart is not already set to true. Or just don't call start()";
-    m_is_running=true;
-    if(m_read_original_data_and_reparse){
-        m_loader_thread=std::thread(&DataLoaderStanfordIndoor::read_data_and_reparse, this);  //starts the spin in another thread
-    }else{
-        m_loader_thread=std::thread(&DataLoaderStanfordIndoor::read_data, this);  //starts the spin in another thread
-    }
+    CHECK(!m_clouds_pipeline.is_running()) << "The loader thread is already running. Please check in the config file that autostart is not already set to true. Or just don't call start()";
+
+    init_data_reading();
+
+    m_clouds_pipeline.set_nr_readers(m_nr_reader_threads);
+    m_clouds_pipeline.set_prefetch_depth(m_prefetch_depth);
+    m_clouds_pipeline.set_ordered(m_ordered_delivery);
+    int nr_clouds= m_do_overfit? -1 : m_room_paths.size(); //when overfitting we keep on reading the first cloud forever
+    m_clouds_pipeline.start(nr_clouds,
+        [this](const int idx){ return read_sample(idx); },
+        [this](MeshCore& cloud){ process_sample(cloud); },
+        "loader_thread_stanford");
 }
 
 bool DataLoaderStanfordIndoor::should_read_area(const int area_number){
@@ -250,347 +279,295 @@ void DataLoaderStanfordIndoor::init_data_reading(){
 
 }
 
-void DataLoaderStanfordIndoor::read_data_and_reparse(){
-
-    loguru::set_thread_name("loader_thread_stanford");
-
-    init_data_reading();
-
-    while (m_is_running ) {
-
-        //we finished reading so we wait here for a reset
-        if(m_idx_cloud_to_read>=m_room_paths.size()){
-            std::this_thread::sleep_for(std::chrono::milliseconds(300));
-            continue;
-        }
-
-        // std::cout << "size approx is " << m_queue.size_approx() << '\n';
-        // std::cout << "m_idx_img_to_read is " << m_idx_img_to_read << '\n';
-        if(m_clouds_buffer.size_approx()<BUFFER_SIZE-1){ //there is enough space
-            //read the frame and everything else and push it to the queue
+MeshCore DataLoaderStanfordIndoor::read_sample(const int idx){
 
-            fs::path room_path=m_room_paths[ m_idx_cloud_to_read ];
-            if(!m_do_overfit){
-                m_idx_cloud_to_read++;
-            }
-            VLOG(1) <<"reading room " << room_path;
+    fs::path room_path=m_room_paths[ m_do_overfit? 0 : idx ];
 
+    if(m_read_original_data_and_reparse){
+        return read_room_and_reparse(room_path);
+    }else{
+        return read_room_binary(room_path);
+    }
+}
 
-            std::vector<Eigen::VectorXd> xyz_vec;
-            std::vector<Eigen::VectorXd> rgb_vec;
-            std::vector<int> labels_vec;
-            std::vector<float> all_room_data;
+MeshCore DataLoaderStanfordIndoor::read_room_and_reparse(const fs::path& room_path){
 
-            fs::path annotations_path=room_path/"Annotations";
-            for(auto& object_path : boost::make_iterator_range(boost::filesystem::directory_iterator(annotations_path), {})){
+    VLOG(1) <<"reading room " << room_path;
 
-                //OBJECTS
 
-                //Now we have to read each object in this room
-                //get the name of the object
-                std::string stem=object_path.path().stem().string();
-                // VLOG(1) << "reading object " << object_path << "stem is " << stem;
-                std::vector<std::string> tokens=er::utils::split(stem, "_");
-                if (tokens.size()!=2){
-                    continue; //some files are actually not objects. There are fucked up files there like Icon and stuff like that...
-                }
-                std::string object_name=tokens[0];
-                int label_id=m_label_mngr->label2idx(object_name);
-
-                //read all the points for this object and put them into a vector of xyz,rgb and labels for this room
-                std::ifstream infile( object_path.path().string() );
-                if(!infile.is_open()){
-                    LOG(FATAL) << "Could not open object file " << object_path;
-                    continue;
-                }
-                std::string line;
-                Eigen::Vector3d xyz, rgb;
-
-                // attempt 1 (about 400 ms)
-                while (std::getline(infile, line)) {
-                    std::istringstream iss(line);
-                    std::vector<std::string> tokens=split(line," ");
-                    if (tokens.size()!=6) {
-                        LOG(WARNING) << "line " << line << "could not be parsed into 6 tokens. Dropping point";
-                        continue;
-                    }
-                    // CHECK(tokens.size()==6) << "We have more than 6 tokens on line " << line;
-                    xyz.x()=stod(tokens[0]);
-                    xyz.y()=stod(tokens[1]);
-                    xyz.z()=stod(tokens[2]);
-                    rgb.x()=stod(tokens[3])/255.0;
-                    rgb.y()=stod(tokens[4])/255.0;
-                    rgb.z()=stod(tokens[5])/255.0;
-                    xyz_vec.push_back(xyz);
-                    rgb_vec.push_back(rgb);
-                    labels_vec.push_back(label_id);
-                    all_room_data.push_back(xyz.x());
-                    all_room_data.push_back(xyz.y());
-                    all_room_data.push_back(xyz.z());
-                    all_room_data.push_back(rgb.x());
-                    all_room_data.push_back(rgb.y());
-                    all_room_data.push_back(rgb.z());
-                    all_room_data.push_back(label_id);
-                }
+    //get the objects of the room. Some files are actually not objects, there are fucked up files there like Icon and stuff like that...
+    std::vector<fs::path> object_paths;
+    std::vector<int> object_label_ids;
+    fs::path annotations_path=room_path/"Annotations";
+    for(auto& object_path : boost::make_iterator_range(boost::filesystem::directory_iterator(annotations_path), {})){
+        std::string stem=object_path.path().stem().string();
+        std::vector<std::string> tokens=er::utils::split(stem, "_");
+        if (tokens.size()!=2){
+            continue;
+        }
+        std::string object_name=tokens[0];
+        object_paths.push_back(object_path.path());
+        object_label_ids.push_back(m_label_mngr->label2idx(object_name));
+    }
 
+    //parse the objects in parallel, each one into its own slot so the points stay in the same order as when reading them one after another
+    std::vector<ObjectPoints> objects(object_paths.size());
+    WorkerPool::parallel_for(m_worker_pool, objects.size(), [&](const int i){
+        MappedFile file(object_paths[i].string());
+        AsciiParser parser(file);
+        size_t max_nr_points=parser.count_lines();
+        ObjectPoints& object=objects[i];
+        object.xyz.resize(max_nr_points, 3);
+        object.rgb.resize(max_nr_points, 3);
+        object.label_id=object_label_ids[i];
+
+        int nr_points=0;
+        while(!parser.at_end()){
+            if (parser.nr_tokens_in_line()!=6) {
+                LOG(WARNING) << "a line of " << object_paths[i] << " could not be parsed into 6 tokens. Dropping point";
+                parser.next_line();
+                continue;
             }
-            //add also the umber of elements as first
-            // all_room_data.insert(all_room_data.begin(), xyz_vec.size() );
-            // Profiler_ns::Profiler::print_all_stats();
-
-            //Finished readin all the oject in the rooom. Now we combine the whole room into a mesh and return it
-            MeshCore cloud;
-            cloud.V=er::utils::vec2eigen(xyz_vec);
-            cloud.C=er::utils::vec2eigen(rgb_vec);
-            cloud.L_gt=er::utils::vec2eigen(labels_vec);
-            // cloud.D=cloud.V.rowwise().norm();
-
-
-            //the rooms are aligned in a weird manner. We rotate them as we see fit
-            Eigen::Affine3d tf_worldGL_worldROS;
-            tf_worldGL_worldROS.setIdentity();
-            Eigen::Matrix3d worldGL_worldROS_rot;
-            worldGL_worldROS_rot = Eigen::AngleAxisd(-0.5*M_PI, Eigen::Vector3d::UnitX());
-            tf_worldGL_worldROS.matrix().block<3,3>(0,0)=worldGL_worldROS_rot;
-            cloud.apply_transform(tf_worldGL_worldROS);
+            object.xyz(nr_points,0)=parser.parse_double();
+            object.xyz(nr_points,1)=parser.parse_double();
+            object.xyz(nr_points,2)=parser.parse_double();
+            object.rgb(nr_points,0)=parser.parse_double()/255.0;
+            object.rgb(nr_points,1)=parser.parse_double()/255.0;
+            object.rgb(nr_points,2)=parser.parse_double()/255.0;
+            nr_points++;
+            parser.next_line();
+        }
+        object.xyz.conservativeResize(nr_points, 3);
+        object.rgb.conservativeResize(nr_points, 3);
+    });
+
+    //Finished readin all the oject in the rooom. Now we combine the whole room into a mesh and return it
+    int nr_points_room=0;
+    for(size_t i=0; i<objects.size(); i++){
+        nr_points_room+=objects[i].xyz.rows();
+    }
+    MeshCore cloud;
+    cloud.V.resize(nr_points_room, 3);
+    cloud.C.resize(nr_points_room, 3);
+    cloud.L_gt.resize(nr_points_room, 1);
+    int start_row=0;
+    for(size_t i=0; i<objects.size(); i++){
+        int nr_points=objects[i].xyz.rows();
+        cloud.V.middleRows(start_row, nr_points)=objects[i].xyz;
+        cloud.C.middleRows(start_row, nr_points)=objects[i].rgb;
+        cloud.L_gt.middleRows(start_row, nr_points).setConstant(objects[i].label_id);
+        start_row+=nr_points;
+    }
+    // cloud.D=cloud.V.rowwise().norm();
 
-            //place the room at the 0.0.0 point otherwise it's just randomly in the space somewhere
-            Eigen::Vector3d min=cloud.V.colwise().minCoeff();
-            cloud.V.rowwise()-=min.transpose();
+    //store the cloud as binary before we move it so that reading it gives the same as reading the original files
+    write_room_binary(room_path/"room_binary.bin", cloud);
 
 
+    //the rooms are aligned in a weird manner. We rotate them as we see fit
+    Eigen::Affine3d tf_worldGL_worldROS;
+    tf_worldGL_worldROS.setIdentity();
+    Eigen::Matrix3d worldGL_worldROS_rot;
+    worldGL_worldROS_rot = Eigen::AngleAxisd(-0.5*M_PI, Eigen::Vector3d::UnitX());
+    tf_worldGL_worldROS.matrix().block<3,3>(0,0)=worldGL_worldROS_rot;
+    cloud.apply_transform(tf_worldGL_worldROS);
 
-            // if(m_shuffle_points){ //when splattin it is better if adyacent points in 3D space are not adyancet in memory so that we don't end up with conflicts or race conditions
-            //     // https://stackoverflow.com/a/15866196
-            //     Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic> perm(cloud.V.rows());
-            //     perm.setIdentity();
-            //     std::shuffle(perm.indices().data(), perm.indices().data()+perm.indices().size(), m_rand_gen->generator());
-            //     // VLOG(1) << "permutation matrix is " << perm.indices();
-            //     // A_perm = A * perm; // permute columns
-            //     cloud.V = perm * cloud.V; // permute rows
-            //     cloud.L_gt = perm * cloud.L_gt; // permute rows
-            //     cloud.D = perm * cloud.D; // permute rows
-            // }
+    //place the room at the 0.0.0 point otherwise it's just randomly in the space somewhere
+    Eigen::Vector3d min=cloud.V.colwise().minCoeff();
+    cloud.V.rowwise()-=min.transpose();
 
 
-            //store the cloud as binary of floats
-            fs::path room_binary_file_path=room_path/"room_binary.bin";
-            auto myfile = std::fstream(room_binary_file_path.string(), std::ios::out | std::ios::binary);
-            myfile.write((char*)&all_room_data[0], all_room_data.size()*sizeof(float));
-            myfile.close();
 
+    // if(m_shuffle_points){ //when splattin it is better if adyacent points in 3D space are not adyancet in memory so that we don't end up with conflicts or race conditions
+    //     // https://stackoverflow.com/a/15866196
+    //     Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic> perm(cloud.V.rows());
+    //     perm.setIdentity();
+    //     std::shuffle(perm.indices().data(), perm.indices().data()+perm.indices().size(), m_rand_gen->generator());
+    //     // VLOG(1) << "permutation matrix is " << perm.indices();
+    //     // A_perm = A * perm; // permute columns
+    //     cloud.V = perm * cloud.V; // permute rows
+    //     cloud.L_gt = perm * cloud.L_gt; // permute rows
+    //     cloud.D = perm * cloud.D; // permute rows
+    // }
 
 
+    //some sensible visualization options
+    cloud.m_vis.m_show_mesh=false;
+    cloud.m_vis.m_show_points=true;
+    cloud.m_vis.m_color_type=+MeshColorType::SemanticGT;
 
+    //set the labelmngr which will be used by the viewer to put correct colors for the semantics
+    cloud.m_label_mngr=m_label_mngr->shared_from_this();
 
-            //some sensible visualization options
-            cloud.m_vis.m_show_mesh=false;
-            cloud.m_vis.m_show_points=true;
-            cloud.m_vis.m_color_type=+MeshColorType::SemanticGT;
+    return cloud;
 
-            //set the labelmngr which will be used by the viewer to put correct colors for the semantics
-            cloud.m_label_mngr=m_label_mngr->shared_from_this();
+}
 
-            m_clouds_buffer.enqueue(cloud);;
+void DataLoaderStanfordIndoor::write_room_binary(const fs::path& binary_path, const MeshCore& cloud){
+    RoomHeader header;
+    std::memcpy(header.magic, ROOM_MAGIC, sizeof(ROOM_MAGIC));
+    header.version=ROOM_VERSION;
+    header.padding=0;
+    header.nr_points=cloud.V.rows();
+
+    //the eigen matrices are column major so casting them gives directly the blocks of the file
+    Eigen::MatrixXf xyz=cloud.V.cast<float>();
+    Eigen::MatrixXf rgb=cloud.C.cast<float>();
+    Eigen::Matrix<int32_t, Eigen::Dynamic, 1> labels=cloud.L_gt.col(0).cast<int32_t>();
+
+    //we write into a temporary file and rename it at the end so that a loader never sees a half written room
+    fs::path tmp_path=binary_path.string()+".tmp";
+    std::ofstream file(tmp_path.string(), std::ios::binary);
+    CHECK(file.is_open()) << "Could not open " << tmp_path << " for writing";
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(xyz.data()), xyz.size()*sizeof(float));
+    file.write(reinterpret_cast<const char*>(rgb.data()), rgb.size()*sizeof(float));
+    file.write(reinterpret_cast<const char*>(labels.data()), labels.size()*sizeof(int32_t));
+    file.close();
+    CHECK(!file.fail()) << "Failed writing " << tmp_path;
+    fs::rename(tmp_path, binary_path);
+}
 
+MeshCore DataLoaderStanfordIndoor::read_room_binary(const fs::path& room_path){
 
+    VLOG(1) <<"reading room " << room_path;
 
-        }
+    //the file is mapped so there is no intermediate buffer and the blocks are converted into the matrices of the cloud in one go
+    MappedFile file(room_path.string());
+    MeshCore cloud;
 
+    bool has_header= file.size()>=sizeof(RoomHeader) && std::memcmp(file.at<RoomHeader>(0)->magic, ROOM_MAGIC, sizeof(ROOM_MAGIC))==0;
+    if(has_header){
+        const RoomHeader* header=file.at<RoomHeader>(0);
+        CHECK(header->version==ROOM_VERSION) << room_path << " has version " << header->version << " but we can only read version " << ROOM_VERSION << ". Please reparse the data by setting read_original_data_and_reparse to true";
+        size_t nr_points=header->nr_points;
+        VLOG(1) << "reading nr of points" << nr_points;
+
+        size_t xyz_offset=sizeof(RoomHeader);
+        size_t rgb_offset=xyz_offset+nr_points*3*sizeof(float);
+        size_t labels_offset=rgb_offset+nr_points*3*sizeof(float);
+        Eigen::Map<const Eigen::MatrixXf> xyz(file.at<float>(xyz_offset, nr_points*3), nr_points, 3);
+        Eigen::Map<const Eigen::MatrixXf> rgb(file.at<float>(rgb_offset, nr_points*3), nr_points, 3);
+        Eigen::Map<const Eigen::Matrix<int32_t, Eigen::Dynamic, 1> > labels(file.at<int32_t>(labels_offset, nr_points), nr_points);
+        cloud.V=xyz.cast<double>();
+        cloud.C=rgb.cast<double>();
+        cloud.L_gt=labels.cast<int>();
+    }else{
+        //old binary where each 7 floats represent xyz and rgb ad label id
+        CHECK(file.size()%(7*sizeof(float))==0) << room_path << " is neither a room binary with a header nor one with 7 floats per point. Please reparse the data by setting read_original_data_and_reparse to true";
+        size_t nr_points=file.size()/(7*sizeof(float));
+        VLOG(1) << "reading nr of points" << nr_points << " from a binary in the old interleaved format";
+        Eigen::Map<const Eigen::Matrix<float, Eigen::Dynamic, 7, Eigen::RowMajor> > points(file.at<float>(0, nr_points*7), nr_points, 7);
+        cloud.V=points.leftCols<3>().cast<double>();
+        cloud.C=points.middleCols<3>(3).cast<double>();
+        cloud.L_gt=points.col(6).array().round().cast<int>();
     }
 
+    return cloud;
 }
 
-void DataLoaderStanfordIndoor::read_data(){
-
-    loguru::set_thread_name("loader_thread_stanford");
-
-    init_data_reading();
+void DataLoaderStanfordIndoor::process_sample(MeshCore& cloud){
 
-    while (m_is_running ) {
-
-        //we finished reading so we wait here for a reset
-        if(m_idx_cloud_to_read>=m_room_paths.size()){
-            std::this_thread::sleep_for(std::chrono::milliseconds(300));
-            continue;
-        }
-
-        // std::cout << "size approx is " << m_queue.size_approx() << '\n';
-        // std::cout << "m_idx_img_to_read is " << m_idx_img_to_read << '\n';
-        if(m_clouds_buffer.size_approx()<BUFFER_SIZE-1){ //there is enough space
-            //read the frame and everything else and push it to the queue
-
-            fs::path room_path=m_room_paths[ m_idx_cloud_to_read ];
-            if(!m_do_overfit){
-                m_idx_cloud_to_read++;
-            }
-            VLOG(1) <<"reading room " << room_path;
-
-
-            TIME_START("read");
-            TIME_START("seekign");
-            //https://stackoverflow.com/questions/6755111/read-input-files-fastest-way-possible
-            std::ifstream is(room_path.string());
-            // Determine the file length
-            is.seekg(0, std::ios_base::end);
-            std::size_t size=is.tellg();
-            is.seekg(0, std::ios_base::beg);
-            TIME_END("seekign");
-            // Create a vector to store the data
-            VLOG(1) << "allocating vector of size" << size/sizeof(float);
-            if (size/sizeof(float)>100000000){
-                LOG(WARNING)<<"Size to allocate is to big. Ignoring this cloud";
-                continue;
-            }
-            std::vector<float> v(size/sizeof(float));
-            // Load the data
-            is.read((char*) &v[0], size);
-            // Close the file
-            is.close();
-
-            //parse the data from the file into the cloud taking into account that each 7 floats represent xyz and rgb ad label id
-            int nr_points=v.size()/7;
-            VLOG(1) << "reading nr of points" << nr_points;
-            MeshCore cloud;
-            cloud.V.resize(nr_points,3);
-            cloud.C.resize(nr_points,3);
-            cloud.L_gt.resize(nr_points,1);
-            for(int i=0; i<nr_points; i++){
-                // VLOG(1) << "reading point " << i << " of " << nr_points;
-                cloud.V(i,0)=v[i*7+0];
-                cloud.V(i,1)=v[i*7+1];
-                cloud.V(i,2)=v[i*7+2];
-                cloud.C(i,0)=v[i*7+3];
-                cloud.C(i,1)=v[i*7+4];
-                cloud.C(i,2)=v[i*7+5];
-                cloud.L_gt(i,0)=std::round( v[i*7+6] );
-            }
-
-            //the stanford dataset is gigantic and sometimes we can't process all points, we establish a maximum amount of points we can process and drop the rest
-            if (nr_points>m_max_nr_points_per_cloud && m_max_nr_points_per_cloud>0){
-                LOG(WARNING)<< "Overstepping theshold of max nr of points of " << m_max_nr_points_per_cloud << " because we have nr of points " << nr_points << ". Dropping points until we only are left with the maximum we can process." ;
-                //percentage of points we have to drop
-                float percentage_to_drop=1.0-(float)m_max_nr_points_per_cloud/(float)nr_points;
-                float prob_of_death=percentage_to_drop;
-                std::vector<bool> is_vertex_to_be_removed(cloud.V.rows(), false);
-                for(int i = 0; i < cloud.V.rows(); i++){
-                    float random= m_rand_gen->rand_float(0.0, 1.0);
-                    if(random<prob_of_death){
-                        is_vertex_to_be_removed[i]=true;
-                    }
-                }
-                cloud.remove_marked_vertices(is_vertex_to_be_removed, false);
-            }
-
-
-
-            //the rooms are aligned in a weird manner. We rotate them as we see fit
-            Eigen::Affine3d tf_worldGL_worldROS;
-            tf_worldGL_worldROS.setIdentity();
-            Eigen::Matrix3d worldGL_worldROS_rot;
-            worldGL_worldROS_rot = Eigen::AngleAxisd(-0.5*M_PI, Eigen::Vector3d::UnitX());
-            tf_worldGL_worldROS.matrix().block<3,3>(0,0)=worldGL_worldROS_rot;
-            cloud.apply_transform(tf_worldGL_worldROS);
-
-            //place the room at the 0.0.0 point otherwise it's just randomly in the space somewhere
-            Eigen::Vector3d min=cloud.V.colwise().minCoeff();
-            cloud.V.rowwise()-=min.transpose();
+    //the reparsed rooms are already done
+    if(m_read_original_data_and_reparse || cloud.V.rows()==0){
+        return;
+    }
 
-            if(m_mode=="train"){
-                cloud=m_transformer->transform(cloud);
+    //the stanford dataset is gigantic and sometimes we can't process all points, we establish a maximum amount of points we can process and drop the rest
+    int nr_points=cloud.V.rows();
+    if (nr_points>m_max_nr_points_per_cloud && m_max_nr_points_per_cloud>0){
+        LOG(WARNING)<< "Overstepping theshold of max nr of points of " << m_max_nr_points_per_cloud << " because we have nr of points " << nr_points << ". Dropping points until we only are left with the maximum we can process." ;
+        //percentage of points we have to drop
+        float percentage_to_drop=1.0-(float)m_max_nr_points_per_cloud/(float)nr_points;
+        float prob_of_death=percentage_to_drop;
+        std::vector<bool> is_vertex_to_be_removed(cloud.V.rows(), false);
+        for(int i = 0; i < cloud.V.rows(); i++){
+            float random= m_rand_gen->rand_float(0.0, 1.0);
+            if(random<prob_of_death){
+                is_vertex_to_be_removed[i]=true;
             }
+        }
+        cloud.remove_marked_vertices(is_vertex_to_be_removed, false);
+    }
 
-            if(m_shuffle_points){ //when splattin it is better if adyacent points in 3D space are not adyancet in memory so that we don't end up with conflicts or race conditions
-                // https://stackoverflow.com/a/15866196
-                Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic> perm(cloud.V.rows());
-                perm.setIdentity();
-                std::shuffle(perm.indices().data(), perm.indices().data()+perm.indices().size(), m_rand_gen->generator());
-                // VLOG(1) << "permutation matrix is " << perm.indices();
-                // A_perm = A * perm; // permute columns
-                cloud.V = perm * cloud.V; // permute rows
-                cloud.L_gt = perm * cloud.L_gt; // permute rows
-                cloud.D = perm * cloud.D; // permute rows
-            }
-            TIME_END("read");
 
-            //some sensible visualization options
-            cloud.m_vis.m_show_mesh=false;
-            cloud.m_vis.m_show_points=true;
-            cloud.m_vis.m_color_type=+MeshColorType::SemanticGT;
 
-            //set the labelmngr which will be used by the viewer to put correct colors for the semantics
-            cloud.m_label_mngr=m_label_mngr->shared_from_this();
+    //the rooms are aligned in a weird manner. We rotate them as we see fit
+    Eigen::Affine3d tf_worldGL_worldROS;
+    tf_worldGL_worldROS.setIdentity();
+    Eigen::Matrix3d worldGL_worldROS_rot;
+    worldGL_worldROS_rot = Eigen::AngleAxisd(-0.5*M_PI, Eigen::Vector3d::UnitX());
+    tf_worldGL_worldROS.matrix().block<3,3>(0,0)=worldGL_worldROS_rot;
+    cloud.apply_transform(tf_worldGL_worldROS);
 
-            m_clouds_buffer.enqueue(cloud);;
+    //place the room at the 0.0.0 point otherwise it's just randomly in the space somewhere
+    Eigen::Vector3d min=cloud.V.colwise().minCoeff();
+    cloud.V.rowwise()-=min.transpose();
 
+    if(m_mode=="train"){
+        cloud=m_transformer->transform(cloud);
+    }
 
+    if(m_shuffle_points){ //when splattin it is better if adyacent points in 3D space are not adyancet in memory so that we don't end up with conflicts or race conditions
+        // https://stackoverflow.com/a/15866196
+        Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic> perm(cloud.V.rows());
+        perm.setIdentity();
+        std::shuffle(perm.indices().data(), perm.indices().data()+perm.indices().size(), m_rand_gen->generator());
+        // VLOG(1) << "permutation matrix is " << perm.indices();
+        // A_perm = A * perm; // permute columns
+        cloud.V = perm * cloud.V; // permute rows
+        cloud.L_gt = perm * cloud.L_gt; // permute rows
+        cloud.D = perm * cloud.D; // permute rows
+    }
 
-        }
+    //some sensible visualization options
+    cloud.m_vis.m_show_mesh=false;
+    cloud.m_vis.m_show_points=true;
+    cloud.m_vis.m_color_type=+MeshColorType::SemanticGT;
 
-    }
+    //set the labelmngr which will be used by the viewer to put correct colors for the semantics
+    cloud.m_label_mngr=m_label_mngr->shared_from_this();
 
 }
 
 bool DataLoaderStanfordIndoor::has_data(){
-    if(m_clouds_buffer.peek()==nullptr){
-        return false;
-    }else{
-        return true;
-    }
+    return m_clouds_pipeline.has_data();
 }
 
 
 MeshCore DataLoaderStanfordIndoor::get_cloud(){
 
-    MeshCore cloud;
-    m_clouds_buffer.try_dequeue(cloud);
-
-    return cloud;
+    return m_clouds_pipeline.try_get();
 }
 
 bool DataLoaderStanfordIndoor::is_finished(){
-    //check if this loader has loaded everything
-    if(m_idx_cloud_to_read<(int)m_room_paths.size()){
-        return false; //there is still more files to read
-    }
-
-    //check that there is nothing in the ring buffers
-    if(m_clouds_buffer.peek()!=nullptr){
-        return false; //there is still something in the buffer
-    }
-
-    return true; //there is nothing more to read and nothing more in the buffer so we are finished
-
+    return m_clouds_pipeline.is_finished(); //there is nothing more to read and nothing more in the buffer
 }
 
 
 bool DataLoaderStanfordIndoor::is_finished_reading(){
-    //check if this loader has loaded everything
-    if(m_idx_cloud_to_read<(int)m_room_paths.size()){
-        return false; //there is still more files to read
-    }
-
-    return true; //there is nothing more to read and so we are finished reading
-
+    return m_clouds_pipeline.is_finished_reading();
 }
 
 void DataLoaderStanfordIndoor::reset(){
-    m_nr_resets++;
-    // we shuffle again the data so as to have freshly shuffled data for the next epoch
-    if(m_shuffle){
-        // unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-        // auto rng = std::default_random_engine(seed);
-        unsigned seed = m_nr_resets;
-        auto rng = std::default_random_engine(seed);
-        std::shuffle(std::begin(m_room_paths), std::end(m_room_paths), rng);
-    }
-
     //during training we do a mode of train and then a mode of test. After finishing test we call reset on it and if the only purpose was to just repasrse the data in binary then we are actually done
     if(m_read_original_data_and_reparse && m_mode=="test"){
         LOG(FATAL) << "finished writing everything and reparsing";
     }
 
-    m_idx_cloud_to_read=0;
+    int nr_clouds= m_do_overfit? -1 : m_room_paths.size();
+    //the readers are paused while we shuffle so none of them sees the file list half shuffled
+    m_clouds_pipeline.reset(nr_clouds, [this](){
+        m_nr_resets++;
+        // we shuffle again the data so as to have freshly shuffled data for the next epoch
+        if(m_shuffle){
+            // unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
+            // auto rng = std::default_random_engine(seed);
+            unsigned seed = m_nr_resets;
+            auto rng = std::default_random_engine(seed);
+            std::shuffle(std::begin(m_room_paths), std::end(m_room_paths), rng);
+        }
+    });
 }
 
 int DataLoaderStanfordIndoor::nr_samples(){
@@ -25,22 +25,20 @@ namespace fs = boost::filesystem;
 
 
 //my stuff
+#include "data_loaders/CameraNeighbourIndex.h"
+#include "data_loaders/WorkerPool.h"
+#include "data_loaders/MiscDataFuncs.h"
 #include "RandGenerator.h"
 #include "string_utils.h"
 
 using namespace radu::utils;
 using namespace easy_pbr;
 
-#define BUFFER_SIZE 5 //clouds are stored in a queue until they are acessed, the queue stores a maximum of X items
-
 DataLoaderVolRef::DataLoaderVolRef(const std::string config_file):
     m_is_modified(false),
-    m_is_running(false),
-    m_frames_color_buffer(BUFFER_SIZE),
-    m_frames_depth_buffer(BUFFER_SIZE),
-    m_idx_sample_to_read(0),
     m_nr_resets(0),
     m_rand_gen(new RandGenerator),
+    m_cam_index(new CameraNeighbourIndex),
     m_rgb_subsample_factor(1),
     m_depth_subsample_factor(1),
     m_idx_colorframe_to_return(0),
@@ -50,19 +48,14 @@ DataLoaderVolRef::DataLoaderVolRef(const std::string config_file):
 
     init_params(config_file);
     if(m_autostart){
-        m_is_running=true;
-        m_loader_thread=std::thread(&DataLoaderVolRef::read_data, this);  //starts the spin in another thread
+        start();
     }
 
 }
 
 DataLoaderVolRef::~DataLoaderVolRef(){
 
-    m_is_running=false;
-
-    if (m_loader_thread.joinable()){
-        m_loader_thread.join();
-    }
+    m_frames_pipeline.stop(); //the readers use the members of the loader so they have to finish before anything gets destroyed
 }
 
 void DataLoaderVolRef::init_params(const std::string config_file){
@@ -85,8 +78,12 @@ void DataLoaderVolRef::init_params(const std::string config_file){
     m_nr_samples_to_read=loader_config["nr_samples_to_read"];
     m_shuffle=loader_config["shuffle"];
     m_do_overfit=loader_config["do_overfit"];
+    m_nr_reader_threads=loader_config.get_or("nr_reader_threads", 1);
+    m_prefetch_depth=loader_config.get_or("prefetch_depth", 4);
+    m_ordered_delivery=loader_config.get_or("ordered_delivery", true);
     m_dataset_path=(std::string)loader_config["dataset_path"];
     m_rgb_subsample_factor=loader_config["rgb_subsample_factor"];
+    m_reduced_jpeg_decode=loader_config.get_or("reduced_jpeg_decode", false);
     m_depth_subsample_factor=loader_config["depth_subsample_factor"];
 
     m_scene_translation=loader_config["scene_translation"];
@@ -95,15 +92,26 @@ void DataLoaderVolRef::init_params(const std::string config_file){
 }
 
 void DataLoaderVolRef::start(){
-    CHECK(m_is_running==false) << "The loader thread is already running. Please check in the config file that autostart is not already set to true. Or just don't call start()";
+    CHECK(!m_frames_pipeline.is_running() && m_frames_color_vec.empty()) << "The loader thread is already running. Please check in the config file that autostart is not already set to true. Or just don't call start()";
 
     init_data_reading();
 
-    m_is_running=true;
-     if (m_preload){
+    if (m_preload){
         read_data(); //if we prelaod we don't need to use any threads and it may cause some other issues
     }else{
-        m_loader_thread=std::thread(&DataLoaderVolRef::read_data, this);  //starts the spin in another thread
+        m_frames_pipeline.set_nr_readers(m_nr_reader_threads);
+        m_frames_pipeline.set_prefetch_depth(m_prefetch_depth);
+        m_frames_pipeline.set_ordered(m_ordered_delivery);
+        int nr_frames= m_do_overfit? -1 : m_samples_filenames.size(); //when overfitting we keep on reading the first sample forever
+        //there is no randomness in reading the samples so there is no processing stage
+        m_frames_pipeline.start(nr_frames,
+            [this](const int idx){
+                std::pair<Frame, Frame> frames;
+                read_sample(frames.first, frames.second, m_samples_filenames[ m_do_overfit? 0 : idx ]);
+                return frames;
+            },
+            nullptr,
+            "loader_thread_vol_ref");
     }
 }
 
@@ -185,73 +193,38 @@ void DataLoaderVolRef::init_data_reading(){
     m_K_depth=read_intrinsics_file(intrinsics_depth);
 
 
+    //parse all the poses once so that finding the closest frames doesn't need to read the pose files again
+    //the index only needs the poses so the frames stay empty otherwise. Their frame_idx is their row in the table
+    std::vector<Frame> cams(m_samples_filenames.size());
+    WorkerPool::parallel_for(WorkerPool::shared(0), cams.size(), [&](const int i){
+        std::string name = m_samples_filenames[i].string().substr(0, m_samples_filenames[i].string().size()-9); //removes the last 5 characters corresponding to "color"
+        cams[i].tf_cam_world=read_tf_cam_world(name+"pose.txt");
+        cams[i].frame_idx=i;
+    });
+    m_cam_table_filenames=m_samples_filenames;
+    //the score of 0.5*diff_translation + 0.5*diff_angle orders the frames the same as the distance of the index with a view direction weight of 1
+    m_cam_index->build(cams, 1.0, 0);
 
 }
 
 void DataLoaderVolRef::read_data(){
 
-    loguru::set_thread_name("loader_thread_vol_ref");
-
     //if we preload, we just read the meshes and store them in memory, data transformation will be done while reading the mesh
-    if (m_preload){
-        for(size_t i=0; i<m_samples_filenames.size(); i++ ){
-
-            fs::path sample_filename=m_samples_filenames[ m_idx_sample_to_read ];
-            VLOG(1) << "preloading from " << sample_filename;
-            if(!m_do_overfit){
-                m_idx_sample_to_read++;
-            }
-            // MeshSharedPtr cloud=read_sample(sample_filename);
-            // m_clouds_vec.push_back(cloud);
-
-
-            //read frame color and frame depth
-            Frame frame_color;
-            Frame frame_depth;
-            read_sample(frame_color, frame_depth, sample_filename);
-
-            m_frames_color_vec.push_back(frame_color);
-            m_frames_depth_vec.push_back(frame_depth);
-
-        }
-
-    }else{ //we continously read from disk
-
-
-        while (m_is_running ) {
-
-            //we finished reading so we wait here for a reset
-            if(m_idx_sample_to_read>=m_samples_filenames.size()){
-                std::this_thread::sleep_for(std::chrono::milliseconds(300));
-                continue;
-            }
-
-            // std::cout << "size approx is " << m_queue.size_approx() << '\n';
-            // std::cout << "m_idx_img_to_read is " << m_idx_img_to_read << '\n';
-            if(m_frames_color_buffer.size_approx()<BUFFER_SIZE-1){ //there is enough space
-                //read the frame and everything else and push it to the queue
-
-                fs::path sample_filename=m_samples_filenames[ m_idx_sample_to_read ];
-                if(!m_do_overfit){
-                    m_idx_sample_to_read++;
-                }
+    for(size_t i=0; i<m_samples_filenames.size(); i++ ){
 
+        fs::path sample_filename=m_samples_filenames[ m_do_overfit? 0 : i ];
+        VLOG(1) << "preloading from " << sample_filename;
+        // MeshSharedPtr cloud=read_sample(sample_filename);
+        // m_clouds_vec.push_back(cloud);
 
 
+        //read frame color and frame depth
+        Frame frame_color;
+        Frame frame_depth;
+        read_sample(frame_color, frame_depth, sample_filename);
 
-                //read frame color and frame depth
-                Frame frame_color;
-                Frame frame_depth;
-                read_sample(frame_color, frame_depth, sample_filename);
-
-
-
-                m_frames_color_buffer.enqueue(frame_color);
-                m_frames_depth_buffer.enqueue(frame_depth);
-
-            }
-
-        }
+        m_frames_color_vec.push_back(frame_color);
+        m_frames_depth_vec.push_back(frame_depth);
 
     }
 
@@ -268,13 +241,7 @@ void DataLoaderVolRef::read_sample(Frame& frame_color, Frame& frame_depth, const
     frame_depth.frame_idx= std::stoi(frame_idx_str);
 
     //read color img
-    frame_color.rgb_8u=cv::imread(sample_filename.string());
-    if(m_rgb_subsample_factor>1){
-        cv::Mat resized;
-        cv::resize(frame_color.rgb_8u, resized, cv::Size(), 1.0/m_rgb_subsample_factor, 1.0/m_rgb_subsample_factor, cv::INTER_AREA);
-        // frame.rgb_8u=resized.clone();
-        frame_color.rgb_8u=resized;
-    }
+    frame_color.rgb_8u=MiscDataFuncs::read_image(sample_filename.string(), cv::IMREAD_COLOR, m_rgb_subsample_factor, cv::INTER_AREA, m_reduced_jpeg_decode);
     frame_color.rgb_8u.convertTo(frame_color.rgb_32f, CV_32FC3, 1.0/255.0);
     frame_color.width=frame_color.rgb_32f.cols;
     frame_color.height=frame_color.rgb_32f.rows;
@@ -293,24 +260,8 @@ void DataLoaderVolRef::read_sample(Frame& frame_color, Frame& frame_depth, const
     frame_depth.height=frame_depth.depth.rows;
 
     //read pose file
-    std::string pose_file=name+"pose.txt";
-    Eigen::Affine3d tf_world_cam=read_pose_file(pose_file);
-    // VLOG(1) << "pose from tf_world_cam" << pose_file << " is " << tf_world_cam.matrix();
-    // frame_color.tf_cam_world=tf_world_cam.inverse().cast<float>();
-    // frame_depth.tf_cam_world=tf_world_cam.inverse().cast<float>();
-    // frame_color.tf_cam_world=tf_world_cam.cast<float>();
-    // frame_depth.tf_cam_world=tf_world_cam.cast<float>();
-
-    //for some reason the y is flipped so we unflip it
-    // tf_world_cam.linear().col(1)=-tf_world_cam.linear().col(1);
-
-    Eigen::Affine3d m_tf_worldGL_world;
-    m_tf_worldGL_world.setIdentity();
-    Eigen::Matrix3d worldGL_world_rot;
-    worldGL_world_rot = Eigen::AngleAxisd(1.0*M_PI, Eigen::Vector3d::UnitX());
-    m_tf_worldGL_world.matrix().block<3,3>(0,0)=worldGL_world_rot;
-    frame_color.tf_cam_world= tf_world_cam.cast<float>().inverse() * m_tf_worldGL_world.cast<float>().inverse(); //from worldgl to world ros, from world ros to cam
-    frame_depth.tf_cam_world= tf_world_cam.cast<float>().inverse() * m_tf_worldGL_world.cast<float>().inverse(); //from worldgl to world ros, from world ros to cam
+    frame_color.tf_cam_world=read_tf_cam_world(name+"pose.txt");
+    frame_depth.tf_cam_world=frame_color.tf_cam_world;
 
    
     //assign K matrix
@@ -341,14 +292,6 @@ void DataLoaderVolRef::read_sample(Frame& frame_color, Frame& frame_depth, const
         frame_color.rgb_32f= rgb_with_valid_depth;
     }
 
-    //rescale things if necessary
-    if(m_scene_scale_multiplier>0.0 || !m_scene_translation.isZero() ){
-        Eigen::Affine3f tf_world_cam_rescaled = frame_color.tf_cam_world.inverse().cast<float>();
-        tf_world_cam_rescaled.translation()+=m_scene_translation;
-        tf_world_cam_rescaled.translation()*=m_scene_scale_multiplier;
-        frame_color.tf_cam_world=tf_world_cam_rescaled.inverse();
-        frame_depth.tf_cam_world=tf_world_cam_rescaled.inverse();
-    }
     //if the scene is rescaled the depth map also needs to be
     if(m_scene_scale_multiplier>0.0 ){
         frame_depth.depth*= m_scene_scale_multiplier;
@@ -358,51 +301,17 @@ void DataLoaderVolRef::read_sample(Frame& frame_color, Frame& frame_depth, const
 }
 
 Frame DataLoaderVolRef::closest_color_frame(const Frame& frame){
+    int idx=closest_cam_idx(frame);
 
-double lowest_score=std::numeric_limits<double>::max();
-fs::path best_path;
-
-for(int i=0; i<(int)m_samples_filenames.size(); i++){
-    fs::path sample_filename=m_samples_filenames[i];
-
-    std::string name = sample_filename.string().substr(0, sample_filename.string().size()-9); //removes the last 5 characters corresponding to "color"
-    std::string pose_file=name+"pose.txt";
-    Eigen::Affine3d tf_worldros_cam=read_pose_file(pose_file);
-
-    //get the difference in transaltion and difference in angle of looking at
-    Eigen::Affine3d m_tf_worldGL_world;
-    m_tf_worldGL_world.setIdentity();
-    Eigen::Matrix3d worldGL_world_rot;
-    worldGL_world_rot = Eigen::AngleAxisd(1.0*M_PI, Eigen::Vector3d::UnitX());
-    m_tf_worldGL_world.matrix().block<3,3>(0,0)=worldGL_world_rot;
-    Eigen::Affine3d other_tf_cam_world= tf_worldros_cam.cast<double>().inverse() * m_tf_worldGL_world.inverse(); //from worldgl to world ros, from world ros to cam
-
-    double diff_translation= (frame.tf_cam_world.cast<double>().inverse().translation() - other_tf_cam_world.inverse().translation()).norm();
-
-    //diff in angle
-    double diff_angle= 1.0- frame.tf_cam_world.cast<double>().inverse().linear().col(2).dot( other_tf_cam_world.inverse().linear().col(2) );
-
-    double score= 0.5*diff_translation + 0.5*diff_angle;
-
-    if (score<0.00001){
-        //if the score is exactly zero then we are just comparing with the same frame
-        continue;
+    //the preloaded frames are in the same order as the table. When overfitting they are all copies of the first sample so we read the right one from disk
+    if(m_preload && !m_do_overfit){
+        return m_frames_color_vec[idx];
     }
 
-        if (score<lowest_score){
-            best_path=sample_filename;
-            lowest_score=score;
-        }
-
-
-
-    }
-
-
     //read frame color and frame depth
     Frame frame_color;
     Frame frame_depth;
-    read_sample(frame_color, frame_depth, best_path);
+    read_sample(frame_color, frame_depth, m_cam_table_filenames[idx]);
 
     return frame_color;
 
@@ -410,56 +319,27 @@ for(int i=0; i<(int)m_samples_filenames.size(); i++){
 
 
 Frame DataLoaderVolRef::closest_depth_frame(const Frame& frame){
+    int idx=closest_cam_idx(frame);
 
-    double lowest_score=std::numeric_limits<double>::max();
-    fs::path best_path;
-
-    for(int i=0; i<(int)m_samples_filenames.size(); i++){
-        fs::path sample_filename=m_samples_filenames[i];
-
-        std::string name = sample_filename.string().substr(0, sample_filename.string().size()-9); //removes the last 5 characters corresponding to "color"
-        std::string pose_file=name+"pose.txt";
-        Eigen::Affine3d tf_worldros_cam=read_pose_file(pose_file);
-
-        //get the difference in transaltion and difference in angle of looking at
-        Eigen::Affine3d m_tf_worldGL_world;
-        m_tf_worldGL_world.setIdentity();
-        Eigen::Matrix3d worldGL_world_rot;
-        worldGL_world_rot = Eigen::AngleAxisd(1.0*M_PI, Eigen::Vector3d::UnitX());
-        m_tf_worldGL_world.matrix().block<3,3>(0,0)=worldGL_world_rot;
-        Eigen::Affine3d other_tf_cam_world= tf_worldros_cam.cast<double>().inverse() * m_tf_worldGL_world.inverse(); //from worldgl to world ros, from world ros to cam
-
-        double diff_translation= (frame.tf_cam_world.cast<double>().inverse().translation() - other_tf_cam_world.inverse().translation()).norm();
-
-        //diff in angle
-        double diff_angle= 1.0- frame.tf_cam_world.cast<double>().inverse().linear().col(2).dot( other_tf_cam_world.inverse().linear().col(2) );
-
-        double score= 0.5*diff_translation + 0.5*diff_angle;
-
-        if (score<0.00001){
-            //if the score is exactly zero then we are just comparing with the same frame
-            continue;
-        }
-
-        if (score<lowest_score){
-            best_path=sample_filename;
-            lowest_score=score;
-        }
-
-
-
+    if(m_preload && !m_do_overfit){
+        return m_frames_depth_vec[idx];
     }
 
-    // VLOG(1) << "Best depth frame has score " << lowest_score;
     //read frame color and frame depth
     Frame frame_color;
     Frame frame_depth;
-    read_sample(frame_color, frame_depth, best_path);
+    read_sample(frame_color, frame_depth, m_cam_table_filenames[idx]);
 
     return frame_depth;
 
 }
 
+int DataLoaderVolRef::closest_cam_idx(const Frame& frame){
+    //the frame with the lowest score of 0.5*diff_translation + 0.5*diff_angle, skipping the ones with a score below 0.00001 because that's the query frame itself
+    //the distance of the index is twice the score
+    return m_cam_index->closest_idx_further_than(frame, 2*0.00001);
+}
+
 
 void DataLoaderVolRef::load_only_from_idxs(const Eigen::VectorXi& vec){
     // if(m_shuffle){
@@ -489,6 +369,30 @@ Eigen::Affine3d DataLoaderVolRef::read_pose_file(std::string pose_file){
     return pose;
 }
 
+Eigen::Affine3f DataLoaderVolRef::read_tf_cam_world(const std::string pose_file){
+    Eigen::Affine3d tf_world_cam=read_pose_file(pose_file);
+
+    //for some reason the y is flipped so we unflip it
+    // tf_world_cam.linear().col(1)=-tf_world_cam.linear().col(1);
+
+    Eigen::Affine3d tf_worldGL_world;
+    tf_worldGL_world.setIdentity();
+    Eigen::Matrix3d worldGL_world_rot;
+    worldGL_world_rot = Eigen::AngleAxisd(1.0*M_PI, Eigen::Vector3d::UnitX());
+    tf_worldGL_world.matrix().block<3,3>(0,0)=worldGL_world_rot;
+    Eigen::Affine3f tf_cam_world= tf_world_cam.cast<float>().inverse() * tf_worldGL_world.cast<float>().inverse(); //from worldgl to world ros, from world ros to cam
+
+    //rescale things if necessary
+    if(m_scene_scale_multiplier>0.0 || !m_scene_translation.isZero() ){
+        Eigen::Affine3f tf_world_cam_rescaled = tf_cam_world.inverse().cast<float>();
+        tf_world_cam_rescaled.translation()+=m_scene_translation;
+        tf_world_cam_rescaled.translation()*=m_scene_scale_multiplier;
+        tf_cam_world=tf_world_cam_rescaled.inverse();
+    }
+
+    return tf_cam_world;
+}
+
 Eigen::Matrix3d DataLoaderVolRef::read_intrinsics_file(std::string intrinsics_file){
     std::ifstream infile( intrinsics_file );
     if(!infile.is_open()){
@@ -516,11 +420,10 @@ bool DataLoaderVolRef::has_data(){
         return true;
     }else{
 
-        if(m_frames_color_buffer.peek()==nullptr || m_frames_depth_buffer.peek()==nullptr){
-            return false;
-        }else{
+        if(!m_frames_color_ready.empty() && !m_frames_depth_ready.empty()){
             return true;
         }
+        return m_frames_pipeline.has_data();
 
     }
 }
@@ -540,8 +443,18 @@ Frame DataLoaderVolRef::get_color_frame(){
 
     }else{
 
+        //the color and depth come together from the pipeline so we keep the depth around until it gets requested
+        if(m_frames_color_ready.empty() && m_frames_pipeline.has_data()){
+            std::pair<Frame, Frame> frames=m_frames_pipeline.try_get();
+            m_frames_color_ready.push_back(frames.first);
+            m_frames_depth_ready.push_back(frames.second);
+        }
+
         Frame frame;
-        m_frames_color_buffer.try_dequeue(frame);
+        if(!m_frames_color_ready.empty()){
+            frame=m_frames_color_ready.front();
+            m_frames_color_ready.pop_front();
+        }
 
         return frame;
     }
@@ -561,8 +474,18 @@ Frame DataLoaderVolRef::get_depth_frame(){
 
     }else{
 
+        //the color and depth come together from the pipeline so we keep the color around until it gets requested
+        if(m_frames_depth_ready.empty() && m_frames_pipeline.has_data()){
+            std::pair<Frame, Frame> frames=m_frames_pipeline.try_get();
+            m_frames_color_ready.push_back(frames.first);
+            m_frames_depth_ready.push_back(frames.second);
+        }
+
         Frame frame;
-        m_frames_depth_buffer.try_dequeue(frame);
+        if(!m_frames_depth_ready.empty()){
+            frame=m_frames_depth_ready.front();
+            m_frames_depth_ready.pop_front();
+        }
 
         return frame;
 
@@ -602,12 +525,12 @@ bool DataLoaderVolRef::is_finished(){
 
 
         //check if this loader has loaded everything
-        if(m_idx_sample_to_read<m_samples_filenames.size()){
+        if(!m_frames_pipeline.is_finished_reading()){
             return false; //there is still more files to read
         }
 
         //if ANY of the two frame buffers is empty then we say that we finished reading. This is because not always we want to read the depth bffer
-        if(m_frames_color_buffer.peek()==nullptr || m_frames_depth_buffer.peek()==nullptr){
+        if( !m_frames_pipeline.has_data() && (m_frames_color_ready.empty() || m_frames_depth_ready.empty()) ){
             return true;
         }
 
@@ -629,30 +552,28 @@ bool DataLoaderVolRef::is_finished_reading(){
 
 
     }else{
-
-        //check if this loader has loaded everything
-        if(m_idx_sample_to_read<m_samples_filenames.size()){
-            return false; //there is still more files to read
-        }
-
-        return true; //there is nothing more to read and so we are finished reading
-
+        return m_frames_pipeline.is_finished_reading();
     }
 
 }
 
 void DataLoaderVolRef::reset(){
-    m_nr_resets++;
-    // we shuffle again the data so as to have freshly shuffled data for the next epoch
-    if(m_shuffle){
-        // unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-        // auto rng = std::default_random_engine(seed);
-        unsigned seed = m_nr_resets;
-        auto rng = std::default_random_engine(seed);
-        std::shuffle(std::begin(m_samples_filenames), std::end(m_samples_filenames), rng);
-    }
+    int nr_frames= m_do_overfit? -1 : m_samples_filenames.size();
+    //the readers are paused while we shuffle so none of them sees the file list half shuffled
+    m_frames_pipeline.reset(nr_frames, [this](){
+        m_nr_resets++;
+        // we shuffle again the data so as to have freshly shuffled data for the next epoch
+        if(m_shuffle){
+            // unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
+            // auto rng = std::default_random_engine(seed);
+            unsigned seed = m_nr_resets;
+            auto rng = std::default_random_engine(seed);
+            std::shuffle(std::begin(m_samples_filenames), std::end(m_samples_filenames), rng);
+        }
+    });
 
-    m_idx_sample_to_read=0;
+    m_frames_color_ready.clear();
+    m_frames_depth_ready.clear();
     m_idx_colorframe_to_return=0;
     m_idx_depthframe_to_return=0;
 }
@@ -1,6 +1,7 @@
 #include "data_loaders/DataTransformer.h"
 
 //c++
+#include <vector>
 
 
 //configuru
@@ -59,10 +60,18 @@ void DataTransformer::init_params(const Config& transformer_config){
     m_chance_of_xyz_noise = transformer_config["chance_of_xyz_noise"];
     m_xyz_noise_stddev=transformer_config["xyz_noise_stddev"];
 
+    m_fused=transformer_config.get_or("fused", false);
+    m_fused_exact_rng=transformer_config.get_or("fused_exact_rng", true);
+
 }
 
 MeshSharedPtr DataTransformer::transform(MeshSharedPtr& mesh){
 
+    //the fused path compacts the per vertex attributes itself so it only deals with point clouds. Meshes with faces need remove_marked_vertices to reindex them
+    if(m_fused && mesh->F.size()==0){
+        return transform_fused(mesh);
+    }
+
     // Mesh transformed_mesh=mesh;
 
     //adaptive subsampling
@@ -232,3 +241,241 @@ MeshSharedPtr DataTransformer::transform(MeshSharedPtr& mesh){
     return mesh;
 
 }
+
+//keeps only the rows at kept_idx. Attributes that are not per vertex (empty ones) are left as they are
+template <typename MatrixType>
+static void gather_rows(MatrixType& mat, const std::vector<int>& kept_idx, const int nr_verts){
+    if(mat.rows()!=nr_verts){
+        CHECK(mat.size()==0) << "Expected a per vertex attribute with " << nr_verts << " rows but it has " << mat.rows();
+        return;
+    }
+    MatrixType gathered(kept_idx.size(), mat.cols());
+    for(size_t i=0; i<kept_idx.size(); i++){
+        gathered.row(i)=mat.row(kept_idx[i]);
+    }
+    mat.swap(gathered);
+}
+
+MeshSharedPtr DataTransformer::transform_fused(MeshSharedPtr& mesh){
+
+    const int nr_verts=mesh->V.rows();
+
+    //subsampling, we only mark the vertices here and compact them together with the transform
+    bool do_adaptive_subsampling=m_adaptive_subsampling_falloff_end!=0.0;
+    bool do_random_subsampling=m_random_subsample_percentage!=0.0;
+    if(do_adaptive_subsampling){
+        CHECK(m_adaptive_subsampling_falloff_start<m_adaptive_subsampling_falloff_end) << " The falloff for the adaptive subsampling start should be lower than the end. For example we start at 0 meters and we end at 60m. The start is " << m_adaptive_subsampling_falloff_start << " adn the end is " << m_adaptive_subsampling_falloff_end;
+    }
+    std::vector<bool> is_kept(nr_verts, true);
+    if(m_fused_exact_rng){
+        //same draws as transform(), one for every vertex for the adaptive subsampling and afterwards one for every vertex that survived it
+        if(do_adaptive_subsampling){
+            for(int i=0; i<nr_verts; i++){
+                float dist=mesh->V.row(i).norm();
+                float prob_to_remove= map(dist, m_adaptive_subsampling_falloff_start, m_adaptive_subsampling_falloff_end, 0.5, 0.0 );
+                float r_val = m_rand_gen->rand_float(0.0, 1.0);
+                if(r_val < prob_to_remove) {
+                    is_kept[i]=false;
+                }
+            }
+        }
+        if(do_random_subsampling){
+            for(int i=0; i<nr_verts; i++){
+                if(!is_kept[i]){
+                    continue;
+                }
+                float random= m_rand_gen->rand_float(0.0, 1.0);
+                if(random<m_random_subsample_percentage){
+                    is_kept[i]=false;
+                }
+            }
+        }
+    }else if(do_adaptive_subsampling || do_random_subsampling){
+        //a vertex survives both subsamplings with the product of the two probabilities so one draw is enough
+        for(int i=0; i<nr_verts; i++){
+            float prob_to_keep=1.0;
+            if(do_adaptive_subsampling){
+                float dist=mesh->V.row(i).norm();
+                prob_to_keep*=1.0-map(dist, m_adaptive_subsampling_falloff_start, m_adaptive_subsampling_falloff_end, 0.5, 0.0 );
+            }
+            if(do_random_subsampling){
+                prob_to_keep*=1.0-m_random_subsample_percentage;
+            }
+            float r_val = m_rand_gen->rand_float(0.0, 1.0);
+            if(r_val >= prob_to_keep) {
+                is_kept[i]=false;
+            }
+        }
+    }
+    std::vector<int> kept_idx;
+    kept_idx.reserve(nr_verts);
+    for(int i=0; i<nr_verts; i++){
+        if(is_kept[i]){
+            kept_idx.push_back(i);
+        }
+    }
+
+
+    //compose all the affine augmentations into tf, drawing the random values in the same order as transform()
+    //rot accumulates only the rotations because transform_vertices_cpu also rotates the normals while the stretch and the mirroring don't
+    Eigen::Matrix3d rot;
+    Eigen::Affine3d tf=draw_random_affine(rot);
+
+    bool do_hsv_jitter=!m_hsv_jitter.isZero() && mesh->C.size();
+    Eigen::Vector3d hsv_noise;
+    if(do_hsv_jitter){
+        hsv_noise << m_rand_gen->rand_float(-m_hsv_jitter.x(), m_hsv_jitter.x() ), m_rand_gen->rand_float( -m_hsv_jitter.y(), m_hsv_jitter.y()  ), m_rand_gen->rand_float( -m_hsv_jitter.z(), m_hsv_jitter.z()  );
+    }
+
+    bool do_xyz_noise=m_rand_gen->rand_bool(m_chance_of_xyz_noise) && !m_xyz_noise_stddev.isZero();
+
+
+    //one pass over the surviving points which compacts, transforms, adds noise and jitters the color
+    const int nr_kept=kept_idx.size();
+    const Eigen::Matrix3d linear=tf.linear();
+    const Eigen::Vector3d translation=tf.translation();
+    bool has_colors=mesh->C.size()>0;
+    if(has_colors){
+        CHECK(mesh->C.rows()==nr_verts && mesh->C.cols()==3) << "Expected one rgb color per vertex but the colors have size " << mesh->C.rows() << "x" << mesh->C.cols() << " for " << nr_verts << " vertices";
+    }
+    Eigen::MatrixXd V_new(nr_kept, 3);
+    Eigen::MatrixXd C_new;
+    if(has_colors){
+        C_new.resize(nr_kept, 3);
+    }
+    for(int i=0; i<nr_kept; i++){
+        int idx=kept_idx[i];
+
+        Eigen::Vector3d v=mesh->V.row(idx);
+        if(!v.isZero()){ //transform_vertices_cpu leaves the points at the origin where they are
+            v=linear*v+translation;
+        }
+        if(do_xyz_noise){
+            v.x()+=m_rand_gen->rand_normal_float(0.0, m_xyz_noise_stddev(0));
+            v.y()+=m_rand_gen->rand_normal_float(0.0, m_xyz_noise_stddev(1));
+            v.z()+=m_rand_gen->rand_normal_float(0.0, m_xyz_noise_stddev(2));
+        }
+        V_new.row(i)=v;
+
+        if(has_colors){
+            Eigen::Vector3d color_rgb=mesh->C.row(idx);
+            if(do_hsv_jitter){
+                Eigen::Vector3d hsv=rgb2hsv(color_rgb );
+                hsv+=hsv_noise;
+                hsv.x()= wrap(hsv.x(), 360.0); //hue is a 360 degree circle so a wrap is better than a clamp
+                hsv.y()= clamp(hsv.y(), 0.0, 1.0);
+                hsv.z()= clamp(hsv.z(), 0.0, 1.0);
+                color_rgb= hsv2rgb(hsv);
+            }
+            C_new.row(i)=color_rgb;
+        }
+    }
+    mesh->V.swap(V_new);
+    if(has_colors){
+        mesh->C.swap(C_new);
+    }
+
+    //the rest of the per vertex attributes only need to be compacted
+    if(nr_kept!=nr_verts){
+        gather_rows(mesh->NV, kept_idx, nr_verts);
+        gather_rows(mesh->L_gt, kept_idx, nr_verts);
+        gather_rows(mesh->L_pred, kept_idx, nr_verts);
+        gather_rows(mesh->D, kept_idx, nr_verts);
+        gather_rows(mesh->I, kept_idx, nr_verts);
+        gather_rows(mesh->UV, kept_idx, nr_verts);
+        gather_rows(mesh->V_tangent_u, kept_idx, nr_verts);
+    }
+    if(mesh->NV.size() && !rot.isIdentity()){
+        mesh->NV=(rot*mesh->NV.transpose()).transpose();
+    }
+
+    return mesh;
+
+}
+
+Eigen::Affine3d DataTransformer::draw_random_affine(Eigen::Matrix3d& rot){
+
+    Eigen::Affine3d tf;
+    tf.setIdentity();
+    rot.setIdentity();
+
+    //same condition as in transform() so that we consume the same random numbers
+    if(m_random_translation_xyz_magnitude.isZero()){
+        Eigen::Affine3d tf_translation;
+        tf_translation.setIdentity();
+        tf_translation.translation().x()=m_rand_gen->rand_float(-1.0, 1.0)*m_random_translation_xyz_magnitude.x();
+        tf_translation.translation().y()=m_rand_gen->rand_float(-1.0, 1.0)*m_random_translation_xyz_magnitude.y();
+        tf_translation.translation().z()=m_rand_gen->rand_float(-1.0, 1.0)*m_random_translation_xyz_magnitude.z();
+        tf=tf_translation*tf;
+    }
+
+    if(!m_random_stretch_xyz_magnitude.isZero()){
+        float sx=m_random_stretch_xyz_magnitude.x();
+        float sy=m_random_stretch_xyz_magnitude.y();
+        float sz=m_random_stretch_xyz_magnitude.z();
+        float stretch_factor_x=1.0 + m_rand_gen->rand_float(-sx, sx);
+        float stretch_factor_y=1.0 + m_rand_gen->rand_float(-sy, sy);
+        float stretch_factor_z=1.0 + m_rand_gen->rand_float(-sz, sz);
+        tf.prescale(Eigen::Vector3d(stretch_factor_x, stretch_factor_y, stretch_factor_z));
+    }
+
+    const Eigen::Vector3d axes[3]={Eigen::Vector3d::UnitX(), Eigen::Vector3d::UnitY(), Eigen::Vector3d::UnitZ()};
+    const float max_angles[3]={m_rotation_x_max_angle, m_rotation_y_max_angle, m_rotation_z_max_angle};
+    for(int i=0; i<3; i++){
+        if(max_angles[i]!=0){
+            float rand_angle_degrees=m_rand_gen->rand_float(-max_angles[i]/2, max_angles[i]/2);
+            float rand_angle_radians=rand_angle_degrees * M_PI / 180.0;
+            Eigen::Matrix3d tf_rot;
+            tf_rot = Eigen::AngleAxisd(rand_angle_radians, axes[i]);
+            tf.prerotate(tf_rot);
+            rot=tf_rot*rot;
+        }
+    }
+
+    const bool mirrors[3]={m_random_mirror_x, m_random_mirror_y, m_random_mirror_z};
+    Eigen::Vector3d mirror_scale=Eigen::Vector3d::Ones();
+    for(int i=0; i<3; i++){
+        if(mirrors[i]){
+            bool do_flip=m_rand_gen->rand_bool(0.5); //50/50 will do a flip
+            if(do_flip){
+                mirror_scale(i)=-1.0;
+            }
+        }
+    }
+    tf.prescale(mirror_scale);
+
+    if(m_random_rotation_90_degrees_y){
+        int nr_times=m_rand_gen->rand_int(0, 3);
+        float rand_angle_degrees=90*nr_times;
+        float rand_angle_radians=rand_angle_degrees * M_PI / 180.0;
+        Eigen::Matrix3d tf_rot;
+        tf_rot = Eigen::AngleAxisd(rand_angle_radians, Eigen::Vector3d::UnitY());
+        tf.prerotate(tf_rot);
+        rot=tf_rot*rot;
+    }
+
+    return tf;
+
+}
+
+Eigen::Affine3d DataTransformer::draw_cloud_augmentation(const int nr_points, Eigen::MatrixXd& xyz_noise){
+
+    CHECK(m_adaptive_subsampling_falloff_end==0.0 && m_random_subsample_percentage==0.0) << "The subsampling would change the nr of points so it's not supported when drawing the augmentation of a cloud. Please set adaptive_subsampling_falloff_end and random_subsample_percentage to 0";
+
+    Eigen::Matrix3d rot;
+    Eigen::Affine3d tf=draw_random_affine(rot);
+
+    //no colors so there is no draw for the hsv jitter
+    bool do_xyz_noise=m_rand_gen->rand_bool(m_chance_of_xyz_noise) && !m_xyz_noise_stddev.isZero();
+    xyz_noise.resize(0,3);
+    if(do_xyz_noise){
+        xyz_noise.resize(nr_points, 3);
+        for(int i=0; i<nr_points; i++){
+            xyz_noise(i,0)=m_rand_gen->rand_normal_float(0.0, m_xyz_noise_stddev(0));
+            xyz_noise(i,1)=m_rand_gen->rand_normal_float(0.0, m_xyz_noise_stddev(1));
+            xyz_noise(i,2)=m_rand_gen->rand_normal_float(0.0, m_xyz_noise_stddev(2));
+        }
+    }
+
+    return tf;
+}
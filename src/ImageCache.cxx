@@ -0,0 +1,137 @@
+#include "data_loaders/ImageCache.h"
+
+//c++
+#include <algorithm>
+
+//loguru
+#define LOGURU_REPLACE_GLOG 1
+#include <loguru.hpp>
+
+//my stuff
+#include "data_loaders/MiscDataFuncs.h"
+
+
+
+ImageCache::ImageCache():
+    m_budget_bytes(0),
+    m_nr_bytes(0),
+    m_nr_hits(0),
+    m_nr_misses(0),
+    m_nr_evictions(0)
+{
+}
+
+std::shared_ptr<ImageCache> ImageCache::shared(){
+    static std::shared_ptr<ImageCache> cache=std::make_shared<ImageCache>();
+    return cache;
+}
+
+cv::Mat ImageCache::read(const std::string& path, const int imread_flags, const int subsample_factor, const int interpolation, const bool reduced_jpeg_decode){
+    std::string key=make_key(path, imread_flags, subsample_factor, interpolation, reduced_jpeg_decode);
+
+    //the frames and python are free to write into the mats they get so we only ever hand out copies of the cached ones
+    cv::Mat cached;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it=m_key2entry.find(key);
+        if(it!=m_key2entry.end()){
+            m_nr_hits++;
+            m_lru.splice(m_lru.begin(), m_lru, it->second);
+            cached=it->second->img; //only the header, the cached mat is never written so we can copy it without the lock
+        }else{
+            m_nr_misses++;
+        }
+    }
+    if(!cached.empty()){
+        return cached.clone();
+    }
+
+    //we decode without holding the lock so that the readers can decode different images at the same time
+    cv::Mat img=decode(path, imread_flags, subsample_factor, interpolation, reduced_jpeg_decode);
+
+    size_t nr_bytes=img.total()*img.elemSize();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    //another thread may have decoded the same image in the meantime, or the image alone may be bigger than the whole budget
+    if(img.empty() || nr_bytes>m_budget_bytes || m_key2entry.count(key)){
+        return img;
+    }
+    evict_until_under(m_budget_bytes-nr_bytes);
+    Entry entry;
+    entry.key=key;
+    entry.img=img;
+    entry.nr_bytes=nr_bytes;
+    m_lru.push_front(entry);
+    m_key2entry[key]=m_lru.begin();
+    m_nr_bytes+=nr_bytes;
+
+    return img.clone();
+}
+
+cv::Mat ImageCache::read(const std::shared_ptr<ImageCache>& cache, const std::string& path, const int imread_flags, const int subsample_factor, const int interpolation, const bool reduced_jpeg_decode){
+    if(!cache){
+        return decode(path, imread_flags, subsample_factor, interpolation, reduced_jpeg_decode);
+    }
+    return cache->read(path, imread_flags, subsample_factor, interpolation, reduced_jpeg_decode);
+}
+
+cv::Mat ImageCache::decode(const std::string& path, const int imread_flags, const int subsample_factor, const int interpolation, const bool reduced_jpeg_decode){
+    return MiscDataFuncs::read_image(path, imread_flags, subsample_factor, interpolation, reduced_jpeg_decode);
+}
+
+void ImageCache::reserve_budget(const size_t nr_bytes){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_budget_bytes=std::max(m_budget_bytes, nr_bytes);
+}
+
+void ImageCache::clear(){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_lru.clear();
+    m_key2entry.clear();
+    m_nr_bytes=0;
+}
+
+size_t ImageCache::budget_bytes(){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_budget_bytes;
+}
+
+size_t ImageCache::nr_bytes(){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_nr_bytes;
+}
+
+size_t ImageCache::nr_images(){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_lru.size();
+}
+
+uint64_t ImageCache::nr_hits(){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_nr_hits;
+}
+
+uint64_t ImageCache::nr_misses(){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_nr_misses;
+}
+
+uint64_t ImageCache::nr_evictions(){
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_nr_evictions;
+}
+
+std::string ImageCache::make_key(const std::string& path, const int imread_flags, const int subsample_factor, const int interpolation, const bool reduced_jpeg_decode){
+    //the same file read with different flags or subsampled differently gives a different image
+    return path+"|"+std::to_string(imread_flags)+"|"+std::to_string(subsample_factor)+"|"+std::to_string(interpolation)+"|"+std::to_string(reduced_jpeg_decode);
+}
+
+void ImageCache::evict_until_under(const size_t nr_bytes){
+    while(m_nr_bytes>nr_bytes && !m_lru.empty()){
+        //the mats that are still used by some frame stay alive until that frame is destroyed, we only drop our reference
+        const Entry& oldest=m_lru.back();
+        m_nr_bytes-=oldest.nr_bytes;
+        m_key2entry.erase(oldest.key);
+        m_lru.pop_back();
+        m_nr_evictions++;
+    }
+}
@@ -0,0 +1,58 @@
+#include "data_loaders/MappedFile.h"
+
+//c++
+#include <cstring>
+#include <cerrno>
+
+//posix
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+//loguru
+#define LOGURU_REPLACE_GLOG 1
+#include <loguru.hpp>
+
+
+
+MappedFile::MappedFile(const std::string& path):
+    m_path(path),
+    m_data(nullptr),
+    m_size(0)
+{
+    int fd=open(path.c_str(), O_RDONLY);
+    if(fd<0){
+        LOG(FATAL) << "Could not open " << path << " : " << std::strerror(errno);
+    }
+
+    struct stat file_stat;
+    if(fstat(fd, &file_stat)!=0){
+        close(fd);
+        LOG(FATAL) << "Could not stat " << path << " : " << std::strerror(errno);
+    }
+    m_size=file_stat.st_size;
+
+    //mmap refuses a length of 0 so an empty file just stays unmapped
+    if(m_size>0){
+        void* ptr=mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(ptr==MAP_FAILED){
+            close(fd);
+            LOG(FATAL) << "Could not mmap " << path << " : " << std::strerror(errno);
+        }
+        m_data=static_cast<const char*>(ptr);
+    }
+
+    //the mapping keeps its own reference to the file
+    close(fd);
+}
+
+MappedFile::~MappedFile(){
+    if(m_data){
+        munmap(const_cast<char*>(m_data), m_size);
+    }
+}
+
+void MappedFile::check_range(const size_t offset, const size_t nr_bytes) const{
+    CHECK(offset<=m_size && nr_bytes<=m_size-offset) << "Trying to read bytes [" << offset << ", " << offset+nr_bytes << ") but " << m_path << " has only " << m_size << " bytes. The file is probably truncated";
+}
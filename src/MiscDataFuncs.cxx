@@ -11,31 +11,247 @@
 // #include <configuru.hpp>
 // using namespace configuru;
 
+//c++
+#include <fstream>
+#include <cmath>
+#include <limits>
+
 //loguru
 #define LOGURU_REPLACE_GLOG 1
 #include <loguru.hpp>
 
+#include <opencv2/imgcodecs.hpp>  //for imread
+#include <opencv2/imgproc/imgproc.hpp> //for cv::resize
+
 
 
 //my stuff
+#include "data_loaders/WorkerPool.h"
 
 // using namespace er::utils;
 using namespace radu::utils;
 using namespace easy_pbr;
 
+namespace{
+
+//does one row of rgba2rgb_and_mask. The values are brought to the range [0,255] first so that the 16 bit images give the same outputs as the 8 bit ones
+//the checks for the outputs and composite don't change within the row so the compiler can take them out of the loop and vectorize the rest
+template <typename T>
+void rgba_row_to_rgb_and_mask(const T* rgba, const int nr_pixels, const float max_val, const bool composite, const float* bg, uchar* rgb_8u, float* rgb_32f, uchar* mask_8u, float* mask_32f){
+    const float to_255=255.0f/max_val;
+    for(int x=0; x<nr_pixels; x++){
+        const T* px=rgba+4*x;
+        float alpha=px[3]/max_val;
+        for(int c=0; c<3; c++){
+            float val=px[c]*to_255;
+            if(composite){
+                val=val*alpha + bg[c]*(1.0f-alpha);
+            }
+            if(rgb_8u){
+                rgb_8u[3*x+c]=cv::saturate_cast<uchar>(val);
+            }
+            if(rgb_32f){
+                rgb_32f[3*x+c]=val/255.0f;
+            }
+        }
+        if(mask_8u){
+            mask_8u[x]= px[3]>0;
+        }
+        if(mask_32f){
+            mask_32f[x]= px[3]>0? 1.0f : 0.0f;
+        }
+    }
+}
+
+} //namespace
+
 
 MiscDataFuncs::MiscDataFuncs(){
 
 
 }
 
+cv::Mat MiscDataFuncs::read_image(const std::string& path, const int imread_flags, const int subsample_factor, const int interpolation, const bool reduced_jpeg_decode){
+
+    if(reduced_jpeg_decode){
+        cv::Mat img=read_jpeg_reduced(path, imread_flags, subsample_factor, interpolation);
+        if(!img.empty()){
+            return img;
+        }
+    }
+
+    cv::Mat img=cv::imread(path, imread_flags);
+    if(subsample_factor>1 && !img.empty()){
+        cv::Mat resized;
+        cv::resize(img, resized, cv::Size(), 1.0/subsample_factor, 1.0/subsample_factor, interpolation);
+        img=resized;
+    }
+    return img;
+}
+
+std::tuple<bool, double, double> MiscDataFuncs::compare_reduced_jpeg_decode(const std::string& path, const int imread_flags, const int subsample_factor){
+    cv::Mat reduced=read_jpeg_reduced(path, imread_flags, subsample_factor, cv::INTER_AREA);
+    if(reduced.empty()){
+        return std::make_tuple(false, std::numeric_limits<double>::infinity(), 0.0); //the reduced decode is not used for this image so read_image gives exactly the resized one
+    }
+    cv::Mat resized=read_image(path, imread_flags, subsample_factor, cv::INTER_AREA, false);
+    CHECK(reduced.size()==resized.size() && reduced.type()==resized.type()) << "The reduced decode of " << path << " has size " << reduced.cols << "x" << reduced.rows << " while the resized one has " << resized.cols << "x" << resized.rows;
+
+    cv::Mat diff;
+    cv::absdiff(reduced, resized, diff);
+    double max_abs_diff=0;
+    cv::minMaxLoc(diff.reshape(1), nullptr, &max_abs_diff);
+    double mse=cv::norm(reduced, resized, cv::NORM_L2SQR)/(double)(reduced.total()*reduced.channels());
+    double psnr= mse>0? 10.0*std::log10(255.0*255.0/mse) : std::numeric_limits<double>::infinity();
+
+    return std::make_tuple(true, psnr, max_abs_diff);
+}
+
+cv::Mat MiscDataFuncs::read_jpeg_reduced(const std::string& path, const int imread_flags, const int subsample_factor, const int interpolation){
+
+    //libjpeg can scale the image by 1/2, 1/4 and 1/8 while decoding, which averages the pixels like INTER_AREA does
+    //it rounds the size up though, so we only use it when the size is divisible by the factor and we get the same size as with cv::resize
+    bool is_unchanged= imread_flags==cv::IMREAD_UNCHANGED;
+    int flags_no_orientation= imread_flags & ~cv::IMREAD_IGNORE_ORIENTATION;
+    bool can_reduce= (subsample_factor==2 || subsample_factor==4 || subsample_factor==8) &&
+                     interpolation==cv::INTER_AREA &&
+                     (is_unchanged || flags_no_orientation==cv::IMREAD_COLOR || flags_no_orientation==cv::IMREAD_GRAYSCALE);
+    int width, height, nr_channels;
+    if(!can_reduce || !read_jpeg_header(path, width, height, nr_channels) || width%subsample_factor!=0 || height%subsample_factor!=0){
+        return cv::Mat();
+    }
+
+    bool color= flags_no_orientation==cv::IMREAD_COLOR;
+    bool ignore_orientation= imread_flags & cv::IMREAD_IGNORE_ORIENTATION;
+    if(is_unchanged){
+        //unchanged gives the 8 bit jpeg as it's stored and without the exif orientation, so the same as the color or grayscale read without orientation depending on the channels of the file
+        //other layouts like cmyk are left to cv::imread
+        if(nr_channels!=1 && nr_channels!=3){
+            return cv::Mat();
+        }
+        color= nr_channels==3;
+        ignore_orientation=true;
+    }
+
+    //the reduced flags are the color or grayscale flag together with the bits that select the factor
+    int reduced_flag= color? cv::IMREAD_REDUCED_COLOR_2 : cv::IMREAD_REDUCED_GRAYSCALE_2;
+    if(subsample_factor==4){
+        reduced_flag= color? cv::IMREAD_REDUCED_COLOR_4 : cv::IMREAD_REDUCED_GRAYSCALE_4;
+    }else if(subsample_factor==8){
+        reduced_flag= color? cv::IMREAD_REDUCED_COLOR_8 : cv::IMREAD_REDUCED_GRAYSCALE_8;
+    }
+    cv::Mat img=cv::imread(path, ignore_orientation? reduced_flag | cv::IMREAD_IGNORE_ORIENTATION : reduced_flag );
+    //the exif orientation may have swapped the width and height but both are divisible so the sizes still match
+    bool has_expected_size= (img.cols*subsample_factor==width && img.rows*subsample_factor==height) ||
+                            (img.cols*subsample_factor==height && img.rows*subsample_factor==width);
+    if(img.empty() || !has_expected_size){
+        return cv::Mat();
+    }
+    return img;
+}
+
+void MiscDataFuncs::rgba2rgb_and_mask(const cv::Mat& rgba, const bool composite, const Eigen::Vector3f& bg_color, cv::Mat* rgb_8u, cv::Mat* rgb_32f, cv::Mat* mask, const int mask_type){
+    CHECK(rgba.channels()==4) << "Expected an rgba image but it has " << rgba.channels() << " channels";
+    CHECK(rgba.depth()==CV_8U || rgba.depth()==CV_16U) << "Expected an 8 or 16 bit rgba image but it has depth " << rgba.depth();
+    CHECK(mask_type==CV_8U || mask_type==CV_32F) << "The mask can only be CV_8U or CV_32F";
+
+    //always new mats, create() would reuse the buffers the outputs already point to and those can still be shared with copies of the frame
+    if(rgb_8u){
+        *rgb_8u=cv::Mat(rgba.rows, rgba.cols, CV_8UC3);
+    }
+    if(rgb_32f){
+        *rgb_32f=cv::Mat(rgba.rows, rgba.cols, CV_32FC3);
+    }
+    if(mask){
+        *mask=cv::Mat(rgba.rows, rgba.cols, mask_type);
+    }
+
+    float bg[3]={bg_color.x(), bg_color.y(), bg_color.z()};
+    for(int y=0; y<rgba.rows; y++){
+        uchar* rgb_8u_row= rgb_8u? rgb_8u->ptr<uchar>(y) : nullptr;
+        float* rgb_32f_row= rgb_32f? rgb_32f->ptr<float>(y) : nullptr;
+        uchar* mask_8u_row= mask && mask_type==CV_8U? mask->ptr<uchar>(y) : nullptr;
+        float* mask_32f_row= mask && mask_type==CV_32F? mask->ptr<float>(y) : nullptr;
+        if(rgba.depth()==CV_8U){
+            rgba_row_to_rgb_and_mask(rgba.ptr<uchar>(y), rgba.cols, 255.0f, composite, bg, rgb_8u_row, rgb_32f_row, mask_8u_row, mask_32f_row);
+        }else{
+            rgba_row_to_rgb_and_mask(rgba.ptr<ushort>(y), rgba.cols, 65535.0f, composite, bg, rgb_8u_row, rgb_32f_row, mask_8u_row, mask_32f_row);
+        }
+    }
+}
+
+bool MiscDataFuncs::read_jpeg_header(const std::string& path, int& width, int& height, int& nr_channels){
+    std::ifstream file(path, std::ios::binary);
+    if(!file.is_open()){
+        return false;
+    }
+
+    //the file starts with the SOI marker and then comes a list of segments. The size is in the first SOF segment, which comes before the image data
+    unsigned char soi[2];
+    if(!file.read(reinterpret_cast<char*>(soi), 2) || soi[0]!=0xFF || soi[1]!=0xD8){
+        return false;
+    }
+    while(file){
+        int byte=file.get();
+        if(byte!=0xFF){
+            return false;
+        }
+        int marker=file.get();
+        while(marker==0xFF){ //markers can be padded with 0xFF
+            marker=file.get();
+        }
+        if(marker==EOF || marker==0xD9 || marker==0xDA){ //end of image or start of the image data without having seen the size
+            return false;
+        }
+        if(marker==0x01 || (marker>=0xD0 && marker<=0xD7)){ //markers without a segment
+            continue;
+        }
+        unsigned char length_bytes[2];
+        if(!file.read(reinterpret_cast<char*>(length_bytes), 2)){
+            return false;
+        }
+        int length=(length_bytes[0]<<8) | length_bytes[1];
+        if(length<2){
+            return false;
+        }
+        //SOF0 to SOF15 except DHT, JPG and DAC which share the range
+        bool is_sof= marker>=0xC0 && marker<=0xCF && marker!=0xC4 && marker!=0xC8 && marker!=0xCC;
+        if(is_sof){
+            unsigned char sof[6]; //precision, height, width, nr of components
+            if(!file.read(reinterpret_cast<char*>(sof), 6)){
+                return false;
+            }
+            height=(sof[1]<<8) | sof[2];
+            width=(sof[3]<<8) | sof[4];
+            nr_channels=sof[5];
+            return sof[0]==8 && width>0 && height>0; //12 bit jpegs are not decoded to 8 bit by every libjpeg so we leave them to cv::imread
+        }
+        file.seekg(length-2, std::ios::cur);
+    }
+    return false;
+}
+
 
 
 #ifdef WITH_TORCH
 
     //function to get all the frames into gpu tensors which allows for faster sampling of rays later
-    TensorReel MiscDataFuncs::frames2tensors(const std::vector< Frame >& frames){
+    TensorReel MiscDataFuncs::frames2tensors(const std::vector< Frame >& frames, const std::string rgb_dtype, const std::string mask_dtype){
+        return frames2reel(frames, true, rgb_dtype, mask_dtype);
+    }
+
+    TensorReel MiscDataFuncs::frames2tensors_cpu(const std::vector< Frame >& frames, const std::string rgb_dtype, const std::string mask_dtype){
+        return frames2reel(frames, false, rgb_dtype, mask_dtype);
+    }
+
+    //all the frames are first written into one host buffer per reel, in parallel over the frames, and then every reel is uploaded with one single copy
+    //uploading every image and matrix on its own was doing 5 small synchronous copies per frame which was most of the time for big captures
+    TensorReel MiscDataFuncs::frames2reel(const std::vector< Frame >& frames, const bool to_gpu, const std::string& rgb_dtype, const std::string& mask_dtype){
         CHECK(!frames.empty()) << "Frames is empty";
+        torch::ScalarType rgb_type=TensorReel::dtype_from_name(rgb_dtype);
+        torch::ScalarType mask_type=TensorReel::dtype_from_name(mask_dtype);
+        CHECK(rgb_type!=torch::kBool) << "The rgb cannot be stored as bool";
+        CHECK(mask_type!=torch::kFloat16) << "The mask cannot be stored as float16, use uint8 which is just as precise for masks and half the size";
 
         //we assume all the images have the same size so that they can be packed into a tensor of size BCHW where B is the nr of images
         int first_w=frames[0].width;
@@ -44,59 +260,114 @@ MiscDataFuncs::MiscDataFuncs(){
             if(frames[i].width!= first_w || frames[i].height!=first_h){
                 LOG(FATAL) << "Frames vector contains images that are not the same size. Found image at idx " << i << " with width and height " << frames[i].width << " " << frames[i].height << " when the first image in the vector has width and height " << first_w << " " << first_h << ". Please use frame.crop to get a frame that has all the same size";
             }
+            CHECK(frames[i].rgb_32f.type()==CV_32FC3 && frames[i].rgb_32f.rows==first_h && frames[i].rgb_32f.cols==first_w) << "The rgb_32f of the frame at idx " << i << " should be a float image with 3 channels and the same size as the frame";
         }
-        
 
-        //make tensors for K(as 3x3 matrix) and poses as 4x4 matrices
-        torch::Tensor K_reel = torch::empty({ (int)frames.size(), 3,3 }, torch::dtype(torch::kFloat32).device(torch::kCUDA, 0) );
-        torch::Tensor tf_cam_world_reel = torch::empty({ (int)frames.size(), 4,4 }, torch::dtype(torch::kFloat32).device(torch::kCUDA, 0) );
-        torch::Tensor tf_world_cam_reel = torch::empty({ (int)frames.size(), 4,4 }, torch::dtype(torch::kFloat32).device(torch::kCUDA, 0) );
-        //Make a reel to contain all the image batches
-        torch::Tensor rgb_reel = torch::empty({ (int)frames.size(), 3, first_h, first_w }, torch::dtype(torch::kFloat32).device(torch::kCUDA, 0) );
+        bool has_mask=!frames[0].mask.empty();
+        if (has_mask){
+            for (size_t i=0; i<frames.size(); i++){
+                CHECK(frames[i].mask.rows==first_h && frames[i].mask.cols==first_w) << "The frame at idx " << i << " has no mask or a mask of a different size while the first frame has one of size " << first_w << " " << first_h;
+            }
+        }
 
-        bool has_mask=false;
-        torch::Tensor mask_reel=torch::empty({ 1, 1, 1, 1 }, torch::dtype(torch::kFloat32).device(torch::kCUDA, 0) );
-        if (!frames[0].mask.empty()){
-            mask_reel = torch::empty({ (int)frames.size(), 1, first_h, first_w }, torch::dtype(torch::kFloat32).device(torch::kCUDA, 0) );
-            has_mask=true;
+        //the staging buffers are pinned so that the copies to the gpu can be async and don't need to go through another pageable copy in the driver
+        //when we stay on the cpu the staging buffers are already the final reels
+        int nr_frames=frames.size();
+        auto host_options=torch::dtype(torch::kFloat32).pinned_memory(to_gpu);
+        torch::Tensor K_reel = torch::empty({ nr_frames, 3,3 }, host_options );
+        torch::Tensor tf_cam_world_reel = torch::empty({ nr_frames, 4,4 }, host_options );
+        torch::Tensor tf_world_cam_reel = torch::empty({ nr_frames, 4,4 }, host_options );
+        //Make a reel to contain all the image batches
+        torch::Tensor rgb_reel = torch::empty({ nr_frames, 3, first_h, first_w }, host_options.dtype(rgb_type) );
+        torch::Tensor mask_reel = torch::empty({ 1, 1, 1, 1 }, host_options.dtype(mask_type) );
+        if (has_mask){
+            mask_reel = torch::empty({ nr_frames, 1, first_h, first_w }, host_options.dtype(mask_type) );
         }
 
-        //load all the images and K and poses
-        for (size_t i=0; i<frames.size(); i++){ 
-            
+        float* K_ptr=K_reel.data_ptr<float>();
+        float* tf_cam_world_ptr=tf_cam_world_reel.data_ptr<float>();
+        float* tf_world_cam_ptr=tf_world_cam_reel.data_ptr<float>();
+        //the images are written byte wise through opencv so we only need the raw pointers and the size of one element
+        unsigned char* rgb_ptr=static_cast<unsigned char*>(rgb_reel.data_ptr());
+        unsigned char* mask_ptr=static_cast<unsigned char*>(mask_reel.data_ptr());
+        size_t rgb_elem_size=rgb_reel.element_size();
+        size_t mask_elem_size=mask_reel.element_size();
+        size_t nr_pixels=(size_t)first_h*first_w;
 
-            //load rgb
-            torch::Tensor rgb_32f_tensor=mat2tensor(frames[i].rgb_32f, true).to("cuda");
-            rgb_reel.slice(0, i, i+1)=rgb_32f_tensor;
+        //load all the images and K and poses
+        //the pool is kept alive between calls since shared() only holds a weak reference and would otherwise spawn and join all the threads every time
+        static std::shared_ptr<WorkerPool> pool=WorkerPool::shared(0);
+        WorkerPool::parallel_for(pool, nr_frames, [&](const int i){
+            const Frame& frame=frames[i];
+
+            //load rgb. The frames are bgr and the reel is rgb so the channels get split directly into the planes in reverse order
+            unsigned char* rgb_frame_ptr=rgb_ptr+(size_t)i*3*nr_pixels*rgb_elem_size;
+            if (rgb_type==torch::kFloat16){
+                //opencv has no half type that we can rely on so we convert while splitting
+                at::Half* rgb_frame_half=reinterpret_cast<at::Half*>(rgb_frame_ptr);
+                for (int y=0; y<first_h; y++){
+                    const cv::Vec3f* row=frame.rgb_32f.ptr<cv::Vec3f>(y);
+                    size_t row_start=(size_t)y*first_w;
+                    for (int x=0; x<first_w; x++){
+                        rgb_frame_half[row_start+x]=at::Half(row[x][2]);
+                        rgb_frame_half[nr_pixels+row_start+x]=at::Half(row[x][1]);
+                        rgb_frame_half[2*nr_pixels+row_start+x]=at::Half(row[x][0]);
+                    }
+                }
+            }else{
+                int plane_type= rgb_type==torch::kUInt8? CV_8UC1 : CV_32FC1;
+                cv::Mat rgb_planes[3]={
+                    cv::Mat(first_h, first_w, plane_type, rgb_frame_ptr+2*nr_pixels*rgb_elem_size),
+                    cv::Mat(first_h, first_w, plane_type, rgb_frame_ptr+1*nr_pixels*rgb_elem_size),
+                    cv::Mat(first_h, first_w, plane_type, rgb_frame_ptr)
+                };
+                if (rgb_type==torch::kUInt8){
+                    cv::Mat rgb_8u;
+                    frame.rgb_32f.convertTo(rgb_8u, CV_8UC3, 255.0); //rounds and saturates to [0,255]
+                    cv::split(rgb_8u, rgb_planes);
+                }else{
+                    cv::split(frame.rgb_32f, rgb_planes);
+                }
+            }
 
-            //load mask
+            //load mask, we only keep the first channel
             if (has_mask){
-                torch::Tensor mask_tensor=mat2tensor(frames[i].mask, false).to("cuda");
-                //get the mask as only 1 channel
-                mask_tensor=mask_tensor.slice(1, 0, 1); //dim,start,end
-                mask_reel.slice(0, i, i+1)=mask_tensor;
+                unsigned char* mask_frame_ptr=mask_ptr+(size_t)i*nr_pixels*mask_elem_size;
+                cv::Mat mask_channel;
+                cv::extractChannel(frame.mask, mask_channel, 0);
+                if (mask_type==torch::kFloat32){
+                    cv::Mat mask_plane(first_h, first_w, CV_32FC1, mask_frame_ptr);
+                    mask_channel.convertTo(mask_plane, CV_32F);
+                }else if (mask_type==torch::kUInt8){
+                    cv::Mat mask_plane(first_h, first_w, CV_8UC1, mask_frame_ptr);
+                    mask_channel.convertTo(mask_plane, CV_8U, 255.0); //masks are in [0,1] so this keeps also the soft ones
+                }else{
+                    //bool is one byte per element with 0 or 1
+                    cv::Mat mask_plane(first_h, first_w, CV_8UC1, mask_frame_ptr);
+                    cv::Mat is_set;
+                    cv::compare(mask_channel, 0.5, is_set, cv::CMP_GE); //gives 0 or 255
+                    is_set.convertTo(mask_plane, CV_8U, 1.0/255.0);
+                }
             }
 
-
-            //load K
-            torch::Tensor K_tensor=eigen2tensor(frames[i].K);
-            K_reel.slice(0, i, i+1)=K_tensor.unsqueeze(0);
-
-            //load pose
-            torch::Tensor tf_cam_world_tensor=eigen2tensor(frames[i].tf_cam_world.matrix());
-            tf_cam_world_reel.slice(0, i, i+1)=tf_cam_world_tensor.unsqueeze(0);
-
-            //load pose inverse
-            torch::Tensor tf_world_cam_tensor=eigen2tensor(frames[i].tf_cam_world.inverse().matrix());
-            tf_world_cam_reel.slice(0, i, i+1)=tf_world_cam_tensor.unsqueeze(0);
-
-
-                
+            //load K and the pose and its inverse, all stored row major like the tensors
+            Eigen::Map< Eigen::Matrix<float, 3, 3, Eigen::RowMajor> > (K_ptr+i*9) = frame.K.cast<float>();
+            Eigen::Map< Eigen::Matrix<float, 4, 4, Eigen::RowMajor> > (tf_cam_world_ptr+i*16) = frame.tf_cam_world.matrix().cast<float>();
+            Eigen::Map< Eigen::Matrix<float, 4, 4, Eigen::RowMajor> > (tf_world_cam_ptr+i*16) = frame.tf_cam_world.inverse().matrix().cast<float>();
+        });
+
+
+        //the copies are async from pinned memory. The caching allocator of torch keeps the pinned blocks alive until the copies that read from them are finished and the reels are used on the same stream as the copies, so there is no need to sync here
+        if (to_gpu){
+            auto gpu=torch::Device(torch::kCUDA, 0);
+            K_reel=K_reel.to(gpu, /*non_blocking=*/true);
+            tf_cam_world_reel=tf_cam_world_reel.to(gpu, /*non_blocking=*/true);
+            tf_world_cam_reel=tf_world_cam_reel.to(gpu, /*non_blocking=*/true);
+            rgb_reel=rgb_reel.to(gpu, /*non_blocking=*/true);
+            mask_reel=mask_reel.to(gpu, /*non_blocking=*/true);
         }
 
 
-
-
         TensorReel reel;
         reel.K_reel=K_reel;
         reel.tf_cam_world_reel=tf_cam_world_reel;
@@ -104,6 +375,10 @@ MiscDataFuncs::MiscDataFuncs(){
         reel.rgb_reel=rgb_reel;
         reel.mask_reel=mask_reel;
         reel.has_mask=has_mask;
+        reel.rgb_dtype=rgb_dtype;
+        reel.mask_dtype=mask_dtype;
+        reel.rgb_scale= rgb_type==torch::kUInt8? 1.0/255.0 : 1.0;
+        reel.mask_scale= mask_type==torch::kUInt8? 1.0/255.0 : 1.0;
 
         return reel;
 
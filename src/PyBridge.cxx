@@ -29,6 +29,7 @@
 #include "data_loaders/DataLoaderLLFF.h"
 #include "data_loaders/DataLoaderMultiFace.h"
 #include "data_loaders/MiscDataFuncs.h"
+#include "data_loaders/ImageCache.h"
 //fb
 #include "data_loaders/fb/DataLoaderBlenderFB.h"
 #ifdef WITH_TORCH
@@ -51,8 +52,37 @@
 
 namespace py = pybind11;
 
+//the constructors and the calls that read from disk, wait for the loader threads or copy frames release the GIL so that other python threads (like the training loop) can run in the meantime
+//only the c++ call runs without the GIL, the arguments and the returned meshes, frames and shared_ptrs are converted after it is acquired again so handing them to python stays safe
+//the cheap accessors and setters keep the GIL because releasing and acquiring it would cost more than the call itself
+using release_gil = py::call_guard<py::gil_scoped_release>;
+//the _ref getters hand python a view of the frames stored in the loader instead of a copy. reference_internal keeps the loader alive for as long as python holds the frames
+//they still get invalidated when the loader reads its frames again (start() or the next timestep), so copy them with get_frame_at_idx if they need to outlive that
+constexpr py::return_value_policy zero_copy = py::return_value_policy::reference_internal;
+
 using namespace easy_pbr;
 
+//the scene loaders (ShapeNetImg, SRN, DTU) switch scenes on their own so their _ref getters can't point into the loader
+//instead the frames point into a snapshot of the scene and the snapshot is kept alive for as long as python holds any of its frames
+using FramesSnapshot = std::shared_ptr< const std::vector<Frame> >;
+static py::capsule snapshot_owner(const FramesSnapshot& frames){
+    return py::capsule( new FramesSnapshot(frames), [](void* p){ delete static_cast<FramesSnapshot*>(p); } );
+}
+static py::list frames_of_snapshot(const FramesSnapshot& frames){
+    py::capsule owner=snapshot_owner(frames);
+    py::list list;
+    for(const Frame& frame : *frames){
+        list.append( py::cast(&frame, zero_copy, owner) );
+    }
+    return list;
+}
+static py::object frame_of_snapshot(const FramesSnapshot& frames, const int idx){
+    if(idx<0 || idx>=(int)frames->size()){
+        throw py::index_error("idx is out of bounds. It is " + std::to_string(idx) + " while the scene has size " + std::to_string(frames->size()));
+    }
+    return py::cast(&(*frames)[idx], zero_copy, snapshot_owner(frames));
+}
+
 
 PYBIND11_MODULE(dataloaders, m) {
 
@@ -60,109 +90,114 @@ PYBIND11_MODULE(dataloaders, m) {
 
     //DataLoader ShapeNetPartSeg
     py::class_<DataLoaderShapeNetPartSeg> (m, "DataLoaderShapeNetPartSeg")
-    .def(py::init<const std::string>())
-    .def("start", &DataLoaderShapeNetPartSeg::start )
+    .def(py::init<const std::string>(), release_gil())
+    .def("start", &DataLoaderShapeNetPartSeg::start, release_gil() )
     .def("get_cloud", &DataLoaderShapeNetPartSeg::get_cloud )
     .def("has_data", &DataLoaderShapeNetPartSeg::has_data )
     .def("is_finished", &DataLoaderShapeNetPartSeg::is_finished )
     .def("is_finished_reading", &DataLoaderShapeNetPartSeg::is_finished_reading )
-    .def("reset", &DataLoaderShapeNetPartSeg::reset )
+    .def("reset", &DataLoaderShapeNetPartSeg::reset, release_gil() )
     .def("nr_samples", &DataLoaderShapeNetPartSeg::nr_samples )
     .def("label_mngr", &DataLoaderShapeNetPartSeg::label_mngr )
     .def("set_mode_train", &DataLoaderShapeNetPartSeg::set_mode_train )
     .def("set_mode_test", &DataLoaderShapeNetPartSeg::set_mode_test )
     .def("set_mode_validation", &DataLoaderShapeNetPartSeg::set_mode_validation )
     .def("get_object_name", &DataLoaderShapeNetPartSeg::get_object_name )
-    .def("set_object_name", &DataLoaderShapeNetPartSeg::set_object_name )
+    .def("set_object_name", &DataLoaderShapeNetPartSeg::set_object_name, release_gil() )
+    .def_static("write_binary_cache", &DataLoaderShapeNetPartSeg::write_binary_cache, release_gil() )
     ;
 
     //DataLoaderShapeNetImg
     py::class_<DataLoaderShapeNetImg> (m, "DataLoaderShapeNetImg")
-    .def(py::init<const std::string>())
-    .def("get_random_frame", &DataLoaderShapeNetImg::get_random_frame )
-    .def("get_frame_at_idx", &DataLoaderShapeNetImg::get_frame_at_idx )
-    .def("start_reading_next_scene", &DataLoaderShapeNetImg::start_reading_next_scene )
+    .def(py::init<const std::string>(), release_gil())
+    .def("get_random_frame", &DataLoaderShapeNetImg::get_random_frame, release_gil() )
+    .def("get_frame_at_idx", &DataLoaderShapeNetImg::get_frame_at_idx, release_gil() )
+    .def("get_frame_ref_at_idx", []( DataLoaderShapeNetImg& loader, const int idx ){ return frame_of_snapshot(loader.get_all_frames_ref(), idx); } )
+    .def("get_all_frames_ref", []( DataLoaderShapeNetImg& loader ){ return frames_of_snapshot(loader.get_all_frames_ref()); } )
+    .def("get_random_frame_idx", &DataLoaderShapeNetImg::get_random_frame_idx )
+    .def("start_reading_next_scene", &DataLoaderShapeNetImg::start_reading_next_scene, release_gil() )
     .def("finished_reading_scene", &DataLoaderShapeNetImg::finished_reading_scene )
     .def("has_data", &DataLoaderShapeNetImg::has_data )
     .def("is_finished", &DataLoaderShapeNetImg::is_finished )
-    .def("reset", &DataLoaderShapeNetImg::reset )
+    .def("reset", &DataLoaderShapeNetImg::reset, release_gil() )
     .def("nr_samples", &DataLoaderShapeNetImg::nr_samples )
     ;
 
     py::class_<DataLoaderVolRef> (m, "DataLoaderVolRef")
-    .def(py::init<const std::string>())
-    .def("start", &DataLoaderVolRef::start )
-    .def("get_frame_at_idx", &DataLoaderVolRef::get_frame_at_idx )
-    .def("get_depth_frame_at_idx", &DataLoaderVolRef::get_depth_frame_at_idx )
+    .def(py::init<const std::string>(), release_gil())
+    .def("start", &DataLoaderVolRef::start, release_gil() )
+    .def("get_frame_at_idx", &DataLoaderVolRef::get_frame_at_idx, release_gil() )
+    .def("get_depth_frame_at_idx", &DataLoaderVolRef::get_depth_frame_at_idx, release_gil() )
     .def("get_color_frame", &DataLoaderVolRef::get_color_frame )
     .def("get_depth_frame", &DataLoaderVolRef::get_depth_frame )
     .def("has_data", &DataLoaderVolRef::has_data )
     .def("is_finished", &DataLoaderVolRef::is_finished )
     .def("is_finished_reading", &DataLoaderVolRef::is_finished_reading )
-    .def("reset", &DataLoaderVolRef::reset )
+    .def("reset", &DataLoaderVolRef::reset, release_gil() )
     .def("nr_samples", &DataLoaderVolRef::nr_samples )
-    .def("closest_color_frame", &DataLoaderVolRef::closest_color_frame )
-    .def("closest_depth_frame", &DataLoaderVolRef::closest_depth_frame )
+    .def("closest_color_frame", &DataLoaderVolRef::closest_color_frame, release_gil() )
+    .def("closest_depth_frame", &DataLoaderVolRef::closest_depth_frame, release_gil() )
     .def("load_only_from_idxs", &DataLoaderVolRef::load_only_from_idxs )
     .def("set_shuffle", &DataLoaderVolRef::set_shuffle )
     .def("set_overfit", &DataLoaderVolRef::set_overfit )
     ;
 
     py::class_<DataLoaderStanford3DScene> (m, "DataLoaderStanford3DScene")
-    .def(py::init<const std::string>())
-    .def("start", &DataLoaderStanford3DScene::start )
+    .def(py::init<const std::string>(), release_gil())
+    .def("start", &DataLoaderStanford3DScene::start, release_gil() )
     .def("get_color_frame", &DataLoaderStanford3DScene::get_color_frame )
     .def("get_depth_frame", &DataLoaderStanford3DScene::get_depth_frame )
     .def("has_data", &DataLoaderStanford3DScene::has_data )
     .def("is_finished", &DataLoaderStanford3DScene::is_finished )
     .def("is_finished_reading", &DataLoaderStanford3DScene::is_finished_reading )
-    .def("reset", &DataLoaderStanford3DScene::reset )
+    .def("reset", &DataLoaderStanford3DScene::reset, release_gil() )
     .def("nr_samples", &DataLoaderStanford3DScene::nr_samples )
     // .def("closest_color_frame", &DataLoaderStanford3DScene::closest_color_frame )
     // .def("closest_depth_frame", &DataLoaderStanford3DScene::closest_depth_frame )
     ;
 
     py::class_<DataLoaderImg> (m, "DataLoaderImg")
-    .def(py::init<const std::string>())
-    .def("start", &DataLoaderImg::start )
-    .def("get_frame_for_cam", &DataLoaderImg::get_frame_for_cam )
+    .def(py::init<const std::string>(), release_gil())
+    .def("start", &DataLoaderImg::start, release_gil() )
+    .def("get_frame_for_cam", &DataLoaderImg::get_frame_for_cam, release_gil() )
     .def("get_nr_cams", &DataLoaderImg::get_nr_cams )
     .def("has_data_for_cam", &DataLoaderImg::has_data_for_cam )
     .def("has_data_for_all_cams", &DataLoaderImg::has_data_for_all_cams )
     .def("is_finished", &DataLoaderImg::is_finished )
     .def("is_finished_reading", &DataLoaderImg::is_finished_reading )
-    .def("reset", &DataLoaderImg::reset )
+    .def("reset", &DataLoaderImg::reset, release_gil() )
     .def("nr_samples_for_cam", &DataLoaderImg::nr_samples_for_cam )
     ;
 
     //DataLoaderSemanticKitti
     py::class_<DataLoaderSemanticKitti> (m, "DataLoaderSemanticKitti")
-    .def(py::init<const std::string>())
-    .def("start", &DataLoaderSemanticKitti::start )
+    .def(py::init<const std::string>(), release_gil())
+    .def("start", &DataLoaderSemanticKitti::start, release_gil() )
     .def("get_cloud", &DataLoaderSemanticKitti::get_cloud, R"EOS( get_cloud. )EOS" )
     .def("has_data", &DataLoaderSemanticKitti::has_data )
     .def("is_finished", &DataLoaderSemanticKitti::is_finished )
     .def("is_finished_reading", &DataLoaderSemanticKitti::is_finished_reading )
-    .def("reset", &DataLoaderSemanticKitti::reset )
+    .def("reset", &DataLoaderSemanticKitti::reset, release_gil() )
     .def("nr_samples", &DataLoaderSemanticKitti::nr_samples )
     .def("label_mngr", &DataLoaderSemanticKitti::label_mngr )
     .def("set_mode_train", &DataLoaderSemanticKitti::set_mode_train )
     .def("set_mode_test", &DataLoaderSemanticKitti::set_mode_test )
     .def("set_mode_validation", &DataLoaderSemanticKitti::set_mode_validation )
     .def("set_sequence", &DataLoaderSemanticKitti::set_sequence )
+    .def_static("pack_sequence", &DataLoaderSemanticKitti::pack_sequence, R"EOS( Converts the npz scans of a sequence folder into a scans.pack which is read when read_packed=true. )EOS", release_gil() )
     // .def("set_adaptive_subsampling", &DataLoaderSemanticKitti::set_adaptive_subsampling )
     ;
 
     //DataLoaderPheno4D
     py::class_<DataLoaderPheno4D> (m, "DataLoaderPheno4D")
-    .def(py::init<const std::string>())
-    .def("start", &DataLoaderPheno4D::start )
+    .def(py::init<const std::string>(), release_gil())
+    .def("start", &DataLoaderPheno4D::start, release_gil() )
     .def("get_cloud", &DataLoaderPheno4D::get_cloud, R"EOS( get_cloud. )EOS" )
-    .def("get_cloud_with_idx", &DataLoaderPheno4D::get_cloud_with_idx )
+    .def("get_cloud_with_idx", &DataLoaderPheno4D::get_cloud_with_idx, release_gil() )
     .def("has_data", &DataLoaderPheno4D::has_data )
     .def("is_finished", &DataLoaderPheno4D::is_finished )
     .def("is_finished_reading", &DataLoaderPheno4D::is_finished_reading )
-    .def("reset", &DataLoaderPheno4D::reset )
+    .def("reset", &DataLoaderPheno4D::reset, release_gil() )
     .def("nr_samples", &DataLoaderPheno4D::nr_samples )
     .def("label_mngr", &DataLoaderPheno4D::label_mngr )
     .def("set_plant_nr", &DataLoaderPheno4D::set_plant_nr )
@@ -176,35 +211,41 @@ PYBIND11_MODULE(dataloaders, m) {
     ;
 
     py::class_<DataLoaderScanNet> (m, "DataLoaderScanNet")
-    .def(py::init<const std::string>())
-    .def("start", &DataLoaderScanNet::start )
+    .def(py::init<const std::string>(), release_gil())
+    .def("start", &DataLoaderScanNet::start, release_gil() )
     .def("get_cloud", &DataLoaderScanNet::get_cloud )
     .def("has_data", &DataLoaderScanNet::has_data )
     .def("is_finished", &DataLoaderScanNet::is_finished )
     .def("is_finished_reading", &DataLoaderScanNet::is_finished_reading )
-    .def("reset", &DataLoaderScanNet::reset )
+    .def("reset", &DataLoaderScanNet::reset, release_gil() )
     .def("nr_samples", &DataLoaderScanNet::nr_samples )
     .def("label_mngr", &DataLoaderScanNet::label_mngr )
     .def("set_mode_train", &DataLoaderScanNet::set_mode_train )
     .def("set_mode_test", &DataLoaderScanNet::set_mode_test )
     .def("set_mode_validation", &DataLoaderScanNet::set_mode_validation )
-    .def("write_for_evaluating_on_scannet_server", &DataLoaderScanNet::write_for_evaluating_on_scannet_server )
+    .def("write_for_evaluating_on_scannet_server", &DataLoaderScanNet::write_for_evaluating_on_scannet_server, release_gil() )
     ;
 
     //DataLoaderNerf
     py::class_<DataLoaderNerf> (m, "DataLoaderNerf")
-    .def(py::init<const std::string>())
-    .def("start", &DataLoaderNerf::start )
+    .def(py::init<const std::string>(), release_gil())
+    .def("start", &DataLoaderNerf::start, release_gil() )
     .def("has_data", &DataLoaderNerf::has_data )
-    .def("get_next_frame", &DataLoaderNerf::get_next_frame )
-    .def("get_all_frames", &DataLoaderNerf::get_all_frames )
-    .def("get_frame_at_idx", &DataLoaderNerf::get_frame_at_idx )
-    .def("get_random_frame", &DataLoaderNerf::get_random_frame )
-    .def("get_closest_frame", &DataLoaderNerf::get_closest_frame )
-    .def("get_close_frames", &DataLoaderNerf::get_close_frames )
+    .def("get_next_frame", &DataLoaderNerf::get_next_frame, release_gil() )
+    .def("get_all_frames", &DataLoaderNerf::get_all_frames, release_gil() )
+    .def("get_frame_at_idx", &DataLoaderNerf::get_frame_at_idx, release_gil() )
+    .def("get_frame_ref_at_idx", &DataLoaderNerf::get_frame_ref_at_idx, zero_copy )
+    .def("get_all_frames_ref", &DataLoaderNerf::get_all_frames_ref, zero_copy )
+    .def("get_next_frame_idx", &DataLoaderNerf::get_next_frame_idx )
+    .def("get_random_frame_idx", &DataLoaderNerf::get_random_frame_idx )
+    .def("get_random_frame", &DataLoaderNerf::get_random_frame, release_gil() )
+    .def("get_closest_frame", &DataLoaderNerf::get_closest_frame, release_gil() )
+    .def("get_close_frames", &DataLoaderNerf::get_close_frames, release_gil() )
+    .def("get_closest_frame_idx", &DataLoaderNerf::get_closest_frame_idx )
+    .def("get_close_frames_idxs", &DataLoaderNerf::get_close_frames_idxs )
     // .def("compute_frame_weights", &DataLoaderNerf::compute_frame_weights )
     .def("is_finished", &DataLoaderNerf::is_finished )
-    .def("reset", &DataLoaderNerf::reset )
+    .def("reset", &DataLoaderNerf::reset, release_gil() )
     .def("nr_samples", &DataLoaderNerf::nr_samples )
     .def("subsample_factor", &DataLoaderNerf::subsample_factor )
     .def("set_load_mask", &DataLoaderNerf::set_load_mask )
@@ -219,20 +260,26 @@ PYBIND11_MODULE(dataloaders, m) {
 
     //DataLoaderEasyPBR
     py::class_<DataLoaderEasyPBR> (m, "DataLoaderEasyPBR")
-    .def(py::init<const std::string>())
-    .def("start", &DataLoaderEasyPBR::start )
+    .def(py::init<const std::string>(), release_gil())
+    .def("start", &DataLoaderEasyPBR::start, release_gil() )
     .def("has_data", &DataLoaderEasyPBR::has_data )
-    .def("get_next_frame", &DataLoaderEasyPBR::get_next_frame )
-    .def("get_all_frames", &DataLoaderEasyPBR::get_all_frames )
-    .def("get_frame_at_idx", &DataLoaderEasyPBR::get_frame_at_idx )
-    .def("get_random_frame", &DataLoaderEasyPBR::get_random_frame )
-    .def("get_closest_frame", &DataLoaderEasyPBR::get_closest_frame )
-    .def("get_close_frames", &DataLoaderEasyPBR::get_close_frames )
+    .def("get_next_frame", &DataLoaderEasyPBR::get_next_frame, release_gil() )
+    .def("get_all_frames", &DataLoaderEasyPBR::get_all_frames, release_gil() )
+    .def("get_frame_at_idx", &DataLoaderEasyPBR::get_frame_at_idx, release_gil() )
+    .def("get_frame_ref_at_idx", &DataLoaderEasyPBR::get_frame_ref_at_idx, zero_copy )
+    .def("get_all_frames_ref", &DataLoaderEasyPBR::get_all_frames_ref, zero_copy )
+    .def("get_next_frame_idx", &DataLoaderEasyPBR::get_next_frame_idx )
+    .def("get_random_frame_idx", &DataLoaderEasyPBR::get_random_frame_idx )
+    .def("get_random_frame", &DataLoaderEasyPBR::get_random_frame, release_gil() )
+    .def("get_closest_frame", &DataLoaderEasyPBR::get_closest_frame, release_gil() )
+    .def("get_close_frames", &DataLoaderEasyPBR::get_close_frames, release_gil() )
+    .def("get_closest_frame_idx", &DataLoaderEasyPBR::get_closest_frame_idx )
+    .def("get_close_frames_idxs", &DataLoaderEasyPBR::get_close_frames_idxs )
     // .def("compute_frame_weights", &DataLoaderNerf::compute_frame_weights )
     .def("loaded_scene_mesh", &DataLoaderEasyPBR::loaded_scene_mesh )
     .def("get_scene_mesh", &DataLoaderEasyPBR::get_scene_mesh )
     .def("is_finished", &DataLoaderEasyPBR::is_finished )
-    .def("reset", &DataLoaderEasyPBR::reset )
+    .def("reset", &DataLoaderEasyPBR::reset, release_gil() )
     .def("nr_samples", &DataLoaderEasyPBR::nr_samples )
     .def("set_dataset_path", &DataLoaderEasyPBR::set_dataset_path )
     .def("set_restrict_to_scene_name", &DataLoaderEasyPBR::set_restrict_to_scene_name )
@@ -248,19 +295,27 @@ PYBIND11_MODULE(dataloaders, m) {
 
     //DataLoaderEasyPBR
     py::class_<DataLoaderMultiFace> (m, "DataLoaderMultiFace")
-    .def(py::init<const std::string, const int>())
-    .def("start", &DataLoaderMultiFace::start )
+    .def(py::init<const std::string, const int>(), release_gil())
+    .def("start", &DataLoaderMultiFace::start, release_gil() )
     .def("has_data", &DataLoaderMultiFace::has_data )
-    .def("get_next_frame", &DataLoaderMultiFace::get_next_frame )
-    .def("get_all_frames", &DataLoaderMultiFace::get_all_frames )
-    .def("get_frame_at_idx", &DataLoaderMultiFace::get_frame_at_idx )
-    .def("get_random_frame", &DataLoaderMultiFace::get_random_frame )
+    .def("get_next_frame", &DataLoaderMultiFace::get_next_frame, release_gil() )
+    .def("get_all_frames", &DataLoaderMultiFace::get_all_frames, release_gil() )
+    .def("get_frame_at_idx", &DataLoaderMultiFace::get_frame_at_idx, release_gil() )
+    .def("get_frame_ref_at_idx", &DataLoaderMultiFace::get_frame_ref_at_idx, zero_copy )
+    .def("get_all_frames_ref", &DataLoaderMultiFace::get_all_frames_ref, zero_copy )
+    .def("get_next_frame_idx", &DataLoaderMultiFace::get_next_frame_idx )
+    .def("get_random_frame_idx", &DataLoaderMultiFace::get_random_frame_idx )
+    .def("get_random_frame", &DataLoaderMultiFace::get_random_frame, release_gil() )
     .def("get_mesh_head", &DataLoaderMultiFace::get_mesh_head )
+    .def("timestep", &DataLoaderMultiFace::timestep )
+    .def("nr_timesteps", &DataLoaderMultiFace::nr_timesteps )
+    .def("set_timestep", &DataLoaderMultiFace::set_timestep, release_gil() )
+    .def("next_timestep", &DataLoaderMultiFace::next_timestep, release_gil() )
     
     // .def("loaded_scene_mesh", &DataLoaderEasyPBR::loaded_scene_mesh )
     // .def("get_scene_mesh", &DataLoaderEasyPBR::get_scene_mesh )
     .def("is_finished", &DataLoaderMultiFace::is_finished )
-    .def("reset", &DataLoaderMultiFace::reset )
+    .def("reset", &DataLoaderMultiFace::reset, release_gil() )
     .def("nr_samples", &DataLoaderMultiFace::nr_samples )
     // .def("set_restrict_to_scene_name", &DataLoaderEasyPBR::set_restrict_to_scene_name )
     // .def("get_restrict_to_scene_name", &DataLoaderEasyPBR::get_restrict_to_scene_name )
@@ -278,34 +333,44 @@ PYBIND11_MODULE(dataloaders, m) {
 
     //DataLoaderColmap
     py::class_<DataLoaderColmap> (m, "DataLoaderColmap")
-    .def(py::init<const std::string>())
-    .def("start", &DataLoaderColmap::start )
+    .def(py::init<const std::string>(), release_gil())
+    .def("start", &DataLoaderColmap::start, release_gil() )
     .def("has_data", &DataLoaderColmap::has_data )
-    .def("get_next_frame", &DataLoaderColmap::get_next_frame )
-    .def("get_frame_at_idx", &DataLoaderColmap::get_frame_at_idx )
-    .def("get_random_frame", &DataLoaderColmap::get_random_frame )
-    .def("get_closest_frame", &DataLoaderColmap::get_closest_frame )
-    .def("get_close_frames", &DataLoaderColmap::get_close_frames )
+    .def("get_next_frame", &DataLoaderColmap::get_next_frame, release_gil() )
+    .def("get_frame_at_idx", &DataLoaderColmap::get_frame_at_idx, release_gil() )
+    .def("get_frame_ref_at_idx", &DataLoaderColmap::get_frame_ref_at_idx, zero_copy )
+    .def("get_all_frames_ref", &DataLoaderColmap::get_all_frames_ref, zero_copy )
+    .def("get_next_frame_idx", &DataLoaderColmap::get_next_frame_idx )
+    .def("get_random_frame_idx", &DataLoaderColmap::get_random_frame_idx )
+    .def("get_random_frame", &DataLoaderColmap::get_random_frame, release_gil() )
+    .def("get_closest_frame", &DataLoaderColmap::get_closest_frame, release_gil() )
+    .def("get_close_frames", &DataLoaderColmap::get_close_frames, release_gil() )
+    .def("get_closest_frame_idx", &DataLoaderColmap::get_closest_frame_idx )
+    .def("get_close_frames_idxs", &DataLoaderColmap::get_close_frames_idxs )
     .def("is_finished", &DataLoaderColmap::is_finished )
-    .def("reset", &DataLoaderColmap::reset )
+    .def("reset", &DataLoaderColmap::reset, release_gil() )
     .def("nr_samples", &DataLoaderColmap::nr_samples )
     .def("set_mode_train", &DataLoaderColmap::set_mode_train )
     .def("set_mode_test", &DataLoaderColmap::set_mode_test )
     .def("set_mode_validation", &DataLoaderColmap::set_mode_validation )
     .def("set_mode_all", &DataLoaderColmap::set_mode_all )
+    .def("read_sparse_cloud", &DataLoaderColmap::read_sparse_cloud, release_gil() )
     ;
 
     //DataLoaderSRN
     py::class_<DataLoaderSRN> (m, "DataLoaderSRN")
-    .def(py::init<const std::string>())
-    .def("start", &DataLoaderSRN::start )
-    .def("get_random_frame", &DataLoaderSRN::get_random_frame )
-    .def("get_frame_at_idx", &DataLoaderSRN::get_frame_at_idx )
-    .def("start_reading_next_scene", &DataLoaderSRN::start_reading_next_scene )
+    .def(py::init<const std::string>(), release_gil())
+    .def("start", &DataLoaderSRN::start, release_gil() )
+    .def("get_random_frame", &DataLoaderSRN::get_random_frame, release_gil() )
+    .def("get_frame_at_idx", &DataLoaderSRN::get_frame_at_idx, release_gil() )
+    .def("get_frame_ref_at_idx", []( DataLoaderSRN& loader, const int idx ){ return frame_of_snapshot(loader.get_all_frames_ref(), idx); } )
+    .def("get_all_frames_ref", []( DataLoaderSRN& loader ){ return frames_of_snapshot(loader.get_all_frames_ref()); } )
+    .def("get_random_frame_idx", &DataLoaderSRN::get_random_frame_idx )
+    .def("start_reading_next_scene", &DataLoaderSRN::start_reading_next_scene, release_gil() )
     .def("finished_reading_scene", &DataLoaderSRN::finished_reading_scene )
     .def("has_data", &DataLoaderSRN::has_data )
     .def("is_finished", &DataLoaderSRN::is_finished )
-    .def("reset", &DataLoaderSRN::reset )
+    .def("reset", &DataLoaderSRN::reset, release_gil() )
     .def("nr_samples", &DataLoaderSRN::nr_samples )
     .def("set_mode_train", &DataLoaderSRN::set_mode_train )
     .def("set_mode_test", &DataLoaderSRN::set_mode_test )
@@ -314,16 +379,19 @@ PYBIND11_MODULE(dataloaders, m) {
 
     //DataLoaderDTU
     py::class_<DataLoaderDTU> (m, "DataLoaderDTU")
-    .def(py::init<const std::string>())
-    .def("start", &DataLoaderDTU::start )
-    .def("get_random_frame", &DataLoaderDTU::get_random_frame )
-    .def("get_frame_at_idx", &DataLoaderDTU::get_frame_at_idx )
-    .def("get_all_frames", &DataLoaderDTU::get_all_frames )
-    .def("start_reading_next_scene", &DataLoaderDTU::start_reading_next_scene )
+    .def(py::init<const std::string>(), release_gil())
+    .def("start", &DataLoaderDTU::start, release_gil() )
+    .def("get_random_frame", &DataLoaderDTU::get_random_frame, release_gil() )
+    .def("get_frame_at_idx", &DataLoaderDTU::get_frame_at_idx, release_gil() )
+    .def("get_frame_ref_at_idx", []( DataLoaderDTU& loader, const int idx ){ return frame_of_snapshot(loader.get_all_frames_ref(), idx); } )
+    .def("get_all_frames_ref", []( DataLoaderDTU& loader ){ return frames_of_snapshot(loader.get_all_frames_ref()); } )
+    .def("get_random_frame_idx", &DataLoaderDTU::get_random_frame_idx )
+    .def("get_all_frames", &DataLoaderDTU::get_all_frames, release_gil() )
+    .def("start_reading_next_scene", &DataLoaderDTU::start_reading_next_scene, release_gil() )
     .def("finished_reading_scene", &DataLoaderDTU::finished_reading_scene )
     .def("has_data", &DataLoaderDTU::has_data )
     .def("is_finished", &DataLoaderDTU::is_finished )
-    .def("reset", &DataLoaderDTU::reset )
+    .def("reset", &DataLoaderDTU::reset, release_gil() )
     .def("nr_samples", &DataLoaderDTU::nr_samples )
     .def("nr_scenes", &DataLoaderDTU::nr_scenes )
     .def("set_dataset_path", &DataLoaderDTU::set_dataset_path )
@@ -345,18 +413,24 @@ PYBIND11_MODULE(dataloaders, m) {
 
     //DataLoaderDeepVoxels
     py::class_<DataLoaderDeepVoxels> (m, "DataLoaderDeepVoxels")
-    .def(py::init<const std::string>())
-    .def("start", &DataLoaderDeepVoxels::start )
+    .def(py::init<const std::string>(), release_gil())
+    .def("start", &DataLoaderDeepVoxels::start, release_gil() )
     .def("has_data", &DataLoaderDeepVoxels::has_data )
-    .def("get_next_frame", &DataLoaderDeepVoxels::get_next_frame )
-    .def("get_all_frames", &DataLoaderDeepVoxels::get_all_frames )
-    .def("get_frame_at_idx", &DataLoaderDeepVoxels::get_frame_at_idx )
-    .def("get_random_frame", &DataLoaderDeepVoxels::get_random_frame )
-    .def("get_closest_frame", &DataLoaderDeepVoxels::get_closest_frame )
-    .def("get_close_frames", &DataLoaderDeepVoxels::get_close_frames )
+    .def("get_next_frame", &DataLoaderDeepVoxels::get_next_frame, release_gil() )
+    .def("get_all_frames", &DataLoaderDeepVoxels::get_all_frames, release_gil() )
+    .def("get_frame_at_idx", &DataLoaderDeepVoxels::get_frame_at_idx, release_gil() )
+    .def("get_frame_ref_at_idx", &DataLoaderDeepVoxels::get_frame_ref_at_idx, zero_copy )
+    .def("get_all_frames_ref", &DataLoaderDeepVoxels::get_all_frames_ref, zero_copy )
+    .def("get_next_frame_idx", &DataLoaderDeepVoxels::get_next_frame_idx )
+    .def("get_random_frame_idx", &DataLoaderDeepVoxels::get_random_frame_idx )
+    .def("get_random_frame", &DataLoaderDeepVoxels::get_random_frame, release_gil() )
+    .def("get_closest_frame", &DataLoaderDeepVoxels::get_closest_frame, release_gil() )
+    .def("get_close_frames", &DataLoaderDeepVoxels::get_close_frames, release_gil() )
+    .def("get_closest_frame_idx", &DataLoaderDeepVoxels::get_closest_frame_idx )
+    .def("get_close_frames_idxs", &DataLoaderDeepVoxels::get_close_frames_idxs )
     // .def("compute_frame_weights", &DataLoaderNerf::compute_frame_weights )
     .def("is_finished", &DataLoaderDeepVoxels::is_finished )
-    .def("reset", &DataLoaderDeepVoxels::reset )
+    .def("reset", &DataLoaderDeepVoxels::reset, release_gil() )
     .def("nr_samples", &DataLoaderDeepVoxels::nr_samples )
     .def("set_mode_train", &DataLoaderDeepVoxels::set_mode_train )
     .def("set_mode_test", &DataLoaderDeepVoxels::set_mode_test )
@@ -366,16 +440,22 @@ PYBIND11_MODULE(dataloaders, m) {
 
     //DataLoaderLLFF
     py::class_<DataLoaderLLFF> (m, "DataLoaderLLFF")
-    .def(py::init<const std::string>())
-    .def("start", &DataLoaderLLFF::start )
+    .def(py::init<const std::string>(), release_gil())
+    .def("start", &DataLoaderLLFF::start, release_gil() )
     .def("has_data", &DataLoaderLLFF::has_data )
-    .def("get_next_frame", &DataLoaderLLFF::get_next_frame )
-    .def("get_frame_at_idx", &DataLoaderLLFF::get_frame_at_idx )
-    .def("get_random_frame", &DataLoaderLLFF::get_random_frame )
-    .def("get_closest_frame", &DataLoaderLLFF::get_closest_frame )
-    .def("get_close_frames", &DataLoaderLLFF::get_close_frames )
+    .def("get_next_frame", &DataLoaderLLFF::get_next_frame, release_gil() )
+    .def("get_frame_at_idx", &DataLoaderLLFF::get_frame_at_idx, release_gil() )
+    .def("get_frame_ref_at_idx", &DataLoaderLLFF::get_frame_ref_at_idx, zero_copy )
+    .def("get_all_frames_ref", &DataLoaderLLFF::get_all_frames_ref, zero_copy )
+    .def("get_next_frame_idx", &DataLoaderLLFF::get_next_frame_idx )
+    .def("get_random_frame_idx", &DataLoaderLLFF::get_random_frame_idx )
+    .def("get_random_frame", &DataLoaderLLFF::get_random_frame, release_gil() )
+    .def("get_closest_frame", &DataLoaderLLFF::get_closest_frame, release_gil() )
+    .def("get_close_frames", &DataLoaderLLFF::get_close_frames, release_gil() )
+    .def("get_closest_frame_idx", &DataLoaderLLFF::get_closest_frame_idx )
+    .def("get_close_frames_idxs", &DataLoaderLLFF::get_close_frames_idxs )
     .def("is_finished", &DataLoaderLLFF::is_finished )
-    .def("reset", &DataLoaderLLFF::reset )
+    .def("reset", &DataLoaderLLFF::reset, release_gil() )
     .def("nr_samples", &DataLoaderLLFF::nr_samples )
     .def("set_mode_train", &DataLoaderLLFF::set_mode_train )
     .def("set_mode_test", &DataLoaderLLFF::set_mode_test )
@@ -384,13 +464,13 @@ PYBIND11_MODULE(dataloaders, m) {
     ;
 
     py::class_<DataLoaderPhenorobCP1> (m, "DataLoaderPhenorobCP1")
-    .def(py::init<const std::string>())
-    .def("start", &DataLoaderPhenorobCP1::start )
+    .def(py::init<const std::string>(), release_gil())
+    .def("start", &DataLoaderPhenorobCP1::start, release_gil() )
     .def("has_data", &DataLoaderPhenorobCP1::has_data )
     .def("get_day_with_idx", &DataLoaderPhenorobCP1::get_day_with_idx )
-    .def("load_mesh", &DataLoaderPhenorobCP1::load_mesh )
+    .def("load_mesh", &DataLoaderPhenorobCP1::load_mesh, release_gil() )
     .def("nr_samples", &DataLoaderPhenorobCP1::nr_samples )
-    .def("get_frame_at_idx", &DataLoaderPhenorobCP1::get_frame_at_idx )
+    .def("get_frame_at_idx", &DataLoaderPhenorobCP1::get_frame_at_idx, release_gil() )
     .def("rgb_subsample_factor", &DataLoaderPhenorobCP1::rgb_subsample_factor )
     // .def("get_next_frame", &DataLoaderPhenorobCP1::get_next_frame )
     // .def("get_all_frames", &DataLoaderPhenorobCP1::get_all_frames )
@@ -404,7 +484,7 @@ PYBIND11_MODULE(dataloaders, m) {
     // .def("scan_date", &DataLoaderPhenorobCP1::scan_date )
     // .def("rgb_pose_file", &DataLoaderPhenorobCP1::rgb_pose_file )
     .def("is_finished", &DataLoaderPhenorobCP1::is_finished )
-    .def("reset", &DataLoaderPhenorobCP1::reset )
+    .def("reset", &DataLoaderPhenorobCP1::reset, release_gil() )
     .def("nr_days", &DataLoaderPhenorobCP1::nr_days )
     .def("loaded_dense_cloud", &DataLoaderPhenorobCP1::loaded_dense_cloud )
     .def("set_dataset_path", &DataLoaderPhenorobCP1::set_dataset_path )
@@ -429,7 +509,7 @@ PYBIND11_MODULE(dataloaders, m) {
     ;
     py::class_<PRCP1Block, std::shared_ptr<PRCP1Block> > (m, "PRCP1Block")
     .def("nr_frames", &PRCP1Block::nr_frames )
-    .def("get_rgb_frame_with_idx", &PRCP1Block::get_rgb_frame_with_idx )
+    .def("get_rgb_frame_with_idx", &PRCP1Block::get_rgb_frame_with_idx, release_gil() )
     // .def("get_photoneo_frame", &PRCP1Block::get_photoneo_frame )
     // .def("get_photoneo_mesh", &PRCP1Block::get_photoneo_mesh )
     .def("get_dense_cloud", &PRCP1Block::get_dense_cloud )
@@ -437,6 +517,19 @@ PYBIND11_MODULE(dataloaders, m) {
     .def("name", &PRCP1Block::name )
     ;
 
+    //decoded images of the shell frames, shared by all the loaders
+    py::class_<ImageCache, std::shared_ptr<ImageCache> > (m, "ImageCache")
+    .def_static("shared", &ImageCache::shared )
+    .def("reserve_budget", &ImageCache::reserve_budget )
+    .def("clear", &ImageCache::clear )
+    .def("budget_bytes", &ImageCache::budget_bytes )
+    .def("nr_bytes", &ImageCache::nr_bytes )
+    .def("nr_images", &ImageCache::nr_images )
+    .def("nr_hits", &ImageCache::nr_hits )
+    .def("nr_misses", &ImageCache::nr_misses )
+    .def("nr_evictions", &ImageCache::nr_evictions )
+    ;
+
 
     #ifdef WITH_TORCH
         py::class_<TensorReel> (m, "TensorReel")
@@ -445,14 +538,24 @@ PYBIND11_MODULE(dataloaders, m) {
         .def_readwrite("mask_reel", &TensorReel::mask_reel )
         .def_readwrite("K_reel", &TensorReel::K_reel )
         .def_readwrite("tf_cam_world_reel", &TensorReel::tf_cam_world_reel )
+        .def_readwrite("tf_world_cam_reel", &TensorReel::tf_world_cam_reel )
+        .def_readwrite("has_mask", &TensorReel::has_mask )
+        .def_readonly("rgb_dtype", &TensorReel::rgb_dtype )
+        .def_readonly("mask_dtype", &TensorReel::mask_dtype )
+        .def_readonly("rgb_scale", &TensorReel::rgb_scale )
+        .def_readonly("mask_scale", &TensorReel::mask_scale )
+        .def("dequantize_rgb", &TensorReel::dequantize_rgb )
+        .def("dequantize_mask", &TensorReel::dequantize_mask )
         ;
     #endif
 
 
     py::class_<MiscDataFuncs> (m, "MiscDataFuncs")
     .def(py::init())
+    .def_static("compare_reduced_jpeg_decode", &MiscDataFuncs::compare_reduced_jpeg_decode, py::arg("path"), py::arg("imread_flags"), py::arg("subsample_factor"), release_gil() )
     #ifdef WITH_TORCH
-        .def_static("frames2tensors", &MiscDataFuncs::frames2tensors )
+        .def_static("frames2tensors", &MiscDataFuncs::frames2tensors, py::arg("frames"), py::arg("rgb_dtype")="float32", py::arg("mask_dtype")="float32", release_gil() )
+        .def_static("frames2tensors_cpu", &MiscDataFuncs::frames2tensors_cpu, py::arg("frames"), py::arg("rgb_dtype")="float32", py::arg("mask_dtype")="float32", release_gil() )
     #endif
     ;
 
@@ -461,18 +564,24 @@ PYBIND11_MODULE(dataloaders, m) {
     //fb
     //DataLoaderBlender
     py::class_<DataLoaderBlenderFB> (m, "DataLoaderBlenderFB")
-    .def(py::init<const std::string>())
-    .def("start", &DataLoaderBlenderFB::start )
+    .def(py::init<const std::string>(), release_gil())
+    .def("start", &DataLoaderBlenderFB::start, release_gil() )
     .def("has_data", &DataLoaderBlenderFB::has_data )
-    .def("get_next_frame", &DataLoaderBlenderFB::get_next_frame )
-    .def("get_all_frames", &DataLoaderBlenderFB::get_all_frames )
-    .def("get_frame_at_idx", &DataLoaderBlenderFB::get_frame_at_idx )
-    .def("get_random_frame", &DataLoaderBlenderFB::get_random_frame )
-    .def("get_closest_frame", &DataLoaderBlenderFB::get_closest_frame )
-    .def("get_close_frames", &DataLoaderBlenderFB::get_close_frames )
+    .def("get_next_frame", &DataLoaderBlenderFB::get_next_frame, release_gil() )
+    .def("get_all_frames", &DataLoaderBlenderFB::get_all_frames, release_gil() )
+    .def("get_frame_at_idx", &DataLoaderBlenderFB::get_frame_at_idx, release_gil() )
+    .def("get_frame_ref_at_idx", &DataLoaderBlenderFB::get_frame_ref_at_idx, zero_copy )
+    .def("get_all_frames_ref", &DataLoaderBlenderFB::get_all_frames_ref, zero_copy )
+    .def("get_next_frame_idx", &DataLoaderBlenderFB::get_next_frame_idx )
+    .def("get_random_frame_idx", &DataLoaderBlenderFB::get_random_frame_idx )
+    .def("get_random_frame", &DataLoaderBlenderFB::get_random_frame, release_gil() )
+    .def("get_closest_frame", &DataLoaderBlenderFB::get_closest_frame, release_gil() )
+    .def("get_close_frames", &DataLoaderBlenderFB::get_close_frames, release_gil() )
+    .def("get_closest_frame_idx", &DataLoaderBlenderFB::get_closest_frame_idx )
+    .def("get_close_frames_idxs", &DataLoaderBlenderFB::get_close_frames_idxs )
     // .def("compute_frame_weights", &DataLoaderNerf::compute_frame_weights )
     .def("is_finished", &DataLoaderBlenderFB::is_finished )
-    .def("reset", &DataLoaderBlenderFB::reset )
+    .def("reset", &DataLoaderBlenderFB::reset, release_gil() )
     .def("nr_samples", &DataLoaderBlenderFB::nr_samples )
     .def("set_mode_train", &DataLoaderBlenderFB::set_mode_train )
     .def("set_mode_test", &DataLoaderBlenderFB::set_mode_test )
@@ -484,28 +593,34 @@ PYBIND11_MODULE(dataloaders, m) {
     #ifdef WITH_TORCH
         //DataLoaderUSCHair
         py::class_<DataLoaderUSCHair> (m, "DataLoaderUSCHair")
-        .def(py::init<const std::string>())
-        .def("start", &DataLoaderUSCHair::start )
-        .def("get_hair", &DataLoaderUSCHair::get_hair )
+        .def(py::init<const std::string>(), release_gil())
+        .def("start", &DataLoaderUSCHair::start, release_gil() )
+        .def("get_hair", &DataLoaderUSCHair::get_hair, release_gil() )
         // .def("get_cloud", &DataLoaderUSCHair::get_cloud, R"EOS( get_cloud. )EOS" )
         .def("get_mesh_head", &DataLoaderUSCHair::get_mesh_head )
         .def("get_mesh_scalp", &DataLoaderUSCHair::get_mesh_scalp )
         .def("has_data", &DataLoaderUSCHair::has_data )
         .def("is_finished", &DataLoaderUSCHair::is_finished )
         .def("is_finished_reading", &DataLoaderUSCHair::is_finished_reading )
-        .def("reset", &DataLoaderUSCHair::reset )
+        .def("reset", &DataLoaderUSCHair::reset, release_gil() )
         .def("nr_samples", &DataLoaderUSCHair::nr_samples )
         .def("set_mode_train", &DataLoaderUSCHair::set_mode_train )
         .def("set_mode_test", &DataLoaderUSCHair::set_mode_test )
         .def("set_mode_validation", &DataLoaderUSCHair::set_mode_validation )
-        .def("get_random_roots", &DataLoaderUSCHair::get_random_roots )
-        .def("get_random_strand", &DataLoaderUSCHair::get_random_strand )
-        .def("get_strand_with_idx", &DataLoaderUSCHair::get_strand_with_idx )
+        .def("get_random_roots", &DataLoaderUSCHair::get_random_roots, release_gil() )
+        .def("get_random_strand", &DataLoaderUSCHair::get_random_strand, release_gil() )
+        .def("get_strand_with_idx", &DataLoaderUSCHair::get_strand_with_idx, release_gil() )
         ;
         //USCHair
         py::class_<USCHair, std::shared_ptr<USCHair> > (m, "USCHair")
         .def_readwrite("full_hair_cloud", &USCHair::full_hair_cloud)
-        .def_readwrite("strand_meshes", &USCHair::strand_meshes)
+        .def_property_readonly("strand_meshes", &USCHair::get_strand_meshes) //created on request from the flat strand_points
+        .def_readwrite("strand_points", &USCHair::strand_points)
+        .def_readwrite("strand_offsets", &USCHair::strand_offsets)
+        .def_readwrite("strand_file_idx", &USCHair::strand_file_idx)
+        .def_readwrite("strand_valid", &USCHair::strand_valid)
+        .def("nr_strands", &USCHair::nr_strands)
+        .def("get_strand_mesh", &USCHair::get_strand_mesh)
         // .def_readwrite("points", &USCHair::points)
         // .def_readwrite("points_tensor", &USCHair::points_tensor)
         // .def_readwrite("per_point_strand_idx", &USCHair::per_point_strand_idx)
@@ -531,8 +646,8 @@ PYBIND11_MODULE(dataloaders, m) {
 
     #ifdef WITH_ROS
         py::class_<DataLoaderImgRos> (m, "DataLoaderImgRos")
-        .def(py::init<const std::string>())
-        .def("get_frame_for_cam", &DataLoaderImgRos::get_frame_for_cam )
+        .def(py::init<const std::string>(), release_gil())
+        .def("get_frame_for_cam", &DataLoaderImgRos::get_frame_for_cam, release_gil() )
         .def("nr_cams", &DataLoaderImgRos::nr_cams )
         .def("has_data_for_all_cams", &DataLoaderImgRos::has_data_for_all_cams )
         .def("has_data_for_cam", &DataLoaderImgRos::has_data_for_cam )
@@ -540,7 +655,7 @@ PYBIND11_MODULE(dataloaders, m) {
         ;
 
         py::class_<DataLoaderCloudRos> (m, "DataLoaderCloudRos")
-        .def(py::init<const std::string>())
+        .def(py::init<const std::string>(), release_gil())
         .def("has_data", &DataLoaderCloudRos::has_data )
         .def("get_cloud", &DataLoaderCloudRos::get_cloud )
         .def("is_loader_thread_alive", &DataLoaderCloudRos::is_loader_thread_alive )
@@ -548,10 +663,10 @@ PYBIND11_MODULE(dataloaders, m) {
 
         py::class_<RosBagPlayer, std::shared_ptr<RosBagPlayer> > (m, "RosBagPlayer")
         .def_static("create",  &RosBagPlayer::create<const std::string>  )
-        .def("start", &RosBagPlayer::start )
+        .def("start", &RosBagPlayer::start, release_gil() )
         .def("play", &RosBagPlayer::play )
         .def("pause", &RosBagPlayer::pause )
-        .def("reset", &RosBagPlayer::reset )
+        .def("reset", &RosBagPlayer::reset, release_gil() )
         .def("is_paused", &RosBagPlayer::is_paused )
         .def("is_finished", &RosBagPlayer::is_finished )
         .def("kill", &RosBagPlayer::kill )
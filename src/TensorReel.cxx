@@ -1,6 +1,7 @@
 #include "data_loaders/TensorReel.h"
 
 //c++
+#include <string>
 
 
 //configuru
@@ -23,7 +24,42 @@ using namespace radu::utils;
 // using namespace easy_pbr;
 
 
-TensorReel::TensorReel(){
+TensorReel::TensorReel():
+    has_mask(false),
+    rgb_dtype("float32"),
+    mask_dtype("float32"),
+    rgb_scale(1.0),
+    mask_scale(1.0)
+{
 
 
-}
\ No newline at end of file
+}
+
+torch::Tensor TensorReel::dequantize_rgb(const torch::Tensor& rgb) const{
+    if (rgb_scale==1.0){
+        return rgb.to(torch::kFloat32);
+    }
+    return rgb.to(torch::kFloat32)*rgb_scale;
+}
+
+torch::Tensor TensorReel::dequantize_mask(const torch::Tensor& mask) const{
+    if (mask_scale==1.0){
+        return mask.to(torch::kFloat32);
+    }
+    return mask.to(torch::kFloat32)*mask_scale;
+}
+
+torch::ScalarType TensorReel::dtype_from_name(const std::string& dtype_name){
+    if (dtype_name=="float32"){
+        return torch::kFloat32;
+    }else if (dtype_name=="float16"){
+        return torch::kFloat16;
+    }else if (dtype_name=="uint8"){
+        return torch::kUInt8;
+    }else if (dtype_name=="bool"){
+        return torch::kBool;
+    }else{
+        LOG(FATAL) << "Unknown dtype " << dtype_name << ". It should be one of float32, float16, uint8 or bool";
+    }
+    return torch::kFloat32;
+}
@@ -0,0 +1,146 @@
+#include "data_loaders/WorkerPool.h"
+
+//c++
+#include <atomic>
+#include <exception>
+#include <map>
+#include <algorithm>
+
+//loguru
+#define LOGURU_REPLACE_GLOG 1
+#include <loguru.hpp>
+
+
+
+WorkerPool::WorkerPool(const int nr_threads):
+    m_is_running(true)
+{
+    CHECK(nr_threads>0) << "The pool needs at least one thread but we requested " << nr_threads;
+
+    for(int i=0; i<nr_threads; i++){
+        m_workers.emplace_back(&WorkerPool::worker_loop, this);
+    }
+}
+
+WorkerPool::~WorkerPool(){
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_is_running=false;
+    }
+    m_task_available.notify_all();
+
+    for(size_t i=0; i<m_workers.size(); i++){
+        if (m_workers[i].joinable()){
+            m_workers[i].join();
+        }
+    }
+}
+
+std::shared_ptr<WorkerPool> WorkerPool::shared(const int nr_threads){
+    int nr_threads_resolved=nr_threads;
+    if(nr_threads_resolved<=0){
+        nr_threads_resolved=std::max(1, (int)std::thread::hardware_concurrency() );
+    }
+
+    //we keep only weak pointers so that the threads are destroyed once no loader is using the pool anymore
+    static std::mutex pools_mutex;
+    static std::map<int, std::weak_ptr<WorkerPool> > pools;
+
+    std::lock_guard<std::mutex> lock(pools_mutex);
+    std::shared_ptr<WorkerPool> pool=pools[nr_threads_resolved].lock();
+    if(!pool){
+        pool=std::make_shared<WorkerPool>(nr_threads_resolved);
+        pools[nr_threads_resolved]=pool;
+    }
+
+    return pool;
+}
+
+void WorkerPool::parallel_for(const int nr_jobs, const std::function<void(const int)>& job){
+    if(nr_jobs<=0){
+        return;
+    }
+
+    //the state is shared with the helper tasks which may still be in the queue after we return, so it lives on the heap
+    struct ParallelForState{
+        std::atomic<int> next_idx{0};
+        std::atomic<int> nr_finished{0};
+        std::mutex mutex;
+        std::condition_variable all_finished;
+        std::exception_ptr exception;
+    };
+    std::shared_ptr<ParallelForState> state=std::make_shared<ParallelForState>();
+
+    //grabs indices until there is nothing left, so each thread runs as many jobs as it can get
+    auto run_jobs = [state, nr_jobs, &job](){
+        int idx;
+        while( (idx=state->next_idx.fetch_add(1)) < nr_jobs ){
+            try{
+                job(idx);
+            }catch(...){
+                std::lock_guard<std::mutex> lock(state->mutex);
+                if(!state->exception){
+                    state->exception=std::current_exception();
+                }
+            }
+            if(state->nr_finished.fetch_add(1)+1==nr_jobs){
+                std::lock_guard<std::mutex> lock(state->mutex);
+                state->all_finished.notify_all();
+            }
+        }
+    };
+
+    //one helper per worker is enough since every helper loops over the remaining indices. The calling thread does its share too
+    int nr_helpers=std::min( (int)m_workers.size(), nr_jobs-1 );
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for(int i=0; i<nr_helpers; i++){
+            //the helpers can only touch job while there are indices left, and those can only be claimed before we return
+            m_tasks.push_back(run_jobs);
+        }
+    }
+    m_task_available.notify_all();
+
+    run_jobs();
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->all_finished.wait(lock, [&state, nr_jobs]{ return state->nr_finished.load()==nr_jobs; });
+
+    if(state->exception){
+        std::rethrow_exception(state->exception);
+    }
+}
+
+void WorkerPool::parallel_for(const std::shared_ptr<WorkerPool>& pool, const int nr_jobs, const std::function<void(const int)>& job){
+    if(!pool || pool->nr_threads()<=1){
+        for(int i=0; i<nr_jobs; i++){
+            job(i);
+        }
+        return;
+    }
+
+    pool->parallel_for(nr_jobs, job);
+}
+
+int WorkerPool::nr_threads(){
+    return m_workers.size();
+}
+
+void WorkerPool::worker_loop(){
+
+    loguru::set_thread_name("worker_pool");
+
+    while(true){
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_task_available.wait(lock, [this]{ return !m_is_running || !m_tasks.empty(); });
+            if(!m_is_running && m_tasks.empty()){
+                return;
+            }
+            task=std::move(m_tasks.front());
+            m_tasks.pop_front();
+        }
+        task();
+    }
+}
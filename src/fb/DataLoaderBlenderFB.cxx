@@ -18,6 +18,8 @@ using namespace configuru;
 
 //my stuff
 #include "data_loaders/DataTransformer.h"
+#include "data_loaders/CameraNeighbourIndex.h"
+#include "data_loaders/ImageCache.h"
 #include "easy_pbr/Frame.h"
 #include "Profiler.h"
 #include "string_utils.h"
@@ -58,7 +60,8 @@ DataLoaderBlenderFB::DataLoaderBlenderFB(const std::string config_file):
     // m_is_running(false),
     m_idx_img_to_read(0),
     m_nr_resets(0),
-    m_rand_gen(new RandGenerator)
+    m_rand_gen(new RandGenerator),
+    m_cam_index(new CameraNeighbourIndex)
 {
     init_params(config_file);
 
@@ -91,10 +94,16 @@ void DataLoaderBlenderFB::init_params(const std::string config_file){
 
     m_autostart=loader_config["autostart"];
     m_subsample_factor=loader_config["subsample_factor"];
+    m_reduced_jpeg_decode=loader_config.get_or("reduced_jpeg_decode", false);
     m_exposure_change = loader_config["exposure_change"];
     m_load_as_float =  loader_config["load_as_float"];
     m_shuffle=loader_config["shuffle"];
     m_load_as_shell= loader_config["load_as_shell"];
+    int image_cache_mb=loader_config.get_or("image_cache_mb", 0);
+    if(m_load_as_shell && image_cache_mb>0){
+        m_image_cache=ImageCache::shared();
+        m_image_cache->reserve_budget( (size_t)image_cache_mb*1024*1024 );
+    }
     m_do_overfit=loader_config["do_overfit"];
     m_scene_scale_multiplier= loader_config["scene_scale_multiplier"];
     m_mode=(std::string)loader_config["mode"];
@@ -102,6 +111,8 @@ void DataLoaderBlenderFB::init_params(const std::string config_file){
     m_dataset_path = (std::string)loader_config["dataset_path"];    //get the path where all the off files are
     m_pose_file_path = (std::string)loader_config["pose_file_path"];    //get the path where all the off files are
     m_orientation_and_variance_path = (std::string)loader_config["orientation_and_variance_path"];
+    m_close_frames_view_dir_weight=loader_config.get_or("close_frames_view_dir_weight", 0.0);
+    m_nr_precomputed_close_frames=loader_config.get_or("nr_precomputed_close_frames", 0);
 
 
     //data transformer
@@ -114,6 +125,8 @@ void DataLoaderBlenderFB::start(){
     init_data_reading();
     init_poses();
     read_data();
+
+    m_cam_index->build(m_frames, m_close_frames_view_dir_weight, m_nr_precomputed_close_frames);
 }
 
 
@@ -509,29 +522,23 @@ void DataLoaderBlenderFB::load_images_in_frame(easy_pbr::Frame& frame){
     //read rgba and split into rgb and alpha mask
     cv::Mat rgb_32f;
     if (m_load_as_float){
-        rgb_32f = cv::imread( frame.rgb_path, cv::IMREAD_ANYCOLOR | cv::IMREAD_ANYDEPTH );
-        ///resize the float mat
-        if(m_subsample_factor>1){
-            cv::Mat resized;
-            cv::resize(rgb_32f, resized, cv::Size(), 1.0/m_subsample_factor, 1.0/m_subsample_factor, cv::INTER_AREA);
-            rgb_32f=resized;
-        }
+        ///the float mat gets resized directly
+        rgb_32f = ImageCache::read(m_image_cache, frame.rgb_path, cv::IMREAD_ANYCOLOR | cv::IMREAD_ANYDEPTH, m_subsample_factor, cv::INTER_AREA);
     }else{
-        cv::Mat rgb_8u = cv::imread( frame.rgb_path );
         //resize the rgb8u mat and then convert to float because its faster
-        if(m_subsample_factor>1){
-            cv::Mat resized;
-            cv::resize(rgb_8u, resized, cv::Size(), 1.0/m_subsample_factor, 1.0/m_subsample_factor, cv::INTER_AREA);
-            rgb_8u=resized;
-        }
+        cv::Mat rgb_8u = ImageCache::read(m_image_cache, frame.rgb_path, cv::IMREAD_COLOR, m_subsample_factor, cv::INTER_AREA, m_reduced_jpeg_decode);
         // frame.rgb_8u=rgb_8u;
         rgb_8u.convertTo(rgb_32f, CV_32FC3, 1.0/255.0);
     }
     // VLOG(1) << " type is  " << radu::utils::type2string(rgba_32f.type());
 
-    rgb_32f=rgb_32f*m_exposure_change;
-    frame.rgb_32f= rgb_32f;
-    cv::cvtColor(frame.rgb_32f, frame.gray_32f, cv::COLOR_BGR2GRAY);
+    //scale into new mats, the ones of the frame may still be shared with copies of it made before it was reloaded
+    cv::Mat rgb_32f_exposed;
+    rgb_32f.convertTo(rgb_32f_exposed, -1, m_exposure_change);
+    frame.rgb_32f= rgb_32f_exposed;
+    cv::Mat gray_32f;
+    cv::cvtColor(frame.rgb_32f, gray_32f, cv::COLOR_BGR2GRAY);
+    frame.gray_32f=gray_32f;
 
     frame.width=frame.rgb_32f.cols;
     frame.height=frame.rgb_32f.rows;
@@ -573,104 +580,63 @@ void DataLoaderBlenderFB::load_images_in_frame(easy_pbr::Frame& frame){
 }
 
 
-Frame DataLoaderBlenderFB::get_next_frame(){
+int DataLoaderBlenderFB::get_next_frame_idx(){
     CHECK(m_idx_img_to_read<(int)m_frames.size()) << "m_idx_img_to_read is out of bounds. It is " << m_idx_img_to_read << " while m_frames has size " << m_frames.size();
-    Frame  frame= m_frames[m_idx_img_to_read];
+    int idx=m_idx_img_to_read;
 
     if(!m_do_overfit){
         m_idx_img_to_read++;
     }
 
-    return frame;
+    return idx;
+}
+Frame DataLoaderBlenderFB::get_next_frame(){
+    return m_frames[get_next_frame_idx()];
+}
+const std::vector<easy_pbr::Frame>& DataLoaderBlenderFB::get_all_frames_ref(){
+    return m_frames;
 }
 std::vector<easy_pbr::Frame> DataLoaderBlenderFB::get_all_frames(){
     return m_frames;
 }
-Frame DataLoaderBlenderFB::get_frame_at_idx( const int idx){
-    CHECK(idx<(int)m_frames.size()) << "idx is out of bounds. It is " << idx << " while m_frames has size " << m_frames.size();
-
-    Frame  frame= m_frames[idx];
+const Frame& DataLoaderBlenderFB::get_frame_ref_at_idx( const int idx){
+    CHECK(idx>=0 && idx<(int)m_frames.size()) << "idx is out of bounds. It is " << idx << " while m_frames has size " << m_frames.size();
 
-    return frame;
+    return m_frames[idx];
+}
+Frame DataLoaderBlenderFB::get_frame_at_idx( const int idx){
+    return get_frame_ref_at_idx(idx);
 }
 
-Frame DataLoaderBlenderFB::get_random_frame(){
+int DataLoaderBlenderFB::get_random_frame_idx(){
     CHECK(m_frames.size()>0 ) << "m_frames has size 0";
 
-    int random_idx=m_rand_gen->rand_int(0, m_frames.size()-1);
-    Frame  frame= m_frames[random_idx];
-
-    return frame;
+    return m_rand_gen->rand_int(0, m_frames.size()-1);
+}
+Frame DataLoaderBlenderFB::get_random_frame(){
+    return m_frames[get_random_frame_idx()];
 }
 Frame DataLoaderBlenderFB::get_closest_frame( const easy_pbr::Frame& frame){
-
-    float closest_distance=std::numeric_limits<float>::max();
-    int closest_idx=-1;
-    for(size_t i=0; i<m_frames.size(); i++){
-        float dist =  ( m_frames[i].tf_cam_world.inverse().translation() - frame.tf_cam_world.inverse().translation() ).norm();
-        if (dist < closest_distance && dist>1e-7){
-            closest_distance=dist;
-            closest_idx=i;
-        }
-    }
-
-    Frame  frame_closest= m_frames[closest_idx];
-
-    return frame_closest;
-
+    return m_frames[ get_closest_frame_idx(frame) ];
+}
+int DataLoaderBlenderFB::get_closest_frame_idx( const easy_pbr::Frame& frame){
+    return m_cam_index->closest_idx(frame);
 }
 
 
 std::vector<easy_pbr::Frame>  DataLoaderBlenderFB::get_close_frames( const easy_pbr::Frame& frame, const int nr_frames, const bool discard_same_idx){
 
-    CHECK(nr_frames<(int)m_frames.size()) << "Cannot select more close frames than the total nr of frames that we have in the loader. Required select of " << nr_frames << " out of a total of " << m_frames.size() << " available in the loader";
+    std::vector<int> close_idxs=get_close_frames_idxs(frame, nr_frames, discard_same_idx);
 
     std::vector<easy_pbr::Frame> selected_close_frames;
-
-    for(int i=0; i<nr_frames; i++){
-
-        //select a close frame
-        float closest_distance=std::numeric_limits<float>::max();
-        int closest_idx=-1;
-        for(size_t j=0; j<m_frames.size(); j++){
-
-            //ignore if the current frame we are checking is THIS
-            if (discard_same_idx){
-                if( m_frames[j].frame_idx == frame.frame_idx ){
-                    continue;
-                }
-            }
-
-            //ignore the current frame that we are checking if it's any of the ones already selected
-            bool is_already_selected=false;
-            for(size_t k=0; k<selected_close_frames.size(); k++){
-                if( m_frames[j].frame_idx == selected_close_frames[k].frame_idx ){
-                    is_already_selected=true;
-                }
-            }
-            if(is_already_selected){
-                continue;
-            }
-
-            //now get the closest one
-            float dist =  ( m_frames[j].tf_cam_world.inverse().translation() - frame.tf_cam_world.inverse().translation() ).norm();
-            // float dist = 1.0 -  m_frames[j].look_dir().dot(frame.look_dir());
-            if (dist < closest_distance){
-                closest_distance=dist;
-                closest_idx=j;
-            }
-        }
-
-        Frame  frame_closest= m_frames[closest_idx];
-        selected_close_frames.push_back(frame_closest);
-
-
+    for(size_t i=0; i<close_idxs.size(); i++){
+        selected_close_frames.push_back( m_frames[close_idxs[i]] );
     }
 
-
     return selected_close_frames;
-
-
+}
+std::vector<int>  DataLoaderBlenderFB::get_close_frames_idxs( const easy_pbr::Frame& frame, const int nr_frames, const bool discard_same_idx){
+    return m_cam_index->close_idxs(frame, nr_frames, discard_same_idx);
 }
 
 // //compute weights
@@ -741,6 +707,8 @@ void DataLoaderBlenderFB::reset(){
         unsigned seed = m_nr_resets;
         auto rng_0 = std::default_random_engine(seed);
         std::shuffle(std::begin(m_frames), std::end(m_frames), rng_0);
+        //the index stores the positions of the frames in m_frames so it has to follow the new order
+        m_cam_index->build(m_frames, m_close_frames_view_dir_weight, m_nr_precomputed_close_frames);
     }
 
     m_idx_img_to_read=0;
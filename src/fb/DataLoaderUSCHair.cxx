@@ -3,7 +3,7 @@
 //c++
 #include <algorithm>
 #include <random>
-#include <cstdio>
+#include <cstring>
 
 //loguru
 #define LOGURU_REPLACE_GLOG 1
@@ -18,8 +18,7 @@ using namespace configuru;
 //cnpy
 // #include "cnpy.h"
 
-#include <igl/point_mesh_squared_distance.h>
-#include <igl/barycentric_coordinates.h>
+#include <igl/AABB.h>
 #include <igl/random_points_on_mesh.h>
 
 
@@ -37,12 +36,53 @@ using namespace configuru;
 #include "RandGenerator.h"
 #include "UtilsPytorch.h"
 #include "data_loaders/DataTransformer.h"
+#include "data_loaders/WorkerPool.h"
+#include "data_loaders/MappedFile.h"
 
 using namespace radu::utils;
 using namespace easy_pbr;
 
 #define BUFFER_SIZE 5 //clouds are stored in a queue until they are acessed, the queue stores a maximum of X items
 
+
+std::shared_ptr<USCHair> USCHair::gather_strands(const std::vector<int>& strand_idxs) const{
+    std::shared_ptr<USCHair> new_hair(new USCHair);
+    new_hair->cloud_path=cloud_path;
+
+    int nr_new_strands=strand_idxs.size();
+    new_hair->strand_offsets.resize(nr_new_strands+1);
+    new_hair->strand_offsets(0)=0;
+    for(int i=0; i<nr_new_strands; i++){
+        new_hair->strand_offsets(i+1)=new_hair->strand_offsets(i)+nr_points_of_strand(strand_idxs[i]);
+    }
+    new_hair->strand_points.resize(new_hair->strand_offsets(nr_new_strands), 3);
+    new_hair->strand_file_idx.resize(nr_new_strands);
+    for(int i=0; i<nr_new_strands; i++){
+        int s=strand_idxs[i];
+        new_hair->strand_points.middleRows(new_hair->strand_offsets(i), nr_points_of_strand(s))=strand_points.middleRows(strand_offsets(s), nr_points_of_strand(s));
+        new_hair->strand_file_idx(i)=strand_file_idx(s);
+    }
+    new_hair->strand_valid.setConstant(nr_new_strands, true);
+
+    return new_hair;
+}
+
+std::shared_ptr<Mesh> USCHair::get_strand_mesh(const int s) const{
+    std::shared_ptr<Mesh> strand=Mesh::create();
+    strand->V=strand_points.middleRows(strand_offsets(s), nr_points_of_strand(s)).cast<double>();
+    strand->add_extra_field("strand_idx", (int)strand_file_idx(s));
+    return strand;
+}
+
+std::vector< std::shared_ptr<Mesh> > USCHair::get_strand_meshes() const{
+    std::vector< std::shared_ptr<Mesh> > strands;
+    for(int s=0; s<nr_strands(); s++){
+        strands.push_back(get_strand_mesh(s));
+    }
+    return strands;
+}
+
+
 DataLoaderUSCHair::DataLoaderUSCHair(const std::string config_file):
     m_is_modified(false),
     m_is_running(false),
@@ -107,12 +147,16 @@ void DataLoaderUSCHair::init_params(const std::string config_file){
     Config transformer_config=loader_config["transformer"];
     m_transformer=std::make_shared<DataTransformer>(transformer_config);
 
+    m_worker_pool=WorkerPool::shared(0);
+
 }
 
 void DataLoaderUSCHair::start(){
     CHECK(m_is_running==false) << "The loader thread is already running. Please check in the config file that autostart is not already set to true. Or just don't call start()";
 
     init_data_reading();
+    //the scalp is loaded before starting the thread so that get_random_roots can be called while the thread is still reading the hair
+    init_scalp();
 
     m_is_running=true;
     if(m_load_buffered){
@@ -181,9 +225,7 @@ void DataLoaderUSCHair::init_data_reading(){
 
 }
 
-void DataLoaderUSCHair::read_data(){
-
-    VLOG(1) << "read data";
+void DataLoaderUSCHair::init_scalp(){
 
     //read head mesh
     m_mesh_head=Mesh::create( (m_dataset_path/"head_model.obj").string()  );
@@ -191,6 +233,15 @@ void DataLoaderUSCHair::read_data(){
     //we also create a tangent-bitangent and normal for the scalp that would serve as a basis frame for he the hair
     m_mesh_scalp->compute_tangents();
 
+    //the scalp doesn't change so we build the tree for the closest point queries only once instead of for every hair
+    m_scalp_tree=std::make_shared< igl::AABB<Eigen::MatrixXd,3> >();
+    m_scalp_tree->init(m_mesh_scalp->V, m_mesh_scalp->F);
+
+}
+
+void DataLoaderUSCHair::read_data(){
+
+    VLOG(1) << "read data";
 
 
 
@@ -260,10 +311,6 @@ std::shared_ptr<USCHair> DataLoaderUSCHair::read_hair_sample(const std::string d
     //read data. most of the code is from http://www-scf.usc.edu/~liwenhu/SHM/Hair.cc
     // VLOG(1) << "reading from " <<  data_filepath;
 
-    std::FILE *f = std::fopen(data_filepath.c_str(), "rb");
-    CHECK(f) << "Couldn't open" << data_filepath;
-
-
     TIME_SCOPE("load");
 
     std::shared_ptr<USCHair> usc_hair(new USCHair);
@@ -279,22 +326,60 @@ std::shared_ptr<USCHair> DataLoaderUSCHair::read_hair_sample(const std::string d
 
     usc_hair->cloud_path=data_filepath;
 
-    int fret;
+    //the file is a int nr of strands and then for every strand a int nr of vertices followed by the xyz floats of the vertices
+    //we map it and first walk only through the headers of the strands to get the offsets and then copy the xyz of every strand in one go
+    MappedFile file(data_filepath);
+    size_t byte_offset=0;
 
     int nstrands = 0;
-    fret=fread(&nstrands, 4, 1, f);
+    std::memcpy(&nstrands, file.at<char>(byte_offset, sizeof(int)), sizeof(int));
+    byte_offset+=sizeof(int);
+    CHECK(nstrands>=0) << "Read a negative nr of strands " << nstrands << " from " << data_filepath;
 
 
     // int load_random_strand_idx=m_rand_gen->rand_int(0, nstrands-1);
     // int load_random_strand_idx=-1;
 
 
+    //the points of all the strands go one after another in one buffer, even the invalid ones, so that the strands are never copied into their own mesh
+    usc_hair->strand_offsets.resize(nstrands+1);
+    usc_hair->strand_offsets(0)=0;
+    std::vector<size_t> strand_byte_offsets(nstrands);
     for (int i = 0; i < nstrands; i++) {
         int nverts = 0;
-        fret=fread(&nverts, 4, 1, f);
+        std::memcpy(&nverts, file.at<char>(byte_offset, sizeof(int)), sizeof(int));
+        byte_offset+=sizeof(int);
+        CHECK(nverts>=0) << "Read a negative nr of vertices " << nverts << " for strand " << i << " from " << data_filepath;
+
+        strand_byte_offsets[i]=byte_offset;
+        file.at<char>(byte_offset, nverts*3*sizeof(float)); //just for the range check
+        byte_offset+=nverts*3*sizeof(float);
+        usc_hair->strand_offsets(i+1)=usc_hair->strand_offsets(i)+nverts;
+    }
 
+    usc_hair->strand_points.resize(usc_hair->strand_offsets(nstrands), 3);
+    for (int i = 0; i < nstrands; i++) {
+        if(usc_hair->nr_points_of_strand(i)==0){
+            continue;
+        }
+        std::memcpy(usc_hair->strand_points.row(usc_hair->strand_offsets(i)).data(), file.data()+strand_byte_offsets[i], usc_hair->nr_points_of_strand(i)*3*sizeof(float));
+    }
+    usc_hair->strand_file_idx=Eigen::VectorXi::LinSpaced(nstrands, 0, nstrands-1);
 
 
+    //some points on the strand are actually the same point in xyz and therefore will produce nans when we try to compute the rotation between them
+    //we compare every point with the next one over the whole array and afterwards ignore the pairs that straddle two strands
+    int nr_points=usc_hair->strand_points.rows();
+    Eigen::Array<bool, Eigen::Dynamic, 1> same_as_next=Eigen::Array<bool, Eigen::Dynamic, 1>::Constant(nr_points, false);
+    if(nr_points>1){
+        same_as_next.head(nr_points-1) = (usc_hair->strand_points.topRows(nr_points-1).array()==usc_hair->strand_points.bottomRows(nr_points-1).array()).rowwise().all();
+    }
+
+    usc_hair->strand_valid.resize(nstrands);
+    int nr_valid_strands=0;
+    for (int i = 0; i < nstrands; i++) {
+        int nverts=usc_hair->nr_points_of_strand(i);
+
         bool is_strand_valid=true;
         if (nverts==1){ //if the nr of vertices per strand is 1 it means that this is no actual strand, it's jsut the root node
             is_strand_valid=false;
@@ -303,74 +388,19 @@ std::shared_ptr<USCHair> DataLoaderUSCHair::read_hair_sample(const std::string d
         if (m_rand_gen->rand_bool(m_percentage_strand_drop) && m_load_buffered){
             is_strand_valid=false;
         }
-        if(m_load_only_strand_with_idx>=0 && (int)usc_hair->strand_meshes.size()!=m_load_only_strand_with_idx){ //loads only one strand with a certain index
+        if(m_load_only_strand_with_idx>=0 && nr_valid_strands!=m_load_only_strand_with_idx){ //loads only one strand with a certain index
             is_strand_valid=false;
         }
-
-        //if the strand survided until here(  it  is stil valid, we vote once if we select it or not )
-
-        // if (m_load_only_one_random_strand && (int)usc_hair->strand_meshes.size()!=load_random_strand_idx){
-        //     is_strand_valid=false;
-        // }
-
-        //store also the previous point on the strand so we can compute length
-        Eigen::Vector3d prev_point;
-
-
-
-
-        //some points on the strand are actually the same point in xyz and therefore will produce nans when we try to compute the rotation between them. so we go once through the reading and check if that happens
-        std::vector<Eigen::Vector3d> points_current_strand_vec; //we need to store here the points we read
-        for (int j = 0; j < nverts; j++) {
-            // VLOG(1) << "vert " <<j;
-            // fread(&strand_points_float(i,0), 12, 1, f);
-            float x,y,z;
-            fret=fread(&x, 4, 1, f);
-            fret=fread(&y, 4, 1, f);
-            fret=fread(&z, 4, 1, f);
-
-            Eigen::Vector3d point;
-            point << x,y,z;
-            points_current_strand_vec.push_back(point);
-
-            //check if the points are the same
-            if(j>=1){ //if we are the first vertex, there is no previous
-                if( (prev_point-point).isZero() ){
-                    is_strand_valid=false;
-                }
-            }
-            prev_point=point;
-        }
-
-
-        //now we add the valid strands
-        if (is_strand_valid) {
-            std::shared_ptr<easy_pbr::Mesh> strand= easy_pbr::Mesh::create();
-            strand->V.resize(nverts,3);
-            for (int j = 0; j < nverts; j++) {
-
-
-                Eigen::Vector3d point = points_current_strand_vec[j];
-                strand->V.row(j) =point;
-
-
-            }
-            strand->add_extra_field("strand_idx",i);
-            //finished reading this strand
-            usc_hair->strand_meshes.push_back(strand);
-
+        //the last point of the strand is compared with the first of the next strand so it doesn't count
+        if (nverts>1 && same_as_next.segment(usc_hair->strand_offsets(i), nverts-1).any()){
+            is_strand_valid=false;
         }
 
-
-
+        usc_hair->strand_valid(i)=is_strand_valid;
+        nr_valid_strands+=is_strand_valid;
     }
 
 
-    fret=fclose(f);
-
-    CHECK(fret==0) << "The file was not correctly closed for some reason";
-
-
     // //if we augment in tbn space we need to compute the tbn for each strand
     // Eigen::MatrixXd uv_roots;
     // std::vector<Eigen::Matrix3d> tbn_roots;
@@ -641,155 +671,139 @@ std::shared_ptr<USCHair> DataLoaderUSCHair::read_hair_sample(const std::string d
 
 
 
+}
+
+//puts the tbn of every root into a nr_strands x 3 x 3 tensor
+static torch::Tensor tbn2tensor(const std::vector<Eigen::Matrix3d>& tbn){
+    int nr_strands=tbn.size();
+    torch::Tensor tbn_tensor = torch::empty({ nr_strands,3,3 }, torch::dtype(torch::kFloat32) );
+    float* tbn_ptr=tbn_tensor.data_ptr<float>();
+    for(int i=0; i<nr_strands; i++){
+        Eigen::Map< Eigen::Matrix<float,3,3,Eigen::RowMajor> >(tbn_ptr+9*i)=tbn[i].cast<float>();
+    }
+    return tbn_tensor;
 }
 
 void DataLoaderUSCHair::compute_full_hair(std::shared_ptr<USCHair>& usc_hair){
 
     //fill in the full hair cloud full_hair_cloud
     usc_hair->full_hair_cloud=Mesh::create();
-    usc_hair->full_hair_cloud->add( usc_hair->strand_meshes  );
+    usc_hair->full_hair_cloud->V=usc_hair->strand_points.cast<double>();
     usc_hair->full_hair_cloud->m_vis.m_show_points=true;
 
 }
 
 void DataLoaderUSCHair::compute_all_atributes(std::shared_ptr<USCHair>& usc_hair){
 
-    CHECK(usc_hair->strand_meshes.size()!=0) << "Strand meshes is empty";
+    CHECK(usc_hair->nr_strands()!=0) << "The hair has no strands";
 
-    int nr_strands= usc_hair->strand_meshes.size();
+    int nr_strands= usc_hair->nr_strands();
 
 
     //get the root positions
-    std::vector<Eigen::Vector3d> position_roots_vec;
+    usc_hair->position_roots.resize(nr_strands, 3);
     for (int i=0; i<nr_strands; i++){
-        position_roots_vec.push_back( usc_hair->strand_meshes[i]->V.row(0) );
+        usc_hair->position_roots.row(i)=usc_hair->strand_points.row( usc_hair->strand_offsets(i) ).cast<double>();
     }
-    usc_hair->position_roots=vec2eigen(position_roots_vec);
 
 
     //get uv and tbn
     Eigen::MatrixXd uv_roots;
     std::vector<Eigen::Matrix3d> tbn_roots;
-    compute_root_points_atributes(uv_roots, tbn_roots, m_mesh_scalp, position_roots_vec);
+    compute_root_points_atributes(uv_roots, tbn_roots, usc_hair->position_roots);
     usc_hair->uv_roots=uv_roots;
-    //get the tbn into the tensor
-    usc_hair->tbn_roots_tensor = torch::empty({ nr_strands,3,3 }, torch::dtype(torch::kFloat32) );
-    auto tbn_roots_tensor_accesor = usc_hair->tbn_roots_tensor.accessor<float,3>();
-    for(size_t i=0; i<tbn_roots.size(); i++){
-        // //row 0
-        tbn_roots_tensor_accesor[i][0][0]=tbn_roots[i](0,0);
-        tbn_roots_tensor_accesor[i][0][1]=tbn_roots[i](0,1);
-        tbn_roots_tensor_accesor[i][0][2]=tbn_roots[i](0,2);
-        //row 1
-        tbn_roots_tensor_accesor[i][1][0]=tbn_roots[i](1,0);
-        tbn_roots_tensor_accesor[i][1][1]=tbn_roots[i](1,1);
-        tbn_roots_tensor_accesor[i][1][2]=tbn_roots[i](1,2);
-        //row 2
-        tbn_roots_tensor_accesor[i][2][0]=tbn_roots[i](2,0);
-        tbn_roots_tensor_accesor[i][2][1]=tbn_roots[i](2,1);
-        tbn_roots_tensor_accesor[i][2][2]=tbn_roots[i](2,2);
-    }
+    usc_hair->tbn_roots_tensor=tbn2tensor(tbn_roots);
 
 
     //get the per_point direction to the next point on the strand
-    int nr_verts_per_strand=100;
+    //the tensor needs the same nr of points for all the strands
+    int nr_verts_per_strand=usc_hair->nr_points_of_strand(0);
+    CHECK(nr_verts_per_strand>=2) << "The strands need at least 2 points to have a direction but they have " << nr_verts_per_strand;
+    CHECK(usc_hair->strand_points.rows()==nr_strands*nr_verts_per_strand) << "All the strands should have the same nr of points as the first one which has " << nr_verts_per_strand;
     usc_hair->per_point_direction_to_next_tensor =  torch::empty({  nr_strands,nr_verts_per_strand, 3  }, torch::dtype(torch::kFloat32) );
-    auto per_point_direction_to_next_tensor_accessor = usc_hair->per_point_direction_to_next_tensor.accessor<float,3>();
-    for(int s=0; s<nr_strands; s++){
-        Eigen::Vector3d last_dir;
-        for(int p=0; p<nr_verts_per_strand-1; p++){
-            Eigen::Vector3d cur_point_world = usc_hair->strand_meshes[s]->V.row(p);
-            Eigen::Vector3d next_point_world = usc_hair->strand_meshes[s]->V.row(p+1);
-            Eigen::Vector3d dir= (next_point_world-cur_point_world).normalized();
-            last_dir=dir;
-            //write the dir
-            per_point_direction_to_next_tensor_accessor[s][p][0] = dir.x();
-            per_point_direction_to_next_tensor_accessor[s][p][1] = dir.y();
-            per_point_direction_to_next_tensor_accessor[s][p][2] = dir.z();
+    //the tensor has the same layout as strand_points so we write the directions for a chunk of strands as the normalized difference between consecutive rows
+    Eigen::Map< Eigen::Matrix<float, Eigen::Dynamic, 3, Eigen::RowMajor> > directions(usc_hair->per_point_direction_to_next_tensor.data_ptr<float>(), usc_hair->strand_points.rows(), 3);
+    const int strands_per_chunk=256;
+    int nr_chunks=(nr_strands+strands_per_chunk-1)/strands_per_chunk;
+    WorkerPool::parallel_for(m_worker_pool, nr_chunks, [&](const int c){
+        int strand_start=c*strands_per_chunk;
+        int strand_end=std::min(nr_strands, (c+1)*strands_per_chunk);
+        int row_start=usc_hair->strand_offsets(strand_start);
+        int nr_rows=usc_hair->strand_offsets(strand_end)-row_start;
+
+        Eigen::MatrixXd dirs= usc_hair->strand_points.middleRows(row_start+1, nr_rows-1).cast<double>() - usc_hair->strand_points.middleRows(row_start, nr_rows-1).cast<double>();
+        Eigen::VectorXd norms=dirs.rowwise().norm();
+        norms=(norms.array()>0).select(norms, 1.0); //same as normalized() which leaves the zero vectors as they are
+        dirs.array().colwise()/=norms.array();
+        directions.middleRows(row_start, nr_rows-1)=dirs.cast<float>();
+
+        //last point on the strand does not have a next so we just copy the last diretion we set. This also overwrites the difference between the last point of a strand and the first of the next one
+        for(int s=strand_start; s<strand_end; s++){
+            int last=usc_hair->strand_offsets(s+1)-1;
+            directions.row(last)=directions.row(last-1);
         }
-         //last point on the strand does not have a next so we just copy the last diretion we set
-        per_point_direction_to_next_tensor_accessor[s][nr_verts_per_strand-1][0] = last_dir.x();
-        per_point_direction_to_next_tensor_accessor[s][nr_verts_per_strand-1][1] = last_dir.y();
-        per_point_direction_to_next_tensor_accessor[s][nr_verts_per_strand-1][2] = last_dir.z();
-    }
+    });
 
 }
 
 
-void DataLoaderUSCHair::compute_root_points_atributes(Eigen::MatrixXd& uv, std::vector<Eigen::Matrix3d>& tbn_per_point, std::shared_ptr<easy_pbr::Mesh> mesh, std::vector<Eigen::Vector3d> points_vec){
-
-    Eigen::MatrixXd points=vec2eigen(points_vec);
-
-    Eigen::VectorXd distances;
-    Eigen::MatrixXd closest_points;
-    Eigen::VectorXi closest_face_indices;
-    igl::point_mesh_squared_distance(points, mesh->V, mesh->F, distances, closest_face_indices, closest_points );
-
-    // VLOG(1) << "points" << points.rows() << "x " << points.cols();
-    // VLOG(1) << "distances" << distances.rows() << "x " << distances.cols();
-    // VLOG(1) << "closest_points" << closest_points.rows() << "x " << closest_points.cols();
-    // VLOG(1) << "closest_face_indices" << closest_face_indices.rows() << "x " << closest_face_indices.cols();
-
-    //get the uv
-    // Eigen::MatrixXd UV;
-    uv.resize(points.rows(), 2);
-    //get also the TBN in world coords
-    tbn_per_point.resize( points.rows() );
-
-    for(int i=0; i<points.rows(); i++){
-        Eigen::MatrixXd closest_point = closest_points.row(i);
-        int face_idx=closest_face_indices(i);
-        Eigen::Vector3i face=mesh->F.row(face_idx);
-        int idx_p0 = face.x();
-        int idx_p1 = face.y();
-        int idx_p2 = face.z();
-        Eigen::Vector3d p0 = mesh->V.row(idx_p0);
-        Eigen::Vector3d p1 = mesh->V.row(idx_p1);
-        Eigen::Vector3d p2 = mesh->V.row(idx_p2);
-
-        Eigen::MatrixXd barycentric;
-        igl::barycentric_coordinates(closest_point, p0.transpose(), p1.transpose(), p2.transpose(), barycentric);
-
-        float b0=barycentric(0,0);
-        float b1=barycentric(0,1);
-        float b2=barycentric(0,2);
-
-        // if (i==0){
-        //     VLOG(1) << " baryc is " << b0 << " " << b1 << " " << b2;
-        //     VLOG(1) << " idx_p0 is " << idx_p0 << " " << idx_p1 << " " << idx_p2;
-        //     VLOG(1) << "idx0 uv " << mesh->UV.row(idx_p0);
-        // }
-
-        Eigen::Vector2d uv_for_point = mesh->UV.row(idx_p0)*b0 + mesh->UV.row(idx_p1)*b1 + mesh->UV.row(idx_p2)*b2;
-
-        uv.row(i) = uv_for_point;
-
-        //get also the TBN per point
-        Eigen::Vector3d T,B,N;
-        N= mesh->NV.row(idx_p0)*b0 + mesh->NV.row(idx_p1)*b1 + mesh->NV.row(idx_p2)*b2;
-        T= mesh->V_tangent_u.row(idx_p0)*b0 + mesh->V_tangent_u.row(idx_p1)*b1 + mesh->V_tangent_u.row(idx_p2)*b2;
-        N.normalize();
-        T.normalize();
-        B=N.cross(T);
-        Eigen::Vector3d Tw,Bw,Nw;
-        Tw=T;
-        Bw=B;
-        Nw=N;
-        //rotate from model coordinates to world
-        T=mesh->model_matrix().linear()*Tw;
-        B=mesh->model_matrix().linear()*Bw;
-        N=mesh->model_matrix().linear()*Nw;
-        Eigen::Matrix3d TBN;
-        TBN.col(0)=T;
-        TBN.col(1)=B;
-        TBN.col(2)=N;
-        tbn_per_point[i] = TBN;
-
-
-
-    }
-
-
+void DataLoaderUSCHair::compute_root_points_atributes(Eigen::MatrixXd& uv, std::vector<Eigen::Matrix3d>& tbn_per_point, const Eigen::MatrixXd& points) const{
+
+    CHECK(m_scalp_tree) << "The scalp was not loaded yet. Please call start() first";
+    CHECK(points.cols()==3) << "The points should be nr_points x 3 but they have " << points.cols() << " columns";
+
+    const Eigen::MatrixXd& V=m_mesh_scalp->V;
+    const Eigen::MatrixXi& F=m_mesh_scalp->F;
+    const Eigen::Matrix3d R=m_mesh_scalp->model_matrix().linear(); //rotates from model coordinates to world
+
+    int nr_points=points.rows();
+    uv.resize(nr_points, 2);
+    tbn_per_point.resize(nr_points);
+
+    //every job projects a chunk of points and writes only the rows of its own points
+    const int chunk_size=256;
+    int nr_chunks=(nr_points+chunk_size-1)/chunk_size;
+    WorkerPool::parallel_for(m_worker_pool, nr_chunks, [&](const int c){
+        int end=std::min(nr_points, (c+1)*chunk_size);
+        for(int i=c*chunk_size; i<end; i++){
+            Eigen::RowVector3d point=points.row(i);
+            Eigen::RowVector3d closest_point;
+            int face_idx=-1;
+            m_scalp_tree->squared_distance(V, F, point, face_idx, closest_point);
+
+            int idx_p0 = F(face_idx,0);
+            int idx_p1 = F(face_idx,1);
+            int idx_p2 = F(face_idx,2);
+
+            //barycentric coordinates of the closest point, same as igl::barycentric_coordinates but without allocating
+            Eigen::RowVector3d v0=V.row(idx_p1)-V.row(idx_p0);
+            Eigen::RowVector3d v1=V.row(idx_p2)-V.row(idx_p0);
+            Eigen::RowVector3d v2=closest_point-V.row(idx_p0);
+            double d00=v0.dot(v0);
+            double d01=v0.dot(v1);
+            double d11=v1.dot(v1);
+            double d20=v2.dot(v0);
+            double d21=v2.dot(v1);
+            double denom=d00*d11-d01*d01;
+            double b1=(d11*d20-d01*d21)/denom;
+            double b2=(d00*d21-d01*d20)/denom;
+            double b0=1.0-b1-b2;
+
+            uv.row(i) = m_mesh_scalp->UV.row(idx_p0)*b0 + m_mesh_scalp->UV.row(idx_p1)*b1 + m_mesh_scalp->UV.row(idx_p2)*b2;
+
+            //get also the TBN per point
+            Eigen::Vector3d T,B,N;
+            N= m_mesh_scalp->NV.row(idx_p0)*b0 + m_mesh_scalp->NV.row(idx_p1)*b1 + m_mesh_scalp->NV.row(idx_p2)*b2;
+            T= m_mesh_scalp->V_tangent_u.row(idx_p0)*b0 + m_mesh_scalp->V_tangent_u.row(idx_p1)*b1 + m_mesh_scalp->V_tangent_u.row(idx_p2)*b2;
+            N.normalize();
+            T.normalize();
+            B=N.cross(T);
+            Eigen::Matrix3d& TBN=tbn_per_point[i];
+            TBN.col(0)=R*T;
+            TBN.col(1)=R*B;
+            TBN.col(2)=R*N;
+        }
+    });
 
 }
 
@@ -977,10 +991,8 @@ std::shared_ptr<USCHair> DataLoaderUSCHair::get_random_roots(const int nr_strand
 
     igl::random_points_on_mesh(nr_strands, m_mesh_scalp->V, m_mesh_scalp->F, barycentric, face_indices);
     //get the points
-    std::vector<Eigen::Vector3d> points_vec;
+    Eigen::MatrixXd points(nr_strands, 3);
     for(int i=0; i<nr_strands; i++){
-        Eigen::Vector3d point;
-        point.setZero();
         int face_index= face_indices(i);
         int vertex_index_0 = m_mesh_scalp->F(face_index, 0);
         int vertex_index_1 = m_mesh_scalp->F(face_index, 1);
@@ -988,37 +1000,21 @@ std::shared_ptr<USCHair> DataLoaderUSCHair::get_random_roots(const int nr_strand
         float barycentric_0= barycentric(i, 0);
         float barycentric_1= barycentric(i, 1);
         float barycentric_2= barycentric(i, 2);
-        point=  barycentric_0*m_mesh_scalp->V.row(vertex_index_0) +
-                barycentric_1*m_mesh_scalp->V.row(vertex_index_1) +
-                barycentric_2*m_mesh_scalp->V.row(vertex_index_2);
-        points_vec.push_back(point);
+        points.row(i)=  barycentric_0*m_mesh_scalp->V.row(vertex_index_0) +
+                        barycentric_1*m_mesh_scalp->V.row(vertex_index_1) +
+                        barycentric_2*m_mesh_scalp->V.row(vertex_index_2);
     }
 
     std::shared_ptr<USCHair> usc_hair(new USCHair);
     Eigen::MatrixXd uv_roots;
     std::vector<Eigen::Matrix3d> tbn_roots;
-    compute_root_points_atributes(uv_roots, tbn_roots, m_mesh_scalp, points_vec);
-    usc_hair->position_roots=vec2eigen(points_vec);
+    compute_root_points_atributes(uv_roots, tbn_roots, points);
+    usc_hair->position_roots=points;
     usc_hair->uv_roots=uv_roots;
 
 
     //tbn roots to tensor
-    usc_hair->tbn_roots_tensor = torch::empty({ nr_strands,3,3 }, torch::dtype(torch::kFloat32) );
-    auto tbn_roots_tensor_accesor = usc_hair->tbn_roots_tensor.accessor<float,3>();
-    for(size_t i=0; i<tbn_roots.size(); i++){
-        // //row 0
-        tbn_roots_tensor_accesor[i][0][0]=tbn_roots[i](0,0);
-        tbn_roots_tensor_accesor[i][0][1]=tbn_roots[i](0,1);
-        tbn_roots_tensor_accesor[i][0][2]=tbn_roots[i](0,2);
-        //row 1
-        tbn_roots_tensor_accesor[i][1][0]=tbn_roots[i](1,0);
-        tbn_roots_tensor_accesor[i][1][1]=tbn_roots[i](1,1);
-        tbn_roots_tensor_accesor[i][1][2]=tbn_roots[i](1,2);
-        //row 2
-        tbn_roots_tensor_accesor[i][2][0]=tbn_roots[i](2,0);
-        tbn_roots_tensor_accesor[i][2][1]=tbn_roots[i](2,1);
-        tbn_roots_tensor_accesor[i][2][2]=tbn_roots[i](2,2);
-    }
+    usc_hair->tbn_roots_tensor=tbn2tensor(tbn_roots);
 
     return usc_hair;
 }
@@ -1082,59 +1078,78 @@ std::shared_ptr<USCHair> DataLoaderUSCHair::get_hair(){
 
 
     //augment the data
-    std::shared_ptr<USCHair> aug_hair(new USCHair); //we create a new augmented one
-    //copyt all the stuff so thet internally we keep the same strands
-    for (size_t i = 0; i < hair->strand_meshes.size(); i++) {
+    //we create a new augmented one with a copy of the valid strands so that internally we keep the same strands
+    std::vector<int> kept_strands;
+    for (int i = 0; i < hair->nr_strands(); i++) {
+        if(!hair->strand_valid(i)){
+            continue;
+        }
         bool is_strand_valid=true;
         if (m_rand_gen->rand_bool(m_percentage_strand_drop) && !m_load_buffered){ //if we have them all stored in a vector we do here the subsampling
             is_strand_valid=false;
         }
         if(is_strand_valid){
-            aug_hair->strand_meshes.push_back( std::make_shared<Mesh>(hair->strand_meshes[i]->clone()) );
+            kept_strands.push_back(i);
         }
     }
-    // aug_hair->uv_roots=hair->uv_roots;
-    // aug_hair->tbn_roots_tensor=hair->tbn_roots_tensor.clone();
-    // aug_hair->position_roots=hair->position_roots;
-
-    aug_hair->cloud_path=hair->cloud_path;
+    std::shared_ptr<USCHair> aug_hair=hair->gather_strands(kept_strands);
+    int nr_strands=aug_hair->nr_strands();
 
     //if we augment in tbn space we need to compute the tbn for each strand
     Eigen::MatrixXd uv_roots;
     std::vector<Eigen::Matrix3d> tbn_roots;
     if (m_augment_in_tbn_space){
-        std::vector<Eigen::Vector3d> position_roots_vec;
-        for (size_t i=0; i<aug_hair->strand_meshes.size(); i++){
-            position_roots_vec.push_back( aug_hair->strand_meshes[i]->V.row(0) );
+        Eigen::MatrixXd position_roots(nr_strands, 3);
+        for (int i=0; i<nr_strands; i++){
+            position_roots.row(i)=aug_hair->strand_points.row( aug_hair->strand_offsets(i) ).cast<double>();
         }
         //get uv and tbn
-        compute_root_points_atributes(uv_roots, tbn_roots, m_mesh_scalp, position_roots_vec);
+        compute_root_points_atributes(uv_roots, tbn_roots, position_roots);
     }
 
     //actual aguemnt
     if(m_mode=="train"){
         if (m_augment_per_strand){ //agument each strand individually
-            for (size_t i = 0; i < aug_hair->strand_meshes.size(); i++) {
+            //the random numbers have to be drawn strand after strand to get the same augmentation as transforming every strand on its own, but applying them is independent for every strand
+            std::vector<Eigen::Affine3d, Eigen::aligned_allocator<Eigen::Affine3d> > per_strand_tf(nr_strands);
+            std::vector<Eigen::MatrixXd> per_strand_noise(nr_strands);
+            for (int i = 0; i < nr_strands; i++) {
+                per_strand_tf[i]=m_transformer->draw_cloud_augmentation(aug_hair->nr_points_of_strand(i), per_strand_noise[i]);
+            }
 
-                Eigen::Affine3d tf_world_scalp;
-                Eigen::Affine3d tf_scalp_world;
-                tf_world_scalp.translation()= aug_hair->strand_meshes[i]->V.row(0);
-                if (m_augment_in_tbn_space){ //also rotate according to the tbn
-                    tf_world_scalp.linear()= tbn_roots[i];
+            const int strands_per_chunk=256;
+            int nr_chunks=(nr_strands+strands_per_chunk-1)/strands_per_chunk;
+            WorkerPool::parallel_for(m_worker_pool, nr_chunks, [&](const int c){
+                int strand_end=std::min(nr_strands, (c+1)*strands_per_chunk);
+                for (int i = c*strands_per_chunk; i < strand_end; i++) {
+                    auto strand_points=aug_hair->strand_points.middleRows(aug_hair->strand_offsets(i), aug_hair->nr_points_of_strand(i));
+
+                    //we augment the strand in the frame of its root, optionally rotated according to the tbn
+                    Eigen::Vector3d t=strand_points.row(0).cast<double>().transpose();
+                    Eigen::Matrix3d R=Eigen::Matrix3d::Identity();
+                    if (m_augment_in_tbn_space){
+                        R=tbn_roots[i];
+                    }
+                    const Eigen::Affine3d& tf_aug=per_strand_tf[i];
+                    const Eigen::MatrixXd& noise=per_strand_noise[i];
+
+                    //optionally augment the hair bounce now that we are in tbn coords
+                    // if (m_augment_hair_bounce){
+                        // usc_hair->strand_meshes[i]=augment_hair_bounce(usc_hair->strand_meshes[i]);
+                    // }
+
+                    for (int p = 0; p < strand_points.rows(); p++) {
+                        Eigen::Vector3d v=R.transpose()*(strand_points.row(p).cast<double>().transpose()-t);
+                        if(!v.isZero()){ //same as the transformer which leaves the points at the origin where they are
+                            v=tf_aug*v;
+                        }
+                        if(noise.size()){
+                            v+=noise.row(p).transpose();
+                        }
+                        strand_points.row(p)=(R*v+t).transpose().cast<float>();
+                    }
                 }
-                tf_scalp_world=tf_world_scalp.inverse();
-                aug_hair->strand_meshes[i]->transform_vertices_cpu(tf_scalp_world, true);
-
-                //optionally augment the hair bounce now that we are in tbn coords
-                // if (m_augment_hair_bounce){
-                    // usc_hair->strand_meshes[i]=augment_hair_bounce(usc_hair->strand_meshes[i]);
-                // }
-
-                aug_hair->strand_meshes[i] = m_transformer->transform(aug_hair->strand_meshes[i]);
-
-                aug_hair->strand_meshes[i]->transform_vertices_cpu(tf_world_scalp, true);
-
-            }
+            });
             compute_full_hair(aug_hair);
         }else{ //agument the whole hair
             compute_full_hair(aug_hair);
@@ -1219,7 +1234,7 @@ void DataLoaderUSCHair::set_mode_validation(){
 
 std::shared_ptr<USCHair> DataLoaderUSCHair::get_random_strand(std::shared_ptr<USCHair> usc_hair){
 
-    int rand_idx=rand() %  usc_hair->strand_meshes.size();
+    int rand_idx=rand() %  usc_hair->nr_strands();
 
     std::shared_ptr<USCHair> new_usc_hair=get_strand_with_idx(usc_hair, rand_idx);
 
@@ -1229,10 +1244,7 @@ std::shared_ptr<USCHair> DataLoaderUSCHair::get_random_strand(std::shared_ptr<US
 std::shared_ptr<USCHair> DataLoaderUSCHair::get_strand_with_idx(std::shared_ptr<USCHair> usc_hair, const int strand_idx){
 
 
-    std::shared_ptr<USCHair> new_usc_hair(new USCHair);
-    new_usc_hair->strand_meshes.push_back(  usc_hair->strand_meshes[strand_idx]   );
-
-    new_usc_hair->cloud_path=usc_hair->cloud_path;
+    std::shared_ptr<USCHair> new_usc_hair=usc_hair->gather_strands({strand_idx});
     new_usc_hair->strand_idx=strand_idx;
 
 